@@ -0,0 +1,369 @@
+/*************************************************************************
+ *   Copyright (C) 2011-2013 by Paul-Louis Ageneau                       *
+ *   paul-louis (at) ageneau (dot) org                                   *
+ *                                                                       *
+ *   This file is part of TeapotNet.                                     *
+ *                                                                       *
+ *   TeapotNet is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU Affero General Public License as      *
+ *   published by the Free Software Foundation, either version 3 of      *
+ *   the License, or (at your option) any later version.                 *
+ *                                                                       *
+ *   TeapotNet is distributed in the hope that it will be useful, but    *
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the        *
+ *   GNU Affero General Public License for more details.                 *
+ *                                                                       *
+ *   You should have received a copy of the GNU Affero General Public    *
+ *   License along with TeapotNet.                                       *
+ *   If not, see <http://www.gnu.org/licenses/>.                         *
+ *************************************************************************/
+
+
+// Checks AES-NI against the table implementation with known-answer vectors,
+// then measures AesCipher throughput with both implementations in CBC and GCM modes
+
+#include "bench/bench.h"
+#include "tpn/aescipher.h"
+#include "tpn/bytestring.h"
+#include "tpn/array.h"
+
+using namespace tpn;
+
+static const size_t BufferBlocks = 4096;	// 64 KiB
+
+static void fromHex(const char *hex, char *out)
+{
+	for(size_t i=0; hex[2*i]; ++i)
+	{
+		unsigned value;
+		std::sscanf(hex + 2*i, "%2x", &value);
+		out[i] = char(value);
+	}
+}
+
+struct Vector
+{
+	const char *key;
+	const char *iv;
+	const char *plain;
+	const char *cipher;
+};
+
+// NIST SP 800-38A, F.2.1, F.2.3 and F.2.5
+static const Vector Vectors[] = {
+	{	"2b7e151628aed2a6abf7158809cf4f3c",
+		"000102030405060708090a0b0c0d0e0f",
+		"6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e5130c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710",
+		"7649abac8119b246cee98e9b12e9197d5086cb9b507219ee95db113a917678b273bed6b8e3c1743b7116e69e222295163ff1caa1681fac09120eca307586e1a7" },
+	{	"8e73b0f7da0e6452c810f32b809079e562f8ead2522c6b7b",
+		"000102030405060708090a0b0c0d0e0f",
+		"6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e5130c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710",
+		"4f021db243bc633d7178183a9fa071e8b4d9ada9ad7dedf4e5e738763f69145a571b242012fb7ae07fa9baac3df102e008b0e27988598881d920a9e64f5615cd" },
+	{	"603deb1015ca71be2b73aef0857d77811f352c073b6108d72d9810a30914dff4",
+		"000102030405060708090a0b0c0d0e0f",
+		"6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e5130c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710",
+		"f58c4c04d6e5f1ba779eabfb5f7bfbd69cfc4e967edb808d679f777bc6702c7d39f23369a9d9bacfa530e26304231461b2eb05e2c39be9fcda6c19078c6a9d1b" }
+};
+
+static void checkVectors(void)
+{
+	for(size_t v=0; v<sizeof(Vectors)/sizeof(Vector); ++v)
+	{
+		char key[32], iv[16], plain[64], cipher[64], buffer[64];
+		size_t keySize = std::strlen(Vectors[v].key)/2;
+		fromHex(Vectors[v].key, key);
+		fromHex(Vectors[v].iv, iv);
+		fromHex(Vectors[v].plain, plain);
+		fromHex(Vectors[v].cipher, cipher);
+		
+		AesCipher aes(NULL);
+		aes.setEncryptionKey(key, keySize);
+		aes.setEncryptionInit(iv, 16);
+		aes.setDecryptionKey(key, keySize);
+		aes.setDecryptionInit(iv, 16);
+		
+		std::memcpy(buffer, plain, 64);
+		aes.encryptBlocks(buffer, 4);
+		if(std::memcmp(buffer, cipher, 64)) throw Exception("AES encryption does not match test vector");
+		
+		aes.decryptBlocks(buffer, buffer, 4);
+		if(std::memcmp(buffer, plain, 64)) throw Exception("AES decryption does not match test vector");
+	}
+}
+
+struct GcmVector
+{
+	const char *key;
+	const char *iv;
+	const char *aad;
+	const char *plain;
+	const char *cipher;
+	const char *tag;
+};
+
+// GCM specification (McGrew and Viega), test cases 13 to 16
+static const GcmVector GcmVectors[] = {
+	{	"0000000000000000000000000000000000000000000000000000000000000000",
+		"000000000000000000000000",
+		"",
+		"",
+		"",
+		"530f8afbc74536b9a963b4f1c4cb738b" },
+	{	"0000000000000000000000000000000000000000000000000000000000000000",
+		"000000000000000000000000",
+		"",
+		"00000000000000000000000000000000",
+		"cea7403d4d606b6e074ec5d3baf39d18",
+		"d0d1c8a799996bf0265b98b5d48ab919" },
+	{	"feffe9928665731c6d6a8f9467308308feffe9928665731c6d6a8f9467308308",
+		"cafebabefacedbaddecaf888",
+		"",
+		"d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a721c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b391aafd255",
+		"522dc1f099567d07f47f37a32a84427d643a8cdcbfe5c0c97598a2bd2555d1aa8cb08e48590dbb3da7b08b1056828838c5f61e6393ba7a0abcc9f662898015ad",
+		"b094dac5d93471bdec1a502270e3cc6c" },
+	{	"feffe9928665731c6d6a8f9467308308feffe9928665731c6d6a8f9467308308",
+		"cafebabefacedbaddecaf888",
+		"feedfacedeadbeeffeedfacedeadbeefabaddad2",
+		"d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a721c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39",
+		"522dc1f099567d07f47f37a32a84427d643a8cdcbfe5c0c97598a2bd2555d1aa8cb08e48590dbb3da7b08b1056828838c5f61e6393ba7a0abcc9f662",
+		"76fc6ece0f4e1768cddf8853bb2d551b" }
+};
+
+static void checkGcmVectors(void)
+{
+	for(size_t v=0; v<sizeof(GcmVectors)/sizeof(GcmVector); ++v)
+	{
+		char key[32], iv[12], aad[32], plain[64], cipher[64], tag[16], buffer[64], check[16];
+		size_t aadSize = std::strlen(GcmVectors[v].aad)/2;
+		size_t size = std::strlen(GcmVectors[v].plain)/2;
+		fromHex(GcmVectors[v].key, key);
+		fromHex(GcmVectors[v].iv, iv);
+		fromHex(GcmVectors[v].aad, aad);
+		fromHex(GcmVectors[v].plain, plain);
+		fromHex(GcmVectors[v].cipher, cipher);
+		fromHex(GcmVectors[v].tag, tag);
+		
+		// The 12-byte nonce is repeated in the init vector, only its 12 first bytes are used
+		AesCipher aes(NULL);
+		aes.setMode(AesCipher::GCM);
+		aes.setEncryptionKey(key, 32);
+		aes.setEncryptionInit(iv, 12);
+		aes.setDecryptionKey(key, 32);
+		aes.setDecryptionInit(iv, 12);
+		
+		aes.encryptRecord(aad, aadSize, plain, buffer, size, check);
+		if(std::memcmp(buffer, cipher, size)) throw Exception("GCM encryption does not match test vector");
+		if(std::memcmp(check, tag, 16)) throw Exception("GCM tag does not match test vector");
+		
+		check[0]^= 1;
+		if(aes.decryptRecord(aad, aadSize, buffer, buffer, size, check)) throw Exception("GCM accepted a forged tag");
+		
+		if(!aes.decryptRecord(aad, aadSize, buffer, buffer, size, tag)) throw Exception("GCM rejected a valid tag");
+		if(std::memcmp(buffer, plain, size)) throw Exception("GCM decryption does not match test vector");
+	}
+}
+
+static void checkImplementations(AesCipher::Mode mode)
+{
+	// Both implementations must produce the same stream, including the padding
+	ByteString key, iv, data;
+	key.writeRandom(32);
+	iv.writeRandom(16);
+	data.writeRandom(100000);
+	
+	// Padding depends on write sizes, so both use the same ones
+	Array<size_t> sizes;
+	for(size_t total = 0; total < data.size(); total+= sizes.back())
+		sizes.push_back(1 + pseudorand() % 1000);
+	
+	ByteString output[2];
+	for(int hw=0; hw<2; ++hw)
+	{
+		AesCipher::SetHardwareEnabled(hw != 0);
+		AesCipher cipher(&output[hw]);
+		cipher.setMode(mode);
+		cipher.setEncryptionKey(key);
+		cipher.setEncryptionInit(iv);
+		
+		ByteString tmp(data);
+		for(int i=0; i<sizes.size(); ++i)
+		{
+			char buffer[1000];
+			size_t size = static_cast<ByteStream&>(tmp).readData(buffer, sizes[i]);
+			cipher.writeData(buffer, size);
+		}
+	}
+	
+	if(output[0] != output[1]) throw Exception("AES-NI and table outputs differ");
+	
+	for(int hw=0; hw<2; ++hw)
+	{
+		AesCipher::SetHardwareEnabled(hw != 0);
+		ByteString input(output[0]);
+		AesCipher cipher(&input);
+		cipher.setMode(mode);
+		cipher.setDecryptionKey(key);
+		cipher.setDecryptionInit(iv);
+		
+		ByteString result;
+		char buffer[4096];
+		size_t size;
+		while((size = cipher.readData(buffer, sizeof(buffer))))
+			static_cast<ByteStream&>(result).writeData(buffer, size);
+		
+		if(result != data) throw Exception("AES decrypted data differs");
+	}
+	
+	if(mode == AesCipher::GCM)
+	{
+		// A modified record must be rejected
+		ByteString input(output[0]);
+		input[input.size()/2]^= 1;
+		AesCipher cipher(&input);
+		cipher.setMode(mode);
+		cipher.setDecryptionKey(key);
+		cipher.setDecryptionInit(iv);
+		
+		bool rejected = false;
+		try {
+			char buffer[4096];
+			while(cipher.readData(buffer, sizeof(buffer))) {}
+		}
+		catch(const IOException &e)
+		{
+			rejected = true;
+		}
+		
+		if(!rejected) throw Exception("GCM accepted modified data");
+	}
+}
+
+struct RawCbc
+{
+	AesCipher *cipher;
+	char *buffer;
+	bool decrypt;
+	
+	void operator()(void)
+	{
+		if(decrypt) cipher->decryptBlocks(buffer, buffer, BufferBlocks);
+		else cipher->encryptBlocks(buffer, BufferBlocks);
+	}
+};
+
+struct StreamWrite
+{
+	ByteString *key;
+	AesCipher::Mode mode;
+	const char *data;
+	size_t size;
+	
+	void operator()(void)
+	{
+		ByteString sink;
+		AesCipher cipher(&sink);
+		cipher.setMode(mode);
+		cipher.setEncryptionKey(*key);
+		cipher.writeData(data, size);
+	}
+};
+
+struct StreamRead
+{
+	ByteString *key;
+	AesCipher::Mode mode;
+	ByteString *source;
+	char *buffer;
+	
+	void operator()(void)
+	{
+		ByteString input(*source);
+		AesCipher cipher(&input);
+		cipher.setMode(mode);
+		cipher.setDecryptionKey(*key);
+		while(cipher.readData(buffer, BufferBlocks*AES_BLOCK_SIZE)) {}
+	}
+};
+
+int main(int argc, char **argv)
+{
+	Bench bench("aes");
+	
+	bool hardware = AesCipher::IsHardwareAvailable();
+	bench.report("AES-NI available", hardware ? 1. : 0., "");
+	
+	for(int hw=0; hw<2; ++hw)
+	{
+		if(hw && !hardware) break;
+		AesCipher::SetHardwareEnabled(hw != 0);
+		checkVectors();
+		checkGcmVectors();
+	}
+	if(hardware)
+	{
+		checkImplementations(AesCipher::CBC);
+		checkImplementations(AesCipher::GCM);
+	}
+	
+	ByteString key;
+	key.writeRandom(32);
+	
+	char *buffer = new char[BufferBlocks*AES_BLOCK_SIZE];
+	std::memset(buffer, 0x5A, BufferBlocks*AES_BLOCK_SIZE);
+	const double mb = double(BufferBlocks*AES_BLOCK_SIZE)/(1024*1024);
+	
+	for(int hw=0; hw<2; ++hw)
+	{
+		if(hw && !hardware) break;
+		AesCipher::SetHardwareEnabled(hw != 0);
+		String impl = (hw ? "AES-NI" : "table");
+		
+		AesCipher cipher(NULL);
+		cipher.setEncryptionKey(key);
+		cipher.setDecryptionKey(key);
+		
+		RawCbc encrypt;
+		encrypt.cipher = &cipher;
+		encrypt.buffer = buffer;
+		encrypt.decrypt = false;
+		bench.report("CBC encrypt (" + impl + ")", bench.run(encrypt)*mb, "MB/s");
+		
+		RawCbc decrypt;
+		decrypt.cipher = &cipher;
+		decrypt.buffer = buffer;
+		decrypt.decrypt = true;
+		bench.report("CBC decrypt (" + impl + ")", bench.run(decrypt)*mb, "MB/s");
+		
+		for(int m=0; m<2; ++m)
+		{
+			AesCipher::Mode mode = (m ? AesCipher::GCM : AesCipher::CBC);
+			String label = String(m ? "GCM" : "CBC") + " " + impl;
+			
+			StreamWrite write;
+			write.key = &key;
+			write.mode = mode;
+			write.data = buffer;
+			write.size = BufferBlocks*AES_BLOCK_SIZE;
+			bench.report("writeData (" + label + ")", bench.run(write)*mb, "MB/s");
+			
+			ByteString source;
+			{
+				AesCipher cipher(&source);
+				cipher.setMode(mode);
+				cipher.setEncryptionKey(key);
+				cipher.writeData(buffer, BufferBlocks*AES_BLOCK_SIZE);
+			}
+			
+			StreamRead read;
+			read.key = &key;
+			read.mode = mode;
+			read.source = &source;
+			read.buffer = buffer;
+			bench.report("readData (" + label + ")", bench.run(read)*mb, "MB/s");
+		}
+	}
+	
+	delete[] buffer;
+	return 0;
+}
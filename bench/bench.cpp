@@ -0,0 +1,94 @@
+/*************************************************************************
+ *   Copyright (C) 2011-2013 by Paul-Louis Ageneau                       *
+ *   paul-louis (at) ageneau (dot) org                                   *
+ *                                                                       *
+ *   This file is part of TeapotNet.                                     *
+ *                                                                       *
+ *   TeapotNet is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU Affero General Public License as      *
+ *   published by the Free Software Foundation, either version 3 of      *
+ *   the License, or (at your option) any later version.                 *
+ *                                                                       *
+ *   TeapotNet is distributed in the hope that it will be useful, but    *
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the        *
+ *   GNU Affero General Public License for more details.                 *
+ *                                                                       *
+ *   You should have received a copy of the GNU Affero General Public    *
+ *   License along with TeapotNet.                                       *
+ *   If not, see <http://www.gnu.org/licenses/>.                         *
+ *************************************************************************/
+
+
+#include "bench/bench.h"
+
+// Globals normally defined in main.cpp
+tpn::Mutex	tpn::LogMutex;
+int		tpn::LogLevel = LEVEL_WARN;
+bool		tpn::ForceLogToFile = false;
+
+namespace tpn
+{
+
+static String JsonString(const String &str)
+{
+	String result;
+	result.reserve(str.size() + 2);
+	result+= '"';
+	for(size_t i=0; i<str.size(); ++i)
+	{
+		char chr = str[i];
+		if(chr == '"' || chr == '\\') result+= '\\';
+		if(uint8_t(chr) >= 0x20) result+= chr;
+	}
+	result+= '"';
+	return result;
+}
+
+Bench::Bench(const String &name) :
+	mName(name),
+	mJson(false)
+{
+
+}
+
+Bench::~Bench(void)
+{
+	if(!mJson) return;
+	
+	std::cout<<"{"<<std::endl;
+	std::cout<<"\t\"bench\": "<<JsonString(mName)<<","<<std::endl;
+	std::cout<<"\t\"results\": ["<<std::endl;
+	for(size_t i=0; i<mResults.size(); ++i)
+	{
+		const Result &result = mResults[i];
+		std::cout<<"\t\t{\"label\": "<<JsonString(result.label)
+			<<", \"value\": "<<std::fixed<<std::setprecision(3)<<result.value
+			<<", \"unit\": "<<JsonString(result.unit)<<"}"
+			<<(i + 1 < mResults.size() ? "," : "")<<std::endl;
+	}
+	std::cout<<"\t]"<<std::endl;
+	std::cout<<"}"<<std::endl;
+}
+
+void Bench::setJson(bool enabled)
+{
+	mJson = enabled;
+}
+
+void Bench::report(const String &label, double value, const String &unit)
+{
+	if(mJson)
+	{
+		Result result;
+		result.label = label;
+		result.value = value;
+		result.unit = unit;
+		mResults.push_back(result);
+		return;
+	}
+	
+	std::cout<<std::setw(16)<<mName<<" "<<std::setw(40)<<std::left<<label<<std::right<<" "<<std::fixed<<std::setprecision(2)<<std::setw(16)<<value<<" "<<unit<<std::endl;
+}
+
+}
@@ -0,0 +1,80 @@
+/*************************************************************************
+ *   Copyright (C) 2011-2013 by Paul-Louis Ageneau                       *
+ *   paul-louis (at) ageneau (dot) org                                   *
+ *                                                                       *
+ *   This file is part of TeapotNet.                                     *
+ *                                                                       *
+ *   TeapotNet is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU Affero General Public License as      *
+ *   published by the Free Software Foundation, either version 3 of      *
+ *   the License, or (at your option) any later version.                 *
+ *                                                                       *
+ *   TeapotNet is distributed in the hope that it will be useful, but    *
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the        *
+ *   GNU Affero General Public License for more details.                 *
+ *                                                                       *
+ *   You should have received a copy of the GNU Affero General Public    *
+ *   License along with TeapotNet.                                       *
+ *   If not, see <http://www.gnu.org/licenses/>.                         *
+ *************************************************************************/
+
+
+#ifndef TPN_BENCH_H
+#define TPN_BENCH_H
+
+#include "tpn/include.h"
+#include "tpn/string.h"
+#include "tpn/time.h"
+#include "tpn/array.h"
+
+namespace tpn
+{
+
+// Minimal benchmarking helper shared by the bench/ programs
+class Bench
+{
+public:
+	Bench(const String &name);
+	~Bench(void);
+	
+	// Results are printed as a single JSON document on destruction instead of text lines
+	void setJson(bool enabled);
+	
+	// Runs func repeatedly for at least minTime seconds, returns runs per second
+	template<typename T> double run(T &func, double minTime = 1.);
+	
+	void report(const String &label, double value, const String &unit);
+	
+private:
+	struct Result
+	{
+		String label;
+		double value;
+		String unit;
+	};
+	
+	String mName;
+	bool mJson;
+	Array<Result> mResults;
+};
+
+template<typename T> double Bench::run(T &func, double minTime)
+{
+	func();	// warm up
+	
+	uint64_t count = 0;
+	Time start = Time::Now();
+	double elapsed;
+	do {
+		func();
+		++count;
+	}
+	while((elapsed = Time::Now() - start) < minTime);
+	
+	return double(count)/elapsed;
+}
+
+}
+
+#endif
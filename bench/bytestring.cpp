@@ -0,0 +1,287 @@
+/*************************************************************************
+ *   Copyright (C) 2011-2013 by Paul-Louis Ageneau                       *
+ *   paul-louis (at) ageneau (dot) org                                   *
+ *                                                                       *
+ *   This file is part of TeapotNet.                                     *
+ *                                                                       *
+ *   TeapotNet is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU Affero General Public License as      *
+ *   published by the Free Software Foundation, either version 3 of      *
+ *   the License, or (at your option) any later version.                 *
+ *                                                                       *
+ *   TeapotNet is distributed in the hope that it will be useful, but    *
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the        *
+ *   GNU Affero General Public License for more details.                 *
+ *                                                                       *
+ *   You should have received a copy of the GNU Affero General Public    *
+ *   License along with TeapotNet.                                       *
+ *   If not, see <http://www.gnu.org/licenses/>.                         *
+ *************************************************************************/
+
+
+
+// Checks the contiguous ByteString and ByteChain against std::deque<char>, the former
+// ByteString base, then counts allocations per message on digest and input paths
+
+#include "bench/bench.h"
+#include "tpn/bytestring.h"
+#include "tpn/bytechain.h"
+#include "tpn/sha512.h"
+
+#include <deque>
+#include <new>
+
+using namespace tpn;
+
+static size_t Allocations = 0;
+
+void *operator new(size_t size)
+{
+	++Allocations;
+	void *ptr = std::malloc(size ? size : 1);
+	if(!ptr) throw std::bad_alloc();
+	return ptr;
+}
+
+void operator delete(void *ptr) throw()
+{
+	std::free(ptr);
+}
+
+void operator delete(void *ptr, size_t) throw()
+{
+	std::free(ptr);
+}
+
+typedef std::deque<char> CharDeque;
+
+static const size_t Messages = 1000;
+static const size_t MessageSize = 1400;	// typical received segment
+static const size_t ReadSize = 4096;	// reads by the cipher
+
+static void checkEquals(const ByteString &bs, const CharDeque &reference)
+{
+	if(bs.size() != reference.size() || !std::equal(reference.begin(), reference.end(), bs.begin()))
+		throw Exception("ByteString differs from reference");
+}
+
+static void checkByteString(void)
+{
+	ByteString bs;
+	CharDeque reference;
+	for(int i=0; i<20000; ++i)
+	{
+		char buffer[300];
+		switch(pseudorand() % 7)
+		{
+		case 0:	// write
+		{
+			size_t size = pseudorand() % sizeof(buffer);
+			for(size_t j=0; j<size; ++j) buffer[j] = char(pseudorand());
+			static_cast<ByteStream&>(bs).writeData(buffer, size);
+			reference.insert(reference.end(), buffer, buffer + size);
+			break;
+		}
+		case 1:	// read
+		{
+			size_t size = static_cast<ByteStream&>(bs).readData(buffer, pseudorand() % sizeof(buffer));
+			if(!std::equal(buffer, buffer + size, reference.begin())) throw Exception("ByteString read differs");
+			reference.erase(reference.begin(), reference.begin() + size);
+			break;
+		}
+		case 2:	// insert in the middle
+		{
+			size_t pos = (bs.empty() ? 0 : pseudorand() % bs.size());
+			char value = char(pseudorand());
+			bs.insert(bs.begin() + pos, 3, value);
+			reference.insert(reference.begin() + pos, 3, value);
+			break;
+		}
+		case 3:	// erase in the middle
+		{
+			if(bs.size() < 2) break;
+			size_t first = pseudorand() % bs.size();
+			size_t last = first + pseudorand() % (bs.size() - first);
+			bs.erase(bs.begin() + first, bs.begin() + last);
+			reference.erase(reference.begin() + first, reference.begin() + last);
+			break;
+		}
+		case 4:	// push and pop
+		{
+			bs.push_front('a');
+			reference.push_front('a');
+			bs.push_back('b');
+			reference.push_back('b');
+			bs.pop_front();
+			reference.pop_front();
+			break;
+		}
+		case 5:	// swap through a small string
+		{
+			const char *small = "xyz";
+			ByteString other(small, 3);
+			bs.swap(other);
+			checkEquals(bs, CharDeque(small, small + 3));
+			bs.swap(other);
+			break;
+		}
+		case 6:	// copy and append to self
+		{
+			ByteString copy(bs);
+			if(copy != bs) throw Exception("ByteString copy differs");
+			if(bs.size() < 10000)
+			{
+				bs.append(bs);
+				CharDeque tmp(reference);
+				reference.insert(reference.end(), tmp.begin(), tmp.end());
+			}
+			break;
+		}
+		}
+		
+		checkEquals(bs, reference);
+	}
+}
+
+static void checkByteChain(void)
+{
+	ByteChain raw, input;
+	CharDeque reference;
+	for(int i=0; i<5000; ++i)
+	{
+		char buffer[ReadSize];
+		size_t size = pseudorand() % MessageSize;
+		for(size_t j=0; j<size; ++j) buffer[j] = char(pseudorand());
+		raw.writeData(buffer, size);
+		reference.insert(reference.end(), buffer, buffer + size);
+		
+		if(pseudorand() % 2) input.append(raw);
+		if(pseudorand() % 3 == 0)
+		{
+			size = input.readData(buffer, pseudorand() % ReadSize);
+			if(!std::equal(buffer, buffer + size, reference.begin())) throw Exception("ByteChain read differs");
+			reference.erase(reference.begin(), reference.begin() + size);
+		}
+		
+		if(input.size() + raw.size() != reference.size()) throw Exception("ByteChain size differs");
+	}
+}
+
+// Former input path: the socket data is inserted in a deque, copied to the cipher input, then drained
+struct LegacyInput
+{
+	const char *data;
+	
+	void operator()(void)
+	{
+		CharDeque raw, input;
+		char buffer[ReadSize];
+		for(size_t m=0; m<Messages; ++m)
+		{
+			raw.insert(raw.end(), data, data + MessageSize);
+			input.insert(input.end(), raw.begin(), raw.end());
+			raw.clear();
+			
+			while(input.size() >= ReadSize)
+			{
+				std::copy(input.begin(), input.begin() + ReadSize, buffer);
+				input.erase(input.begin(), input.begin() + ReadSize);
+			}
+		}
+	}
+};
+
+struct ChainInput
+{
+	const char *data;
+	
+	void operator()(void)
+	{
+		ByteChain raw, input;
+		char buffer[ReadSize];
+		for(size_t m=0; m<Messages; ++m)
+		{
+			raw.writeData(data, MessageSize);
+			input.append(raw);
+			
+			while(input.size() >= ReadSize)
+				input.readData(buffer, ReadSize);
+		}
+	}
+};
+
+// Digests are computed, copied as map keys and compared
+struct LegacyDigest
+{
+	const char *data;
+	
+	void operator()(void)
+	{
+		for(size_t m=0; m<Messages; ++m)
+		{
+			unsigned char digest[Sha512::DigestSize];
+			Sha512::Span span = { data, 64 };
+			Sha512::Hash(&span, 1, digest);
+			
+			CharDeque d(digest, digest + Sha512::DigestSize);
+			CharDeque key(d);
+			if(key != d) throw Exception("Digest copy differs");
+		}
+	}
+};
+
+struct Digest
+{
+	const char *data;
+	
+	void operator()(void)
+	{
+		for(size_t m=0; m<Messages; ++m)
+		{
+			ByteString d;
+			Sha512::Hash(data, 64, d);
+			
+			ByteString key(d);
+			if(key != d) throw Exception("Digest copy differs");
+		}
+	}
+};
+
+template<typename T> void measure(Bench &bench, const String &label, T &func)
+{
+	Allocations = 0;
+	func();
+	bench.report(label + " allocations", double(Allocations)/Messages, "/message");
+	bench.report(label, bench.run(func)*Messages, "messages/s");
+}
+
+int main(int argc, char **argv)
+{
+	Bench bench("bytestring");
+	
+	checkByteString();
+	checkByteChain();
+	
+	char *data = new char[MessageSize];
+	std::memset(data, 0x5A, MessageSize);
+	
+	LegacyInput legacyInput;
+	legacyInput.data = data;
+	measure(bench, "input (deque)", legacyInput);
+	
+	ChainInput chainInput;
+	chainInput.data = data;
+	measure(bench, "input (ByteChain)", chainInput);
+	
+	LegacyDigest legacyDigest;
+	legacyDigest.data = data;
+	measure(bench, "digest (deque)", legacyDigest);
+	
+	Digest digest;
+	digest.data = data;
+	measure(bench, "digest (ByteString)", digest);
+	
+	delete[] data;
+	return 0;
+}
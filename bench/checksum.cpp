@@ -0,0 +1,108 @@
+/*************************************************************************
+ *   Copyright (C) 2011-2013 by Paul-Louis Ageneau                       *
+ *   paul-louis (at) ageneau (dot) org                                   *
+ *                                                                       *
+ *   This file is part of TeapotNet.                                     *
+ *                                                                       *
+ *   TeapotNet is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU Affero General Public License as      *
+ *   published by the Free Software Foundation, either version 3 of      *
+ *   the License, or (at your option) any later version.                 *
+ *                                                                       *
+ *   TeapotNet is distributed in the hope that it will be useful, but    *
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the        *
+ *   GNU Affero General Public License for more details.                 *
+ *                                                                       *
+ *   You should have received a copy of the GNU Affero General Public    *
+ *   License along with TeapotNet.                                       *
+ *   If not, see <http://www.gnu.org/licenses/>.                         *
+ *************************************************************************/
+
+
+
+// Checks ByteString checksums against a byte-wise reference implementation,
+// then measures them on large inputs
+
+#include "bench/bench.h"
+#include "tpn/bytestring.h"
+
+using namespace tpn;
+
+static const size_t LargeSize = 16*1024*1024;	// 16 MiB
+
+// XOR of the big-endian words of the data padded with zeros
+template<typename T> static T referenceChecksum(const ByteString &bs)
+{
+	T result = 0;
+	for(size_t i=0; i<bs.size(); i+= sizeof(T))
+	{
+		T value = 0;
+		for(size_t j=0; j<sizeof(T); ++j)
+			value = T(value << 8) | T(i + j < bs.size() ? uint8_t(bs[i + j]) : 0);
+		result^= value;
+	}
+	return result;
+}
+
+static void checkChecksums(void)
+{
+	for(int i=0; i<2000; ++i)
+	{
+		ByteString bs;
+		bs.writeRandom(pseudorand() % 600);
+		
+		// Start at an arbitrary offset in the buffer
+		size_t offset = pseudorand() % 8;
+		bs.erase(bs.begin(), bs.begin() + std::min(offset, bs.size()));
+		
+		if(bs.checksum16() != referenceChecksum<uint16_t>(bs)) throw Exception("checksum16 does not match reference");
+		if(bs.checksum32() != referenceChecksum<uint32_t>(bs)) throw Exception("checksum32 does not match reference");
+		if(bs.checksum64() != referenceChecksum<uint64_t>(bs)) throw Exception("checksum64 does not match reference");
+	}
+	
+	// Known values
+	const char data[] = { 0x01, 0x02, 0x03, 0x04, 0x05 };
+	ByteString bs(data, sizeof(data));
+	if(bs.checksum16() != (0x0102 ^ 0x0304 ^ 0x0500)) throw Exception("checksum16 does not match known value");
+	if(bs.checksum32() != (0x01020304 ^ 0x05000000)) throw Exception("checksum32 does not match known value");
+	if(ByteString().checksum64() != 0) throw Exception("checksum64 of empty string is not zero");
+}
+
+struct Checksum
+{
+	ByteString *data;
+	bool reference;
+	uint64_t result;
+	
+	void operator()(void)
+	{
+		if(reference) result = referenceChecksum<uint64_t>(*data);
+		else result = data->checksum64();
+	}
+};
+
+int main(int argc, char **argv)
+{
+	Bench bench("checksum");
+	
+	checkChecksums();
+	
+	ByteString data;
+	data.writeRandom(LargeSize);
+	const double mb = double(LargeSize)/(1024*1024);
+	
+	Checksum reference;
+	reference.data = &data;
+	reference.reference = true;
+	bench.report("checksum64 16 MiB (reference)", bench.run(reference)*mb, "MB/s");
+	
+	Checksum checksum;
+	checksum.data = &data;
+	checksum.reference = false;
+	bench.report("checksum64 16 MiB", bench.run(checksum)*mb, "MB/s");
+	
+	if(checksum.result != reference.result) throw Exception("checksum64 differs from reference");
+	
+	return 0;
+}
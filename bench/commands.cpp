@@ -0,0 +1,161 @@
+/*************************************************************************
+ *   Copyright (C) 2011-2013 by Paul-Louis Ageneau                       *
+ *   paul-louis (at) ageneau (dot) org                                   *
+ *                                                                       *
+ *   This file is part of TeapotNet.                                     *
+ *                                                                       *
+ *   TeapotNet is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU Affero General Public License as      *
+ *   published by the Free Software Foundation, either version 3 of      *
+ *   the License, or (at your option) any later version.                 *
+ *                                                                       *
+ *   TeapotNet is distributed in the hope that it will be useful, but    *
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the        *
+ *   GNU Affero General Public License for more details.                 *
+ *                                                                       *
+ *   You should have received a copy of the GNU Affero General Public    *
+ *   License along with TeapotNet.                                       *
+ *   If not, see <http://www.gnu.org/licenses/>.                         *
+ *************************************************************************/
+
+
+// Measures TPN command framing throughput through the link cipher,
+// with plain Stream::readLine and with the BufferedStream layer
+
+#include "bench/bench.h"
+#include "tpn/aescipher.h"
+#include "tpn/bufferedstream.h"
+#include "tpn/bytestring.h"
+#include "tpn/map.h"
+
+using namespace tpn;
+
+static const int CommandsCount = 1000;
+
+static void setKeys(AesCipher *cipher)
+{
+	ByteString key, iv;
+	key.fill(0x2A, 32);
+	iv.fill(0x17, 16);
+	cipher->setEncryptionKey(key);
+	cipher->setEncryptionInit(iv);
+	cipher->setDecryptionKey(key);
+	cipher->setDecryptionInit(iv);
+}
+
+// Same parsing as Core::Handler::recvCommand
+static bool recvCommand(Stream *stream, String &command, String &args, StringMap &parameters)
+{
+	command.clear();
+	if(!stream->readLine(command)) return false;
+	args = command.cut(' ').lineDecode();
+	command = command.toUpper();
+	
+	parameters.clear();
+	while(true)
+	{
+		String name;
+		AssertIO(stream->readLine(name));
+		if(name.empty()) break;
+		String value = name.cut(':');
+		name.trim();
+		value.trim();
+		name = name.toLower();
+		parameters.insert(name,value.lineDecode());
+	}
+	return true;
+}
+
+// Reads all lines from input with a small buffer so lines span several chunks
+static String readLines(const String &input)
+{
+	String source(input);
+	BufferedStream stream(&source, 3, false);
+	
+	String result, line;
+	while(stream.readLine(line)) result << '[' << line << ']';
+	return result;
+}
+
+static void checkReadLine(void)
+{
+	struct { const char *input; const char *expected; } cases[] = {
+		{ "", "" },
+		{ "a", "[a]" },
+		{ "a\n", "[a]" },
+		{ "a\r\nb", "[a][b]" },
+		{ "a\r\n\r\n", "[a][]" },
+		{ "\n\n", "[][]" },
+		{ "a\n\r", "[a][]" },
+		{ "\r", "[]" },
+		{ "ab\rcd\n", "[abcd]" }
+	};
+	
+	for(size_t i=0; i<sizeof(cases)/sizeof(cases[0]); ++i)
+	{
+		String result = readLines(cases[i].input);
+		if(result != cases[i].expected)
+			throw Exception("BufferedStream::readLine framing differs: " + result + " instead of " + cases[i].expected);
+	}
+}
+
+struct ReadCommands
+{
+	ByteString *source;
+	bool buffered;
+	
+	void operator()(void)
+	{
+		ByteString raw(*source);
+		AesCipher *cipher = new AesCipher(&raw);
+		setKeys(cipher);
+		
+		Stream *stream = cipher;
+		if(buffered) stream = new BufferedStream(cipher);
+		
+		String command, args;
+		StringMap parameters;
+		int count = 0;
+		while(recvCommand(stream, command, args, parameters)) ++count;
+		Assert(count == CommandsCount);
+		
+		delete stream;
+	}
+};
+
+int main(int argc, char **argv)
+{
+	checkReadLine();
+	
+	ByteString raw;
+	{
+		AesCipher cipher(&raw);
+		setKeys(&cipher);
+		
+		for(int i=0; i<CommandsCount; ++i)
+		{
+			String buffer;
+			buffer << "R " << i << " 0 " << (i%16) << Stream::NewLine;
+			buffer << "length: " << 4096 << Stream::NewLine;
+			buffer << "type: directory" << Stream::NewLine;
+			buffer << "time: " << 1380000000+i << Stream::NewLine;
+			buffer << Stream::NewLine;
+			cipher.writeData(buffer.data(), buffer.size());
+		}
+	}
+	
+	Bench bench("commands");
+	
+	ReadCommands unbuffered;
+	unbuffered.source = &raw;
+	unbuffered.buffered = false;
+	bench.report("recvCommand (Stream::readLine)", bench.run(unbuffered)*CommandsCount, "commands/s");
+	
+	ReadCommands buffered;
+	buffered.source = &raw;
+	buffered.buffered = true;
+	bench.report("recvCommand (BufferedStream)", bench.run(buffered)*CommandsCount, "commands/s");
+	
+	return 0;
+}
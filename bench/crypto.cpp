@@ -0,0 +1,257 @@
+/*************************************************************************
+ *   Copyright (C) 2011-2013 by Paul-Louis Ageneau                       *
+ *   paul-louis (at) ageneau (dot) org                                   *
+ *                                                                       *
+ *   This file is part of TeapotNet.                                     *
+ *                                                                       *
+ *   TeapotNet is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU Affero General Public License as      *
+ *   published by the Free Software Foundation, either version 3 of      *
+ *   the License, or (at your option) any later version.                 *
+ *                                                                       *
+ *   TeapotNet is distributed in the hope that it will be useful, but    *
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the        *
+ *   GNU Affero General Public License for more details.                 *
+ *                                                                       *
+ *   You should have received a copy of the GNU Affero General Public    *
+ *   License along with TeapotNet.                                       *
+ *   If not, see <http://www.gnu.org/licenses/>.                         *
+ *************************************************************************/
+
+
+// Standalone crypto and hashing benchmark, reports throughput across buffer sizes
+// for the cipher, the hash functions and the authentication path
+// Usage: crypto [--json] [--time seconds]
+
+#include "bench/bench.h"
+#include "tpn/aescipher.h"
+#include "tpn/sha512.h"
+#include "tpn/user.h"
+#include "tpn/bytestring.h"
+
+using namespace tpn;
+
+static const size_t CipherSizes[] = { 64, 1024, 16384, 65536 };	// sizes of writeData and readData calls
+static const size_t StreamSize = 1024*1024;	// ciphers process a whole stream so setup is amortized
+static const size_t HashSizes[] = { 64, 1024, 16384, 1024*1024 };
+static const size_t HmacSizes[] = { 64, 1024 };
+static const int DerivationRounds = 1000;
+
+struct CipherWrite
+{
+	ByteString *key;
+	AesCipher::Mode mode;
+	const char *data;
+	size_t size;
+	
+	void operator()(void)
+	{
+		ByteString sink;
+		AesCipher cipher(&sink);
+		cipher.setMode(mode);
+		cipher.setEncryptionKey(*key);
+		for(size_t offset = 0; offset < StreamSize; offset+= size)
+			cipher.writeData(data + offset, size);
+	}
+};
+
+struct CipherRead
+{
+	ByteString *key;
+	AesCipher::Mode mode;
+	ByteString *source;
+	char *buffer;
+	size_t size;
+	
+	void operator()(void)
+	{
+		ByteString input(*source);
+		AesCipher cipher(&input);
+		cipher.setMode(mode);
+		cipher.setDecryptionKey(*key);
+		while(cipher.readData(buffer, size)) {}
+	}
+};
+
+struct Hash
+{
+	const char *data;
+	size_t size;
+	
+	void operator()(void)
+	{
+		unsigned char digest[Sha512::DigestSize];
+		Sha512::Span span = { data, size };
+		Sha512::Hash(&span, 1, digest);
+	}
+};
+
+struct AuthenticationCode
+{
+	ByteString *key;
+	const char *data;
+	size_t size;
+	
+	void operator()(void)
+	{
+		ByteString out;
+		Sha512::AuthenticationCode(*key, data, size, out);
+	}
+};
+
+struct Derivation
+{
+	ByteString *password;
+	ByteString *salt;
+	
+	void operator()(void)
+	{
+		ByteString key;
+		Sha512::DerivateKey(*password, *salt, key, DerivationRounds);
+	}
+};
+
+struct Authentication
+{
+	String name;
+	String password;
+	
+	void operator()(void)
+	{
+		// No user is registered, so this measures the full failing path
+		User::Authenticate(name, password);
+	}
+};
+
+static String sizeLabel(size_t size)
+{
+	if(size >= 1024*1024) return String::number(unsigned(size/(1024*1024))) + " MiB";
+	if(size >= 1024) return String::number(unsigned(size/1024)) + " KiB";
+	return String::number(unsigned(size)) + " B";
+}
+
+int main(int argc, char **argv)
+{
+	bool json = false;
+	double minTime = 0.5;
+	for(int i=1; i<argc; ++i)
+	{
+		String arg(argv[i]);
+		if(arg == "--json") json = true;
+		else if(arg == "--time" && i+1 < argc) minTime = String(argv[++i]).toDouble();
+		else {
+			std::cerr<<"Usage: "<<argv[0]<<" [--json] [--time seconds]"<<std::endl;
+			return 1;
+		}
+	}
+	
+	LogLevel = LEVEL_ERROR;	// silence authentication failures
+	
+	Bench bench("crypto");
+	bench.setJson(json);
+	
+	bool hardware = AesCipher::IsHardwareAvailable();
+	bool vector = Sha512::IsVectorAvailable();
+	bench.report("AES-NI available", hardware ? 1. : 0., "");
+	bench.report("AVX2 available", vector ? 1. : 0., "");
+	
+	const size_t maxSize = 1024*1024;
+	char *data = new char[std::max(maxSize, StreamSize)];
+	char *buffer = new char[maxSize];
+	std::memset(data, 0x5A, std::max(maxSize, StreamSize));
+	
+	ByteString key;
+	key.writeRandom(32);
+	
+	for(int hw=0; hw<2; ++hw)
+	{
+		if(hw && !hardware) break;
+		AesCipher::SetHardwareEnabled(hw != 0);
+		String impl = (hw ? "AES-NI" : "table");
+		
+		for(int m=0; m<2; ++m)
+		{
+			AesCipher::Mode mode = (m ? AesCipher::GCM : AesCipher::CBC);
+			String label = String(m ? "GCM" : "CBC") + " " + impl;
+			
+			for(size_t s=0; s<sizeof(CipherSizes)/sizeof(size_t); ++s)
+			{
+				size_t size = CipherSizes[s];
+				const double mb = double(StreamSize)/(1024*1024);
+				
+				CipherWrite write;
+				write.key = &key;
+				write.mode = mode;
+				write.data = data;
+				write.size = size;
+				bench.report("AES writeData " + sizeLabel(size) + " (" + label + ")", bench.run(write, minTime)*mb, "MB/s");
+				
+				ByteString source;
+				{
+					AesCipher cipher(&source);
+					cipher.setMode(mode);
+					cipher.setEncryptionKey(key);
+					for(size_t offset = 0; offset < StreamSize; offset+= size)
+						cipher.writeData(data + offset, size);
+				}
+				
+				CipherRead read;
+				read.key = &key;
+				read.mode = mode;
+				read.source = &source;
+				read.buffer = buffer;
+				read.size = size;
+				bench.report("AES readData " + sizeLabel(size) + " (" + label + ")", bench.run(read, minTime)*mb, "MB/s");
+			}
+		}
+	}
+	AesCipher::SetHardwareEnabled(hardware);
+	
+	for(int v=0; v<2; ++v)
+	{
+		if(v && !vector) break;
+		Sha512::SetVectorEnabled(v != 0);
+		String impl = (v ? "AVX2" : "scalar");
+		
+		for(size_t s=0; s<sizeof(HashSizes)/sizeof(size_t); ++s)
+		{
+			size_t size = HashSizes[s];
+			
+			Hash hash;
+			hash.data = data;
+			hash.size = size;
+			double rate = bench.run(hash, minTime);
+			bench.report("Sha512::Hash " + sizeLabel(size) + " (" + impl + ")", rate*double(size)/(1024*1024), "MB/s");
+			bench.report("Sha512::Hash " + sizeLabel(size) + " (" + impl + ")", rate, "ops/s");
+		}
+	}
+	Sha512::SetVectorEnabled(vector);
+	
+	for(size_t s=0; s<sizeof(HmacSizes)/sizeof(size_t); ++s)
+	{
+		AuthenticationCode hmac;
+		hmac.key = &key;
+		hmac.data = data;
+		hmac.size = HmacSizes[s];
+		bench.report("AuthenticationCode " + sizeLabel(HmacSizes[s]), bench.run(hmac, minTime), "ops/s");
+	}
+	
+	ByteString password, salt;
+	password.writeRandom(32);
+	salt.writeRandom(32);
+	
+	Derivation derivation;
+	derivation.password = &password;
+	derivation.salt = &salt;
+	bench.report("DerivateKey " + String::number(DerivationRounds) + " rounds", bench.run(derivation, minTime), "ops/s");
+	
+	Authentication authentication;
+	authentication.name = "bench";
+	authentication.password = "password";
+	bench.report("User::Authenticate", bench.run(authentication, minTime), "ops/s");
+	
+	delete[] data;
+	delete[] buffer;
+	return 0;
+}
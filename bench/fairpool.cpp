@@ -0,0 +1,219 @@
+/*************************************************************************
+ *   Copyright (C) 2011-2013 by Paul-Louis Ageneau                       *
+ *   paul-louis (at) ageneau (dot) org                                   *
+ *                                                                       *
+ *   This file is part of TeapotNet.                                     *
+ *                                                                       *
+ *   TeapotNet is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU Affero General Public License as      *
+ *   published by the Free Software Foundation, either version 3 of      *
+ *   the License, or (at your option) any later version.                 *
+ *                                                                       *
+ *   TeapotNet is distributed in the hope that it will be useful, but    *
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the        *
+ *   GNU Affero General Public License for more details.                 *
+ *                                                                       *
+ *   You should have received a copy of the GNU Affero General Public    *
+ *   License along with TeapotNet.                                       *
+ *   If not, see <http://www.gnu.org/licenses/>.                         *
+ *************************************************************************/
+
+
+// Checks FairPool round-robin between sources, per-source caps and cancellation,
+// then measures throughput and the queue latency of a light source during a flood
+
+#include "bench/bench.h"
+#include "tpn/fairpool.h"
+#include "tpn/array.h"
+
+using namespace tpn;
+
+class CountTask : public Task
+{
+public:
+	CountTask(void) : running(NULL), maxRunning(NULL), order(NULL), rank(-1), duration(0.) {}
+	
+	void run(void)
+	{
+		int current = __atomic_add_fetch(running, 1, __ATOMIC_SEQ_CST);
+		int max = __atomic_load_n(maxRunning, __ATOMIC_SEQ_CST);
+		while(current > max && !__atomic_compare_exchange_n(maxRunning, &max, current, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {}
+		
+		if(duration > 0.) Thread::Sleep(duration);
+		
+		__atomic_sub_fetch(running, 1, __ATOMIC_SEQ_CST);
+		rank = __atomic_fetch_add(order, 1, __ATOMIC_SEQ_CST);
+	}
+	
+	int *running;
+	int *maxRunning;
+	int *order;
+	int rank;
+	double duration;
+};
+
+static void setup(Array<CountTask> &tasks, int *running, int *maxRunning, int *order, double duration)
+{
+	for(int i=0; i<tasks.size(); ++i)
+	{
+		tasks[i].running = running;
+		tasks[i].maxRunning = maxRunning;
+		tasks[i].order = order;
+		tasks[i].duration = duration;
+	}
+}
+
+static void waitOrder(int *order, int count, double timeout)
+{
+	Time start = Time::Now();
+	while(__atomic_load_n(order, __ATOMIC_SEQ_CST) < count)
+	{
+		if(Time::Now() - start > timeout)
+			throw Exception("Only " + String::number(__atomic_load_n(order, __ATOMIC_SEQ_CST)) + " of " + String::number(count) + " tasks ran");
+		Thread::Sleep(0.002);
+	}
+}
+
+static void checkFairness(void)
+{
+	FairPool pool(4, 2);
+	Identifier heavy(ByteString(64, 'h'));
+	Identifier light(ByteString(64, 'l'));
+	
+	int order = 0;
+	int heavyRunning = 0, heavyMax = 0;
+	int lightRunning = 0, lightMax = 0;
+	
+	Array<CountTask> heavyTasks, lightTasks;
+	heavyTasks.resize(100);
+	lightTasks.resize(10);
+	setup(heavyTasks, &heavyRunning, &heavyMax, &order, 0.002);
+	setup(lightTasks, &lightRunning, &lightMax, &order, 0.002);
+	
+	// The light source arrives after the heavy one has filled its queue
+	for(int i=0; i<heavyTasks.size(); ++i) pool.launch(heavy, &heavyTasks[i]);
+	for(int i=0; i<lightTasks.size(); ++i) pool.launch(light, &lightTasks[i]);
+	
+	waitOrder(&order, heavyTasks.size() + lightTasks.size(), 10.);
+	
+	if(heavyMax > 2 || lightMax > 2) throw Exception("Per-source cap exceeded");
+	
+	// With round-robin, the light source is not stuck behind the heavy one
+	int lastLight = 0;
+	for(int i=0; i<lightTasks.size(); ++i) lastLight = std::max(lastLight, lightTasks[i].rank);
+	if(lastLight > 3*lightTasks.size()) throw Exception("Light source finished at rank " + String::number(lastLight));
+}
+
+static void checkCancel(void)
+{
+	FairPool pool(1, 1);
+	Identifier source(ByteString(64, 's'));
+	
+	int order = 0, running = 0, maxRunning = 0;
+	Array<CountTask> tasks;
+	tasks.resize(11);
+	setup(tasks, &running, &maxRunning, &order, 0.);
+	tasks[0].duration = 0.1;
+	
+	for(int i=0; i<tasks.size(); ++i) pool.launch(source, &tasks[i]);
+	Thread::Sleep(0.02);
+	
+	if(pool.cancel(source, &tasks[0])) throw Exception("Cancelled a running task");
+	for(int i=1; i<tasks.size(); i+=2)
+		if(!pool.cancel(source, &tasks[i])) throw Exception("Failed to cancel a queued task");
+	
+	waitOrder(&order, 6, 5.);
+	Thread::Sleep(0.05);
+	
+	for(int i=0; i<tasks.size(); ++i)
+		if((tasks[i].rank >= 0) != (i % 2 == 0)) throw Exception("Task " + String::number(i) + " has wrong state");
+	
+	FairPool::Stats stats;
+	pool.getStats(stats);
+	if(stats.cancelled != 5 || stats.executed != 6 || stats.queued || stats.running)
+		throw Exception("Wrong pool statistics");
+}
+
+struct Throughput
+{
+	FairPool *pool;
+	Array<Identifier> *sources;
+	Array<CountTask> *tasks;
+	int *order;
+	
+	void operator()(void)
+	{
+		*order = 0;
+		for(int i=0; i<tasks->size(); ++i)
+			pool->launch((*sources)[i % sources->size()], &(*tasks)[i]);
+		waitOrder(order, tasks->size(), 30.);
+	}
+};
+
+int main(int argc, char **argv)
+{
+	Bench bench("fairpool");
+	
+	try {
+		checkFairness();
+		checkCancel();
+		
+		FairPool pool(4, 2);
+		
+		Array<Identifier> sources;
+		for(int i=0; i<16; ++i) sources.push_back(Identifier(ByteString(64, char('a' + i))));
+		
+		int order = 0, running = 0, maxRunning = 0;
+		Array<CountTask> tasks;
+		tasks.resize(10000);
+		setup(tasks, &running, &maxRunning, &order, 0.);
+		
+		Throughput throughput;
+		throughput.pool = &pool;
+		throughput.sources = &sources;
+		throughput.tasks = &tasks;
+		throughput.order = &order;
+		bench.report("run 10k tasks from 16 sources", bench.run(throughput)*tasks.size(), "tasks/s");
+		
+		// A single request from a light source while another one floods the pool
+		FairPool flooded(4, 2);
+		Identifier heavy(ByteString(64, 'h'));
+		Identifier light(ByteString(64, 'l'));
+		
+		int floodOrder = 0, floodRunning = 0, floodMax = 0;
+		Array<CountTask> flood;
+		flood.resize(2000);
+		setup(flood, &floodRunning, &floodMax, &floodOrder, 0.0005);
+		for(int i=0; i<flood.size(); ++i) flooded.launch(heavy, &flood[i]);
+		
+		int lightOrder = 0, lightRunning = 0, lightMax = 0;
+		Array<CountTask> probes;
+		probes.resize(20);
+		setup(probes, &lightRunning, &lightMax, &lightOrder, 0.);
+		
+		double latency = 0.;
+		for(int i=0; i<probes.size(); ++i)
+		{
+			Time start = Time::Now();
+			flooded.launch(light, &probes[i]);
+			waitOrder(&lightOrder, i+1, 10.);
+			latency+= Time::Now() - start;
+		}
+		
+		bench.report("light source latency during flood", 1000.*latency/probes.size(), "ms");
+		
+		waitOrder(&floodOrder, flood.size(), 30.);
+		
+		FairPool::Stats stats;
+		flooded.getStats(stats);
+		bench.report("average queue latency during flood", 1000.*stats.queueLatency/stats.executed, "ms");
+	}
+	catch(const std::exception &e)
+	{
+		std::cerr << "Error: " << e.what() << std::endl;
+		return 1;
+	}
+	
+	return 0;
+}
@@ -0,0 +1,81 @@
+/*************************************************************************
+ *   Copyright (C) 2011-2013 by Paul-Louis Ageneau                       *
+ *   paul-louis (at) ageneau (dot) org                                   *
+ *                                                                       *
+ *   This file is part of TeapotNet.                                     *
+ *                                                                       *
+ *   TeapotNet is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU Affero General Public License as      *
+ *   published by the Free Software Foundation, either version 3 of      *
+ *   the License, or (at your option) any later version.                 *
+ *                                                                       *
+ *   TeapotNet is distributed in the hope that it will be useful, but    *
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the        *
+ *   GNU Affero General Public License for more details.                 *
+ *                                                                       *
+ *   You should have received a copy of the GNU Affero General Public    *
+ *   License along with TeapotNet.                                       *
+ *   If not, see <http://www.gnu.org/licenses/>.                         *
+ *************************************************************************/
+
+
+// Measures the session key derivation cost of a handshake,
+// with a full derivation and when resuming from a session ticket
+
+#include "bench/bench.h"
+#include "tpn/sha512.h"
+#include "tpn/bytestring.h"
+
+using namespace tpn;
+
+// Same derivation as Core::Handler::derivateKey
+struct DerivateKeys
+{
+	ByteString *secret;
+	ByteString *ticketKey;
+	
+	void operator()(void)
+	{
+		ByteString salt_a, salt_b;
+		salt_a.writeRandom(32);
+		salt_b.writeRandom(32);
+		
+		ByteString key_a, key_b;
+		if(!ticketKey->empty())
+		{
+			Sha512::AuthenticationCode(*ticketKey, salt_a, key_a);
+			Sha512::AuthenticationCode(*ticketKey, salt_b, key_b);
+		}
+		else {
+			Sha512::DerivateKey(*secret, salt_a, key_a, Sha512::CryptRounds);
+			Sha512::DerivateKey(*secret, salt_b, key_b, Sha512::CryptRounds);
+		}
+		Assert(key_a.size() == 64 && key_b.size() == 64);
+	}
+};
+
+int main(int argc, char **argv)
+{
+	ByteString secret, ticketKey;
+	secret.writeRandom(64);
+	ticketKey.writeRandom(64);
+	
+	Bench bench("handshake");
+	
+	ByteString noTicket;
+	DerivateKeys full;
+	full.secret = &secret;
+	full.ticketKey = &noTicket;
+	double fullRate = bench.run(full);
+	bench.report("full derivation", 1000./fullRate, "ms/handshake");
+	
+	DerivateKeys resumed;
+	resumed.secret = &secret;
+	resumed.ticketKey = &ticketKey;
+	double resumedRate = bench.run(resumed);
+	bench.report("resumed from ticket", 1000./resumedRate, "ms/handshake");
+	
+	bench.report("speedup", resumedRate/fullRate, "x");
+	return 0;
+}
@@ -0,0 +1,210 @@
+/*************************************************************************
+ *   Copyright (C) 2011-2013 by Paul-Louis Ageneau                       *
+ *   paul-louis (at) ageneau (dot) org                                   *
+ *                                                                       *
+ *   This file is part of TeapotNet.                                     *
+ *                                                                       *
+ *   TeapotNet is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU Affero General Public License as      *
+ *   published by the Free Software Foundation, either version 3 of      *
+ *   the License, or (at your option) any later version.                 *
+ *                                                                       *
+ *   TeapotNet is distributed in the hope that it will be useful, but    *
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the        *
+ *   GNU Affero General Public License for more details.                 *
+ *                                                                       *
+ *   You should have received a copy of the GNU Affero General Public    *
+ *   License along with TeapotNet.                                       *
+ *   If not, see <http://www.gnu.org/licenses/>.                         *
+ *************************************************************************/
+
+
+// Checks the span-based HMAC against the former ByteString implementation,
+// then measures HMAC operations with and without a reused key schedule
+
+#include "bench/bench.h"
+#include "tpn/sha512.h"
+#include "tpn/bytestring.h"
+
+using namespace tpn;
+
+// Former implementation, padded keys are copied through ByteStrings on each call
+static void LegacyAuthenticationCode(const ByteString &key, ByteStream &data, ByteStream &out)
+{
+	ByteString ikey;
+	ByteString okey;
+	
+	ByteString tmp(key);
+	if(tmp.size() < 64) tmp.writeZero(64 - tmp.size());
+	
+	uint8_t u;
+	while(tmp.readBinary(u))
+	{
+		ikey.writeBinary(u ^ 0x36);
+		okey.writeBinary(u ^ 0x5C);
+	}
+	
+	Sha512 sha;
+	sha.process(ikey);
+	sha.process(data);
+	sha.finalize(tmp);
+	
+	sha.init();
+	sha.process(okey);
+	sha.process(tmp);
+	sha.finalize(out);
+}
+
+static void LegacyDerivateKey(const ByteString &password, const ByteString &salt, ByteStream &out, int rounds)
+{
+	ByteString buffer(salt);
+	while(--rounds)
+	{
+		ByteString tmp;
+		LegacyAuthenticationCode(password, buffer, tmp);
+		buffer = tmp;
+	}
+	
+	out.writeBinary(buffer);
+}
+
+static void checkCompatibility(void)
+{
+	for(int k=0; k<3; ++k)
+	{
+		ByteString key, data;
+		key.writeRandom(k == 2 ? 100 : 32*(k+1));	// shorter and longer than the padding
+		data.writeRandom(pseudorand() % 300);
+		
+		ByteString expected, result;
+		ByteString tmp(data);
+		LegacyAuthenticationCode(key, tmp, expected);
+		tmp = data;
+		Sha512::AuthenticationCode(key, tmp, result);
+		if(result != expected) throw Exception("HMAC differs from the former implementation");
+		
+		expected.clear();
+		result.clear();
+		LegacyDerivateKey(key, data, expected, 50);
+		Sha512::DerivateKey(key, data, result, 50);
+		if(result != expected) throw Exception("Key derivation differs from the former implementation");
+	}
+	
+	ByteString message, salt, expected, result;
+	message.writeRandom(20);
+	salt.writeRandom(16);
+	{
+		// Former recursive hash
+		ByteString buffer(message);
+		for(int i=0; i<9; ++i)
+		{
+			ByteString tmp(salt);
+			Sha512 sha;
+			sha.process(tmp);
+			sha.process(buffer);
+			sha.finalize(buffer);
+		}
+		expected = buffer;
+	}
+	
+	Sha512::RecursiveHash(message, salt, result, 10);
+	if(result != expected) throw Exception("Recursive hash differs from the former implementation");
+}
+
+struct LegacyHmac
+{
+	ByteString *key;
+	ByteString *data;
+	
+	void operator()(void)
+	{
+		ByteString tmp(*data), out;
+		LegacyAuthenticationCode(*key, tmp, out);
+	}
+};
+
+struct AuthenticationCode
+{
+	ByteString *key;
+	const char *data;
+	size_t size;
+	
+	void operator()(void)
+	{
+		ByteString out;
+		Sha512::AuthenticationCode(*key, data, size, out);
+	}
+};
+
+struct ScheduledHmac
+{
+	Sha512::Hmac *hmac;
+	const char *data;
+	size_t size;
+	
+	void operator()(void)
+	{
+		unsigned char out[Sha512::DigestSize];
+		hmac->compute(data, size, out);
+	}
+};
+
+struct Derivation
+{
+	ByteString *password;
+	ByteString *salt;
+	bool legacy;
+	
+	void operator()(void)
+	{
+		ByteString out;
+		if(legacy) LegacyDerivateKey(*password, *salt, out, Sha512::CryptRounds);
+		else Sha512::DerivateKey(*password, *salt, out, Sha512::CryptRounds);
+	}
+};
+
+int main(int argc, char **argv)
+{
+	Bench bench("hmac");
+	
+	checkCompatibility();
+	
+	ByteString key, data;
+	key.writeRandom(32);
+	data.writeRandom(64);
+	char raw[64];
+	std::copy(data.begin(), data.end(), raw);
+	
+	LegacyHmac legacy;
+	legacy.key = &key;
+	legacy.data = &data;
+	bench.report("former AuthenticationCode", bench.run(legacy), "ops/s");
+	
+	AuthenticationCode code;
+	code.key = &key;
+	code.data = raw;
+	code.size = sizeof(raw);
+	bench.report("AuthenticationCode", bench.run(code), "ops/s");
+	
+	Sha512::Hmac hmac(key);
+	ScheduledHmac scheduled;
+	scheduled.hmac = &hmac;
+	scheduled.data = raw;
+	scheduled.size = sizeof(raw);
+	bench.report("Hmac::compute with key schedule", bench.run(scheduled), "ops/s");
+	
+	Derivation former;
+	former.password = &key;
+	former.salt = &data;
+	former.legacy = true;
+	bench.report("former DerivateKey", 1000./bench.run(former), "ms");
+	
+	Derivation derivation;
+	derivation.password = &key;
+	derivation.salt = &data;
+	derivation.legacy = false;
+	bench.report("DerivateKey", 1000./bench.run(derivation), "ms");
+	
+	return 0;
+}
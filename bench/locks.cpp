@@ -0,0 +1,197 @@
+/*************************************************************************
+ *   Copyright (C) 2011-2013 by Paul-Louis Ageneau                       *
+ *   paul-louis (at) ageneau (dot) org                                   *
+ *                                                                       *
+ *   This file is part of TeapotNet.                                     *
+ *                                                                       *
+ *   TeapotNet is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU Affero General Public License as      *
+ *   published by the Free Software Foundation, either version 3 of      *
+ *   the License, or (at your option) any later version.                 *
+ *                                                                       *
+ *   TeapotNet is distributed in the hope that it will be useful, but    *
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the        *
+ *   GNU Affero General Public License for more details.                 *
+ *                                                                       *
+ *   You should have received a copy of the GNU Affero General Public    *
+ *   License along with TeapotNet.                                       *
+ *   If not, see <http://www.gnu.org/licenses/>.                         *
+ *************************************************************************/
+
+
+// Measures Mutex and Synchronize costs, uncontended and across threads,
+// and checks that the lock profiler records contended call sites
+
+#include "bench/bench.h"
+#include "tpn/synchronizable.h"
+#include "tpn/lockprofiler.h"
+#include "tpn/thread.h"
+#include "tpn/array.h"
+
+using namespace tpn;
+
+static const int LocksCount = 100000;
+
+struct LockUnlock
+{
+	Mutex *mutex;
+	
+	void operator()(void)
+	{
+		for(int i=0; i<LocksCount; ++i)
+		{
+			mutex->lock();
+			mutex->unlock();
+		}
+	}
+};
+
+struct Recursive
+{
+	Mutex *mutex;
+	
+	void operator()(void)
+	{
+		mutex->lock();
+		for(int i=0; i<LocksCount; ++i)
+		{
+			mutex->lock();
+			mutex->unlock();
+		}
+		mutex->unlock();
+	}
+};
+
+struct SynchronizeLoop
+{
+	Synchronizable *sync;
+	int *counter;
+	
+	void operator()(void)
+	{
+		for(int i=0; i<LocksCount; ++i)
+		{
+			Synchronize(sync);
+			++*counter;
+		}
+	}
+};
+
+class ContendingThread : public Thread
+{
+public:
+	ContendingThread(Synchronizable *sync, int *counter) : mSync(sync), mCounter(counter) {}
+	
+	void run(void)
+	{
+		for(int i=0; i<LocksCount; ++i)
+		{
+			Synchronize(mSync);
+			++*mCounter;
+			if(i % 1000 == 0) Thread::Sleep(0.0001);	// hold the lock at times
+		}
+	}
+	
+private:
+	Synchronizable *mSync;
+	int *mCounter;
+};
+
+static double contended(Synchronizable *sync, int *counter, int threads)
+{
+	Array<ContendingThread*> array;
+	Time start = Time::Now();
+	for(int i=0; i<threads; ++i)
+	{
+		array.push_back(new ContendingThread(sync, counter));
+		array.back()->start();
+	}
+	
+	for(int i=0; i<threads; ++i)
+	{
+		array[i]->join();
+		delete array[i];
+	}
+	
+	return threads*LocksCount/(Time::Now() - start);
+}
+
+static void checkProfiler(void)
+{
+	Synchronizable sync;
+	int counter = 0;
+	
+	LockProfiler::Reset();
+	LockProfiler::SetEnabled(true);
+	contended(&sync, &counter, 4);
+	LockProfiler::SetEnabled(false);
+	
+	if(counter != 4*LocksCount) throw Exception("Counter is " + String::number(counter));
+	
+	Array<LockProfiler::Entry> entries;
+	LockProfiler::GetReport(entries);
+	
+	bool found = false;
+	for(int i=0; i<entries.size(); ++i)
+	{
+		if(String(entries[i].file).find("locks.cpp") != String::NotFound)
+		{
+			if(entries[i].count != uint64_t(4*LocksCount)) throw Exception("Site recorded " + String::number(entries[i].count) + " locks");
+			if(entries[i].holdTime <= 0.) throw Exception("Site has no hold time");
+			found = true;
+		}
+	}
+	
+	if(!found) throw Exception("Contended site is missing from the report");
+	
+	// Lock counts are cumulative, unlocking a free mutex fails
+	Mutex mutex;
+	mutex.lock(2);
+	if(mutex.lockCount() != 2) throw Exception("Wrong lock count");
+	mutex.unlockAll();
+	if(mutex.lockCount() != 0) throw Exception("Mutex is still locked");
+	
+	bool thrown = false;
+	try { mutex.unlock(); }
+	catch(const Exception &e) { thrown = true; }
+	if(!thrown) throw Exception("Unlocking a free mutex succeeded");
+}
+
+int main(int argc, char **argv)
+{
+	Bench bench("locks");
+	
+	try {
+		checkProfiler();
+		
+		Mutex mutex;
+		LockUnlock lockUnlock;
+		lockUnlock.mutex = &mutex;
+		bench.report("mutex lock and unlock", bench.run(lockUnlock)*LocksCount, "locks/s");
+		
+		Recursive recursive;
+		recursive.mutex = &mutex;
+		bench.report("recursive lock and unlock", bench.run(recursive)*LocksCount, "locks/s");
+		
+		Synchronizable sync;
+		int counter = 0;
+		SynchronizeLoop loop;
+		loop.sync = &sync;
+		loop.counter = &counter;
+		bench.report("Synchronize", bench.run(loop)*LocksCount, "locks/s");
+		
+		LockProfiler::SetEnabled(true);
+		bench.report("Synchronize with profiler", bench.run(loop)*LocksCount, "locks/s");
+		LockProfiler::SetEnabled(false);
+		
+		bench.report("Synchronize from 4 threads", contended(&sync, &counter, 4), "locks/s");
+	}
+	catch(const std::exception &e)
+	{
+		std::cerr << "Error: " << e.what() << std::endl;
+		return 1;
+	}
+	
+	return 0;
+}
@@ -0,0 +1,159 @@
+/*************************************************************************
+ *   Copyright (C) 2011-2013 by Paul-Louis Ageneau                       *
+ *   paul-louis (at) ageneau (dot) org                                   *
+ *                                                                       *
+ *   This file is part of TeapotNet.                                     *
+ *                                                                       *
+ *   TeapotNet is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU Affero General Public License as      *
+ *   published by the Free Software Foundation, either version 3 of      *
+ *   the License, or (at your option) any later version.                 *
+ *                                                                       *
+ *   TeapotNet is distributed in the hope that it will be useful, but    *
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the        *
+ *   GNU Affero General Public License for more details.                 *
+ *                                                                       *
+ *   You should have received a copy of the GNU Affero General Public    *
+ *   License along with TeapotNet.                                       *
+ *   If not, see <http://www.gnu.org/licenses/>.                         *
+ *************************************************************************/
+
+
+
+
+// Checks the compact encoding of synchronization stamps (round trip and fallback),
+// then compares payload size and encode/decode rates with YAML on 10k-stamp lists
+
+#include "bench/bench.h"
+#include "tpn/messagequeue.h"
+#include "tpn/notification.h"
+#include "tpn/array.h"
+
+using namespace tpn;
+
+static const int StampsCount = 10000;
+
+static void generateStamps(StringArray &stamps, int count)
+{
+	// Messages spread over a month, like unread lists after a long disconnection
+	uint32_t time = 1380000000;
+	for(int i=0; i<count; ++i)
+	{
+		time+= uint32_t(pseudorand() % 300);
+		stamps.append(String::random(4) + String::hexa(time));
+	}
+}
+
+static void checkRoundTrip(const StringArray &stamps, bool binary)
+{
+	Notification notification;
+	MessageQueue::WriteStamps(notification, stamps, binary);
+	if(binary != (notification.parameter("format") == "binary"))
+		throw Exception("Unexpected format parameter");
+	
+	StringArray result;
+	MessageQueue::ReadStamps(notification, result);
+	
+	// The compact encoding sorts stamps by time
+	StringSet expected, actual;
+	expected.insert(stamps.begin(), stamps.end());
+	actual.insert(result.begin(), result.end());
+	if(result.size() != stamps.size() || actual != expected)
+		throw Exception(String("Stamps differ after round trip (") + (binary ? "binary" : "YAML") + ")");
+}
+
+static void checkFormats(void)
+{
+	StringArray stamps;
+	stamps.append("aB3z523D8A80");
+	stamps.append("Zz0952442C01");
+	stamps.append("aB3z523D8A80");	// duplicate
+	stamps.append("x9Yq7FFFFFFF");	// time gap larger than 16 bits
+	stamps.append("AAAAF");		// short time
+	stamps.append("legacy-stamp");	// not generated, sent verbatim
+	stamps.append("abcd0123");	// leading zero, sent verbatim
+	stamps.append("");
+	checkRoundTrip(stamps, true);
+	checkRoundTrip(stamps, false);
+	
+	StringArray empty;
+	checkRoundTrip(empty, true);
+	checkRoundTrip(empty, false);
+	
+	// Truncated payloads must be rejected
+	Notification notification;
+	MessageQueue::WriteStamps(notification, stamps, true);
+	String content = notification.content();
+	notification.setContent(content.substr(0, content.size() - 3));
+	bool failed = false;
+	try {
+		StringArray result;
+		MessageQueue::ReadStamps(notification, result);
+	}
+	catch(const Exception &e)
+	{
+		failed = true;
+	}
+	if(!failed) throw Exception("Truncated payload was accepted");
+}
+
+struct Encode
+{
+	const StringArray *stamps;
+	bool binary;
+	size_t size;
+	
+	void operator()(void)
+	{
+		Notification notification;
+		MessageQueue::WriteStamps(notification, *stamps, binary);
+		size = notification.content().size();
+	}
+};
+
+struct Decode
+{
+	Notification notification;
+	
+	void operator()(void)
+	{
+		StringArray stamps;
+		MessageQueue::ReadStamps(notification, stamps);
+	}
+};
+
+static void measure(Bench &bench, const String &format, const StringArray &stamps, bool binary)
+{
+	Encode encode;
+	encode.stamps = &stamps;
+	encode.binary = binary;
+	bench.report(format + " encode", bench.run(encode)*stamps.size(), "stamps/s");
+	bench.report(format + " payload", double(encode.size)/stamps.size(), "bytes/stamp");
+	
+	Decode decode;
+	MessageQueue::WriteStamps(decode.notification, stamps, binary);
+	bench.report(format + " decode", bench.run(decode)*stamps.size(), "stamps/s");
+}
+
+int main(int argc, char **argv)
+{
+	Bench bench("notifications");
+	
+	try {
+		checkFormats();
+		
+		StringArray stamps;
+		generateStamps(stamps, StampsCount);
+		checkRoundTrip(stamps, true);
+		measure(bench, "YAML", stamps, false);
+		measure(bench, "binary", stamps, true);
+	}
+	catch(const std::exception &e)
+	{
+		std::cerr << "Error: " << e.what() << std::endl;
+		return 1;
+	}
+	
+	return 0;
+}
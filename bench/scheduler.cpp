@@ -0,0 +1,182 @@
+/*************************************************************************
+ *   Copyright (C) 2011-2013 by Paul-Louis Ageneau                       *
+ *   paul-louis (at) ageneau (dot) org                                   *
+ *                                                                       *
+ *   This file is part of TeapotNet.                                     *
+ *                                                                       *
+ *   TeapotNet is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU Affero General Public License as      *
+ *   published by the Free Software Foundation, either version 3 of      *
+ *   the License, or (at your option) any later version.                 *
+ *                                                                       *
+ *   TeapotNet is distributed in the hope that it will be useful, but    *
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the        *
+ *   GNU Affero General Public License for more details.                 *
+ *                                                                       *
+ *   You should have received a copy of the GNU Affero General Public    *
+ *   License along with TeapotNet.                                       *
+ *   If not, see <http://www.gnu.org/licenses/>.                         *
+ *************************************************************************/
+
+
+
+
+// Checks Scheduler expiry times and repeated tasks,
+// then measures schedule, reschedule, remove and expiry rates with 100k timers
+
+#include "bench/bench.h"
+#include "tpn/scheduler.h"
+#include "tpn/array.h"
+
+using namespace tpn;
+
+static const int TimersCount = 100000;
+
+class TimerTask : public Task
+{
+public:
+	TimerTask(void) : runs(0), early(false) {}
+	
+	void run(void)
+	{
+		if(Time::Now() - when < 0.) early = true;
+		__atomic_add_fetch(&runs, 1, __ATOMIC_SEQ_CST);
+	}
+	
+	Time when;
+	int runs;
+	bool early;
+};
+
+static int totalRuns(const Array<TimerTask> &tasks)
+{
+	int total = 0;
+	for(int i=0; i<tasks.size(); ++i)
+		total+= __atomic_load_n(&tasks[i].runs, __ATOMIC_SEQ_CST);
+	return total;
+}
+
+static void waitRuns(const Array<TimerTask> &tasks, int count, double timeout)
+{
+	Time start = Time::Now();
+	while(totalRuns(tasks) < count)
+	{
+		if(Time::Now() - start > timeout)
+			throw Exception("Only " + String::number(totalRuns(tasks)) + " of " + String::number(count) + " tasks ran");
+		Thread::Sleep(0.005);
+	}
+}
+
+static void checkExpiry(void)
+{
+	Scheduler scheduler(4);
+	
+	// Delays cross the first level of the wheel (256 ms)
+	Array<TimerTask> tasks;
+	tasks.resize(1000);
+	for(int i=0; i<tasks.size(); ++i)
+	{
+		double delay = milliseconds(50 + pseudorand() % 650);
+		tasks[i].when = Time::Now() + delay;
+		scheduler.schedule(&tasks[i], tasks[i].when);
+	}
+	
+	// Removed and rescheduled timers
+	for(int i=0; i<100; ++i) scheduler.remove(&tasks[i]);
+	for(int i=100; i<200; ++i)
+	{
+		tasks[i].when = Time::Now() + milliseconds(300);
+		scheduler.schedule(&tasks[i], tasks[i].when);
+	}
+	
+	waitRuns(tasks, tasks.size() - 100, 5.);
+	Thread::Sleep(0.1);
+	
+	for(int i=0; i<tasks.size(); ++i)
+	{
+		if(tasks[i].early) throw Exception("Task " + String::number(i) + " ran early");
+		if(tasks[i].runs != (i < 100 ? 0 : 1)) throw Exception("Task " + String::number(i) + " ran " + String::number(tasks[i].runs) + " times");
+	}
+	
+	// Repeated task
+	Array<TimerTask> repeated;
+	repeated.resize(1);
+	repeated[0].when = Time::Now();
+	scheduler.repeat(&repeated[0], milliseconds(20));
+	Thread::Sleep(0.3);
+	scheduler.remove(&repeated[0]);
+	int runs = repeated[0].runs;
+	if(runs < 5 || runs > 16) throw Exception("Repeated task ran " + String::number(runs) + " times in 300 ms");
+	Thread::Sleep(0.1);
+	if(repeated[0].runs > runs + 1) throw Exception("Repeated task still runs after removal");
+}
+
+struct ScheduleAll
+{
+	Scheduler *scheduler;
+	Array<TimerTask> *tasks;
+	
+	void operator()(void)
+	{
+		// Like HttpTunnel flush tasks and connection timeouts
+		for(int i=0; i<tasks->size(); ++i)
+			scheduler->schedule(&(*tasks)[i], 60. + (i % 3600));
+	}
+};
+
+struct RemoveAll
+{
+	Scheduler *scheduler;
+	Array<TimerTask> *tasks;
+	
+	void operator()(void)
+	{
+		for(int i=0; i<tasks->size(); ++i)
+			scheduler->schedule(&(*tasks)[i], 60. + (i % 3600));
+		for(int i=0; i<tasks->size(); ++i)
+			scheduler->remove(&(*tasks)[i]);
+	}
+};
+
+int main(int argc, char **argv)
+{
+	Bench bench("scheduler");
+	
+	try {
+		checkExpiry();
+		
+		Scheduler scheduler(4);
+		Array<TimerTask> tasks;
+		tasks.resize(TimersCount);
+		
+		ScheduleAll scheduleAll;
+		scheduleAll.scheduler = &scheduler;
+		scheduleAll.tasks = &tasks;
+		bench.report("schedule and reschedule 100k timers", bench.run(scheduleAll)*TimersCount, "timers/s");
+		
+		RemoveAll removeAll;
+		removeAll.scheduler = &scheduler;
+		removeAll.tasks = &tasks;
+		bench.report("schedule and remove 100k timers", bench.run(removeAll)*TimersCount*2, "operations/s");
+		
+		// Expiry of 100k timers spread over 1 s
+		Time start = Time::Now();
+		for(int i=0; i<tasks.size(); ++i)
+		{
+			tasks[i].runs = 0;
+			tasks[i].when = start;
+			scheduler.schedule(&tasks[i], milliseconds(i % 1000));
+		}
+		
+		waitRuns(tasks, TimersCount, 30.);
+		bench.report("expire 100k timers", TimersCount/(Time::Now() - start), "timers/s");
+	}
+	catch(const std::exception &e)
+	{
+		std::cerr << "Error: " << e.what() << std::endl;
+		return 1;
+	}
+	
+	return 0;
+}
@@ -0,0 +1,300 @@
+/*************************************************************************
+ *   Copyright (C) 2011-2013 by Paul-Louis Ageneau                       *
+ *   paul-louis (at) ageneau (dot) org                                   *
+ *                                                                       *
+ *   This file is part of TeapotNet.                                     *
+ *                                                                       *
+ *   TeapotNet is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU Affero General Public License as      *
+ *   published by the Free Software Foundation, either version 3 of      *
+ *   the License, or (at your option) any later version.                 *
+ *                                                                       *
+ *   TeapotNet is distributed in the hope that it will be useful, but    *
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the        *
+ *   GNU Affero General Public License for more details.                 *
+ *                                                                       *
+ *   You should have received a copy of the GNU Affero General Public    *
+ *   License along with TeapotNet.                                       *
+ *   If not, see <http://www.gnu.org/licenses/>.                         *
+ *************************************************************************/
+
+
+
+// Checks YAML and JSON serializers on directory listings (format and round trip),
+// then measures records/s on synthetic 10k-entry listings
+
+#include "bench/bench.h"
+#include "tpn/yamlserializer.h"
+#include "tpn/jsonserializer.h"
+#include "tpn/bufferedstream.h"
+#include "tpn/array.h"
+#include "tpn/map.h"
+
+using namespace tpn;
+
+static const int EntriesCount = 10000;
+
+// Fields of a Resource in a directory listing
+class Entry : public Serializable
+{
+public:
+	String digest;
+	String url;
+	String name;
+	String type;
+	int64_t time;
+	int64_t size;
+	
+	void serialize(Serializer &s) const
+	{
+		ConstSerializableWrapper<int64_t> timeWrapper(time);
+		ConstSerializableWrapper<int64_t> sizeWrapper(size);
+		
+		Serializer::ConstObjectMapping mapping;
+		mapping["digest"] = &digest;
+		mapping["url"] = &url;
+		mapping["name"] = &name;
+		mapping["type"] = &type;
+		mapping["time"] = &timeWrapper;
+		mapping["size"] = &sizeWrapper;
+		s.outputObject(mapping);
+	}
+	
+	bool deserialize(Serializer &s)
+	{
+		SerializableWrapper<int64_t> timeWrapper(&time);
+		SerializableWrapper<int64_t> sizeWrapper(&size);
+		
+		Serializer::ObjectMapping mapping;
+		mapping["digest"] = &digest;
+		mapping["url"] = &url;
+		mapping["name"] = &name;
+		mapping["type"] = &type;
+		mapping["time"] = &timeWrapper;
+		mapping["size"] = &sizeWrapper;
+		return s.inputObject(mapping);
+	}
+	
+	bool isInlineSerializable(void) const
+	{
+		return false;
+	}
+	
+	bool operator==(const Entry &e) const
+	{
+		return digest == e.digest && url == e.url && name == e.name && type == e.type
+			&& time == e.time && size == e.size;
+	}
+};
+
+typedef SerializableArray<Entry> Listing;
+
+// Input from memory without the linear cost of String::readData
+class MemoryStream : public Stream
+{
+public:
+	MemoryStream(const String &data) : mData(data), mPos(0) {}
+	
+	size_t readData(char *buffer, size_t size)
+	{
+		size = std::min(size, mData.size() - mPos);
+		std::memcpy(buffer, mData.data() + mPos, size);
+		mPos+= size;
+		return size;
+	}
+	
+	void writeData(const char *data, size_t size)
+	{
+		throw Unsupported("Writing to MemoryStream");
+	}
+	
+private:
+	const String &mData;
+	size_t mPos;
+};
+
+// Output sink counting writes, each one would be a send() on a socket
+class CountingStream : public Stream
+{
+public:
+	CountingStream(void) : writes(0), bytes(0) {}
+	
+	size_t readData(char *buffer, size_t size)
+	{
+		return 0;
+	}
+	
+	void writeData(const char *data, size_t size)
+	{
+		++writes;
+		bytes+= size;
+	}
+	
+	uint64_t writes;
+	uint64_t bytes;
+};
+
+static void generateListing(Listing &listing, int count)
+{
+	const char *extensions[] = { ".mp3", ".ogg", ".avi", ".txt", "" };
+	
+	listing.clear();
+	for(int i=0; i<count; ++i)
+	{
+		Entry entry;
+		int r = pseudorand();
+		entry.type = (r % 8 == 0 ? "directory" : "file");
+		entry.name << "Entry " << i << " - track" << String(r % 13, 'x') << extensions[r % 5];
+		entry.url = "/files/music/" + entry.name;
+		if(entry.type == "file")
+		{
+			for(int j=0; j<32; ++j)
+				entry.digest << "0123456789abcdef"[pseudorand() % 16];
+			entry.size = pseudorand() % 100000000;
+		}
+		else entry.size = 0;
+		entry.time = 1380000000 + pseudorand() % 10000000;
+		listing.append(entry);
+	}
+}
+
+template<class S> static void checkRoundTrip(const Listing &listing)
+{
+	String data;
+	{
+		S serializer(&data);
+		serializer.output(listing);
+	}
+	
+	MemoryStream memory(data);
+	BufferedStream buffered(&memory, BufferSize, false);
+	S serializer(&buffered);
+	Listing result;
+	if(!serializer.input(result)) throw Exception("Unable to read listing back");
+	if(result.size() != listing.size()) throw Exception(String("Listing read back with ") + String::number(result.size()) + " entries instead of " + String::number(listing.size()));
+	for(size_t i=0; i<listing.size(); ++i)
+		if(!(result[i] == listing[i])) throw Exception("Entry " + String::number(i) + " differs after round trip");
+}
+
+static void checkFormats(void)
+{
+	Entry entry;
+	entry.digest = "00ff";
+	entry.url = "/files/a \"b\"";
+	entry.name = "a \"b\"";
+	entry.type = "file";
+	entry.time = 1380000000;
+	entry.size = 42;
+	Listing listing;
+	listing.append(entry);
+	
+	// Output must stay byte-identical to the former serializers
+	String yaml;
+	YamlSerializer yamlSerializer(&yaml);
+	yamlSerializer.output(listing);
+	if(yaml != "---\r\n-\r\n  digest: 00ff\r\n  name: a \"b\"\r\n  size: 42\r\n  time: 1380000000\r\n  type: file\r\n  url: /files/a \"b\"\r\n\r\n")
+		throw Exception("Unexpected YAML output:\n" + yaml);
+	
+	String json;
+	JsonSerializer jsonSerializer(&json);
+	jsonSerializer.output(listing);
+	if(json != "[\r\n  {\r\n    \"digest\": \"00ff\",\r\n    \"name\": \"a \\\"b\\\"\",\r\n    \"size\":  42,\r\n    \"time\":  1380000000,\r\n    \"type\": \"file\",\r\n    \"url\": \"/files/a \\\"b\\\"\"\r\n  }\r\n]")
+		throw Exception("Unexpected JSON output:\n" + json);
+	
+	// Escapes and empty containers
+	String input = "{ \"a\": \"x\\ty\\u00e9\", \"b\": 7 }";
+	StringMap map;
+	JsonSerializer mapSerializer(&input);
+	if(!mapSerializer.input(map) || map.size() != 2 || map["a"] != "x\ty\xC3\xA9" || map["b"] != "7")
+		throw Exception("Unexpected JSON input for map");
+	
+	input = "[ [], [ \"1\", 2 ], [ ] ]";
+	SerializableArray<StringArray> arrays;
+	JsonSerializer arraysSerializer(&input);
+	if(!arraysSerializer.input(arrays) || arrays.size() != 3 || !arrays[0].empty() || arrays[1].size() != 2 || !arrays[2].empty())
+		throw Exception("Unexpected JSON input for arrays");
+	
+	input = "[ {}, { \"k\": \"v\" } ]";
+	SerializableArray<StringMap> maps;
+	JsonSerializer mapsSerializer(&input);
+	if(!mapsSerializer.input(maps) || maps.size() != 2 || !maps[0].empty() || maps[1]["k"] != "v")
+		throw Exception("Unexpected JSON input for maps");
+	
+	Listing random;
+	generateListing(random, 500);
+	checkRoundTrip<YamlSerializer>(random);
+	checkRoundTrip<JsonSerializer>(random);
+}
+
+template<class S> struct Output
+{
+	const Listing *listing;
+	CountingStream *sink;
+	
+	void operator()(void)
+	{
+		S serializer(sink);
+		serializer.output(*listing);
+	}
+};
+
+template<class S> struct Input
+{
+	const String *data;
+	
+	void operator()(void)
+	{
+		MemoryStream memory(*data);
+		BufferedStream buffered(&memory, BufferSize, false);
+		S serializer(&buffered);
+		Listing listing;
+		serializer.input(listing);
+	}
+};
+
+template<class S> static void measure(Bench &bench, const String &format, const Listing &listing)
+{
+	CountingStream sink;
+	Output<S> output;
+	output.listing = &listing;
+	output.sink = &sink;
+	double rate = bench.run(output);
+	bench.report(format + " output", rate*listing.size(), "records/s");
+	
+	CountingStream single;
+	output.sink = &single;
+	output();
+	bench.report(format + " output writes per listing", double(single.writes), "writes");
+	
+	String data;
+	{
+		S serializer(&data);
+		serializer.output(listing);
+	}
+	
+	Input<S> input;
+	input.data = &data;
+	bench.report(format + " input", bench.run(input)*listing.size(), "records/s");
+}
+
+int main(int argc, char **argv)
+{
+	Bench bench("serializers");
+	
+	try {
+		checkFormats();
+		
+		Listing listing;
+		generateListing(listing, EntriesCount);
+		measure<YamlSerializer>(bench, "YAML", listing);
+		measure<JsonSerializer>(bench, "JSON", listing);
+	}
+	catch(const std::exception &e)
+	{
+		std::cerr << "Error: " << e.what() << std::endl;
+		return 1;
+	}
+	
+	return 0;
+}
@@ -0,0 +1,201 @@
+/*************************************************************************
+ *   Copyright (C) 2011-2013 by Paul-Louis Ageneau                       *
+ *   paul-louis (at) ageneau (dot) org                                   *
+ *                                                                       *
+ *   This file is part of TeapotNet.                                     *
+ *                                                                       *
+ *   TeapotNet is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU Affero General Public License as      *
+ *   published by the Free Software Foundation, either version 3 of      *
+ *   the License, or (at your option) any later version.                 *
+ *                                                                       *
+ *   TeapotNet is distributed in the hope that it will be useful, but    *
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the        *
+ *   GNU Affero General Public License for more details.                 *
+ *                                                                       *
+ *   You should have received a copy of the GNU Affero General Public    *
+ *   License along with TeapotNet.                                       *
+ *   If not, see <http://www.gnu.org/licenses/>.                         *
+ *************************************************************************/
+
+
+// Checks the vectorized SHA-512 paths against the scalar one, then measures
+// single-stream and multi-buffer hashing throughput and key derivation
+
+#include "bench/bench.h"
+#include "tpn/sha512.h"
+#include "tpn/bytestring.h"
+#include "tpn/bytearray.h"
+
+using namespace tpn;
+
+static const size_t MessageSize = 1024*1024;	// 1 MiB
+static const int DerivationRounds = 1000;
+
+static void checkVectors(void)
+{
+	// FIPS 180-2, SHA-512 of "abc"
+	static const char *expected = "ddaf35a193617abacc417349ae20413112e6fa4e89a97ea20a9eeee64b55d39a2192992a274fc1a836ba3c23a3feebbd454d4423643ce80e2a9ac94fa54ca49f";
+	
+	ByteString digest;
+	Sha512::Hash("abc", 3, digest);
+	if(digest.toString().toLower() != expected) throw Exception("SHA-512 does not match test vector");
+}
+
+static void checkImplementations(void)
+{
+	// Messages of various sizes must give the same digests in lockstep and alone
+	const size_t count = 7;
+	ByteString messages[count];
+	for(size_t i=0; i<count; ++i)
+		messages[i].writeRandom(pseudorand() % 20000);
+	
+	ByteString reference[count];
+	Sha512::SetVectorEnabled(false);
+	for(size_t i=0; i<count; ++i)
+		Sha512::Hash(messages[i], reference[i]);
+	
+	Sha512::SetVectorEnabled(true);
+	for(size_t i=0; i<count; ++i)
+	{
+		ByteString digest;
+		Sha512::Hash(messages[i], digest);
+		if(digest != reference[i]) throw Exception("SHA-512 vector schedule differs");
+	}
+	
+	ByteString copies[count], digests[count];
+	ByteStream *data[count], *out[count];
+	for(size_t i=0; i<count; ++i)
+	{
+		copies[i] = messages[i];
+		data[i] = &copies[i];
+		out[i] = &digests[i];
+	}
+	
+	Sha512::Hash(data, out, count);
+	for(size_t i=0; i<count; ++i)
+		if(digests[i] != reference[i]) throw Exception("SHA-512 multi-buffer differs");
+	
+	ByteString password, salts[3], keys[3];
+	ByteStream *keyPtrs[3];
+	password.writeRandom(32);
+	for(int i=0; i<3; ++i)
+	{
+		salts[i].writeRandom(16 + 8*i);
+		keyPtrs[i] = &keys[i];
+	}
+	
+	Sha512::DerivateKey(password, salts, keyPtrs, 3, 10);
+	for(int i=0; i<3; ++i)
+	{
+		ByteString key;
+		Sha512::DerivateKey(password, salts[i], key, 10);
+		if(key != keys[i]) throw Exception("SHA-512 multi-lane derivation differs");
+	}
+}
+
+struct SingleHash
+{
+	char *data;
+	
+	void operator()(void)
+	{
+		ByteString digest;
+		Sha512::Hash(data, MessageSize, digest);
+	}
+};
+
+struct MultiHash
+{
+	char *data;
+	
+	void operator()(void)
+	{
+		ByteArray arrays[Sha512::Lanes] = {
+			ByteArray(data, MessageSize), ByteArray(data, MessageSize),
+			ByteArray(data, MessageSize), ByteArray(data, MessageSize)
+		};
+		
+		ByteString digests[Sha512::Lanes];
+		ByteStream *in[Sha512::Lanes], *out[Sha512::Lanes];
+		for(size_t i=0; i<Sha512::Lanes; ++i)
+		{
+			in[i] = &arrays[i];
+			out[i] = &digests[i];
+		}
+		
+		Sha512::Hash(in, out, Sha512::Lanes);
+	}
+};
+
+struct Derivation
+{
+	ByteString *password;
+	ByteString *salts;
+	bool multi;
+	
+	void operator()(void)
+	{
+		ByteString keys[2];
+		if(multi)
+		{
+			ByteStream *out[2] = { &keys[0], &keys[1] };
+			Sha512::DerivateKey(*password, salts, out, 2, DerivationRounds);
+		}
+		else {
+			Sha512::DerivateKey(*password, salts[0], keys[0], DerivationRounds);
+			Sha512::DerivateKey(*password, salts[1], keys[1], DerivationRounds);
+		}
+	}
+};
+
+int main(int argc, char **argv)
+{
+	Bench bench("sha512");
+	
+	bool vector = Sha512::IsVectorAvailable();
+	bench.report("AVX2 available", vector ? 1. : 0., "");
+	
+	checkVectors();
+	if(vector) checkImplementations();
+	
+	char *data = new char[MessageSize];
+	std::memset(data, 0x5A, MessageSize);
+	const double mb = double(MessageSize)/(1024*1024);
+	
+	ByteString password, salts[2];
+	password.writeRandom(32);
+	salts[0].writeRandom(32);
+	salts[1].writeRandom(32);
+	
+	for(int v=0; v<2; ++v)
+	{
+		if(v && !vector) break;
+		Sha512::SetVectorEnabled(v != 0);
+		String impl = (v ? "AVX2" : "scalar");
+		
+		SingleHash single;
+		single.data = data;
+		bench.report("single stream (" + impl + ")", bench.run(single)*mb, "MB/s");
+		
+		MultiHash multi;
+		multi.data = data;
+		bench.report("4 streams (" + impl + ")", bench.run(multi)*Sha512::Lanes*mb, "MB/s");
+		
+		Derivation sequential;
+		sequential.password = &password;
+		sequential.salts = salts;
+		sequential.multi = false;
+		bench.report("2 derivations sequential (" + impl + ")", 1000./bench.run(sequential), "ms");
+		
+		Derivation lockstep;
+		lockstep.password = &password;
+		lockstep.salts = salts;
+		lockstep.multi = true;
+		bench.report("2 derivations lockstep (" + impl + ")", 1000./bench.run(lockstep), "ms");
+	}
+	
+	delete[] data;
+	return 0;
+}
@@ -0,0 +1,208 @@
+/*************************************************************************
+ *   Copyright (C) 2011-2013 by Paul-Louis Ageneau                       *
+ *   paul-louis (at) ageneau (dot) org                                   *
+ *                                                                       *
+ *   This file is part of TeapotNet.                                     *
+ *                                                                       *
+ *   TeapotNet is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU Affero General Public License as      *
+ *   published by the Free Software Foundation, either version 3 of      *
+ *   the License, or (at your option) any later version.                 *
+ *                                                                       *
+ *   TeapotNet is distributed in the hope that it will be useful, but    *
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the        *
+ *   GNU Affero General Public License for more details.                 *
+ *                                                                       *
+ *   You should have received a copy of the GNU Affero General Public    *
+ *   License along with TeapotNet.                                       *
+ *   If not, see <http://www.gnu.org/licenses/>.                         *
+ *************************************************************************/
+
+
+
+// Checks the numeric fast paths of Stream against iostreams, then measures
+// Stream::read(int) and Stream::write(int) on short strings like command arguments
+
+#include "bench/bench.h"
+#include "tpn/string.h"
+
+using namespace tpn;
+
+static const int Values = 1000;
+
+// Former conversions through iostreams
+template<typename T> static String legacyWrite(T value, bool hexa)
+{
+	std::ostringstream oss;
+	if(hexa) oss<<std::hex<<std::uppercase;
+	oss<<value;
+	return oss.str();
+}
+
+template<typename T> static bool legacyRead(const String &str, T &value, bool hexa)
+{
+	std::istringstream iss(str);
+	if(hexa) iss>>std::hex;
+	return bool(iss>>value);
+}
+
+template<typename T> static void checkValue(T value)
+{
+	for(int h=0; h<2; ++h)
+	{
+		bool hexa = (h != 0);
+		String expected = legacyWrite(value, hexa);
+		
+		String str;
+		str.hexaMode(hexa);
+		str.write(value);
+		if(str != expected) throw Exception("Stream::write differs from iostreams: " + str + " instead of " + expected);
+		
+		T result = 0, legacy = 0;
+		String tmp(str);
+		tmp.hexaMode(hexa);
+		bool success;
+		try { success = tmp.read(result); }
+		catch(const IOException &e) { success = false; }
+		if(success != legacyRead(str, legacy, hexa)) throw Exception("Stream::read accepts differently from iostreams: " + str);
+		if(success && result != legacy) throw Exception("Stream::read differs from iostreams: " + str);
+	}
+}
+
+template<typename T> static void checkType(void)
+{
+	checkValue(T(0));
+	checkValue(std::numeric_limits<T>::min());
+	checkValue(std::numeric_limits<T>::max());
+	for(int i=0; i<Values; ++i)
+	{
+		uint64_t r = (uint64_t(pseudorand()) << 32) ^ pseudorand();
+		checkValue(T(r >> (pseudorand() % 64)));
+	}
+}
+
+static void checkParsing(void)
+{
+	// Malformed and out of range input must be rejected like with iostreams
+	const char *inputs[] = { "12abc", "+7", "-0", "0x1F", "-1", "abc", "-", "99999999999", "-2147483649", "1e3", " \t 42 " };
+	for(size_t i=0; i<sizeof(inputs)/sizeof(inputs[0]); ++i)
+		for(int h=0; h<2; ++h)
+		{
+			bool hexa = (h != 0);
+			int result = 0, legacy = 0;
+			unsigned uresult = 0, ulegacy = 0;
+			String str(inputs[i]), ustr(inputs[i]);
+			str.hexaMode(hexa);
+			ustr.hexaMode(hexa);
+			
+			bool success, usuccess;
+			try { success = str.read(result); }
+			catch(const IOException &e) { success = false; }
+			try { usuccess = ustr.read(uresult); }
+			catch(const IOException &e) { usuccess = false; }
+			
+			String trimmed = String(inputs[i]).trimmed();
+			if(success != legacyRead(trimmed, legacy, hexa) || (success && result != legacy)
+				|| usuccess != legacyRead(trimmed, ulegacy, hexa) || (usuccess && uresult != ulegacy))
+				throw Exception(String("Stream::read differs from iostreams on \"") + inputs[i] + "\"");
+		}
+}
+
+static void checkFloating(void)
+{
+	const double values[] = { 0., 1., -1.5, 3.14159265358979, 1e-7, 123456789., 1e20, -2.5e-300 };
+	for(size_t i=0; i<sizeof(values)/sizeof(values[0]); ++i)
+		for(int h=0; h<2; ++h)
+		{
+			String str;
+			str.hexaMode(h != 0);
+			str.write(values[i]);
+			if(str != legacyWrite(values[i], h != 0)) throw Exception("Stream::write differs from iostreams: " + str);
+			
+			double result, legacy;
+			legacyRead(str, legacy, false);
+			if(!str.read(result) || result != legacy) throw Exception("Stream::read differs from iostreams: " + str);
+		}
+}
+
+struct Write
+{
+	int *values;
+	bool legacy;
+	
+	void operator()(void)
+	{
+		for(int i=0; i<Values; ++i)
+		{
+			String str;
+			if(legacy) str = legacyWrite(values[i], false);
+			else str.write(values[i]);
+		}
+	}
+};
+
+struct Read
+{
+	String *strings;
+	bool legacy;
+	
+	void operator()(void)
+	{
+		for(int i=0; i<Values; ++i)
+		{
+			int value;
+			String str(strings[i]);
+			if(legacy)
+			{
+				// Former path: the token is read, then parsed by a string stream
+				String token;
+				str.read(token);
+				legacyRead(token, value, false);
+			}
+			else str.read(value);
+		}
+	}
+};
+
+int main(int argc, char **argv)
+{
+	Bench bench("stream");
+	
+	checkType<short>();
+	checkType<unsigned short>();
+	checkType<int>();
+	checkType<unsigned int>();
+	checkType<long>();
+	checkType<unsigned long>();
+	checkType<long long>();
+	checkType<unsigned long long>();
+	checkParsing();
+	checkFloating();
+	
+	int values[Values];
+	String strings[Values];
+	for(int i=0; i<Values; ++i)
+	{
+		values[i] = int(pseudorand()) >> (pseudorand() % 32);
+		strings[i] = legacyWrite(values[i], false);
+	}
+	
+	for(int l=0; l<2; ++l)
+	{
+		bool legacy = (l == 0);
+		String impl = (legacy ? "iostreams" : "fast path");
+		
+		Write write;
+		write.values = values;
+		write.legacy = legacy;
+		bench.report("write(int) (" + impl + ")", bench.run(write)*Values, "values/s");
+		
+		Read read;
+		read.strings = strings;
+		read.legacy = legacy;
+		bench.report("read(int) (" + impl + ")", bench.run(read)*Values, "values/s");
+	}
+	
+	return 0;
+}
@@ -0,0 +1,169 @@
+/*************************************************************************
+ *   Copyright (C) 2011-2013 by Paul-Louis Ageneau                       *
+ *   paul-louis (at) ageneau (dot) org                                   *
+ *                                                                       *
+ *   This file is part of TeapotNet.                                     *
+ *                                                                       *
+ *   TeapotNet is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU Affero General Public License as      *
+ *   published by the Free Software Foundation, either version 3 of      *
+ *   the License, or (at your option) any later version.                 *
+ *                                                                       *
+ *   TeapotNet is distributed in the hope that it will be useful, but    *
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the        *
+ *   GNU Affero General Public License for more details.                 *
+ *                                                                       *
+ *   You should have received a copy of the GNU Affero General Public    *
+ *   License along with TeapotNet.                                       *
+ *   If not, see <http://www.gnu.org/licenses/>.                         *
+ *************************************************************************/
+
+
+
+
+// Measures ThreadPool task throughput with 1 to 64 threads,
+// each launching tiny tasks into a pool with as many workers,
+// then tasks launched from workers themselves
+
+#include "bench/bench.h"
+#include "tpn/threadpool.h"
+#include "tpn/thread.h"
+#include "tpn/array.h"
+
+using namespace tpn;
+
+static const int TasksCount = 20000;
+
+class CountTask : public Task
+{
+public:
+	CountTask(void) : count(0) {}
+	
+	void run(void)
+	{
+		__atomic_add_fetch(&count, 1, __ATOMIC_RELAXED);
+	}
+	
+	int count;
+};
+
+struct Producer
+{
+	ThreadPool *pool;
+	Task *task;
+	int count;
+};
+
+static void produce(Producer *producer)
+{
+	for(int i=0; i<producer->count; ++i)
+		producer->pool->launch(producer->task);
+}
+
+// Launches a few tasks from inside the pool so they go to the worker deques
+class SpawnTask : public Task
+{
+public:
+	ThreadPool *pool;
+	Task *child;
+	int children;
+	
+	void run(void)
+	{
+		for(int i=0; i<children; ++i)
+			pool->launch(child);
+	}
+};
+
+struct Launch
+{
+	ThreadPool *pool;
+	CountTask *task;
+	int threads;
+	
+	void operator()(void)
+	{
+		Array<Producer> producers;
+		producers.resize(threads);
+		Array<Thread*> list;
+		for(int i=0; i<threads; ++i)
+		{
+			producers[i].pool = pool;
+			producers[i].task = task;
+			producers[i].count = TasksCount/threads;
+			list.push_back(new Thread(produce, &producers[i]));
+		}
+		
+		for(int i=0; i<threads; ++i)
+		{
+			list[i]->join();
+			delete list[i];
+		}
+		
+		pool->join();
+	}
+};
+
+struct Spawn
+{
+	ThreadPool *pool;
+	SpawnTask *task;
+	
+	void operator()(void)
+	{
+		for(int i=0; i<TasksCount/(task->children+1); ++i)
+			pool->launch(task);
+		
+		pool->join();
+	}
+};
+
+int main(int argc, char **argv)
+{
+	Bench bench("threadpool");
+	
+	try {
+		for(int threads=1; threads<=64; threads*=2)
+		{
+			ThreadPool pool(threads, threads, threads);
+			CountTask task;
+			
+			Launch launch;
+			launch.pool = &pool;
+			launch.task = &task;
+			launch.threads = threads;
+			
+			double rate = bench.run(launch)*(TasksCount/threads)*threads;
+			if(task.count % ((TasksCount/threads)*threads) != 0)
+				throw Exception("Some tasks did not run");
+			
+			bench.report("launch " + String::number(threads) + " threads", rate, "tasks/s");
+		}
+		
+		for(int threads=2; threads<=64; threads*=2)
+		{
+			// The spawning task keeps a worker busy, the others run its children
+			ThreadPool pool(threads, threads, 0);
+			CountTask child;
+			SpawnTask task;
+			task.pool = &pool;
+			task.child = &child;
+			task.children = 8;
+			
+			Spawn spawn;
+			spawn.pool = &pool;
+			spawn.task = &task;
+			
+			double rate = bench.run(spawn)*(TasksCount/(task.children+1))*(task.children+1);
+			bench.report("spawn " + String::number(threads) + " threads", rate, "tasks/s");
+		}
+	}
+	catch(const std::exception &e)
+	{
+		std::cerr << "Error: " << e.what() << std::endl;
+		return 1;
+	}
+	
+	return 0;
+}
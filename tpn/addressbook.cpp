@@ -902,19 +902,20 @@ AddressBook::Contact::Contact(	AddressBook *addressBook,
 	// Only half the secret (256 bits) is used to compute peerings
 	ByteString halfSecret(mSecret, 0, mSecret.size()/2);
 	
-	// Compute peering
-	salt.clear();
-	ssalt.output("TeapotNet");
-	ssalt.output(mAddressBook->userName());
-	ssalt.output(mName);
-	Sha512::DerivateKey(halfSecret, salt, mPeering, Sha512::CryptRounds);
+	// Peering and remote peering are computed together
+	ByteString salts[2];
+	ByteSerializer speering(&salts[0]);
+	speering.output("TeapotNet");
+	speering.output(mAddressBook->userName());
+	speering.output(mName);
 	
-	// Compute remote peering
-	salt.clear();
-	ssalt.output("TeapotNet");
-	ssalt.output(mName);
-	ssalt.output(mAddressBook->userName());
-	Sha512::DerivateKey(halfSecret, salt, mRemotePeering, Sha512::CryptRounds);
+	ByteSerializer sremote(&salts[1]);
+	sremote.output("TeapotNet");
+	sremote.output(mName);
+	sremote.output(mAddressBook->userName());
+	
+	ByteStream *peerings[2] = { &static_cast<ByteString&>(mPeering), &static_cast<ByteString&>(mRemotePeering) };
+	Sha512::DerivateKey(halfSecret, salts, peerings, 2, Sha512::CryptRounds);
 	
 	createProfile();
 }
@@ -1425,10 +1426,8 @@ bool AddressBook::Contact::notification(const Identifier &peering, Notification
 	}
 	else if(type == "read" || type == "ack")
 	{
-		String data = notification->content();
-                YamlSerializer serializer(&data);
 		StringArray stamps;
-		serializer.input(stamps);
+		MessageQueue::ReadStamps(*notification, stamps);
 
 		// Mark messages as read
 		bool privateOnly = !isSelf();	// others may not mark public messages as read
@@ -1439,10 +1438,10 @@ bool AddressBook::Contact::notification(const Identifier &peering, Notification
 	}
 	else if(type == "unread")
 	{
-		String data = notification->content();
-                YamlSerializer serializer(&data);
+		StringArray stamps;
+		MessageQueue::ReadStamps(*notification, stamps);
 		StringSet recvStamps;
-		serializer.input(recvStamps);
+		recvStamps.insert(stamps.begin(), stamps.end());
 
 		// Mark messages as read
                 bool privateOnly = !isSelf();   // others may not mark public messages as read
@@ -1465,12 +1464,9 @@ bool AddressBook::Contact::notification(const Identifier &peering, Notification
 			StringArray ackedStamps;
 			ackedStamps.assign(recvStamps.begin(), recvStamps.end());
 			
-			String tmp;
-			YamlSerializer outSerializer(&tmp);
-			outSerializer.output(ackedStamps);
-
-			Notification notification(tmp);
+			Notification notification;
 			notification.setParameter("type", "read");
+			MessageQueue::WriteStamps(notification, ackedStamps, peering);
 			notification.send(peering);
 		}
 	}
@@ -1502,7 +1498,10 @@ bool AddressBook::Contact::notification(const Identifier &peering, Notification
 		ByteString checksum;
 		
 		try {
-			notification->content().extract(checksum);
+			if(parameters.contains("format") && parameters["format"] == "binary")
+				checksum.assign(notification->content().begin(), notification->content().end());
+			else
+				notification->content().extract(checksum);
 		}
 		catch(...)
 		{
@@ -1724,7 +1723,13 @@ void AddressBook::Contact::sendMessagesChecksum(const Identifier &peering, const
 	String base = selection.baseStamp();
 	if(!base.empty()) parameters["base"] << base;
 		
-	Notification notification(result.toString());
+	Notification notification;
+	if(Core::Instance->supportsFormat(peering, "binary"))
+	{
+		parameters["format"] = "binary";
+		notification.setContent(String(result.begin(), result.end()));
+	}
+	else notification.setContent(result.toString());
 	notification.setParameters(parameters);
 	notification.send(peering);
 }
@@ -1737,12 +1742,9 @@ void AddressBook::Contact::sendUnread(const Identifier &peering) const
 	StringArray unreadStamps;
 	selection.getUnreadStamps(unreadStamps);
 	
-	String tmp;
-	YamlSerializer serializer(&tmp);
-	serializer.output(unreadStamps);
-
-	Notification notification(tmp);
+	Notification notification;
 	notification.setParameter("type", "unread");
+	MessageQueue::WriteStamps(notification, unreadStamps, peering);
 	notification.send(peering);
 }
 
@@ -23,17 +23,324 @@
 #include "tpn/exception.h"
 #include "tpn/bytearray.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define AES_NI
+#include <cpuid.h>
+#include <wmmintrin.h>
+#include <tmmintrin.h>
+#define AES_NI_TARGET __attribute__((target("aes,sse2")))
+#define CLMUL_TARGET __attribute__((target("aes,sse2,ssse3,pclmul")))
+#endif
+
 namespace tpn
 {
 
 #define GETU32(pt) (uint32_t(uint8_t((pt)[0]) << 24) ^ uint32_t(uint8_t((pt)[1]) << 16) ^ uint32_t(uint8_t((pt)[2]) <<  8) ^ uint32_t(uint8_t((pt)[3])))
 #define PUTU32(ct, st) { (ct)[0] = uint8_t((st) >> 24); (ct)[1] = uint8_t((st) >> 16); (ct)[2] = uint8_t((st) >>  8); (ct)[3] = uint8_t(st); }
 
+#ifdef AES_NI
+
+static AES_NI_TARGET void AesNiEncryptCbc(const uint8_t *keys, int rounds, char *data, size_t blocks, char *iv)
+{
+	__m128i k[AES_MAXNR + 1];
+	for(int r=0; r<=rounds; ++r)
+		k[r] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + r*AES_BLOCK_SIZE));
+	
+	// CBC encryption is sequential
+	__m128i state = _mm_loadu_si128(reinterpret_cast<const __m128i*>(iv));
+	for(size_t b=0; b<blocks; ++b)
+	{
+		__m128i *block = reinterpret_cast<__m128i*>(data + b*AES_BLOCK_SIZE);
+		state = _mm_xor_si128(_mm_loadu_si128(block), state);
+		state = _mm_xor_si128(state, k[0]);
+		for(int r=1; r<rounds; ++r)
+			state = _mm_aesenc_si128(state, k[r]);
+		state = _mm_aesenclast_si128(state, k[rounds]);
+		_mm_storeu_si128(block, state);
+	}
+	
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(iv), state);
+}
+
+static AES_NI_TARGET void AesNiDecryptCbc(const uint8_t *keys, int rounds, const char *in, char *out, size_t blocks, char *iv)
+{
+	const __m128i *k = reinterpret_cast<const __m128i*>(keys);
+	const __m128i *src = reinterpret_cast<const __m128i*>(in);
+	__m128i *dst = reinterpret_cast<__m128i*>(out);
+	
+	__m128i prev = _mm_loadu_si128(reinterpret_cast<const __m128i*>(iv));
+	size_t b = 0;
+	
+	// CBC decryption is parallel, 4 blocks are interleaved to fill the pipeline
+	for(; b + 4 <= blocks; b+= 4)
+	{
+		__m128i c0 = _mm_loadu_si128(src + b);
+		__m128i c1 = _mm_loadu_si128(src + b + 1);
+		__m128i c2 = _mm_loadu_si128(src + b + 2);
+		__m128i c3 = _mm_loadu_si128(src + b + 3);
+		
+		__m128i rk = _mm_loadu_si128(k);
+		__m128i x0 = _mm_xor_si128(c0, rk);
+		__m128i x1 = _mm_xor_si128(c1, rk);
+		__m128i x2 = _mm_xor_si128(c2, rk);
+		__m128i x3 = _mm_xor_si128(c3, rk);
+		
+		for(int r=1; r<rounds; ++r)
+		{
+			rk = _mm_loadu_si128(k + r);
+			x0 = _mm_aesdec_si128(x0, rk);
+			x1 = _mm_aesdec_si128(x1, rk);
+			x2 = _mm_aesdec_si128(x2, rk);
+			x3 = _mm_aesdec_si128(x3, rk);
+		}
+		
+		rk = _mm_loadu_si128(k + rounds);
+		_mm_storeu_si128(dst + b,     _mm_xor_si128(_mm_aesdeclast_si128(x0, rk), prev));
+		_mm_storeu_si128(dst + b + 1, _mm_xor_si128(_mm_aesdeclast_si128(x1, rk), c0));
+		_mm_storeu_si128(dst + b + 2, _mm_xor_si128(_mm_aesdeclast_si128(x2, rk), c1));
+		_mm_storeu_si128(dst + b + 3, _mm_xor_si128(_mm_aesdeclast_si128(x3, rk), c2));
+		prev = c3;
+	}
+	
+	for(; b<blocks; ++b)
+	{
+		__m128i c = _mm_loadu_si128(src + b);
+		__m128i x = _mm_xor_si128(c, _mm_loadu_si128(k));
+		for(int r=1; r<rounds; ++r)
+			x = _mm_aesdec_si128(x, _mm_loadu_si128(k + r));
+		x = _mm_aesdeclast_si128(x, _mm_loadu_si128(k + rounds));
+		_mm_storeu_si128(dst + b, _mm_xor_si128(x, prev));
+		prev = c;
+	}
+	
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(iv), prev);
+}
+
+static AES_NI_TARGET void AesNiCtr(const uint8_t *keys, int rounds, char *block, const char *in, char *out, size_t size)
+{
+	const __m128i *k = reinterpret_cast<const __m128i*>(keys);
+	
+	uint32_t counter = GETU32(block + 12);
+	char ctr[4][AES_BLOCK_SIZE];
+	for(int i=0; i<4; ++i)
+		std::memcpy(ctr[i], block, 12);
+	
+	// Counter blocks are independent, 4 blocks are interleaved to fill the pipeline
+	while(size >= 4*AES_BLOCK_SIZE)
+	{
+		for(int i=0; i<4; ++i)
+			PUTU32(ctr[i] + 12, counter + i);
+		counter+= 4;
+		
+		__m128i rk = _mm_loadu_si128(k);
+		__m128i x0 = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(ctr[0])), rk);
+		__m128i x1 = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(ctr[1])), rk);
+		__m128i x2 = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(ctr[2])), rk);
+		__m128i x3 = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(ctr[3])), rk);
+		
+		for(int r=1; r<rounds; ++r)
+		{
+			rk = _mm_loadu_si128(k + r);
+			x0 = _mm_aesenc_si128(x0, rk);
+			x1 = _mm_aesenc_si128(x1, rk);
+			x2 = _mm_aesenc_si128(x2, rk);
+			x3 = _mm_aesenc_si128(x3, rk);
+		}
+		
+		rk = _mm_loadu_si128(k + rounds);
+		const __m128i *src = reinterpret_cast<const __m128i*>(in);
+		__m128i *dst = reinterpret_cast<__m128i*>(out);
+		_mm_storeu_si128(dst,     _mm_xor_si128(_mm_aesenclast_si128(x0, rk), _mm_loadu_si128(src)));
+		_mm_storeu_si128(dst + 1, _mm_xor_si128(_mm_aesenclast_si128(x1, rk), _mm_loadu_si128(src + 1)));
+		_mm_storeu_si128(dst + 2, _mm_xor_si128(_mm_aesenclast_si128(x2, rk), _mm_loadu_si128(src + 2)));
+		_mm_storeu_si128(dst + 3, _mm_xor_si128(_mm_aesenclast_si128(x3, rk), _mm_loadu_si128(src + 3)));
+		
+		in+= 4*AES_BLOCK_SIZE;
+		out+= 4*AES_BLOCK_SIZE;
+		size-= 4*AES_BLOCK_SIZE;
+	}
+	
+	while(size)
+	{
+		PUTU32(ctr[0] + 12, counter);
+		++counter;
+		
+		__m128i x = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(ctr[0])), _mm_loadu_si128(k));
+		for(int r=1; r<rounds; ++r)
+			x = _mm_aesenc_si128(x, _mm_loadu_si128(k + r));
+		x = _mm_aesenclast_si128(x, _mm_loadu_si128(k + rounds));
+		
+		char stream[AES_BLOCK_SIZE];
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(stream), x);
+		size_t len = std::min(size, size_t(AES_BLOCK_SIZE));
+		for(size_t n=0; n<len; ++n)
+			out[n] = in[n] ^ stream[n];
+		
+		in+= len;
+		out+= len;
+		size-= len;
+	}
+	
+	PUTU32(block + 12, counter);
+}
+
+// Carry-less multiplication in GF(2^128) on bit-reflected operands, from the Intel white paper
+static CLMUL_TARGET __m128i ClmulGfmul(__m128i a, __m128i b)
+{
+	__m128i t3 = _mm_clmulepi64_si128(a, b, 0x00);
+	__m128i t4 = _mm_clmulepi64_si128(a, b, 0x10);
+	__m128i t5 = _mm_clmulepi64_si128(a, b, 0x01);
+	__m128i t6 = _mm_clmulepi64_si128(a, b, 0x11);
+	
+	t4 = _mm_xor_si128(t4, t5);
+	t5 = _mm_slli_si128(t4, 8);
+	t4 = _mm_srli_si128(t4, 8);
+	t3 = _mm_xor_si128(t3, t5);
+	t6 = _mm_xor_si128(t6, t4);
+	
+	// Shift the 256-bit product left by one bit
+	__m128i t7 = _mm_srli_epi32(t3, 31);
+	__m128i t8 = _mm_srli_epi32(t6, 31);
+	t3 = _mm_slli_epi32(t3, 1);
+	t6 = _mm_slli_epi32(t6, 1);
+	__m128i t9 = _mm_srli_si128(t7, 12);
+	t8 = _mm_slli_si128(t8, 4);
+	t7 = _mm_slli_si128(t7, 4);
+	t3 = _mm_or_si128(t3, t7);
+	t6 = _mm_or_si128(t6, t8);
+	t6 = _mm_or_si128(t6, t9);
+	
+	// Reduce modulo x^128 + x^7 + x^2 + x + 1
+	t7 = _mm_slli_epi32(t3, 31);
+	t8 = _mm_slli_epi32(t3, 30);
+	t9 = _mm_slli_epi32(t3, 25);
+	t7 = _mm_xor_si128(t7, t8);
+	t7 = _mm_xor_si128(t7, t9);
+	t8 = _mm_srli_si128(t7, 4);
+	t7 = _mm_slli_si128(t7, 12);
+	t3 = _mm_xor_si128(t3, t7);
+	
+	__m128i t2 = _mm_srli_epi32(t3, 1);
+	t4 = _mm_srli_epi32(t3, 2);
+	t5 = _mm_srli_epi32(t3, 7);
+	t2 = _mm_xor_si128(t2, t4);
+	t2 = _mm_xor_si128(t2, t5);
+	t2 = _mm_xor_si128(t2, t8);
+	t3 = _mm_xor_si128(t3, t2);
+	return _mm_xor_si128(t6, t3);
+}
+
+static CLMUL_TARGET void ClmulGhash(const uint8_t *h, uint8_t *y, const char *data, size_t size)
+{
+	const __m128i swap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	const __m128i hk = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(h)), swap);
+	__m128i x = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(y)), swap);
+	
+	if(size >= 4*AES_BLOCK_SIZE)
+	{
+		// Multiplications by powers of H are independent, so 4 blocks are processed at once
+		const __m128i hk2 = ClmulGfmul(hk, hk);
+		const __m128i hk3 = ClmulGfmul(hk2, hk);
+		const __m128i hk4 = ClmulGfmul(hk3, hk);
+		
+		const __m128i *src = reinterpret_cast<const __m128i*>(data);
+		while(size >= 4*AES_BLOCK_SIZE)
+		{
+			__m128i b0 = _mm_xor_si128(x, _mm_shuffle_epi8(_mm_loadu_si128(src), swap));
+			__m128i b1 = _mm_shuffle_epi8(_mm_loadu_si128(src + 1), swap);
+			__m128i b2 = _mm_shuffle_epi8(_mm_loadu_si128(src + 2), swap);
+			__m128i b3 = _mm_shuffle_epi8(_mm_loadu_si128(src + 3), swap);
+			
+			x = _mm_xor_si128(_mm_xor_si128(ClmulGfmul(b0, hk4), ClmulGfmul(b1, hk3)),
+					_mm_xor_si128(ClmulGfmul(b2, hk2), ClmulGfmul(b3, hk)));
+			
+			src+= 4;
+			size-= 4*AES_BLOCK_SIZE;
+		}
+		
+		data = reinterpret_cast<const char*>(src);
+	}
+	
+	while(size)
+	{
+		__m128i block;
+		if(size >= AES_BLOCK_SIZE)
+		{
+			block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+			data+= AES_BLOCK_SIZE;
+			size-= AES_BLOCK_SIZE;
+		}
+		else {
+			// The last partial block is padded with zeros
+			char tmp[AES_BLOCK_SIZE];
+			std::memset(tmp, 0, AES_BLOCK_SIZE);
+			std::memcpy(tmp, data, size);
+			block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(tmp));
+			size = 0;
+		}
+		
+		x = ClmulGfmul(_mm_xor_si128(x, _mm_shuffle_epi8(block, swap)), hk);
+	}
+	
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(y), _mm_shuffle_epi8(x, swap));
+}
+
+#endif
+
+static bool IsClmulAvailable(void)
+{
+#ifdef AES_NI
+	unsigned int eax, ebx, ecx, edx;
+	if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+	return (ecx & bit_PCLMUL) && (ecx & bit_SSSE3);
+#else
+	return false;
+#endif
+}
+
+static const bool ClmulAvailable = IsClmulAvailable();
+
+// GCM nonce for a record: the sequence number is xored into the end of the 96-bit base,
+// the pre-counter block J0 is the nonce followed by a 32-bit counter set to 1
+static void GcmPreCounter(const char *init, uint64_t seq, char *j0)
+{
+	std::memcpy(j0, init, 12);
+	for(int i=0; i<8; ++i)
+		j0[11 - i]^= char(uint8_t(seq >> (8*i)));
+	PUTU32(j0 + 12, uint32_t(1));
+}
+
+bool AesCipher::HardwareEnabled = AesCipher::IsHardwareAvailable();
+
+bool AesCipher::IsHardwareAvailable(void)
+{
+#ifdef AES_NI
+	unsigned int eax, ebx, ecx, edx;
+	if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+	return (ecx & bit_AES) && (edx & bit_SSE2);
+#else
+	return false;
+#endif
+}
+
+void AesCipher::SetHardwareEnabled(bool enabled)
+{
+	HardwareEnabled = enabled && IsHardwareAvailable();
+}
+
 AesCipher::AesCipher(ByteStream *bs) :
 	mByteStream(bs),
 	mDumpStream(NULL),
-	mTempBlockInSize(0),
-	mTempBlockOutSize(0)
+	mMode(CBC),
+	mEncryptionSeq(0),
+	mDecryptionSeq(0),
+	mReadBuffer(NULL),
+	mReadBufferSize(0),
+	mPlainBuffer(NULL),
+	mPlainOffset(0),
+	mPlainSize(0),
+	mWriteBuffer(NULL),
+	mReadAhead(true)
 {
 	// TODO: set keys and rounds to a safe values
 	
@@ -44,20 +351,22 @@ AesCipher::AesCipher(ByteStream *bs) :
 AesCipher::~AesCipher(void)
 {
 	// mByteStream is not deleted
+	delete[] mReadBuffer;
+	delete[] mPlainBuffer;
+	delete[] mWriteBuffer;
 }
 
 size_t AesCipher::setEncryptionKey(const ByteString &key)
 {
-	 char tmp[AES_MAX_KEY_SIZE];
-	 size_t size = key.size();
-	 if(size > AES_MAX_KEY_SIZE) size = AES_MAX_KEY_SIZE;
-	 std::copy(key.begin(), key.begin()+size, tmp);
-	 return setEncryptionKey(tmp, size);
+	 return setEncryptionKey(key.data(), std::min(key.size(), size_t(AES_MAX_KEY_SIZE)));
 }
 
 size_t AesCipher::setEncryptionKey(const char *key, size_t size)
 {
-	return setEncryptionKey(key, size, mEncryptionKey);
+	size = setEncryptionKey(key, size, mEncryptionKey);
+	storeRoundKeys(mEncryptionKey);
+	setHashKey(mEncryptionKey, mEncryptionHashKey);
+	return size;
 }
 
 size_t AesCipher::setEncryptionKey(const char *key, size_t size, AesCipher::Key &out)
@@ -177,16 +486,19 @@ size_t AesCipher::setEncryptionKey(const char *key, size_t size, AesCipher::Key
 
 size_t AesCipher::setDecryptionKey(const ByteString &key)
 {
-	 char tmp[AES_MAX_KEY_SIZE];
-	 size_t size = key.size();
-	 if(size > AES_MAX_KEY_SIZE) size = AES_MAX_KEY_SIZE;
-	 std::copy(key.begin(), key.begin()+size, tmp);
-	 return setDecryptionKey(tmp, size);
+	 return setDecryptionKey(key.data(), std::min(key.size(), size_t(AES_MAX_KEY_SIZE)));
 }
 
 size_t AesCipher::setDecryptionKey(const char *key, size_t size)
 {
-	return setDecryptionKey(key, size, mDecryptionKey);
+	size = setDecryptionKey(key, size, mDecryptionKey);
+	storeRoundKeys(mDecryptionKey);
+	
+	// GCM only uses the forward cipher in both directions
+	setEncryptionKey(key, size, mCounterKey);
+	storeRoundKeys(mCounterKey);
+	setHashKey(mCounterKey, mDecryptionHashKey);
+	return size;
 }
 
 size_t AesCipher::setDecryptionKey(const char *key, size_t size, AesCipher::Key &out)
@@ -240,13 +552,56 @@ size_t AesCipher::setDecryptionKey(const char *key, size_t size, AesCipher::Key
 	return size;
 }
 
+void AesCipher::storeRoundKeys(AesCipher::Key &key)
+{
+	// The decryption schedule is already in the equivalent inverse cipher form expected by AESDEC
+	for(int i=0; i<4*(key.rounds+1); ++i)
+		PUTU32(key.rd_bytes + 4*i, key.rd_key[i]);
+}
+
+void AesCipher::setHashKey(const AesCipher::Key &key, AesCipher::HashKey &out)
+{
+	// H = E(K, 0^128)
+	char zero[AES_BLOCK_SIZE];
+	std::memset(zero, 0, AES_BLOCK_SIZE);
+	encrypt(key, zero, reinterpret_cast<char*>(out.h));
+	
+	// Precompute the 4-bit multiplication tables
+	uint64_t vh = 0, vl = 0;
+	for(int i=0; i<8; ++i)
+	{
+		vh = (vh << 8) | out.h[i];
+		vl = (vl << 8) | out.h[8 + i];
+	}
+	
+	out.hl[8] = vl;
+	out.hh[8] = vh;
+	out.hl[0] = 0;
+	out.hh[0] = 0;
+	
+	for(int i=4; i>0; i>>=1)
+	{
+		uint64_t t = (vl & 1) * 0xe1000000U;
+		vl = (vh << 63) | (vl >> 1);
+		vh = (vh >> 1) ^ (t << 32);
+		out.hl[i] = vl;
+		out.hh[i] = vh;
+	}
+	
+	for(int i=2; i<=8; i*=2)
+		for(int j=1; j<i; ++j)
+		{
+			out.hh[i + j] = out.hh[i] ^ out.hh[j];
+			out.hl[i + j] = out.hl[i] ^ out.hl[j];
+		}
+}
+
 void AesCipher::setEncryptionInit(const ByteString &iv)
 {
 	if(iv.empty()) std::memset(mEncryptionInit, 0, AES_BLOCK_SIZE);
-	else {
-		for(int i=0; i<AES_BLOCK_SIZE; ++i)
-			mEncryptionInit[i] = iv.at(i % iv.size());
-	}
+	else setEncryptionInit(iv.data(), iv.size());
+	
+	mEncryptionSeq = 0;
 }
 
 void AesCipher::setEncryptionInit(const char *iv, size_t size)
@@ -257,15 +612,16 @@ void AesCipher::setEncryptionInit(const char *iv, size_t size)
 		for(int i=0; i<AES_BLOCK_SIZE; ++i)
 			mEncryptionInit[i] = iv[i % size];
 	}
+	
+	mEncryptionSeq = 0;
 }
 
 void AesCipher::setDecryptionInit(const ByteString &iv)
 {
 	if(iv.empty()) std::memset(mDecryptionInit, 0, AES_BLOCK_SIZE);
-	else {
-		for(int i=0; i<AES_BLOCK_SIZE; ++i)
-			mDecryptionInit[i] = iv.at(i % iv.size());
-	}
+	else setDecryptionInit(iv.data(), iv.size());
+	
+	mDecryptionSeq = 0;
 }
 
 void AesCipher::setDecryptionInit(const char *iv, size_t size)
@@ -276,6 +632,15 @@ void AesCipher::setDecryptionInit(const char *iv, size_t size)
 		for(int i=0; i<AES_BLOCK_SIZE; ++i)
 			mDecryptionInit[i] = iv[i % size];
 	}
+	
+	mDecryptionSeq = 0;
+}
+
+void AesCipher::setMode(Mode mode)
+{
+	mMode = mode;
+	mEncryptionSeq = 0;
+	mDecryptionSeq = 0;
 }
 
 void AesCipher::dumpStream(ByteStream *bs)
@@ -283,14 +648,19 @@ void AesCipher::dumpStream(ByteStream *bs)
 	mDumpStream = bs; 
 }
 
+void AesCipher::setReadAhead(bool enabled)
+{
+	mReadAhead = enabled;
+}
+
 /*
  * Encrypt a single block
  * in and out can overlap
  */
-void AesCipher::encrypt(char *in, char *out)
+void AesCipher::encrypt(const AesCipher::Key &key, const char *in, char *out)
 {
 	uint32_t s0, s1, s2, s3, t0, t1, t2, t3;
-	const uint32_t *rk = mEncryptionKey.rd_key;
+	const uint32_t *rk = key.rd_key;
 
 	// Map byte array block to cipher state and add initial round key
 	s0 = GETU32(in     ) ^ rk[0];
@@ -299,7 +669,7 @@ void AesCipher::encrypt(char *in, char *out)
 	s3 = GETU32(in + 12) ^ rk[3];
 	
 	// Nr - 1 full rounds
-	int r = mEncryptionKey.rounds >> 1;
+	int r = key.rounds >> 1;
 	while(true)
 	{
 		t0 =	Te0[(s0 >> 24)       ] ^
@@ -385,10 +755,10 @@ void AesCipher::encrypt(char *in, char *out)
  * Decrypt a single block
  * in and out can overlap
  */
-void AesCipher::decrypt(char *in, char *out)
+void AesCipher::decrypt(const AesCipher::Key &key, const char *in, char *out)
 {
 	uint32_t s0, s1, s2, s3, t0, t1, t2, t3;
-	const uint32_t *rk = mDecryptionKey.rd_key;
+	const uint32_t *rk = key.rd_key;
 
 	// Map byte array block to cipher state and add initial round key
 	s0 = GETU32(in     ) ^ rk[0];
@@ -397,7 +767,7 @@ void AesCipher::decrypt(char *in, char *out)
 	s3 = GETU32(in + 12) ^ rk[3];
 
 	// Nr - 1 full rounds
-	int r = mDecryptionKey.rounds >> 1;
+	int r = key.rounds >> 1;
 	while(true)
 	{
 		t0 =	Td0[(s0 >> 24)       ] ^
@@ -482,6 +852,224 @@ void AesCipher::decrypt(char *in, char *out)
 	PUTU32(out + 12, s3);
 }
 
+void AesCipher::encryptBlocks(char *data, size_t blocks)
+{
+	Assert(data);
+	
+#ifdef AES_NI
+	if(HardwareEnabled)
+	{
+		AesNiEncryptCbc(mEncryptionKey.rd_bytes, mEncryptionKey.rounds, data, blocks, mEncryptionInit);
+		return;
+	}
+#endif
+	
+	for(size_t b=0; b<blocks; ++b)
+	{
+		char *block = data + b*AES_BLOCK_SIZE;
+		for(size_t n=0; n<AES_BLOCK_SIZE; ++n)
+			block[n]^= mEncryptionInit[n];
+		
+		encrypt(mEncryptionKey, block, block);
+		std::memcpy(mEncryptionInit, block, AES_BLOCK_SIZE);
+	}
+}
+
+void AesCipher::decryptBlocks(const char *in, char *out, size_t blocks)
+{
+	Assert(in);
+	Assert(out);
+	
+#ifdef AES_NI
+	if(HardwareEnabled)
+	{
+		AesNiDecryptCbc(mDecryptionKey.rd_bytes, mDecryptionKey.rounds, in, out, blocks, mDecryptionInit);
+		return;
+	}
+#endif
+	
+	for(size_t b=0; b<blocks; ++b)
+	{
+		char block[AES_BLOCK_SIZE];
+		std::memcpy(block, in + b*AES_BLOCK_SIZE, AES_BLOCK_SIZE);
+		
+		char *o = out + b*AES_BLOCK_SIZE;
+		decrypt(mDecryptionKey, block, o);
+		for(size_t n=0; n<AES_BLOCK_SIZE; ++n)
+			o[n]^= mDecryptionInit[n];
+		
+		std::memcpy(mDecryptionInit, block, AES_BLOCK_SIZE);
+	}
+}
+
+/*
+ * Encrypt or decrypt with the counter mode
+ * block is the counter block, incremented on 32 bits for each block
+ */
+void AesCipher::counter(const AesCipher::Key &key, char *block, const char *in, char *out, size_t size)
+{
+	Assert(block);
+	Assert(in);
+	Assert(out);
+	
+#ifdef AES_NI
+	if(HardwareEnabled)
+	{
+		AesNiCtr(key.rd_bytes, key.rounds, block, in, out, size);
+		return;
+	}
+#endif
+	
+	uint32_t count = GETU32(block + 12);
+	char ctr[AES_BLOCK_SIZE];
+	char stream[AES_BLOCK_SIZE];
+	std::memcpy(ctr, block, 12);
+	
+	while(size)
+	{
+		PUTU32(ctr + 12, count);
+		++count;
+		
+		encrypt(key, ctr, stream);
+		size_t len = std::min(size, size_t(AES_BLOCK_SIZE));
+		for(size_t n=0; n<len; ++n)
+			out[n] = in[n] ^ stream[n];
+		
+		in+= len;
+		out+= len;
+		size-= len;
+	}
+	
+	PUTU32(block + 12, count);
+}
+
+/*
+ * Update the GHASH value y with data
+ * The last partial block is padded with zeros
+ */
+void AesCipher::ghash(const AesCipher::HashKey &key, uint8_t *y, const char *data, size_t size)
+{
+	Assert(y);
+	Assert(data || !size);
+	
+#ifdef AES_NI
+	if(HardwareEnabled && ClmulAvailable)
+	{
+		ClmulGhash(key.h, y, data, size);
+		return;
+	}
+#endif
+	
+	while(size)
+	{
+		size_t len = std::min(size, size_t(AES_BLOCK_SIZE));
+		for(size_t n=0; n<len; ++n)
+			y[n]^= uint8_t(data[n]);
+		
+		// Multiply y by H with 4-bit tables
+		uint8_t lo = y[15] & 0xf;
+		uint64_t zh = key.hh[lo];
+		uint64_t zl = key.hl[lo];
+		
+		for(int i=15; i>=0; --i)
+		{
+			lo = y[i] & 0xf;
+			uint8_t hi = (y[i] >> 4) & 0xf;
+			
+			if(i != 15)
+			{
+				uint8_t rem = uint8_t(zl & 0xf);
+				zl = (zh << 60) | (zl >> 4);
+				zh = (zh >> 4) ^ (last4[rem] << 48);
+				zh^= key.hh[lo];
+				zl^= key.hl[lo];
+			}
+			
+			uint8_t rem = uint8_t(zl & 0xf);
+			zl = (zh << 60) | (zl >> 4);
+			zh = (zh >> 4) ^ (last4[rem] << 48);
+			zh^= key.hh[hi];
+			zl^= key.hl[hi];
+		}
+		
+		for(int i=0; i<8; ++i)
+		{
+			y[i]     = uint8_t(zh >> (56 - 8*i));
+			y[8 + i] = uint8_t(zl >> (56 - 8*i));
+		}
+		
+		data+= len;
+		size-= len;
+	}
+}
+
+void AesCipher::computeTag(const AesCipher::Key &key, const AesCipher::HashKey &hash, const char *j0,
+			const char *aad, size_t aadSize, const char *data, size_t size, char *tag)
+{
+	uint8_t y[AES_BLOCK_SIZE];
+	std::memset(y, 0, AES_BLOCK_SIZE);
+	ghash(hash, y, aad, aadSize);
+	ghash(hash, y, data, size);
+	
+	char lengths[AES_BLOCK_SIZE];
+	uint64_t aadBits = uint64_t(aadSize)*8;
+	uint64_t dataBits = uint64_t(size)*8;
+	PUTU32(lengths,      uint32_t(aadBits >> 32));
+	PUTU32(lengths + 4,  uint32_t(aadBits));
+	PUTU32(lengths + 8,  uint32_t(dataBits >> 32));
+	PUTU32(lengths + 12, uint32_t(dataBits));
+	ghash(hash, y, lengths, AES_BLOCK_SIZE);
+	
+	// T = E(K, J0) xor GHASH
+	encrypt(key, j0, tag);
+	for(size_t n=0; n<GcmTagSize; ++n)
+		tag[n]^= char(y[n]);
+}
+
+void AesCipher::encryptRecord(const char *aad, size_t aadSize, const char *in, char *out, size_t size, char *tag)
+{
+	Assert(in || !size);
+	Assert(out || !size);
+	Assert(tag);
+	
+	char j0[AES_BLOCK_SIZE];
+	GcmPreCounter(mEncryptionInit, mEncryptionSeq, j0);
+	++mEncryptionSeq;
+	
+	char block[AES_BLOCK_SIZE];
+	std::memcpy(block, j0, AES_BLOCK_SIZE);
+	PUTU32(block + 12, uint32_t(2));
+	counter(mEncryptionKey, block, in, out, size);
+	computeTag(mEncryptionKey, mEncryptionHashKey, j0, aad, aadSize, out, size, tag);
+}
+
+bool AesCipher::decryptRecord(const char *aad, size_t aadSize, const char *in, char *out, size_t size, const char *tag)
+{
+	Assert(in || !size);
+	Assert(out || !size);
+	Assert(tag);
+	
+	char j0[AES_BLOCK_SIZE];
+	GcmPreCounter(mDecryptionInit, mDecryptionSeq, j0);
+	
+	// Authenticate before deciphering
+	char check[GcmTagSize];
+	computeTag(mCounterKey, mDecryptionHashKey, j0, aad, aadSize, in, size, check);
+	
+	uint8_t diff = 0;
+	for(size_t n=0; n<GcmTagSize; ++n)
+		diff|= uint8_t(check[n] ^ tag[n]);
+	if(diff) return false;
+	
+	++mDecryptionSeq;
+	
+	char block[AES_BLOCK_SIZE];
+	std::memcpy(block, j0, AES_BLOCK_SIZE);
+	PUTU32(block + 12, uint32_t(2));
+	counter(mCounterKey, block, in, out, size);
+	return true;
+}
+
 size_t AesCipher::readData(char *buffer, size_t size)
 {
 	Assert(buffer);
@@ -490,88 +1078,183 @@ size_t AesCipher::readData(char *buffer, size_t size)
 
 	while(size)
 	{
-		if(!mTempBlockOutSize)
+		if(mPlainOffset == mPlainSize)
 		{
-			mTempBlockOutSize = readBlock(mTempBlockOut);
-			if(!mTempBlockOutSize) break;
+			// Do not block waiting for more data once something was read
+			if(total) break;
+			if(mMode == GCM) { if(!readRecord()) break; }
+			else if(!readBlocks()) break;
 		}
 		
-		size_t count = std::min(mTempBlockOutSize, size);
-		std::memcpy(buffer, mTempBlockOut, count);
+		size_t count = std::min(mPlainSize - mPlainOffset, size);
+		std::memcpy(buffer, mPlainBuffer + mPlainOffset, count);
 		
-		mTempBlockOutSize-= count;
+		mPlainOffset+= count;
 		buffer+= count;
 		size-= count;
 		total+= count;
-		
-		if(mTempBlockOutSize)
-			std::memmove(mTempBlockOut, mTempBlockOut+count, mTempBlockOutSize);
 	}
 	
 	return total;
 }
 
-size_t AesCipher::readBlock(char *out)
+bool AesCipher::readBlocks(void)
 {
+	if(!mReadBuffer)
+	{
+		mReadBuffer  = new char[WriteBufferBlocks*AES_BLOCK_SIZE];
+		mPlainBuffer = new char[BufferBlocks*AES_BLOCK_SIZE];
+	}
+	
+	// Without read-ahead, exactly one block is read at a time, so nothing
+	// is taken from the underlying stream past the current block
+	const size_t capacity = (mReadAhead ? BufferBlocks*AES_BLOCK_SIZE : AES_BLOCK_SIZE);
+	
 	while(true)
 	{
-		while(mTempBlockInSize != AES_BLOCK_SIZE)
+		while(mReadBufferSize < AES_BLOCK_SIZE)
 		{
-			size_t count = mByteStream->readData(mTempBlockIn+mTempBlockInSize, AES_BLOCK_SIZE-mTempBlockInSize);
-			if(!count) return 0;
-			mTempBlockInSize+= count;
+			size_t count = mByteStream->readData(mReadBuffer+mReadBufferSize, capacity-mReadBufferSize);
+			if(!count) return false;
+			mReadBufferSize+= count;
 		}
-
-		if(mDumpStream) mDumpStream->writeData(mTempBlockIn, AES_BLOCK_SIZE);
+		
+		size_t blocks = mReadBufferSize/AES_BLOCK_SIZE;
+		size_t length = blocks*AES_BLOCK_SIZE;
+		if(mDumpStream) mDumpStream->writeData(mReadBuffer, length);
 		
 		// CBC block cipher
-		decrypt(mTempBlockIn, out);
-
-		for(size_t n=0; n < AES_BLOCK_SIZE; ++n)
-			out[n] ^= mDecryptionInit[n];
-				
-		std::memcpy(mDecryptionInit, mTempBlockIn, AES_BLOCK_SIZE);
-		mTempBlockInSize = 0;
+		decryptBlocks(mReadBuffer, mPlainBuffer, blocks);
 		
-		// Remove PKCS7 padding
-		size_t padding = uint8_t(out[AES_BLOCK_SIZE - 1]);
-		if(padding > AES_BLOCK_SIZE) 
-			throw IOException("AES: Corrupted data");
+		mReadBufferSize-= length;
+		if(mReadBufferSize) std::memmove(mReadBuffer, mReadBuffer+length, mReadBufferSize);
 		
-		size_t size = AES_BLOCK_SIZE - padding;
-		for(int i=1; i<padding; ++i)
-			if(uint8_t(out[size + i - 1]) != padding)
+		// Remove PKCS7 padding of each block, data is compacted in place
+		mPlainOffset = 0;
+		mPlainSize = 0;
+		for(size_t b=0; b<blocks; ++b)
+		{
+			const char *block = mPlainBuffer + b*AES_BLOCK_SIZE;
+			size_t padding = uint8_t(block[AES_BLOCK_SIZE - 1]);
+			if(padding > AES_BLOCK_SIZE) 
 				throw IOException("AES: Corrupted data");
+			
+			size_t size = AES_BLOCK_SIZE - padding;
+			for(int i=1; i<padding; ++i)
+				if(uint8_t(block[size + i - 1]) != padding)
+					throw IOException("AES: Corrupted data");
+			
+			if(size && mPlainBuffer + mPlainSize != block)
+				std::memmove(mPlainBuffer + mPlainSize, block, size);
+			mPlainSize+= size;
+		}
 		
-		if(size) return size;
+		if(mPlainSize) return true;
 	}
 }
 
-void AesCipher::writeData(const char *data, size_t size)
+/*
+ * Read and authenticate a whole GCM record
+ * A record is the 32-bit plaintext length, the ciphertext, and the tag
+ * The length is authenticated as additional data
+ */
+bool AesCipher::readRecord(void)
 {
-	Assert(data);
+	if(!mReadBuffer)
+	{
+		mReadBuffer  = new char[WriteBufferBlocks*AES_BLOCK_SIZE];
+		mPlainBuffer = new char[BufferBlocks*AES_BLOCK_SIZE];
+	}
+	
+	const size_t capacity = WriteBufferBlocks*AES_BLOCK_SIZE;
+	
+	while(true)
+	{
+		// Partial records are kept across calls
+		size_t length = 0;
+		size_t needed = 4;
+		while(true)
+		{
+			if(mReadBufferSize >= 4)
+			{
+				length = GETU32(mReadBuffer);
+				if(length > GcmMaxRecordSize)
+					throw IOException("AES: Invalid record length");
+				needed = 4 + length + GcmTagSize;
+				if(mReadBufferSize >= needed) break;
+			}
+			
+			// Without read-ahead, nothing is taken from the underlying stream past the current record
+			size_t count = mByteStream->readData(mReadBuffer+mReadBufferSize, (mReadAhead ? capacity : needed) - mReadBufferSize);
+			if(!count) return false;
+			mReadBufferSize+= count;
+		}
+		
+		if(mDumpStream) mDumpStream->writeData(mReadBuffer, needed);
+		
+		const char *ciphertext = mReadBuffer + 4;
+		if(!decryptRecord(mReadBuffer, 4, ciphertext, mPlainBuffer, length, ciphertext + length))
+			throw IOException("AES: Authentication failed");
+		
+		mReadBufferSize-= needed;
+		if(mReadBufferSize) std::memmove(mReadBuffer, mReadBuffer+needed, mReadBufferSize);
+		
+		mPlainOffset = 0;
+		mPlainSize = length;
+		if(mPlainSize) return true;
+	}
+}
 
+void AesCipher::writeRecords(const char *data, size_t size)
+{
 	while(size)
 	{
-		char tmp[AES_BLOCK_SIZE];
-		size_t len = std::min(size, size_t(AES_BLOCK_SIZE - 1)); 
-		std::memcpy(tmp, data, len);
+		size_t length = std::min(size, GcmMaxRecordSize);
+		PUTU32(mWriteBuffer, uint32_t(length));
 		
-		// Add PKCS7 padding
-		size_t padding = AES_BLOCK_SIZE - len;
-		for(size_t n=len; n<AES_BLOCK_SIZE; ++n)
-			tmp[n] = uint8_t(padding);
+		char *ciphertext = mWriteBuffer + 4;
+		encryptRecord(mWriteBuffer, 4, data, ciphertext, length, ciphertext + length);
+		mByteStream->writeData(mWriteBuffer, 4 + length + GcmTagSize);
 		
-		// CBC block cipher
-		for(size_t n=0; n<AES_BLOCK_SIZE; ++n)
-			tmp[n] = tmp[n] ^ mEncryptionInit[n];
-		
-		encrypt(tmp, tmp);
-		std::memcpy(mEncryptionInit, tmp, AES_BLOCK_SIZE);
-		mByteStream->writeData(tmp, AES_BLOCK_SIZE);
+		data+= length;
+		size-= length;
+	}
+}
 
-		data+= len;
-		size-= len;
+void AesCipher::writeData(const char *data, size_t size)
+{
+	Assert(data);
+	
+	if(!mWriteBuffer) mWriteBuffer = new char[WriteBufferBlocks*AES_BLOCK_SIZE];
+	
+	if(mMode == GCM)
+	{
+		writeRecords(data, size);
+		return;
+	}
+	
+	while(size)
+	{
+		// Each block carries up to 15 bytes followed by PKCS7 padding
+		size_t blocks = 0;
+		while(size && blocks < WriteBufferBlocks)
+		{
+			char *block = mWriteBuffer + blocks*AES_BLOCK_SIZE;
+			size_t len = std::min(size, size_t(AES_BLOCK_SIZE - 1)); 
+			std::memcpy(block, data, len);
+			
+			// Add PKCS7 padding
+			size_t padding = AES_BLOCK_SIZE - len;
+			std::memset(block + len, int(padding), padding);
+			
+			data+= len;
+			size-= len;
+			++blocks;
+		}
+		
+		// CBC block cipher
+		encryptBlocks(mWriteBuffer, blocks);
+		mByteStream->writeData(mWriteBuffer, blocks*AES_BLOCK_SIZE);
 	}
 }
 
@@ -1265,4 +1948,10 @@ const uint32_t AesCipher::rcon[] = {
 	0x1B000000, 0x36000000, /* for 128-bit blocks, Rijndael never uses more than 10 rcon values */
 };
 
+// GHASH reduction of a 4-bit shift
+const uint64_t AesCipher::last4[16] = {
+	0x0000, 0x1c20, 0x3840, 0x2460, 0x7080, 0x6ca0, 0x48c0, 0x54e0,
+	0xe100, 0xfd20, 0xd940, 0xc560, 0x9180, 0x8da0, 0xa9c0, 0xb5e0
+};
+
 }
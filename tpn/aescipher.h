@@ -34,10 +34,20 @@ namespace tpn
 #define AES_MAX_KEY_SIZE 32
 #define AES_MAXNR 14
 
-// Implements AES-CBC with PKCS7 padding
+// Implements AES-CBC with PKCS7 padding, or AES-GCM with length-prefixed records
+// AES-NI and PCLMULQDQ instructions are used when the CPU supports them
 class AesCipher : public Stream, public ByteString
 {
 public:
+	static bool IsHardwareAvailable(void);
+	static void SetHardwareEnabled(bool enabled);	// enabled by default if available
+	
+	// In GCM mode, the 12 first bytes of the init vectors are the nonce base,
+	// xored with a record counter in each direction
+	enum Mode { CBC, GCM };
+	static const size_t GcmMaxRecordSize = 65536;
+	static const size_t GcmTagSize = 16;
+	
   	AesCipher(ByteStream *bs);	// bs will not be deleted
 	~AesCipher(void);
 	
@@ -51,38 +61,76 @@ public:
 	void setDecryptionInit(const ByteString &iv);
 	void setDecryptionInit(const char *iv, size_t size);
 	
+	void setMode(Mode mode);		// CBC by default
 	void dumpStream(ByteStream *bs);
+	void setReadAhead(bool enabled);	// read all available blocks at once, enabled by default
 	
 	size_t readData(char *buffer, size_t size);
 	void writeData(const char *data, size_t size);
+	
+	// Raw CBC on whole blocks without padding, chained with the current init vectors
+	void encryptBlocks(char *data, size_t blocks);
+	void decryptBlocks(const char *in, char *out, size_t blocks);	// in and out can be the same
+	
+	// Raw GCM with the nonce of the next record, the record counter is then incremented
+	void encryptRecord(const char *aad, size_t aadSize, const char *in, char *out, size_t size, char *tag);
+	bool decryptRecord(const char *aad, size_t aadSize, const char *in, char *out, size_t size, const char *tag);	// false if authentication failed
 
 private:
   	struct Key
 	{
 	    uint32_t rd_key[4 *(AES_MAXNR + 1)];
+	    uint8_t rd_bytes[AES_BLOCK_SIZE *(AES_MAXNR + 1)];	// byte order for AES-NI
 	    int rounds;
 	};
   
+	// GHASH subkey with 4-bit tables for the portable implementation
+	struct HashKey
+	{
+		uint8_t h[AES_BLOCK_SIZE];
+		uint64_t hl[16], hh[16];
+	};
+	
   	size_t setEncryptionKey(const char *key, size_t size, Key &out);
 	size_t setDecryptionKey(const char *key, size_t size, Key &out);
+	void storeRoundKeys(Key &key);
+	void setHashKey(const Key &key, HashKey &out);
   
-  	void encrypt(char *in, char *out);
-	void decrypt(char *in, char *out);
-  
-	size_t readBlock(char *out);
+  	void encrypt(const Key &key, const char *in, char *out);
+	void decrypt(const Key &key, const char *in, char *out);
+	
+	// GCM
+	void counter(const Key &key, char *block, const char *in, char *out, size_t size);
+	void ghash(const HashKey &key, uint8_t *y, const char *data, size_t size);
+	void computeTag(const Key &key, const HashKey &hash, const char *j0,
+			const char *aad, size_t aadSize, const char *data, size_t size, char *tag);
+	
+	bool readBlocks(void);
+	bool readRecord(void);
+	void writeRecords(const char *data, size_t size);
+	
+	static const size_t BufferBlocks = 4096;		// 64 KiB
+	static const size_t WriteBufferBlocks = 4370;	// 64 KiB of data with padding, or a GCM record
 	
 	ByteStream *mByteStream;
 	ByteStream *mDumpStream;
 	
+	Mode mMode;
 	Key mEncryptionKey;
 	Key mDecryptionKey;
+	Key mCounterKey;		// encryption schedule of the decryption key
+	HashKey mEncryptionHashKey;
+	HashKey mDecryptionHashKey;
+	uint64_t mEncryptionSeq, mDecryptionSeq;
 	char mEncryptionInit[AES_BLOCK_SIZE];
 	char mDecryptionInit[AES_BLOCK_SIZE];
 	
-	char	mTempBlockIn[AES_BLOCK_SIZE];
-	size_t	mTempBlockInSize;
-	char	mTempBlockOut[AES_BLOCK_SIZE];
-	size_t	mTempBlockOutSize;
+	char	*mReadBuffer;	// ciphertext
+	size_t	mReadBufferSize;
+	char	*mPlainBuffer;	// deciphered data without padding
+	size_t	mPlainOffset, mPlainSize;
+	char	*mWriteBuffer;
+	bool	mReadAhead;
 	
 	static const uint32_t Te0[];
 	static const uint32_t Te1[];
@@ -95,6 +143,9 @@ private:
 	static const uint32_t Td3[];
 	static const uint32_t Td4[];
 	static const uint32_t rcon[];
+	static const uint64_t last4[];
+	
+	static bool HardwareEnabled;
 };
 
 }
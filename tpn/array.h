@@ -89,7 +89,9 @@ const T *Array<T>::data(void) const
 template<typename T>
 void Array<T>::append(const T &value, int n)
 {
-	this->reserve(this->size()+n);
+	// Exact reservation would reallocate on each call
+	if(this->capacity() < this->size()+n)
+		this->reserve(std::max(this->size()+n, 2*this->capacity()));
 	for(int i=0; i<n; ++i)
 		this->push_back(value);
 }
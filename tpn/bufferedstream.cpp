@@ -0,0 +1,143 @@
+/*************************************************************************
+ *   Copyright (C) 2011-2013 by Paul-Louis Ageneau                       *
+ *   paul-louis (at) ageneau (dot) org                                   *
+ *                                                                       *
+ *   This file is part of TeapotNet.                                     *
+ *                                                                       *
+ *   TeapotNet is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU Affero General Public License as      *
+ *   published by the Free Software Foundation, either version 3 of      *
+ *   the License, or (at your option) any later version.                 *
+ *                                                                       *
+ *   TeapotNet is distributed in the hope that it will be useful, but    *
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the        *
+ *   GNU Affero General Public License for more details.                 *
+ *                                                                       *
+ *   You should have received a copy of the GNU Affero General Public    *
+ *   License along with TeapotNet.                                       *
+ *   If not, see <http://www.gnu.org/licenses/>.                         *
+ *************************************************************************/
+
+
+#include "tpn/bufferedstream.h"
+#include "tpn/exception.h"
+#include "tpn/string.h"
+
+namespace tpn
+{
+
+BufferedStream::BufferedStream(Stream *stream, size_t size, bool owner) :
+	mStream(stream),
+	mBuffer(new char[size]),
+	mBufferSize(size),
+	mReadPos(0),
+	mLeft(0),
+	mOwner(owner)
+{
+	Assert(mStream);
+	Assert(mBufferSize);
+}
+
+BufferedStream::~BufferedStream(void)
+{
+	delete[] mBuffer;
+	if(mOwner) delete mStream;
+}
+
+Stream *BufferedStream::stream(void) const
+{
+	return mStream;
+}
+
+size_t BufferedStream::pending(void) const
+{
+	return mLeft;
+}
+
+size_t BufferedStream::readData(char *buffer, size_t size)
+{
+	if(!mLeft)
+	{
+		// Large reads bypass the buffer
+		if(size >= mBufferSize) return mStream->readData(buffer, size);
+		if(!fill()) return 0;
+	}
+	
+	size = std::min(size, mLeft);
+	std::memcpy(buffer, mBuffer + mReadPos, size);
+	mReadPos+= size;
+	mLeft-= size;
+	return size;
+}
+
+void BufferedStream::writeData(const char *data, size_t size)
+{
+	mStream->writeData(data, size);
+}
+
+bool BufferedStream::readLine(String &str)
+{
+	const size_t maxCount = 10240;	// 10 Ko for security reasons
+	
+	str.clear();
+	bool found = false;
+	while(true)
+	{
+		if(!mLeft && !fill())
+		{
+			mEnd = true;
+			return found;
+		}
+		
+		mEnd = false;
+		const char *begin = mBuffer + mReadPos;
+		const char *end = reinterpret_cast<const char*>(std::memchr(begin, '\n', mLeft));
+		size_t len = (end ? size_t(end - begin) : mLeft);
+		bool truncated = false;
+		if(len > maxCount - str.size())
+		{
+			len = maxCount - str.size();
+			truncated = true;
+			end = NULL;
+		}
+		
+		// Append the chunk while removing ignored characters
+		const char *p = begin;
+		const char *last = begin + len;
+		while(p != last)
+		{
+			const char *q = reinterpret_cast<const char*>(std::memchr(p, '\r', last - p));
+			if(!q) q = last;
+			str.append(p, q - p);
+			if(q != last) ++q;
+			p = q;
+		}
+		
+		if(len) mLast = begin[len-1];
+		if(len) found = true;	// a line of ignored characters is still a line
+		
+		mReadPos+= len;
+		mLeft-= len;
+		
+		if(end)
+		{
+			// Consume the delimiter
+			++mReadPos;
+			--mLeft;
+			mLast = '\n';
+			return true;
+		}
+		
+		if(truncated) return true;
+	}
+}
+
+bool BufferedStream::fill(void)
+{
+	mReadPos = 0;
+	mLeft = mStream->readData(mBuffer, mBufferSize);
+	return (mLeft != 0);
+}
+
+}
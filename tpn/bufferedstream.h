@@ -0,0 +1,65 @@
+/*************************************************************************
+ *   Copyright (C) 2011-2013 by Paul-Louis Ageneau                       *
+ *   paul-louis (at) ageneau (dot) org                                   *
+ *                                                                       *
+ *   This file is part of TeapotNet.                                     *
+ *                                                                       *
+ *   TeapotNet is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU Affero General Public License as      *
+ *   published by the Free Software Foundation, either version 3 of      *
+ *   the License, or (at your option) any later version.                 *
+ *                                                                       *
+ *   TeapotNet is distributed in the hope that it will be useful, but    *
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the        *
+ *   GNU Affero General Public License for more details.                 *
+ *                                                                       *
+ *   You should have received a copy of the GNU Affero General Public    *
+ *   License along with TeapotNet.                                       *
+ *   If not, see <http://www.gnu.org/licenses/>.                         *
+ *************************************************************************/
+
+
+#ifndef TPN_BUFFEREDSTREAM_H
+#define TPN_BUFFEREDSTREAM_H
+
+#include "tpn/include.h"
+#include "tpn/stream.h"
+
+namespace tpn
+{
+
+// Read buffer on top of a Stream, lines are framed with memchr on whole chunks
+// Writes are passed through to the underlying stream
+class BufferedStream : public Stream
+{
+public:
+	using Stream::readData;
+	using Stream::writeData;
+	using Stream::readLine;
+	
+	BufferedStream(Stream *stream, size_t size = BufferSize, bool owner = true);	// stream destroyed at deletion if owner
+	virtual ~BufferedStream(void);
+	
+	Stream *stream(void) const;
+	size_t pending(void) const;	// bytes available without reading the stream
+	
+	// Stream
+	size_t readData(char *buffer, size_t size);
+	void writeData(const char *data, size_t size);
+	bool readLine(String &str);
+	
+private:
+	bool fill(void);
+	
+	Stream *mStream;
+	char *mBuffer;
+	size_t mBufferSize;
+	size_t mReadPos;
+	size_t mLeft;
+	bool mOwner;
+};
+
+}
+
+#endif
@@ -0,0 +1,90 @@
+/*************************************************************************
+ *   Copyright (C) 2011-2013 by Paul-Louis Ageneau                       *
+ *   paul-louis (at) ageneau (dot) org                                   *
+ *                                                                       *
+ *   This file is part of TeapotNet.                                     *
+ *                                                                       *
+ *   TeapotNet is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU Affero General Public License as      *
+ *   published by the Free Software Foundation, either version 3 of      *
+ *   the License, or (at your option) any later version.                 *
+ *                                                                       *
+ *   TeapotNet is distributed in the hope that it will be useful, but    *
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the        *
+ *   GNU Affero General Public License for more details.                 *
+ *                                                                       *
+ *   You should have received a copy of the GNU Affero General Public    *
+ *   License along with TeapotNet.                                       *
+ *   If not, see <http://www.gnu.org/licenses/>.                         *
+ *************************************************************************/
+
+#include "tpn/bufferedwriter.h"
+#include "tpn/exception.h"
+#include "tpn/string.h"
+
+namespace tpn
+{
+
+BufferedWriter::BufferedWriter(Stream *stream) :
+	mStream(stream),
+	mSize(0)
+{
+	Assert(mStream);
+}
+
+BufferedWriter::~BufferedWriter(void)
+{
+	try {
+		flush();
+	}
+	catch(const Exception &e)
+	{
+		LogWarn("BufferedWriter", String("Unable to flush pending data: ") + e.what());
+	}
+}
+
+Stream *BufferedWriter::stream(void) const
+{
+	return mStream;
+}
+
+size_t BufferedWriter::pending(void) const
+{
+	return mSize;
+}
+
+void BufferedWriter::flush(void)
+{
+	if(!mSize) return;
+	
+	// Reset first so a failing stream does not get the same data twice
+	size_t size = mSize;
+	mSize = 0;
+	mStream->writeData(mBuffer, size);
+}
+
+size_t BufferedWriter::readData(char *buffer, size_t size)
+{
+	return mStream->readData(buffer, size);
+}
+
+void BufferedWriter::writeData(const char *data, size_t size)
+{
+	if(mSize + size > BufferSize)
+	{
+		flush();
+		
+		// Large writes bypass the buffer
+		if(size >= BufferSize)
+		{
+			mStream->writeData(data, size);
+			return;
+		}
+	}
+	
+	std::memcpy(mBuffer + mSize, data, size);
+	mSize+= size;
+}
+
+}
@@ -0,0 +1,59 @@
+/*************************************************************************
+ *   Copyright (C) 2011-2013 by Paul-Louis Ageneau                       *
+ *   paul-louis (at) ageneau (dot) org                                   *
+ *                                                                       *
+ *   This file is part of TeapotNet.                                     *
+ *                                                                       *
+ *   TeapotNet is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU Affero General Public License as      *
+ *   published by the Free Software Foundation, either version 3 of      *
+ *   the License, or (at your option) any later version.                 *
+ *                                                                       *
+ *   TeapotNet is distributed in the hope that it will be useful, but    *
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the        *
+ *   GNU Affero General Public License for more details.                 *
+ *                                                                       *
+ *   You should have received a copy of the GNU Affero General Public    *
+ *   License along with TeapotNet.                                       *
+ *   If not, see <http://www.gnu.org/licenses/>.                         *
+ *************************************************************************/
+
+#ifndef TPN_BUFFEREDWRITER_H
+#define TPN_BUFFEREDWRITER_H
+
+#include "tpn/include.h"
+#include "tpn/stream.h"
+
+namespace tpn
+{
+
+// Write buffer on top of a Stream, data is passed to the underlying stream in chunks
+// Reads are passed through to the underlying stream
+class BufferedWriter : public Stream
+{
+public:
+	using Stream::readData;
+	using Stream::writeData;
+	
+	BufferedWriter(Stream *stream);	// stream WON'T be destroyed
+	virtual ~BufferedWriter(void);	// pending data is flushed
+	
+	Stream *stream(void) const;
+	size_t pending(void) const;	// bytes not yet written to the stream
+	void flush(void);
+	
+	// Stream
+	size_t readData(char *buffer, size_t size);
+	void writeData(const char *data, size_t size);
+	
+private:
+	Stream *mStream;
+	char mBuffer[BufferSize];
+	size_t mSize;
+};
+
+}
+
+#endif
+
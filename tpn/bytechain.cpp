@@ -0,0 +1,150 @@
+/*************************************************************************
+ *   Copyright (C) 2011-2013 by Paul-Louis Ageneau                       *
+ *   paul-louis (at) ageneau (dot) org                                   *
+ *                                                                       *
+ *   This file is part of TeapotNet.                                     *
+ *                                                                       *
+ *   TeapotNet is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU Affero General Public License as      *
+ *   published by the Free Software Foundation, either version 3 of      *
+ *   the License, or (at your option) any later version.                 *
+ *                                                                       *
+ *   TeapotNet is distributed in the hope that it will be useful, but    *
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the        *
+ *   GNU Affero General Public License for more details.                 *
+ *                                                                       *
+ *   You should have received a copy of the GNU Affero General Public    *
+ *   License along with TeapotNet.                                       *
+ *   If not, see <http://www.gnu.org/licenses/>.                         *
+ *************************************************************************/
+
+
+#include "tpn/bytechain.h"
+
+namespace tpn
+{
+
+ByteChain::ByteChain(void) :
+	mSize(0)
+{
+
+}
+
+ByteChain::~ByteChain(void)
+{
+
+}
+
+void ByteChain::append(ByteString &segment)
+{
+	if(segment.empty()) return;
+	
+	pushSegment();
+	mSegments.back().swap(segment);
+	mSize+= mSegments.back().size();
+	segment.clear();
+}
+
+void ByteChain::append(ByteChain &chain)
+{
+	if(&chain == this || chain.empty()) return;
+	
+	mSize+= chain.mSize;
+	mSegments.splice(mSegments.end(), chain.mSegments);
+	chain.mSize = 0;
+	
+	// Spare segments go back to the producer, which will fill them again
+	chain.mSpare.splice(chain.mSpare.end(), mSpare);
+	while(chain.mSpare.size() > MaxSpareSegments)
+		chain.mSpare.pop_back();
+}
+
+bool ByteChain::pop(ByteString &segment)
+{
+	if(mSegments.empty()) return false;
+	
+	segment.swap(mSegments.front());
+	mSize-= segment.size();
+	popSegment();
+	return true;
+}
+
+size_t ByteChain::readData(char *buffer, size_t size)
+{
+	size_t total = 0;
+	while(size && !mSegments.empty())
+	{
+		ByteStream &front = mSegments.front();
+		size_t len = front.readData(buffer, size);
+		if(mSegments.front().empty()) popSegment();
+		
+		buffer+= len;
+		size-= len;
+		total+= len;
+	}
+	
+	mSize-= total;
+	return total;
+}
+
+void ByteChain::writeData(const char *data, size_t size)
+{
+	mSize+= size;
+	while(size)
+	{
+		if(mSegments.empty() || mSegments.back().size() >= SegmentSize)
+			pushSegment();
+		
+		ByteString &back = mSegments.back();
+		size_t len = std::min(size, std::max(back.capacity(), SegmentSize) - back.size());
+		back.append(data, len);
+		data+= len;
+		size-= len;
+	}
+}
+
+void ByteChain::clear(void)
+{
+	while(!mSegments.empty())
+	{
+		mSegments.front().clear();
+		popSegment();
+	}
+	
+	mSize = 0;
+}
+
+bool ByteChain::ignore(size_t size)
+{
+	size = std::min(size, mSize);
+	mSize-= size;
+	while(size)
+	{
+		ByteString &front = mSegments.front();
+		size_t len = std::min(size, front.size());
+		front.ignore(len);
+		if(front.empty()) popSegment();
+		size-= len;
+	}
+	
+	return true;
+}
+
+void ByteChain::pushSegment(void)
+{
+	if(!mSpare.empty()) mSegments.splice(mSegments.end(), mSpare, mSpare.begin());
+	else {
+		mSegments.push_back(ByteString());
+		mSegments.back().reserve(SegmentSize);
+	}
+}
+
+void ByteChain::popSegment(void)
+{
+	mSegments.front().clear();
+	if(mSpare.size() < MaxSpareSegments) mSpare.splice(mSpare.end(), mSegments, mSegments.begin());
+	else mSegments.pop_front();
+}
+
+}
@@ -0,0 +1,71 @@
+/*************************************************************************
+ *   Copyright (C) 2011-2013 by Paul-Louis Ageneau                       *
+ *   paul-louis (at) ageneau (dot) org                                   *
+ *                                                                       *
+ *   This file is part of TeapotNet.                                     *
+ *                                                                       *
+ *   TeapotNet is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU Affero General Public License as      *
+ *   published by the Free Software Foundation, either version 3 of      *
+ *   the License, or (at your option) any later version.                 *
+ *                                                                       *
+ *   TeapotNet is distributed in the hope that it will be useful, but    *
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the        *
+ *   GNU Affero General Public License for more details.                 *
+ *                                                                       *
+ *   You should have received a copy of the GNU Affero General Public    *
+ *   License along with TeapotNet.                                       *
+ *   If not, see <http://www.gnu.org/licenses/>.                         *
+ *************************************************************************/
+
+
+#ifndef TPN_BYTECHAIN_H
+#define TPN_BYTECHAIN_H
+
+#include "tpn/include.h"
+#include "tpn/bytestream.h"
+#include "tpn/bytestring.h"
+#include "tpn/list.h"
+
+namespace tpn
+{
+
+// Byte queue made of chained contiguous segments, for I/O staging
+// Segments are moved between chains and consumed in place without copying data,
+// and consumed segments are kept for reuse.
+class ByteChain : public ByteStream
+{
+public:
+	static const size_t SegmentSize = 16384;
+	static const size_t MaxSpareSegments = 4;
+	
+	ByteChain(void);
+	~ByteChain(void);
+	
+	size_t size(void) const { return mSize; }
+	bool empty(void) const { return mSize == 0; }
+	size_t segments(void) const { return mSegments.size(); }
+	
+	void append(ByteString &segment);	// takes the content of segment, which is left empty
+	void append(ByteChain &chain);		// moves all segments of chain, which is left empty
+	bool pop(ByteString &segment);		// replaces segment with the first segment
+	
+	// ByteStream
+	size_t readData(char *buffer, size_t size);
+	void writeData(const char *data, size_t size);
+	void clear(void);
+	bool ignore(size_t size = 1);
+	
+private:
+	void pushSegment(void);
+	void popSegment(void);
+	
+	List<ByteString> mSegments;
+	List<ByteString> mSpare;	// empty segments with allocated storage
+	size_t mSize;
+};
+
+}
+
+#endif
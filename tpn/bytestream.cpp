@@ -249,9 +249,7 @@ void ByteStream::writeBinary(ByteStream &s)
 
 void ByteStream::writeBinary(const ByteString &s)
 {
-	ByteString tmp(s);
-	ByteStream &stream = tmp;
-	writeBinary(stream);
+	if(!s.empty()) writeData(s.data(), s.size());
 }
 
 void ByteStream::writeBinary(char *data, size_t size)
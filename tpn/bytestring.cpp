@@ -22,73 +22,363 @@
 #include "tpn/bytestring.h"
 #include "tpn/exception.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BYTESTRING_SIMD
+#include <immintrin.h>
+#define SSE2_TARGET __attribute__((target("sse2")))
+#define AVX2_TARGET __attribute__((target("avx2")))
+#endif
+
 namespace tpn
 {
 
-ByteString::ByteString(void)
+ByteString::ByteString(void) :
+	mData(mInline),
+	mBegin(0),
+	mEnd(0),
+	mCapacity(InlineSize)
 {
 
 }
 
 ByteString::ByteString(const ByteString &bs) :
-	std::deque<char>(bs)
+	mData(mInline),
+	mBegin(0),
+	mEnd(0),
+	mCapacity(InlineSize)
 {
-
+	insertData(0, bs.data(), bs.size());
 }
 
 ByteString::ByteString(const ByteString &bs, size_t begin) :
-	std::deque<char>(bs.begin()+std::min(begin, bs.size()), bs.end())
+	mData(mInline),
+	mBegin(0),
+	mEnd(0),
+	mCapacity(InlineSize)
 {
-
+	begin = std::min(begin, bs.size());
+	insertData(0, bs.data() + begin, bs.size() - begin);
 }
 
 ByteString::ByteString(const ByteString &bs, size_t begin, size_t end) :
-	std::deque<char>(bs.begin()+std::min(begin, bs.size()), bs.begin()+std::min(end, bs.size()))
+	mData(mInline),
+	mBegin(0),
+	mEnd(0),
+	mCapacity(InlineSize)
 {
-
+	end = std::min(end, bs.size());
+	begin = std::min(begin, end);
+	insertData(0, bs.data() + begin, end - begin);
 }
 
 ByteString::ByteString(const char *data, size_t size) :
-	std::deque<char>(data,data+size)
+	mData(mInline),
+	mBegin(0),
+	mEnd(0),
+	mCapacity(InlineSize)
 {
+	insertData(0, data, size);
+}
 
+ByteString::ByteString(size_t n, char value) :
+	mData(mInline),
+	mBegin(0),
+	mEnd(0),
+	mCapacity(InlineSize)
+{
+	assign(n, value);
 }
 
 ByteString::ByteString(const String &str) :
-	std::deque<char>(str.data(),str.data()+str.size())
+	mData(mInline),
+	mBegin(0),
+	mEnd(0),
+	mCapacity(InlineSize)
 {
-
+	insertData(0, str.data(), str.size());
 }
 
 ByteString::~ByteString(void)
 {
+	release();
+}
+
+ByteString &ByteString::operator=(const ByteString &bs)
+{
+	if(&bs != this)
+	{
+		mBegin = mEnd = 0;
+		insertData(0, bs.data(), bs.size());
+	}
+	return *this;
+}
+
+char &ByteString::at(size_t i)
+{
+	if(i >= size()) throw OutOfBounds("ByteString index out of bounds");
+	return mData[mBegin + i];
+}
+
+const char &ByteString::at(size_t i) const
+{
+	if(i >= size()) throw OutOfBounds("ByteString index out of bounds");
+	return mData[mBegin + i];
+}
+
+void ByteString::push_back(char value)
+{
+	if(mEnd == mCapacity) insertSpace(size(), 1)[0] = value;
+	else mData[mEnd++] = value;
+}
+
+void ByteString::push_front(char value)
+{
+	if(mBegin) mData[--mBegin] = value;
+	else insertSpace(0, 1)[0] = value;
+}
+
+void ByteString::pop_back(void)
+{
+	Assert(!empty());
+	if(--mEnd == mBegin) mBegin = mEnd = 0;
+}
+
+void ByteString::pop_front(void)
+{
+	Assert(!empty());
+	if(++mBegin == mEnd) mBegin = mEnd = 0;
+}
+
+ByteString::iterator ByteString::insert(iterator pos, char value)
+{
+	char *p = insertSpace(pos - begin(), 1);
+	*p = value;
+	return p;
+}
+
+void ByteString::insert(iterator pos, size_t n, char value)
+{
+	char *p = insertSpace(pos - begin(), n);
+	std::memset(p, value, n);
+}
+
+void ByteString::insert(iterator pos, const char *first, const char *last)
+{
+	insertData(pos - begin(), first, last - first);
+}
+
+void ByteString::insert(iterator pos, char *first, char *last)
+{
+	insertData(pos - begin(), first, last - first);
+}
+
+ByteString::iterator ByteString::erase(iterator pos)
+{
+	return erase(pos, pos + 1);
+}
+
+ByteString::iterator ByteString::erase(iterator first, iterator last)
+{
+	Assert(first >= begin() && last <= end() && first <= last);
+	
+	if(first == begin())
+	{
+		// Erasing at the front only moves the read cursor
+		mBegin+= last - first;
+		if(mBegin == mEnd) mBegin = mEnd = 0;
+		return begin();
+	}
+	
+	std::memmove(first, last, end() - last);
+	mEnd-= last - first;
+	return first;
+}
+
+void ByteString::assign(size_t n, char value)
+{
+	mBegin = mEnd = 0;
+	insert(end(), n, value);
+}
+
+void ByteString::assign(const char *first, const char *last)
+{
+	if(first >= mData && first < mData + mCapacity)
+	{
+		// Source is inside the buffer
+		ByteString tmp(first, last - first);
+		swap(tmp);
+		return;
+	}
+	
+	mBegin = mEnd = 0;
+	insertData(0, first, last - first);
+}
+
+void ByteString::assign(char *first, char *last)
+{
+	assign(static_cast<const char*>(first), static_cast<const char*>(last));
+}
+
+void ByteString::resize(size_t n, char value)
+{
+	if(n <= size()) mEnd = mBegin + n;
+	else insert(end(), n - size(), value);
+}
 
+void ByteString::reserve(size_t n)
+{
+	size_t count = size();
+	if(n > count)
+	{
+		insertSpace(count, n - count);
+		mEnd = mBegin + count;
+	}
+}
+
+void ByteString::swap(ByteString &bs)
+{
+	if(&bs == this) return;
+	
+	if(!isInline() && !bs.isInline())
+	{
+		std::swap(mData, bs.mData);
+		std::swap(mBegin, bs.mBegin);
+		std::swap(mEnd, bs.mEnd);
+		std::swap(mCapacity, bs.mCapacity);
+		return;
+	}
+	
+	ByteString tmp;
+	tmp.take(*this);
+	take(bs);
+	bs.take(tmp);
 }
 
 void ByteString::clear(void)
 {
-	std::deque<char>::clear();
+	// Capacity is kept so the buffer can be reused without allocation
+	mBegin = mEnd = 0;
 }
 
 void ByteString::append(char value, int n)
 {
-	for(int i=0; i<n; ++i)
-		push_back(value);
+	if(n > 0) insert(end(), size_t(n), value);
 }
 
 void ByteString::append(const ByteString &bs)
 {
-	insert(end(), bs.begin(), bs.end());
+	insertData(size(), bs.data(), bs.size());
 }
 
 void ByteString::append(const char *array, size_t size)
 {
-	insert(end(), array, array+size);
+	insertData(this->size(), array, size);
 }
 
 void ByteString::fill(char value, int n)
 {
-	assign(n, value);
+	assign(size_t(std::max(n, 0)), value);
+}
+
+#ifdef BYTESTRING_SIMD
+
+static bool IsAvx2Available(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+// XOR 32-byte blocks into a 16-byte block, returns the number of bytes processed
+static AVX2_TARGET size_t Avx2XorBlocks(const char *data, size_t size, __m128i &acc)
+{
+	const __m256i *p = reinterpret_cast<const __m256i*>(data);
+	__m256i a0 = _mm256_setzero_si256();
+	__m256i a1 = _mm256_setzero_si256();
+	__m256i a2 = _mm256_setzero_si256();
+	__m256i a3 = _mm256_setzero_si256();
+	
+	size_t blocks = size/32;
+	size_t b = 0;
+	for(; b + 4 <= blocks; b+= 4)
+	{
+		a0 = _mm256_xor_si256(a0, _mm256_loadu_si256(p + b));
+		a1 = _mm256_xor_si256(a1, _mm256_loadu_si256(p + b + 1));
+		a2 = _mm256_xor_si256(a2, _mm256_loadu_si256(p + b + 2));
+		a3 = _mm256_xor_si256(a3, _mm256_loadu_si256(p + b + 3));
+	}
+	for(; b < blocks; ++b)
+		a0 = _mm256_xor_si256(a0, _mm256_loadu_si256(p + b));
+	
+	a0 = _mm256_xor_si256(_mm256_xor_si256(a0, a1), _mm256_xor_si256(a2, a3));
+	acc = _mm_xor_si128(acc, _mm_xor_si128(_mm256_castsi256_si128(a0), _mm256_extracti128_si256(a0, 1)));
+	_mm256_zeroupper();
+	return blocks*32;
+}
+
+static SSE2_TARGET size_t Sse2XorBlocks(const char *data, size_t size, __m128i &acc)
+{
+	const __m128i *p = reinterpret_cast<const __m128i*>(data);
+	__m128i a1 = _mm_setzero_si128();
+	
+	size_t blocks = size/16;
+	size_t b = 0;
+	for(; b + 2 <= blocks; b+= 2)
+	{
+		acc = _mm_xor_si128(acc, _mm_loadu_si128(p + b));
+		a1 = _mm_xor_si128(a1, _mm_loadu_si128(p + b + 1));
+	}
+	for(; b < blocks; ++b)
+		acc = _mm_xor_si128(acc, _mm_loadu_si128(p + b));
+	
+	acc = _mm_xor_si128(acc, a1);
+	return blocks*16;
+}
+
+#endif
+
+void ByteString::xorBlocks(uint8_t *block) const
+{
+	const char *p = data();
+	size_t left = size();
+	
+#ifdef BYTESTRING_SIMD
+	static const bool avx2 = IsAvx2Available();
+	
+	__m128i acc = _mm_setzero_si128();
+	if(avx2)
+	{
+		size_t len = Avx2XorBlocks(p, left, acc);
+		p+= len;
+		left-= len;
+	}
+	
+	size_t len = Sse2XorBlocks(p, left, acc);
+	p+= len;
+	left-= len;
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(block), acc);
+#else
+	uint64_t acc[2] = {0, 0};
+	for(; left >= ChecksumBlockSize; left-= ChecksumBlockSize, p+= ChecksumBlockSize)
+	{
+		uint64_t words[2];
+		std::memcpy(words, p, ChecksumBlockSize);
+		acc[0]^= words[0];
+		acc[1]^= words[1];
+	}
+	std::memcpy(block, acc, ChecksumBlockSize);
+#endif
+	
+	// The last block is padded with zeros
+	for(size_t i=0; i<left; ++i)
+		block[i]^= uint8_t(p[i]);
+}
+
+bool ByteString::ignore(size_t size)
+{
+	size = std::min(size, this->size());
+	mBegin+= size;
+	if(mBegin == mEnd) mBegin = mEnd = 0;
+	return true;
 }
 
 void ByteString::serialize(Serializer &s) const
@@ -105,15 +395,17 @@ bool ByteString::deserialize(Serializer &s)
 
 void ByteString::serialize(Stream &s) const
 {
+	static const char digits[] = "0123456789ABCDEF";
+	
 	String str;
-	for(int i=0; i<size(); ++i)
+	str.reserve(2*size());
+	for(size_t i=0; i<size(); ++i)
 	{
-		std::ostringstream oss;
-		oss.width(2);
-		oss.fill('0');
-		oss<<std::hex<<std::uppercase<<unsigned(uint8_t(at(i)));
-		s<<oss.str();
+		uint8_t value = uint8_t((*this)[i]);
+		str+= digits[value >> 4];
+		str+= digits[value & 0x0F];
 	}
+	s<<str;
 }
 
 bool ByteString::deserialize(Stream &s)
@@ -151,16 +443,92 @@ bool ByteString::isNativeSerializable(void) const
 
 size_t ByteString::readData(char *buffer, size_t size)
 {
-	if(this->empty()) return 0;
 	size = std::min(size, this->size());
-	std::copy(begin(), begin()+size, buffer);
-	erase(begin(), begin()+size);
+	if(!size) return 0;
+	std::memcpy(buffer, data(), size);
+	mBegin+= size;
+	if(mBegin == mEnd) mBegin = mEnd = 0;
 	return size;
 }
 
 void ByteString::writeData(const char *data, size_t size)
 {
-	insert(end(), data, data+size);
+	insertData(this->size(), data, size);
+}
+
+char *ByteString::insertSpace(size_t pos, size_t size)
+{
+	Assert(pos <= this->size());
+	
+	if(mEnd + size > mCapacity)
+	{
+		size_t count = this->size();
+		if(count + size <= mCapacity)
+		{
+			// Enough room once the consumed front is reclaimed
+			std::memmove(mData, mData + mBegin, count);
+		}
+		else {
+			size_t capacity = std::max(count + size, 2*mCapacity);
+			char *buffer = new char[capacity];
+			std::memcpy(buffer, mData + mBegin, count);
+			release();
+			mData = buffer;
+			mCapacity = capacity;
+		}
+		
+		mBegin = 0;
+		mEnd = count;
+	}
+	
+	char *p = mData + mBegin + pos;
+	if(pos != this->size()) std::memmove(p + size, p, this->size() - pos);
+	mEnd+= size;
+	return p;
+}
+
+void ByteString::insertData(size_t pos, const char *data, size_t size)
+{
+	if(!size) return;
+	Assert(data);
+	
+	if(data >= mData && data < mData + mCapacity)
+	{
+		// Source is inside the buffer and could be moved
+		ByteString tmp(data, size);
+		insertData(pos, tmp.mData + tmp.mBegin, size);
+		return;
+	}
+	
+	std::memcpy(insertSpace(pos, size), data, size);
+}
+
+void ByteString::release(void)
+{
+	if(!isInline()) delete[] mData;
+	mData = mInline;
+	mCapacity = InlineSize;
+	mBegin = mEnd = 0;
+}
+
+void ByteString::take(ByteString &bs)
+{
+	release();
+	if(bs.isInline())
+	{
+		std::memcpy(mInline, bs.data(), bs.size());
+		mEnd = bs.size();
+	}
+	else {
+		mData = bs.mData;
+		mBegin = bs.mBegin;
+		mEnd = bs.mEnd;
+		mCapacity = bs.mCapacity;
+		bs.mData = bs.mInline;
+		bs.mCapacity = InlineSize;
+	}
+	
+	bs.mBegin = bs.mEnd = 0;
 }
 
 #ifdef __GNUC__
@@ -188,5 +556,35 @@ bool ByteString::constantTimeEquals(const ByteString &bs) const
 #pragma GCC pop_options
 #endif
 
+bool operator == (const ByteString &a, const ByteString &b)
+{
+	return a.size() == b.size() && std::memcmp(a.data(), b.data(), a.size()) == 0;
+}
+
+bool operator != (const ByteString &a, const ByteString &b)
+{
+	return !(a == b);
+}
+
+bool operator < (const ByteString &a, const ByteString &b)
+{
+	// Bytes are compared as char, like the former std::deque<char> base
+	return std::lexicographical_compare(a.begin(), a.end(), b.begin(), b.end());
+}
+
+bool operator > (const ByteString &a, const ByteString &b)
+{
+	return b < a;
+}
+
+bool operator <= (const ByteString &a, const ByteString &b)
+{
+	return !(b < a);
 }
 
+bool operator >= (const ByteString &a, const ByteString &b)
+{
+	return !(a < b);
+}
+
+}
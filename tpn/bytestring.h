@@ -19,6 +19,7 @@
  *   If not, see <http://www.gnu.org/licenses/>.                         *
  *************************************************************************/
 
+
 #ifndef TPN_BYTESTRING_H
 #define TPN_BYTESTRING_H
 
@@ -26,25 +27,90 @@
 #include "tpn/bytestream.h"
 #include "tpn/serializable.h"
 
-#include <deque>
+#include <iterator>
 
 namespace tpn
 {
 
 class String;
-  
-class ByteString : public std::deque<char>, public ByteStream, public Serializable
+
+// Contiguous byte buffer with a read cursor
+// Small contents (digests, keys, nonces) are stored inline without allocation,
+// reading consumes from the front without moving the remaining bytes.
+class ByteString : public ByteStream, public Serializable
 {
-public:	
+public:
+	typedef char value_type;
+	typedef char &reference;
+	typedef const char &const_reference;
+	typedef char *iterator;
+	typedef const char *const_iterator;
+	typedef std::reverse_iterator<iterator> reverse_iterator;
+	typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+	typedef size_t size_type;
+	typedef ptrdiff_t difference_type;
+	
+	static const size_t InlineSize = 64;
+	
 	ByteString(void);
 	ByteString(const ByteString &bs);
 	ByteString(const ByteString &bs, size_t begin);
 	ByteString(const ByteString &bs, size_t begin, size_t end);
 	ByteString(const char *data, size_t size);
+	ByteString(size_t n, char value);
 	ByteString(const String &str);
-	template <class InputIterator> ByteString(InputIterator first, InputIterator last) : std::deque<char>(first, last) {}
+	template<class InputIterator> ByteString(InputIterator first, InputIterator last);
 	virtual ~ByteString(void);
-
+	
+	ByteString &operator=(const ByteString &bs);
+	
+	size_t size(void) const	{ return mEnd - mBegin; }
+	bool empty(void) const	{ return mEnd == mBegin; }
+	size_t capacity(void) const { return mCapacity - mBegin; }
+	
+	char *data(void)		{ return mData + mBegin; }
+	const char *data(void) const	{ return mData + mBegin; }
+	
+	iterator begin(void)			{ return mData + mBegin; }
+	iterator end(void)			{ return mData + mEnd; }
+	const_iterator begin(void) const	{ return mData + mBegin; }
+	const_iterator end(void) const		{ return mData + mEnd; }
+	reverse_iterator rbegin(void)			{ return reverse_iterator(end()); }
+	reverse_iterator rend(void)			{ return reverse_iterator(begin()); }
+	const_reverse_iterator rbegin(void) const	{ return const_reverse_iterator(end()); }
+	const_reverse_iterator rend(void) const		{ return const_reverse_iterator(begin()); }
+	
+	char &operator[](size_t i)		{ return mData[mBegin + i]; }
+	const char &operator[](size_t i) const	{ return mData[mBegin + i]; }
+	char &at(size_t i);
+	const char &at(size_t i) const;
+	char &front(void)		{ return mData[mBegin]; }
+	const char &front(void) const	{ return mData[mBegin]; }
+	char &back(void)		{ return mData[mEnd - 1]; }
+	const char &back(void) const	{ return mData[mEnd - 1]; }
+	
+	void push_back(char value);
+	void push_front(char value);
+	void pop_back(void);
+	void pop_front(void);
+	
+	iterator insert(iterator pos, char value);
+	void insert(iterator pos, size_t n, char value);
+	void insert(iterator pos, const char *first, const char *last);
+	void insert(iterator pos, char *first, char *last);
+	template<class InputIterator> void insert(iterator pos, InputIterator first, InputIterator last);
+	iterator erase(iterator pos);
+	iterator erase(iterator first, iterator last);
+	
+	void assign(size_t n, char value);
+	void assign(const char *first, const char *last);
+	void assign(char *first, char *last);
+	template<class InputIterator> void assign(InputIterator first, InputIterator last);
+	
+	void resize(size_t n, char value = 0);
+	void reserve(size_t n);
+	void swap(ByteString &bs);
+	
 	void clear(void);
 	void append(char value, int n = 1);
 	void append(const ByteString &bs);
@@ -57,6 +123,9 @@ public:
 
 	bool constantTimeEquals(const ByteString &bs) const;
 	
+	// ByteStream
+	bool ignore(size_t size = 1);
+	
 	// Serializable
 	virtual void serialize(Serializer &s) const;
 	virtual bool deserialize(Serializer &s);
@@ -69,22 +138,71 @@ protected:
 	void writeData(const char *data, size_t size);
 	
 	template<typename T> T checksum(T &result) const;
+	
+private:
+	static const size_t ChecksumBlockSize = 16;
+	void xorBlocks(uint8_t *block) const;	// XOR of the 16-byte blocks of the content padded with zeros
+	
+
+	bool isInline(void) const { return mData == mInline; }
+	char *insertSpace(size_t pos, size_t size);	// returns a pointer to the uninitialized space
+	void insertData(size_t pos, const char *data, size_t size);
+	void release(void);
+	void take(ByteString &bs);
+	
+	char *mData;
+	size_t mBegin, mEnd;	// read cursor and end of data
+	size_t mCapacity;
+	char mInline[InlineSize];
 };
 
+bool operator == (const ByteString &a, const ByteString &b);
+bool operator != (const ByteString &a, const ByteString &b);
+bool operator <  (const ByteString &a, const ByteString &b);
+bool operator >  (const ByteString &a, const ByteString &b);
+bool operator <= (const ByteString &a, const ByteString &b);
+bool operator >= (const ByteString &a, const ByteString &b);
+
+template<class InputIterator>
+ByteString::ByteString(InputIterator first, InputIterator last) :
+	mData(mInline),
+	mBegin(0),
+	mEnd(0),
+	mCapacity(InlineSize)
+{
+	assign(first, last);
+}
+
+template<class InputIterator>
+void ByteString::insert(iterator pos, InputIterator first, InputIterator last)
+{
+	size_t count = std::distance(first, last);
+	char *p = insertSpace(pos - begin(), count);
+	std::copy(first, last, p);
+}
+
+template<class InputIterator>
+void ByteString::assign(InputIterator first, InputIterator last)
+{
+	clear();
+	insert(end(), first, last);
+}
+
+// XOR of the big-endian words of the content padded with zeros
 template<typename T>
 T ByteString::checksum(T &result) const
 {
- 	ByteString copy(*this);
+	// Words are aligned on the 16-byte blocks, so XORing the blocks first gives the same result
+	uint8_t block[ChecksumBlockSize];
+	xorBlocks(block);
 	
-	while(copy.size() % sizeof(T))
-	  copy.writeBinary(uint8_t(0));
-
 	result = 0;
-	for(size_t i=0; i<size(); ++i)
+	for(size_t i=0; i<ChecksumBlockSize; i+= sizeof(T))
 	{
-	  	T value;
-		copy.readBinary(value);
-		result = result ^ value;
+		T value = 0;
+		for(size_t j=0; j<sizeof(T); ++j)
+			value = T(value << 8) | T(block[i + j]);
+		result^= value;
 	}
 	
 	return result;
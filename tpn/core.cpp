@@ -33,10 +33,18 @@ Core *Core::Instance = NULL;
 
 
 Core::Core(int port) :
-		mSock(port),
+		mSock(port, Config::Get("tpot_backlog").toInt()),
+		mReactor(NULL),
+		mRequestPool(NULL),
+		mRelay(NULL),
+		mMaxIncoming(64),
+		mIncomingClosed(false),
 		mLastRequest(0),
 		mLastPublicIncomingTime(0)
 {
+	std::memset(&mHandshakeStats, 0, sizeof(mHandshakeStats));
+	std::memset(&mAcceptStats, 0, sizeof(mAcceptStats));
+	
 	mName = Config::Get("instance_name");
 	
 	if(mName.empty())
@@ -58,11 +66,73 @@ Core::Core(int port) :
 			Config::Save(configFileName);
 		}
 	}
+	
+	if(Reactor::IsAvailable() && Config::Get("reactor_enabled").toBool())
+	{
+		unsigned ioThreads = 1;
+		unsigned workers = 4;
+		Config::Get("reactor_io_threads").extract(ioThreads);
+		Config::Get("reactor_workers").extract(workers);
+		
+		LogDebug("Core", "Using reactor (" + String::number(ioThreads) + " I/O threads, " + String::number(workers) + " workers)");
+		mReactor = new Reactor(ioThreads, workers);
+	}
+	
+	// Remote requests from all links share a bounded pool, a peering
+	// cannot hold more than its share of workers
+	unsigned requestWorkers = 4;
+	unsigned requestsPerPeering = 2;
+	Config::Get("tpot_request_workers").extract(requestWorkers);
+	Config::Get("tpot_request_per_peering").extract(requestsPerPeering);
+	mRequestPool = new FairPool(requestWorkers, requestsPerPeering);
+	
+	unsigned relayMaxSessions = 0;
+	unsigned relayMaxBufferedSessions = 0;
+	Config::Get("relay_max_sessions").extract(relayMaxSessions);
+	Config::Get("relay_max_buffered_sessions").extract(relayMaxBufferedSessions);
+	mRelay = new Relay(mReactor, relayMaxSessions, relayMaxBufferedSessions, milliseconds(Config::Get("tpot_read_timeout").toInt()));
+	
+	// At least two workers are needed so both sides of a relayed connection can meet
+	unsigned handshakeWorkers = 4;
+	Config::Get("tpot_handshake_workers").extract(handshakeWorkers);
+	Config::Get("tpot_handshake_queue").extract(mMaxIncoming);
+	handshakeWorkers = std::max(handshakeWorkers, 2U);
+	mMaxIncoming = std::max(mMaxIncoming, 1U);
+	
+	for(unsigned i=0; i<handshakeWorkers; ++i)
+	{
+		HandshakeWorker *worker = new HandshakeWorker(this);
+		mHandshakeWorkers.push_back(worker);
+		worker->start();
+	}
 }
 
 Core::~Core(void)
 {
-
+	{
+		Synchronize(&mIncomingSync);
+		mIncomingClosed = true;
+		mIncomingSync.notifyAll();
+	}
+	
+	for(int i=0; i<mHandshakeWorkers.size(); ++i)
+	{
+		mHandshakeWorkers[i]->join();
+		delete mHandshakeWorkers[i];
+	}
+	
+	{
+		Synchronize(&mIncomingSync);
+		while(!mIncoming.empty())
+		{
+			delete mIncoming.front().sock;
+			mIncoming.pop();
+		}
+	}
+	
+	delete mRelay;
+	delete mRequestPool;
+	delete mReactor;
 }
 
 String Core::getName(void) const
@@ -102,6 +172,12 @@ void Core::registerPeering(	const Identifier &peering,
 	Synchronize(this);
 	
 	mPeerings[peering] = remotePeering;
+	
+	// A ticket is only valid for the secret it was negotiated with
+	ByteString oldSecret;
+	if(mSecrets.get(peering, oldSecret) && oldSecret != secret)
+		mTickets.erase(peering);
+	
 	mSecrets[peering] = secret;
 	if(listener) mListeners[peering] = listener;
 	else mListeners.erase(peering);
@@ -113,6 +189,7 @@ void Core::unregisterPeering(const Identifier &peering)
 	
 	mPeerings.erase(peering);
 	mSecrets.erase(peering);
+	mTickets.erase(peering);
 }
 
 bool Core::hasRegisteredPeering(const Identifier &peering)
@@ -167,6 +244,22 @@ bool Core::hasPeer(const Identifier &peering)
 	return mHandlers.contains(peering);
 }
 
+bool Core::supportsFormat(const Identifier &peering, const String &format)
+{
+	Synchronize(this);
+	
+	Map<Identifier,Handler*>::iterator it = mHandlers.lower_bound(peering);
+	if(it == mHandlers.end() || it->first != peering) return false;
+	
+	while(it != mHandlers.end() && it->first == peering)
+	{
+		if(!it->second->supportsFormat(format)) return false;
+		++it;
+	}
+	
+	return true;
+}
+
 bool Core::getInstancesNames(const Identifier &peering, Array<String> &array)
 {
 	array.clear();
@@ -185,6 +278,18 @@ bool Core::getInstancesNames(const Identifier &peering, Array<String> &array)
 	return true;
 }
 
+void Core::getAcceptStats(AcceptStats &stats)
+{
+	Synchronize(&mIncomingSync);
+	stats = mAcceptStats;
+	stats.queued = mIncoming.size();
+}
+
+void Core::getRequestStats(RequestStats &stats)
+{
+	mRequestPool->getStats(stats);
+}
+
 void Core::run(void)
 {
 	LogDebug("Core", "Starting...");
@@ -192,43 +297,53 @@ void Core::run(void)
 	try {
 		while(true)
 		{
-			Thread::Sleep(0.01);
-
-			Socket *sock = new Socket;
-			mSock.accept(*sock);
+			Incoming incoming;
+			incoming.sock = new Socket;
+			mSock.accept(*incoming.sock);
+			incoming.time = Time::Now();
 			
 			try {
-				Address addr = sock->getRemoteAddress();
-                        	LogDebug("Core::run", "Incoming connection from " + addr.toString());
+				incoming.addr = incoming.sock->getRemoteAddress();
+                        	LogDebug("Core::run", "Incoming connection from " + incoming.addr.toString());
+				
+                        	if(incoming.addr.isPublic() && incoming.addr.isIpv4()) // TODO: isPublicConnectable() currently reports state for ipv4 only
+					mLastPublicIncomingTime = incoming.time;
+				
+				// The accept loop never blocks, excess connections are dropped
+				Synchronize(&mIncomingSync);
+				++mAcceptStats.accepted;
 				
-                        	if(addr.isPublic() && addr.isIpv4()) // TODO: isPublicConnectable() currently reports state for ipv4 only
-					mLastPublicIncomingTime = Time::Now();
-
-				// TODO: this is not a clean way to proceed
-				const size_t peekSize = 5;	
-				char peekData[peekSize];
-				sock->setTimeout(milliseconds(Config::Get("tpot_timeout").toInt()));
-				if(sock->peekData(peekData, peekSize) != peekSize)
+				// A single source may not occupy more than half of the workers
+				String host = incoming.addr.host();
+				unsigned count = 0;
+				mIncomingSources.get(host, count);
+				
+				if(mIncoming.size() >= mMaxIncoming || count >= std::max(unsigned(mHandshakeWorkers.size()/2), 1U))
+				{
+					++mAcceptStats.rejected;
+					LogDebug("Core::run", "Dropping incoming connection from " + incoming.addr.toString());
+					delete incoming.sock;
 					continue;
-	
-				sock->setTimeout(milliseconds(Config::Get("tpot_read_timeout").toInt()));
-
-				ByteStream *bs = sock;
-				if(std::memcmp(peekData, "GET ", 4) == 0
-					|| std::memcmp(peekData, "POST ", 5) == 0)
+				}
+				
+				// Rate is checked here as the sniff may take up to tpot_timeout
+				if(!checkHandshakeRate(incoming.addr))
 				{
-					// This is HTTP, forward connection to HttpTunnel
-					bs = HttpTunnel::Incoming(sock);
-					if(!bs) continue;
+					++mAcceptStats.limited;
+					LogDebug("Core::run", "Handshake rate exceeded for " + host);
+					delete incoming.sock;
+					continue;
 				}
 				
-				LogInfo("Core", "Incoming peer from " + addr.toString() + " (tunnel=" + (bs != sock ? "true" : "false") + ")");
-				addPeer(bs, addr, Identifier::Null, true);	// async
+				// Released once the handshake is done, see HandshakeWorker::run()
+				mIncomingSources[host] = count + 1;
+				mIncoming.push(incoming);
+				mIncomingSync.notify();
 			}
 			catch(const Exception &e)
 			{
 				LogDebug("Core::run", String("Processing failed: ") + e.what());
-				delete sock;
+				delete incoming.sock;
 			}
 		}
 	}
@@ -240,6 +355,145 @@ void Core::run(void)
 	LogDebug("Core", "Finished");
 }
 
+void Core::processIncoming(const Incoming &incoming)
+{
+	Socket *sock = incoming.sock;
+	const Address &addr = incoming.addr;
+	
+	ByteStream *bs = NULL;
+	try {
+		// TODO: this is not a clean way to proceed
+		const size_t peekSize = 5;	
+		char peekData[peekSize];
+		sock->setTimeout(milliseconds(Config::Get("tpot_timeout").toInt()));
+		if(sock->peekData(peekData, peekSize) == peekSize)
+		{
+			sock->setTimeout(milliseconds(Config::Get("tpot_read_timeout").toInt()));
+			
+			bs = sock;
+			if(std::memcmp(peekData, "GET ", 4) == 0
+				|| std::memcmp(peekData, "POST ", 5) == 0)
+			{
+				// This is HTTP, forward connection to HttpTunnel
+				bs = HttpTunnel::Incoming(sock);
+			}
+		}
+		else {
+			delete sock;
+		}
+	}
+	catch(const Exception &e)
+	{
+		LogDebug("Core::processIncoming", String("Processing failed: ") + e.what());
+		delete sock;
+		bs = NULL;
+	}
+	
+	if(!bs) return;
+	
+	LogInfo("Core", "Incoming peer from " + addr.toString() + " (tunnel=" + (bs != sock ? "true" : "false") + ")");
+	
+	// The handshake runs here, the handler thread only takes over established links
+	LogDebug("Core", "Spawning new handler");
+	Handler *handler = new Handler(this, bs, addr);
+	if(!handler->handshake()) handler->start(true);	// autodelete
+}
+
+bool Core::checkHandshakeRate(const Address &addr)
+{
+	double rate = 5.;
+	double burst = 10.;
+	Config::Get("tpot_handshake_rate").extract(rate);
+	Config::Get("tpot_handshake_burst").extract(burst);
+	if(rate <= 0.) return true;
+	
+	Synchronize(&mIncomingSync);
+	
+	Time now = Time::Now();
+	String host = addr.host();
+	
+	// Forget idle sources, their buckets would be full anyway
+	if(mHandshakeRates.size() >= 1024)
+	{
+		Map<String, RateBucket>::iterator it = mHandshakeRates.begin();
+		while(it != mHandshakeRates.end())
+		{
+			if(it->second.tokens + (now - it->second.time)*rate >= burst) mHandshakeRates.erase(it++);
+			else ++it;
+		}
+	}
+	
+	RateBucket bucket;
+	if(!mHandshakeRates.get(host, bucket))
+	{
+		bucket.tokens = burst;
+		bucket.time = now;
+	}
+	
+	bucket.tokens = std::min(bucket.tokens + (now - bucket.time)*rate, burst);
+	bucket.time = now;
+	
+	bool allowed = (bucket.tokens >= 1.);
+	if(allowed) bucket.tokens-= 1.;
+	mHandshakeRates[host] = bucket;
+	return allowed;
+}
+
+Core::HandshakeWorker::HandshakeWorker(Core *core) :
+	mCore(core)
+{
+	
+}
+
+Core::HandshakeWorker::~HandshakeWorker(void)
+{
+	
+}
+
+void Core::HandshakeWorker::run(void)
+{
+	while(true)
+	{
+		Incoming incoming;
+		{
+			Synchronize(&mCore->mIncomingSync);
+			while(mCore->mIncoming.empty() && !mCore->mIncomingClosed)
+				mCore->mIncomingSync.wait();
+			
+			if(mCore->mIncomingClosed) break;
+			
+			incoming = mCore->mIncoming.front();
+			mCore->mIncoming.pop();
+			
+			double latency = Time::Now() - incoming.time;
+			AcceptStats &stats = mCore->mAcceptStats;
+			++stats.started;
+			++stats.active;
+			stats.acceptLatency+= latency;
+			stats.maxAcceptLatency = std::max(stats.maxAcceptLatency, latency);
+		}
+		
+		try {
+			mCore->processIncoming(incoming);
+		}
+		catch(const std::exception &e)
+		{
+			LogWarn("Core::HandshakeWorker", e.what());
+		}
+		
+		{
+			Synchronize(&mCore->mIncomingSync);
+			--mCore->mAcceptStats.active;
+			
+			// The source slot covers the whole handshake
+			String host = incoming.addr.host();
+			unsigned count = 0;
+			if(mCore->mIncomingSources.get(host, count) && count > 1) mCore->mIncomingSources[host] = count - 1;
+			else mCore->mIncomingSources.erase(host);
+		}
+	}
+}
+
 bool Core::sendNotification(const Notification &notification)
 {
 	Synchronize(this);
@@ -334,6 +588,51 @@ void Core::removeRequest(unsigned id)
 	}
 }
 
+void Core::getQueueDepths(QueueDepths &depths)
+{
+	std::memset(&depths, 0, sizeof(depths));
+	
+	Synchronize(this);
+	for(Map<Identifier, Handler*>::iterator it = mHandlers.begin();
+		it != mHandlers.end();
+		++it)
+	{
+		it->second->getQueueDepths(depths);
+	}
+}
+
+void Core::getHandshakeStats(HandshakeStats &stats)
+{
+	Synchronize(this);
+	stats = mHandshakeStats;
+}
+
+bool Core::getTicket(const Identifier &peering, Ticket &ticket)
+{
+	Synchronize(this);
+	
+	if(!mTickets.get(peering, ticket)) return false;
+	if(ticket.expiry <= Time::Now())
+	{
+		mTickets.erase(peering);
+		return false;
+	}
+	
+	return true;
+}
+
+void Core::addTicket(const Identifier &peering, const Ticket &ticket)
+{
+	Synchronize(this);
+	mTickets[peering] = ticket;
+}
+
+void Core::removeTicket(const Identifier &peering)
+{
+	Synchronize(this);
+	mTickets.erase(peering);
+}
+
 bool Core::addHandler(const Identifier &peer, Core::Handler *handler)
 {
 	Assert(handler != NULL);
@@ -362,12 +661,12 @@ bool Core::removeHandler(const Identifier &peer, Core::Handler *handler)
 
 void Core::Handler::sendCommand(Stream *stream, const String &command, const String &args, const StringMap &parameters)
 {
+	// The whole command is written at once to avoid small writes through the cipher
+	String buffer;
 	String line;
 	line << command << " " << args.lineEncode();
 	LogTrace("Core::Handler", "<< " + line);
-	
-	line << Stream::NewLine;
-  	*stream << line;
+	buffer << line << Stream::NewLine;
 
 	for(	StringMap::const_iterator it = parameters.begin();
 		it != parameters.end();
@@ -376,10 +675,11 @@ void Core::Handler::sendCommand(Stream *stream, const String &command, const Str
 	  	line.clear();
 		line << it->first << ": " << it->second.lineEncode();
 		LogTrace("Core::Handler", "<< " + line);
-		line << Stream::NewLine;
-		*stream << line;
+		buffer << line << Stream::NewLine;
 	}
-	*stream << Stream::NewLine;
+	
+	buffer << Stream::NewLine;
+	stream->writeData(buffer.data(), buffer.size());
 }
 		
 bool Core::Handler::recvCommand(Stream *stream, String &command, String &args, StringMap &parameters)
@@ -409,6 +709,182 @@ bool Core::Handler::recvCommand(Stream *stream, String &command, String &args, S
 	return true;
 }
 
+String Core::Handler::chooseCipher(const String &offered, const String &accepted)
+{
+	std::list<String> offeredList, acceptedList;
+	offered.toUpper().explode(offeredList, ',');
+	accepted.toUpper().explode(acceptedList, ',');
+	
+	for(std::list<String>::iterator it = acceptedList.begin(); it != acceptedList.end(); ++it)
+		it->trim();
+	
+	for(std::list<String>::iterator it = offeredList.begin(); it != offeredList.end(); ++it)
+	{
+		String name = it->trimmed();
+		if(name != "AES256" && name != "AES256-GCM") continue;
+		if(std::find(acceptedList.begin(), acceptedList.end(), name) != acceptedList.end())
+			return name;
+	}
+	
+	return "";
+}
+
+const size_t Core::Handler::MaxFramePayload = 1024*1024;	// 1 MiB
+const size_t Core::Handler::ChannelWindow = 1024*1024;		// 1 MiB
+const size_t Core::Handler::MaxRawInput = 256*1024;		// 256 KiB
+const size_t Core::Handler::Output::MaxPending = 256*1024;	// 256 KiB
+
+void Core::Handler::sendFrame(Stream *stream, const String &command, const String &args, const StringMap &parameters)
+{
+	Assert(command.size() == 1);
+	LogTrace("Core::Handler", "<< " + command + " " + args);
+	
+	// Payload is the varint-prefixed args followed by varint-prefixed name/value pairs
+	String payload;
+	writeVarint(payload, args.size());
+	payload.append(args);
+	writeVarint(payload, parameters.size());
+	for(	StringMap::const_iterator it = parameters.begin();
+		it != parameters.end();
+		++it)
+	{
+		writeVarint(payload, it->first.size());
+		payload.append(it->first);
+		writeVarint(payload, it->second.size());
+		payload.append(it->second);
+	}
+	
+	if(payload.size() > MaxFramePayload)
+		throw Exception("Frame payload is too large");
+	
+	String frame(FrameHeaderSize, '\0');
+	writeFrameHeader(&frame[0], command[0], 0, uint32_t(payload.size()));
+	frame.append(payload);
+	stream->writeData(frame.data(), frame.size());
+}
+
+bool Core::Handler::recvFrameHeader(Stream *stream, char &opcode, uint32_t &channel, uint32_t &length)
+{
+	char header[FrameHeaderSize];
+	size_t size = 0;
+	while(size < FrameHeaderSize)
+	{
+		size_t len = stream->readData(header + size, FrameHeaderSize - size);
+		if(!len)
+		{
+			if(!size) return false;
+			throw IOException("Incomplete frame header");
+		}
+		size+= len;
+	}
+	
+	readFrameHeader(header, opcode, channel, length);
+	return true;
+}
+
+void Core::Handler::recvFramePayload(Stream *stream, uint32_t length, String &args, StringMap &parameters)
+{
+	if(length > MaxFramePayload)
+		throw IOException("Frame payload is too large");
+	
+	String payload;
+	payload.reserve(length);
+	if(stream->read(payload, length) != int64_t(length))
+		throw IOException("Incomplete frame payload");
+	
+	readFramePayload(payload.data(), payload.size(), args, parameters);
+}
+
+void Core::Handler::readFrameHeader(const char *header, char &opcode, uint32_t &channel, uint32_t &length)
+{
+	const uint8_t *p = reinterpret_cast<const uint8_t*>(header);
+	opcode  = header[0];
+	channel = (uint32_t(p[1]) << 24) | (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 8) | uint32_t(p[4]);
+	length  = (uint32_t(p[5]) << 24) | (uint32_t(p[6]) << 16) | (uint32_t(p[7]) << 8) | uint32_t(p[8]);
+}
+
+void Core::Handler::readFramePayload(const char *data, size_t size, String &args, StringMap &parameters)
+{
+	const char *end = data + size;
+	
+	uint64_t len, count;
+	if(!readVarint(data, end, len) || len > uint64_t(end - data))
+		throw IOException("Invalid frame payload");
+	args.assign(data, len);
+	data+= len;
+	
+	parameters.clear();
+	if(!readVarint(data, end, count))
+		throw IOException("Invalid frame payload");
+	
+	while(count--)
+	{
+		String name, value;
+		if(!readVarint(data, end, len) || len > uint64_t(end - data))
+			throw IOException("Invalid frame payload");
+		name.assign(data, len);
+		data+= len;
+		
+		if(!readVarint(data, end, len) || len > uint64_t(end - data))
+			throw IOException("Invalid frame payload");
+		value.assign(data, len);
+		data+= len;
+		
+		parameters.insert(name.toLower(), value);	// same as text framing
+	}
+}
+
+void Core::Handler::writeFrameHeader(char *header, char opcode, uint32_t channel, uint32_t length)
+{
+	header[0] = opcode;
+	header[1] = char(uint8_t(channel >> 24));
+	header[2] = char(uint8_t(channel >> 16));
+	header[3] = char(uint8_t(channel >> 8));
+	header[4] = char(uint8_t(channel));
+	header[5] = char(uint8_t(length >> 24));
+	header[6] = char(uint8_t(length >> 16));
+	header[7] = char(uint8_t(length >> 8));
+	header[8] = char(uint8_t(length));
+}
+
+void Core::Handler::writeVarint(String &out, uint64_t value)
+{
+	// LEB128
+	while(value >= 0x80)
+	{
+		out.push_back(char(uint8_t(value | 0x80)));
+		value >>= 7;
+	}
+	out.push_back(char(uint8_t(value)));
+}
+
+bool Core::Handler::readVarint(const char *&data, const char *end, uint64_t &value)
+{
+	value = 0;
+	int shift = 0;
+	while(data != end && shift < 64)
+	{
+		uint8_t b = uint8_t(*data++);
+		value|= uint64_t(b & 0x7F) << shift;
+		if(!(b & 0x80)) return true;
+		shift+= 7;
+	}
+	return false;
+}
+
+void Core::Handler::derivateKey(const ByteString &secret, const ByteString &salt, const ByteString &ticketKey, ByteString &key)
+{
+	// With a session ticket, a single HMAC replaces the expensive derivation
+	if(!ticketKey.empty())
+	{
+		ByteString tmp(salt);
+		Sha512::AuthenticationCode(ticketKey, tmp, key);
+	}
+	else {
+		Sha512::DerivateKey(secret, salt, key, Sha512::CryptRounds);
+	}
+}
+
 Core::Handler::Handler(Core *core, ByteStream *bs, const Address &remoteAddr) :
 	mCore(core),
 	mRawStream(bs),
@@ -416,9 +892,32 @@ Core::Handler::Handler(Core *core, ByteStream *bs, const Address &remoteAddr) :
 	mRemoteAddr(remoteAddr),
 	mSender(NULL),
 	mIsIncoming(true),
+	mBinaryFraming(false),
+	mFlowControl(false),
+	mRemoteWindow(0),
 	mLinkStatus(Disconnected),
-	mScheduler(1),
-	mStopping(false)
+	mRunningTasks(0),
+	mRequestCancel(false),
+	mStopping(false),
+	mHandshakeDone(false),
+	mHandshakeSucceeded(false),
+	mForwarding(false),
+	mLookup(NULL),
+	mForwardedStream(NULL),
+	mForwardedRawStream(NULL),
+	mReactor(NULL),
+	mSocket(NULL),
+	mInputCipher(NULL),
+	mOutputCipher(NULL),
+	mOutput(NULL),
+	mInputScheduled(false),
+	mInputPaused(false),
+	mDisconnected(false),
+	mWatchReadable(true),
+	mWatchWritable(false),
+	mInputTask(this, &Handler::processInput),
+	mTimeoutTask(this, &Handler::checkTimeout),
+	mFinishTask(this, &Handler::finish)
 {
 
 }
@@ -431,6 +930,9 @@ Core::Handler::~Handler(void)
 	}
 	
 	delete mSender;
+	delete mInputCipher;
+	delete mOutputCipher;
+	delete mOutput;
 	delete mStream;
 	delete mRawStream;
 }
@@ -494,6 +996,8 @@ void Core::Handler::addRequest(Request *request)
 		requestInfo.target = request->target();
 		requestInfo.parameters = request->mParameters;
 		requestInfo.isData = request->mIsData;
+		requestInfo.weight = request->mWeight;
+		requestInfo.cancel = false;
 		mSender->mRequestsQueue.push(requestInfo);
 	
 		mSender->notify();
@@ -511,16 +1015,60 @@ void Core::Handler::removeRequest(unsigned id)
 		//LogDebug("Core::Handler", "Removing request " + String::number(id));
 	
 		Request *request = it->second;
-		Synchronize(request);
-	
-		for(int i=0; i<request->responsesCount(); ++i)
+		Array<unsigned> channels;
+		bool pending;
+		
 		{
-			Request::Response *response = request->response(i);
-			if(response->mChannel) mResponses.erase(response->mChannel);
+			Synchronize(request);
+			
+			for(int i=0; i<request->responsesCount(); ++i)
+			{
+				Request::Response *response = request->response(i);
+				if(response->mChannel) channels.push_back(response->mChannel);
+			}
+			
+			pending = request->mPending.contains(mPeering);
+			request->removePending(mPeering);
 		}
 		
-		request->removePending(mPeering);
+		// Channels are closed without the request lock as it locks the sender
+		for(int i=0; i<channels.size(); ++i)
+			closeChannel(channels[i]);
+		
 		mRequests.erase(it);
+		
+		// The remote side may drop the request if it has not been executed yet
+		if(pending && mRequestCancel && mSender)
+		{
+			Synchronize(mSender);
+			
+			Sender::RequestInfo requestInfo;
+			requestInfo.id = id;
+			requestInfo.isData = false;
+			requestInfo.weight = Request::DefaultWeight;
+			requestInfo.cancel = true;
+			mSender->mRequestsQueue.push(requestInfo);
+			
+			mSender->notify();
+		}
+	}
+}
+
+void Core::Handler::getQueueDepths(QueueDepths &depths)
+{
+	if(!mSender) return;
+	
+	Synchronize(mSender);
+	depths.notifications+= mSender->mNotificationsQueue.size();
+	depths.requests+= mSender->mRequestsQueue.size();
+	depths.responses+= mSender->mRequestsToRespond.size();	// requests are not locked here, the core is
+	
+	for(Map<unsigned, Sender::Transfert>::iterator it = mSender->mTransferts.begin();
+		it != mSender->mTransferts.end();
+		++it)
+	{
+		++depths.transferts;
+		if(!mSender->hasCredit(it->second)) ++depths.stalled;
 	}
 }
 
@@ -544,29 +1092,69 @@ Core::LinkStatus Core::Handler::linkStatus(void) const
 	return mLinkStatus;
 }
 
-void Core::Handler::process(void)
+bool Core::Handler::supportsFormat(const String &format) const
 {
-	String command, args;
-	StringMap parameters;
-  
+	return mRemoteFormats.contains(format);
+}
+
+bool Core::Handler::handshake(void)
+{
+	Request *lookup = NULL;
+	{
+		Synchronize(this);
+		authenticate();
+		lookup = mLookup;
+	}
+	
+	if(!lookup) return false;
+	
+	// The lookup callbacks start the handler thread, see response() and finished()
+	const double meetingStepTimeout = milliseconds(std::min(Config::Get("meeting_timeout").toInt()/3, Config::Get("request_timeout").toInt()));
 	try {
+		lookup->submit(this, meetingStepTimeout);
+	}
+	catch(const std::exception &e)
+	{
+		LogWarn("Core::Handler", String("Peer lookup failed: ") + e.what());
 		Synchronize(this);
-		LogDebug("Core::Handler", "Starting...");
-	  
-		// Set up obfuscation cipher
-		ByteString tmp;
+		mForwarding = false;
+		mLookup = NULL;
+		delete lookup;
+		return false;
+	}
+	
+	return true;
+}
+
+bool Core::Handler::authenticate(void)
+{
+	String command, args;
+	StringMap parameters;
+	Ticket ticket;
+	bool resumed = false;
+	
+	mHandshakeDone = true;
+	
+	try {
+		Synchronize(this);
+		LogDebug("Core::Handler", "Starting...");
+	  
+		// Set up obfuscation cipher
+		ByteString tmp;
 		Sha512::Hash(String("TeapotNet"), tmp);
 		ByteString tmpkey, tmpiv;
 		tmp.readBinary(tmpkey, 32);	// 256 bits
 		tmp.readBinary(tmpiv, 16);	// 128 bits
 		tmp.clear();		
 
+		// No read-ahead, the cipher is changed on the same stream after authentication
 		AesCipher *cipher = new AesCipher(mRawStream);
+		cipher->setReadAhead(false);
 		cipher->setEncryptionKey(tmpkey);
 		cipher->setEncryptionInit(tmpiv);
 		cipher->setDecryptionKey(tmpkey);
 		cipher->setDecryptionInit(tmpiv);
-		mStream = cipher;
+		mStream = new BufferedStream(cipher);
 		
 		cipher->dumpStream(&mObfuscatedHello);
 		
@@ -593,11 +1181,21 @@ void Core::Handler::process(void)
 			parameters["nonce"] << nonce_a;
 			parameters["instance"] << mPeering.getName();
 			parameters["relay"] << false;
+			parameters["framing"] << "binary";
+			parameters["formats"] << "binary";
+			parameters["cancel"] << "request";
+			parameters["window"] << ChannelWindow;
+			parameters["ciphers"] << Config::Get("tpot_ciphers");
+			
+			// Offer to resume the previous session
+			if(mCore->getTicket(mPeering, ticket))
+				parameters["ticket"] << ticket.id;
+			
 			sendCommand(mStream, "H", args, parameters);
 		}
 
 		DesynchronizeStatement(this, AssertIO(recvCommand(mStream, command, args, parameters)));
-		if(command == "Q") return;
+		if(command == "Q") return false;
 		if(command != "H") throw Exception("Unexpected command: " + command);
 		
 		mLinkStatus = Established;	// Established means we got a response
@@ -610,6 +1208,46 @@ void Core::Handler::process(void)
 		parameters["nonce"] >> nonce_b;
 		parameters.get("instance", instance);
 		
+		// Binary framing is used after authentication if both sides support it
+		String framing;
+		if(parameters.get("framing", framing))
+			mBinaryFraming = (framing.toLower() == "binary");
+		
+		// Notification payloads may be sent in the formats the remote side advertises
+		String formats;
+		if(parameters.get("formats", formats))
+		{
+			std::list<String> list;
+			formats.toLower().explode(list, ',');
+			for(std::list<String>::iterator it = list.begin(); it != list.end(); ++it)
+				mRemoteFormats.insert(it->trimmed());
+		}
+		
+		// Queued requests may be cancelled if the remote side supports it
+		String cancel;
+		if(parameters.get("cancel", cancel))
+			mRequestCancel = (cancel.toLower() == "request");
+		
+		// Per-channel flow control is used if the remote side advertises its window
+		String window;
+		if(parameters.get("window", window))
+		{
+			window.extract(mRemoteWindow);
+			mFlowControl = (mRemoteWindow > 0);
+		}
+		
+		// Remote side supports only AES256 in CBC mode if it does not advertise ciphers
+		String remoteCiphers = "AES256";
+		parameters.get("ciphers", remoteCiphers);
+		
+		ByteString remoteTicket;
+		if(parameters.contains("ticket"))
+			parameters["ticket"] >> remoteTicket;
+		
+		// The session is resumed if the remote side sent back our ticket
+		if(!mIsIncoming)
+			resumed = (!ticket.id.empty() && remoteTicket == ticket.id);
+		
 		bool relayEnabled;
 		if(mIsIncoming) relayEnabled = Config::Get("relay_enabled").toBool();
 		else relayEnabled = (!parameters.contains("relay") || parameters["relay"].toBool());
@@ -633,38 +1271,21 @@ void Core::Handler::process(void)
 				if(!Config::Get("relay_enabled").toBool()) 
 				{
 					sendCommand(mStream, "Q", String::number(NotFound), StringMap());
-					return;
+					return false;
 				}
 			  
-				const double meetingStepTimeout = milliseconds(std::min(Config::Get("meeting_timeout").toInt()/3, Config::Get("request_timeout").toInt()));
-			  
-				double timeout = meetingStepTimeout;
+				// The meeting point is handled by the handler thread, so handshake workers never wait for it
+				if(SynchronizeTest(mCore, mCore->mRedirections.contains(mPeering)))
 				{
-					Synchronize(&mCore->mMeetingPoint);
-					while(timeout > 0.)
-					{
-						if(SynchronizeTest(mCore, mCore->mRedirections.contains(mPeering))) break;
-						if(!mCore->mMeetingPoint.wait(timeout)) break;
-					}
+					mForwarding = true;
+					return false;
 				}
 				
-				Handler *handler = NULL;
-				if(SynchronizeTest(mCore, mCore->mRedirections.get(mPeering, handler)))
+				if(mCore->mRelay->isFull())
 				{
-					if(handler)
-					{
-						LogDebug("Core::Handler", "Connection already forwarded");
-						sendCommand(mStream, "Q", String::number(RedirectionExists), StringMap());
-						return;
-					}
-					
-					//Log("Core::Handler", "Reached forwarding meeting point");
-					SynchronizeStatement(mCore, mCore->mRedirections.insert(mPeering, this));
-					mCore->mMeetingPoint.notifyAll();
-					wait(meetingStepTimeout);
-					SynchronizeStatement(mCore, mCore->mRedirections.erase(mPeering));
-					if(mStream) sendCommand(mStream, "Q", String::number(RedirectionFailed), StringMap());
-					return;
+					LogDebug("Core::Handler", "Relay is full, refusing to forward connection");
+					sendCommand(mStream, "Q", String::number(RedirectionFailed), StringMap());
+					return false;
 				}
 				
 				LogDebug("Core::Handler", "Got non local peering, asking peers");
@@ -679,82 +1300,14 @@ void Core::Handler::process(void)
 					if(!adresses.empty()) adresses+= ',';
 					adresses+= it->toString();
 				}
-					
-				Request request(String("peer:") + mPeering.toString(), false);
-				request.setParameter("adresses", adresses);
-				if(!instance.empty()) request.setParameter("instance", instance);
-				request.submit();
-				request.wait(meetingStepTimeout);
-						
-				String remote;
-				for(int i=0; i<request.responsesCount(); ++i)
-				{
-					if(!request.response(i)->error() && request.response(i)->parameter("remote", remote))
-						break;
-				}
-				
-				if(remote.empty())
-				{
-					sendCommand(mStream, "Q", String::number(NotFound), StringMap());
-					return;
-				}
 				
-				LogDebug("Core::Handler", "Got positive response for peering");
-					
-				remote >> mRemotePeering;
-				SynchronizeStatement(mCore, mCore->mRedirections.insert(mRemotePeering, NULL));
-					
-				Handler *otherHandler = NULL;
-				
-				timeout = meetingStepTimeout;
-				{
-					Synchronize(&mCore->mMeetingPoint);
-					mCore->mMeetingPoint.notifyAll();
-					while(timeout > 0.)
-					{
-						SynchronizeStatement(mCore, mCore->mRedirections.get(mRemotePeering, otherHandler));
-						if(otherHandler) break;
-						if(!mCore->mMeetingPoint.wait(timeout)) break;
-					}
-				}
+				// The lookup is submitted by handshake() once the handler is not touched anymore
+				mForwarding = true;
+				mLookup = new Request(String("peer:") + mPeering.toString(), false);
+				mLookup->setParameter("adresses", adresses);
+				if(!instance.empty()) mLookup->setParameter("instance", instance);
 				
-				if(otherHandler)
-				{
-					Stream     *otherStream    = NULL;
-					ByteStream *otherRawStream = NULL;
-					
-					{
-						Synchronize(otherHandler);
-						
-						otherStream    = otherHandler->mStream;
-						otherRawStream = otherHandler->mRawStream;
-						otherHandler->mStream      = NULL;
-						otherHandler->mRawStream   = NULL;
-						
-						mRawStream->writeBinary(otherHandler->mObfuscatedHello);
-						otherRawStream->writeBinary(mObfuscatedHello);
-						mObfuscatedHello.clear();
-					
-						otherHandler->notifyAll();
-					}
-					
-					otherHandler = NULL;
-					
-					LogInfo("Core::Handler", "Successfully forwarded connection");
-					
-					// Transfer
-					ByteStream::Transfer(mRawStream, otherRawStream);
-					
-					delete otherStream;
-					delete otherRawStream;
-				}
-				else {
-					LogWarn("Core::Handler", "No other handler reached forwarding meeting point");
-					sendCommand(mStream, "Q", String::number(RedirectionFailed), StringMap());
-				}
-					
-				SynchronizeStatement(mCore, mCore->mRedirections.erase(mPeering));	
-				return;
+				return false;
 			}
 			
 			if(mPeering == mRemotePeering && mPeering.getName() == mCore->getName())
@@ -768,19 +1321,44 @@ void Core::Handler::process(void)
 			parameters["nonce"] << nonce_a;
 			parameters["instance"] << mPeering.getName();
 			parameters["relay"] << relayEnabled;
+			parameters["framing"] << "binary";
+			parameters["formats"] << "binary";
+			parameters["cancel"] << "request";
+			parameters["window"] << ChannelWindow;
+			parameters["ciphers"] << Config::Get("tpot_ciphers");
+			
+			// Accept to resume the session if we hold the same ticket
+			if(!remoteTicket.empty()
+				&& mCore->getTicket(mPeering, ticket) 
+				&& ticket.id == remoteTicket)
+			{
+				resumed = true;
+				parameters["ticket"] << ticket.id;
+			}
+			
 			sendCommand(mStream, "H", args, parameters);
 		}
 		
 		cipher->dumpStream(NULL);
 		mObfuscatedHello.clear();
 		
+		// The session cipher is the first one offered by the initiator that the responder supports
+		String localCiphers = Config::Get("tpot_ciphers");
+		String cipherName = (mIsIncoming ? chooseCipher(remoteCiphers, localCiphers) : chooseCipher(localCiphers, remoteCiphers));
+		if(cipherName.empty()) throw Exception("No common cipher (remote=" + remoteCiphers + ")");
+		
 		ByteString secret;
 		if(SynchronizeTest(mCore, !mCore->mSecrets.get(peering, secret)))
 			throw Exception(String("Warning: No secret for peering: ") + peering.toString());
 	
+		if(!resumed) ticket.key.clear();
+		Time derivationStart = Time::Now();
+		
 		// Derivate session key	
 		ByteString key_a;
-                Sha512::DerivateKey(secret, salt_a, key_a, Sha512::CryptRounds);
+		derivateKey(secret, salt_a, ticket.key, key_a);
+		ByteString fullkey_a(key_a);
+		double derivationTime = Time::Now() - derivationStart;
 
 		// Get authentication key
 		ByteString authkey_a;
@@ -792,13 +1370,13 @@ void Core::Handler::process(void)
 	
 		parameters.clear();
 		parameters["method"] << "DIGEST";
-		parameters["cipher"] << "AES256";
+		parameters["cipher"] << cipherName;
 		parameters["salt"] << salt_a;
 		parameters["init"] << iv_a;
 		sendCommand(mStream, "A", hmac_a.toString(), parameters);
 		
 		DesynchronizeStatement(this, AssertIO(recvCommand(mStream, command, args, parameters)));
-		if(command == "Q") return;
+		if(command == "Q") return false;
 		if(command != "A") throw Exception("Unexpected command: " + command);
 		
 		String strMethod = "DIGEST";
@@ -808,7 +1386,7 @@ void Core::Handler::process(void)
 
 		// Only one method is supported for now
 		if(strMethod != "DIGEST") throw Exception("Unknown authentication method: " + strMethod);
-		if(strCipher != "AES256") throw Exception("Unknown authentication cipher: " + strCipher);
+		if(strCipher != cipherName) throw Exception("Unexpected authentication cipher: " + strCipher);
 		
 		ByteString test_b, salt_b, iv_b;
 		args >> test_b;
@@ -816,8 +1394,11 @@ void Core::Handler::process(void)
 		parameters["init"] >> iv_b;		
 
 		// Derivate remote session key
+		derivationStart = Time::Now();
 		ByteString key_b;
-                Sha512::DerivateKey(secret, salt_b, key_b, Sha512::CryptRounds);
+		derivateKey(secret, salt_b, ticket.key, key_b);
+		ByteString fullkey_b(key_b);
+		derivationTime+= Time::Now() - derivationStart;
 	
 		// Get remote authentication key
 		ByteString authkey_b;
@@ -828,20 +1409,73 @@ void Core::Handler::process(void)
 		ByteString hmac_b;
 		Sha512::AuthenticationCode(authkey_b, nonce_a, hmac_b);
 		
-		if(mIsIncoming) Thread::Sleep(uniform(0.0, 0.5));
-
+		// No random delay here, incoming attempts are already limited per source by checkHandshakeRate()
 		if(!test_b.constantTimeEquals(hmac_b)) throw Exception("Authentication failed (remote="+appversion+")");
-		LogInfo("Core::Handler", "Authentication successful: " + mPeering.getName() + " (remote="+appversion+")");
+		LogInfo("Core::Handler", "Authentication successful: " + mPeering.getName() + " (remote="+appversion+(resumed ? ", resumed" : "")+")");
+		LogDebug("Core::Handler", "Session keys derivated in " + String::number(derivationTime*1000., 2) + " ms");
 		mLinkStatus = Authenticated;		
+		
+		{
+			Synchronize(mCore);
+			if(resumed)
+			{
+				++mCore->mHandshakeStats.resumed;
+				mCore->mHandshakeStats.resumedTime+= derivationTime;
+			}
+			else {
+				++mCore->mHandshakeStats.full;
+				mCore->mHandshakeStats.fullTime+= derivationTime;
+			}
+		}
+		
+		// Issue a new ticket after a full authentication, both sides compute the same one
+		double ticketLifetime = milliseconds(Config::Get("tpot_ticket_lifetime").toInt());
+		if(!resumed && ticketLifetime > 0.)
+		{
+			ByteString initiatorKey = (mIsIncoming ? fullkey_b : fullkey_a);
+			ByteString responderKey = (mIsIncoming ? fullkey_a : fullkey_b);
+			
+			Ticket newTicket;
+			Sha512::AuthenticationCode(initiatorKey, responderKey, newTicket.key);
+			
+			ByteString label(String("TeapotNet ticket"));
+			ByteString tmp;
+			Sha512::AuthenticationCode(newTicket.key, label, tmp);
+			tmp.readBinary(newTicket.id, 16);	// 128 bits
+			
+			newTicket.expiry = Time::Now() + ticketLifetime;
+			mCore->addTicket(mPeering, newTicket);
+		}
 
+		// The cipher only reads whole blocks on demand, so nothing may be left in the buffer here
+		if(mStream->pending()) throw Exception("Unexpected data before cipher change");
+		
 		// Set up new cipher for the connection
-		delete cipher;
+		delete mStream;
 		cipher = new AesCipher(mRawStream);
 		cipher->setEncryptionKey(key_a);
 		cipher->setEncryptionInit(iv_a);
 		cipher->setDecryptionKey(key_b);
 		cipher->setDecryptionInit(iv_b);
-		mStream = cipher;
+		if(cipherName == "AES256-GCM") cipher->setMode(AesCipher::GCM);
+		mStream = new BufferedStream(cipher);
+		
+		// Binary-framed links over plain sockets can be driven by the reactor,
+		// in that case incoming data is deciphered separately from the socket
+		if(mCore->mReactor && mBinaryFraming && dynamic_cast<Socket*>(mRawStream))
+		{
+			mInputCipher = new AesCipher(&mCipherInput);
+			mInputCipher->setDecryptionKey(key_b);
+			mInputCipher->setDecryptionInit(iv_b);
+			if(cipherName == "AES256-GCM") mInputCipher->setMode(AesCipher::GCM);
+			
+			// Likewise outgoing data is enciphered to a queue, sent when the socket accepts it
+			mOutput = new Output(this, dynamic_cast<Socket*>(mRawStream));
+			mOutputCipher = new AesCipher(mOutput);
+			mOutputCipher->setEncryptionKey(key_a);
+			mOutputCipher->setEncryptionInit(iv_a);
+			if(cipherName == "AES256-GCM") mOutputCipher->setMode(AesCipher::GCM);
+		}
 		
 		if(!mIsIncoming && relayEnabled && mRemoteAddr.isPublic())
 		{
@@ -854,16 +1488,171 @@ void Core::Handler::process(void)
 	catch(const IOException &e)
 	{
 		LogDebug("Core::Handler", "Handshake aborted");
-		return;
+		
+		// The remote side may have rejected the resumed session
+		if(resumed) mCore->removeTicket(mPeering);
+		return false;
 	}
 	catch(const std::exception &e)
 	{
 		LogWarn("Core::Handler", String("Handshake failed: ") + e.what()); 
+		if(resumed) mCore->removeTicket(mPeering);
+		return false;
+	}
+	
+	mHandshakeSucceeded = true;
+	return true;
+}
+
+void Core::Handler::forward(void)
+{
+	// The lookup is cancelled if a positive response came first
+	Request *lookup = NULL;
+	SynchronizeStatement(this, std::swap(lookup, mLookup));
+	delete lookup;
+	
+	Synchronize(this);
+	
+	const double meetingStepTimeout = milliseconds(std::min(Config::Get("meeting_timeout").toInt()/3, Config::Get("request_timeout").toInt()));
+	
+	if(mForwardRemote.empty())
+	{
+		// Wait for a handler asking for this peering
+		double timeout = meetingStepTimeout;
+		{
+			Synchronize(&mCore->mMeetingPoint);
+			while(timeout > 0.)
+			{
+				if(SynchronizeTest(mCore, mCore->mRedirections.contains(mPeering))) break;
+				if(!mCore->mMeetingPoint.wait(timeout)) break;
+			}
+		}
+		
+		Handler *handler = NULL;
+		if(SynchronizeTest(mCore, !mCore->mRedirections.get(mPeering, handler)))
+		{
+			sendCommand(mStream, "Q", String::number(NotFound), StringMap());
+			return;
+		}
+		
+		if(handler)
+		{
+			LogDebug("Core::Handler", "Connection already forwarded");
+			sendCommand(mStream, "Q", String::number(RedirectionExists), StringMap());
+			return;
+		}
+		
+		//Log("Core::Handler", "Reached forwarding meeting point");
+		SynchronizeStatement(mCore, mCore->mRedirections.insert(mPeering, this));
+		mCore->mMeetingPoint.notifyAll();
+		wait(meetingStepTimeout);
+		SynchronizeStatement(mCore, mCore->mRedirections.erase(mPeering));
+		if(mStream) sendCommand(mStream, "Q", String::number(RedirectionFailed), StringMap());
 		return;
 	}
 	
-	Identifier peering;
-	SynchronizeStatement(this, peering = mPeering);
+	LogDebug("Core::Handler", "Got positive response for peering");
+	
+	mForwardRemote >> mRemotePeering;
+	SynchronizeStatement(mCore, mCore->mRedirections.insert(mRemotePeering, NULL));
+	
+	Handler *otherHandler = NULL;
+	
+	double timeout = meetingStepTimeout;
+	{
+		Synchronize(&mCore->mMeetingPoint);
+		mCore->mMeetingPoint.notifyAll();
+		while(timeout > 0.)
+		{
+			SynchronizeStatement(mCore, mCore->mRedirections.get(mRemotePeering, otherHandler));
+			if(otherHandler) break;
+			if(!mCore->mMeetingPoint.wait(timeout)) break;
+		}
+	}
+	
+	if(otherHandler)
+	{
+		Stream     *otherStream    = NULL;
+		ByteStream *otherRawStream = NULL;
+		
+		{
+			Synchronize(otherHandler);
+			
+			otherStream    = otherHandler->mStream;
+			otherRawStream = otherHandler->mRawStream;
+			otherHandler->mStream      = NULL;
+			otherHandler->mRawStream   = NULL;
+			
+			mRawStream->writeBinary(otherHandler->mObfuscatedHello);
+			otherRawStream->writeBinary(mObfuscatedHello);
+			mObfuscatedHello.clear();
+		
+			otherHandler->notifyAll();
+		}
+		
+		otherHandler = NULL;
+		
+		LogInfo("Core::Handler", "Successfully forwarded connection");
+		
+		// The forwarding is set up by process()
+		mForwardedStream = otherStream;
+		mForwardedRawStream = otherRawStream;
+		return;
+	}
+	
+	LogWarn("Core::Handler", "No other handler reached forwarding meeting point");
+	sendCommand(mStream, "Q", String::number(RedirectionFailed), StringMap());
+	SynchronizeStatement(mCore, mCore->mRedirections.erase(mPeering));
+}
+
+void Core::Handler::response(Request *request, Request::Response *response)
+{
+	// Forwarding goes on at the first positive response instead of waiting for every peer
+	String remote;
+	if(response->error() || !response->parameter("remote", remote) || remote.empty())
+		return;
+	
+	{
+		Synchronize(this);
+		if(request != mLookup || !mForwardRemote.empty()) return;
+		mForwardRemote = remote;
+	}
+	
+	start(true);	// autodelete
+}
+
+void Core::Handler::finished(Request *request, bool timeout)
+{
+	bool started = false;
+	{
+		Synchronize(this);
+		if(request != mLookup) return;	// the handler thread owns it
+		mLookup = NULL;
+		started = !mForwardRemote.empty();
+	}
+	
+	delete request;
+	if(!started) start(true);	// autodelete
+}
+
+void Core::Handler::process(void)
+{
+	if(!mHandshakeSucceeded)
+	{
+		if(mForwardedRawStream)
+		{
+			delete mForwardedStream;
+			mForwardedStream = NULL;
+			
+			// The relay takes ownership of both raw streams
+			if(mCore->mRelay->add(mRawStream, mForwardedRawStream)) mRawStream = NULL;
+			else delete mForwardedRawStream;
+			mForwardedRawStream = NULL;
+			
+			SynchronizeStatement(mCore, mCore->mRedirections.erase(mPeering));
+		}
+		return;
+	}
 	
 	try {
 		// Register the handler
@@ -879,272 +1668,94 @@ void Core::Handler::process(void)
 		// Start the sender
 		mSender = new Sender;
 		mSender->mStream = mStream;
-		mSender->start();
-		Thread::Sleep(0.1);
+		mSender->mBinaryFraming = mBinaryFraming;
+		mSender->mFlowControl = mFlowControl;
+		mSender->mInitialCredit = mRemoteWindow;
+		if(mBinaryFraming) LogDebug("Core::Handler", "Using binary framing");
+		if(mFlowControl) LogDebug("Core::Handler", "Using flow control");
+		
+		if(mInputCipher)
+		{
+			// The link is driven by the reactor from now on
+			SynchronizeStatement(this, mReactor = mCore->mReactor);
+			mSocket = dynamic_cast<Socket*>(mRawStream);
+			mSender->mStream = mOutputCipher;
+			mSender->mOutput = mOutput;
+			mSender->mReactor = mReactor;
+		}
+		else {
+			mSender->start();
+			Thread::Sleep(0.1);
+		}
 		
 		Listener *listener = NULL;
-		if(SynchronizeTest(mCore, mCore->mListeners.get(peering, listener)))
+		if(SynchronizeTest(mCore, mCore->mListeners.get(mPeering, listener)))
 		{
 			try {
-				listener->connected(peering, mIsIncoming);
+				listener->connected(mPeering, mIsIncoming);
 			}
 			catch(const Exception &e)
 			{
 				LogWarn("Core::Handler", String("Listener connected callback failed: ")+e.what());
 			}
 		}
-
-		// Main loop
-		LogDebug("Core::Handler", "Entering main loop");
-		while(recvCommand(mStream, command, args, parameters))
+		
+		if(mReactor)
 		{
-			Synchronize(this);
-
-			if(command == "K")	// Keep Alive
-			{
-				String dummy;
-				Assert(args.read(dummy));
-			}
-			else if(command == "R")	// Response
-			{
-				unsigned id;
-				int status;
-				unsigned channel;
-				Assert(args.read(id));
-				Assert(args.read(status));
-				Assert(args.read(channel));
-				
-				Request *request;
-				if(mRequests.get(id,request))
-				{
-					Synchronize(request);
-				  
-				  	Request::Response *response;
-					if(channel)
-					{
-						//LogDebug("Core::Handler", "Received response for request "+String::number(id)+", status "+String::number(status)+", receiving on channel "+String::number(channel));
-	
-						ByteStream *sink = NULL;
-						if(request->mContentSink)
-						{
-							if(!request->hasContent())
-								sink = request->mContentSink;
-						}
-						else sink = new TempFile;	// TODO: or ByteString ?
-						
-						response = new Request::Response(status, parameters, sink);
-						response->mChannel = channel;
-						if(sink) 
-						{
-							mResponses.insert(channel, response);
-							mCancelled.clear();
-						}
-					}
-					else {
-						//LogDebug("Core::Handler", "Received response for request "+String::number(id)+", status "+String::number(status)+", no data");
-						response = new Request::Response(status, parameters);
-					}
-
-					response->mPeering = peering;
-					response->mTransfertStarted = true;
-					request->addResponse(response);
-					if(response->status() != Request::Response::Pending) 
-						request->removePending(peering);	// this triggers the notification
-				}
-				else LogDebug("Core::Handler", "Received response for unknown request "+String::number(id));
-			}
-			else if(command == "D")	// Data block
-			{
-				unsigned channel;
-				Assert(args.read(channel));
-				
-				unsigned size = 0;
-				if(parameters.contains("length")) parameters["length"].extract(size);
-
-				Request::Response *response;
-				if(mResponses.get(channel,response))
-				{
-				 	Assert(response->content());
-					if(size) {
-					  	size_t len = mStream->readData(*response->content(), size);
-						if(len != size) throw IOException("Incomplete data chunk");
-					}
-					else {
-						LogDebug("Core::Handler", "Finished receiving on channel "+String::number(channel));
-						response->content()->close();
-						response->mTransfertFinished = true;
-						response->mStatus = Request::Response::Finished;
-						mResponses.erase(channel);
-					}
-				}
-				else {
-					AssertIO(mStream->ignore(size));
-					
-					if(mCancelled.find(channel) == mCancelled.end())
-					{
-						mCancelled.insert(channel);
-					  
-						args.clear();
-						args.write(channel);
-						parameters.clear();
-						
-						Desynchronize(this);
-						LogDebug("Core::Handler", "Sending cancel on channel "+String::number(channel));
-						SynchronizeStatement(mSender, Handler::sendCommand(mStream, "C", args, parameters));
-					}
-				}
-			}
-			else if(command == "E")	// Error
-			{
-				unsigned channel;
-				int status;
-				Assert(args.read(channel));
-				Assert(args.read(status));
-				
-				Request::Response *response;
-				if(mResponses.get(channel,response))
-				{
-				 	Assert(response->content() != NULL);
-					
-					LogDebug("Core::Handler", "Error on channel "+String::number(channel)+", status "+String::number(status));
-					
-					Assert(status > 0);
-				
-					response->mStatus = status;
-					response->content()->close();
-					mResponses.erase(channel);
-				}
-				//else LogDebug("Core::Handler", "Received error for unknown channel "+String::number(channel));
-			}
-			else if(command == "C")	// Cancel
+			LogDebug("Core::Handler", "Handing link over to the reactor");
+			
+			// The handler is deleted once the link is closed
+			setAutoDelete(false);
+			
+			const double readTimeout = milliseconds(Config::Get("tpot_read_timeout").toInt());
+			SynchronizeStatement(&mInputSync, mLastInputTime = Time::Now());
+			Scheduler::Global->repeat(&mTimeoutTask, readTimeout/2);
+			
+#ifdef LINUX
+			// Nothing may block the reactor threads, the socket is written as it accepts data
+			int fd = mSocket->descriptor();
+			::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+#endif
 			{
-				unsigned channel;
-				Assert(args.read(channel));
-				
-				Synchronize(mSender);
-				Request::Response *response;
-				if(mSender->mTransferts.get(channel, response))
-				{
-					LogDebug("Core::Handler", "Received cancel for channel "+String::number(channel));
-					response->mTransfertFinished = true;
-					mSender->mTransferts.erase(channel);
-				}
-				//else LogDebug("Core::Handler", "Received cancel for unknown channel "+String::number(channel));
+				// The socket is only watched for reading once added
+				Synchronize(&mWatchSync);
+				mReactor->add(mSocket->descriptor(), this);
+				mWatchReadable = true;
+				mWatchWritable = false;
 			}
-			else if(command == "I" || command == "G") // Request
+			
+			updateWatch();	// output may already be queued
+			return;
+		}
+		
+		// Main loop
+		LogDebug("Core::Handler", "Entering main loop");
+		while(true)
+		{
+			String command, args;
+			StringMap parameters;
+			
+			if(mBinaryFraming)
 			{
-			  	unsigned id;
-				Assert(args.read(id));
-				String &target = args;
-			  	LogDebug("Core::Handler", "Received request "+String::number(id));
-
-				Request *request = new Request(target, (command == "G"));
-				request->setParameters(parameters);
-				request->mId = id;
-				request->mRemoteAddr = mRemoteAddr;
+				char opcode;
+				uint32_t channel, length;
+				if(!recvFrameHeader(mStream, opcode, channel, length)) break;
 				
-				Listener *listener = NULL;
-				if(!SynchronizeTest(mCore, mCore->mListeners.get(peering, listener)))
-				{
-					LogDebug("Core::Handler", "No listener for request " + String::number(id));
-				}
-				else {
-					class RequestTask : public Task
-					{
-					public:
-						RequestTask(	const Identifier &peering,
-								Listener *listener,
-								Request *request, 
-								Sender *sender)
-						{
-							this->peering = peering;
-							this->listener = listener;
-							this->request = request;
-							this->sender = sender;
-						}
-						
-						void run(void)
-						{
-							try {
-								listener->request(peering, request);
-							}
-							catch(const Exception &e)
-							{
-								LogWarn("RequestTask::run", String("Listener failed to process request "+String::number(request->mId)+": ") + e.what()); 
-							}
-							
-							try {
-								if(request->responsesCount() == 0) 
-									request->addResponse(new Request::Response(Request::Response::Failed));
-					
-								Synchronize(sender);	
-								sender->mRequestsToRespond.push_back(request);
-								request->mResponseSender = sender;
-								sender->notify();
-							}
-							catch(const Exception &e)
-							{
-								LogWarn("RequestTask::run", e.what()); 
-							}
-							
-							delete this;	// autodelete
-						}
-						
-					private:
-						Identifier peering;
-						Listener *listener;
-						Request *request;
-						Sender  *sender;
-					};
-					
-					mScheduler.schedule(new RequestTask(peering, listener, request, mSender));
-				}
-			}
-			else if(command == "M")
-			{
-				unsigned length = 0;
-				if(parameters.contains("length")) 
+				if(opcode == 'D')	// Data block, no parameters
 				{
-					parameters["length"].extract(length);
-					parameters.erase("length");
+					Synchronize(this);
+					processData(mStream, channel, length);
+					if(mStopping) break;
+					continue;
 				}
-			  
-				//LogDebug("Core::Handler", "Received notification");
-				
-				Notification notification;
-				notification.setParameters(parameters);
-				notification.mPeering = mPeering;
-				notification.mContent.reserve(length);
-				mStream->read(notification.mContent, length);
 				
-				Listener *listener = NULL;
-				if(!SynchronizeTest(mCore, mCore->mListeners.get(peering, listener)))
-				{
-					LogDebug("Core::Handler", "No listener, dropping notification");
-				}
-				else {
-					try {
-						Desynchronize(this);
-						if(!listener->notification(peering, &notification)) break;
-					}
-					catch(const Exception &e)
-					{
-						LogWarn("Core::Handler", String("Listener failed to process the notification: ") + e.what());
-					}
-				}
-			}
-			else if(command == "Q")	// Optionnal, closing the connection is sufficient
-			{
-				break;
-			}
-			else {
-				LogWarn("Core::Handler", "Unknown command: " + command);
-
-				unsigned length = 0;
-				if(parameters.contains("length")) parameters["length"].extract(length);
-				if(length) AssertIO(mStream->ignore(length));
+				command = String(opcode);
+				recvFramePayload(mStream, length, args, parameters);
 			}
+			else if(!recvCommand(mStream, command, args, parameters)) break;
 			
+			Synchronize(this);
+			if(!processCommand(mStream, command, args, parameters)) break;
 			if(mStopping) break;
 		}
 
@@ -1154,35 +1765,319 @@ void Core::Handler::process(void)
 	{
 		LogWarn("Core::Handler", e.what()); 
 	}
-
-	// Wait for tasks to finish
-	mScheduler.clear();
 	
-	try {
-		Synchronize(this);
-
-		mStopping = true;
-
-		for(Map<unsigned, Request::Response*>::iterator it = mResponses.begin();
-			it != mResponses.end();
-			++it)
-		{
-			it->second->mStatus = Request::Response::Interrupted;
-			it->second->content()->close();
-		}
+	finish();
+}
 
-		for(Map<unsigned, Request*>::iterator it = mRequests.begin();
-			it != mRequests.end();
-			++it)
-		{
-			it->second->removePending(mPeering);
-		}
-	}
-	catch(const std::exception &e)
+bool Core::Handler::processCommand(Stream *input, const String &command, String &args, StringMap &parameters)
+{
+	if(command == "K")	// Keep Alive
 	{
-		LogError("Core::Handler", e.what());
+		String dummy;
+		Assert(args.read(dummy));
 	}
-	
+	else if(command == "R")	// Response
+	{
+		unsigned id;
+		int status;
+		unsigned channel;
+		Assert(args.read(id));
+		Assert(args.read(status));
+		Assert(args.read(channel));
+		
+		Pipe *windowContent = NULL;
+		bool windowDirect = false;
+		
+		Request *request;
+		if(mRequests.get(id,request))
+		{
+			Synchronize(request);
+		  
+		  	Request::Response *response;
+			if(channel)
+			{
+				//LogDebug("Core::Handler", "Received response for request "+String::number(id)+", status "+String::number(status)+", receiving on channel "+String::number(channel));
+	
+				ByteStream *sink = NULL;
+				if(request->mContentSink)
+				{
+					if(!request->hasContent())
+						sink = request->mContentSink;
+				}
+				else sink = new TempFile;	// TODO: or ByteString ?
+				
+				response = new Request::Response(status, parameters, sink);
+				response->mChannel = channel;
+				if(sink) 
+				{
+					mResponses.insert(channel, response);
+					mCancelled.clear();
+					windowContent = response->content();
+					windowDirect = (sink == request->mContentSink);
+				}
+			}
+			else {
+				//LogDebug("Core::Handler", "Received response for request "+String::number(id)+", status "+String::number(status)+", no data");
+				response = new Request::Response(status, parameters);
+			}
+
+			response->mPeering = mPeering;
+			response->mTransfertStarted = true;
+			request->addResponse(response);
+			if(response->status() != Request::Response::Pending) 
+				request->removePending(mPeering);	// this triggers the notification
+		}
+		else LogDebug("Core::Handler", "Received response for unknown request "+String::number(id));
+		
+		if(mFlowControl && windowContent)
+		{
+			// The remote sender starts with our advertised window as credit
+			Synchronize(mSender);
+			Sender::ReceiveWindow window;
+			window.content = windowContent;
+			window.direct = windowDirect;
+			window.granted = ChannelWindow;
+			window.received = 0;
+			mSender->mWindows.insert(channel, window);
+			windowContent->setReadListener(mSender);
+		}
+	}
+	else if(command == "D")	// Data block
+	{
+		unsigned channel;
+		Assert(args.read(channel));
+		
+		unsigned size = 0;
+		if(parameters.contains("length")) parameters["length"].extract(size);
+		
+		processData(input, channel, size);
+	}
+	else if(command == "E")	// Error
+	{
+		unsigned channel;
+		int status;
+		Assert(args.read(channel));
+		Assert(args.read(status));
+		
+		Request::Response *response;
+		if(mResponses.get(channel,response))
+		{
+		 	Assert(response->content() != NULL);
+			
+			LogDebug("Core::Handler", "Error on channel "+String::number(channel)+", status "+String::number(status));
+			
+			Assert(status > 0);
+		
+			response->mStatus = status;
+			response->content()->close();
+			closeChannel(channel);
+		}
+		//else LogDebug("Core::Handler", "Received error for unknown channel "+String::number(channel));
+	}
+	else if(command == "C")	// Cancel
+	{
+		unsigned channel;
+		Assert(args.read(channel));
+		
+		// Cancel for a request, it is dropped if still queued
+		if(parameters.contains("request"))
+		{
+			RequestTask *task;
+			if(mRequestTasks.get(channel, task) && mCore->mRequestPool->cancel(mPeering, task))
+			{
+				LogDebug("Core::Handler", "Received cancel for request "+String::number(channel));
+				mRequestTasks.erase(channel);
+				task->cancel();
+			}
+			return true;
+		}
+		
+		Synchronize(mSender);
+		Map<unsigned, Sender::Transfert>::iterator it = mSender->mTransferts.find(channel);
+		if(it != mSender->mTransferts.end())
+		{
+			LogDebug("Core::Handler", "Received cancel for channel "+String::number(channel));
+			it->second.response->mTransfertFinished = true;
+			mSender->mTransferts.erase(it);
+		}
+		//else LogDebug("Core::Handler", "Received cancel for unknown channel "+String::number(channel));
+	}
+	else if(command == "W")	// Window update
+	{
+		// Parameters map channels to additional credit in bytes
+		Synchronize(mSender);
+		for(	StringMap::iterator it = parameters.begin();
+			it != parameters.end();
+			++it)
+		{
+			unsigned channel = 0;
+			uint64_t credit = 0;
+			it->first.extract(channel);
+			it->second.extract(credit);
+			
+			Map<unsigned, Sender::Transfert>::iterator jt = mSender->mTransferts.find(channel);
+			if(jt != mSender->mTransferts.end()) jt->second.credit+= credit;
+		}
+		
+		mSender->notify();
+	}
+	else if(command == "I" || command == "G") // Request
+	{
+	  	unsigned id;
+		Assert(args.read(id));
+		String &target = args;
+	  	LogDebug("Core::Handler", "Received request "+String::number(id));
+
+		// The weight is for our sender only and is not passed to listeners
+		unsigned weight = Request::DefaultWeight;
+		if(parameters.contains("weight"))
+		{
+			parameters["weight"].extract(weight);
+			parameters.erase("weight");
+		}
+		
+		Request *request = new Request(target, (command == "G"));
+		request->setParameters(parameters);
+		request->setWeight(weight);
+		request->mId = id;
+		request->mRemoteAddr = mRemoteAddr;
+		
+		Listener *listener = NULL;
+		if(!SynchronizeTest(mCore, mCore->mListeners.get(mPeering, listener)))
+		{
+			LogDebug("Core::Handler", "No listener for request " + String::number(id));
+		}
+		else {
+			RequestTask *task = new RequestTask(this, listener, request);
+			mRequestTasks.insert(id, task);
+			++mRunningTasks;
+			mCore->mRequestPool->launch(mPeering, task);
+		}
+	}
+	else if(command == "M")
+	{
+		unsigned length = 0;
+		if(parameters.contains("length")) 
+		{
+			parameters["length"].extract(length);
+			parameters.erase("length");
+		}
+	  
+		//LogDebug("Core::Handler", "Received notification");
+		
+		Notification notification;
+		notification.setParameters(parameters);
+		notification.mPeering = mPeering;
+		notification.mContent.reserve(length);
+		input->read(notification.mContent, length);
+		
+		Listener *listener = NULL;
+		if(!SynchronizeTest(mCore, mCore->mListeners.get(mPeering, listener)))
+		{
+			LogDebug("Core::Handler", "No listener, dropping notification");
+		}
+		else {
+			try {
+				Desynchronize(this);
+				if(!listener->notification(mPeering, &notification)) return false;
+			}
+			catch(const Exception &e)
+			{
+				LogWarn("Core::Handler", String("Listener failed to process the notification: ") + e.what());
+			}
+		}
+	}
+	else if(command == "Q")	// Optionnal, closing the connection is sufficient
+	{
+		return false;
+	}
+	else {
+		LogWarn("Core::Handler", "Unknown command: " + command);
+
+		unsigned length = 0;
+		if(parameters.contains("length")) parameters["length"].extract(length);
+		if(length) AssertIO(input->ignore(length));
+	}
+	
+	return true;
+}
+
+void Core::Handler::closeChannel(unsigned channel)
+{
+	Request::Response *response;
+	if(!mResponses.get(channel, response)) return;
+	mResponses.erase(channel);
+	
+	if(mSender)
+	{
+		Synchronize(mSender);
+		mSender->mWindows.erase(channel);
+	}
+	
+	// The response may outlive the sender
+	response->content()->setReadListener(NULL);
+}
+
+void Core::Handler::cancelRequestTasks(void)
+{
+	Synchronize(this);
+	
+	for(Map<unsigned, RequestTask*>::iterator it = mRequestTasks.begin();
+		it != mRequestTasks.end();
+		++it)
+	{
+		if(mCore->mRequestPool->cancel(mPeering, it->second))
+			it->second->cancel();
+	}
+	
+	mRequestTasks.clear();
+}
+
+void Core::Handler::finish(void)
+{
+	if(mReactor)
+	{
+		// Wait for the input task to return
+		Synchronize(&mInputSync);
+		while(mInputScheduled) mInputSync.wait();
+	}
+	
+	// Queued requests are dropped, running ones hold pointers to the handler
+	cancelRequestTasks();
+	if(!mReactor)
+	{
+		Synchronize(this);
+		while(mRunningTasks) wait();
+	}
+	
+	try {
+		Synchronize(this);
+
+		mStopping = true;
+
+		for(Map<unsigned, Request::Response*>::iterator it = mResponses.begin();
+			it != mResponses.end();
+			++it)
+		{
+			it->second->mStatus = Request::Response::Interrupted;
+			it->second->content()->close();
+			it->second->content()->setReadListener(NULL);
+		}
+		
+		if(mSender) SynchronizeStatement(mSender, mSender->mWindows.clear());
+
+		for(Map<unsigned, Request*>::iterator it = mRequests.begin();
+			it != mRequests.end();
+			++it)
+		{
+			it->second->removePending(mPeering);
+		}
+	}
+	catch(const std::exception &e)
+	{
+		LogError("Core::Handler", e.what());
+	}
+	
 	try {
 		Synchronize(mCore);
 		
@@ -1199,43 +2094,471 @@ void Core::Handler::process(void)
 	{
 		LogError("Core::Handler", e.what()); 
 	}
-	
-	Listener *listener = NULL;
-	if(SynchronizeTest(mCore, mCore->mListeners.get(peering, listener)))
+	
+	Identifier peering;
+	SynchronizeStatement(this, peering = mPeering);
+	
+	Listener *listener = NULL;
+	if(SynchronizeTest(mCore, mCore->mListeners.get(peering, listener)))
+	{
+		try {
+			listener->disconnected(peering);
+		}
+		catch(const Exception &e)
+		{
+			LogWarn("Core::Handler", String("Listener disconnected callback failed: ") + e.what());
+		}
+	}
+	
+	// Stop the sender
+	if(mSender) mSender->stop();
+	
+	// In reactor mode, the handler is deleted after the same delay as in run()
+	if(mReactor) Scheduler::Global->schedule(new DeleteTask(this), 5.);
+}
+
+void Core::Handler::processData(Stream *input, unsigned channel, unsigned size)
+{
+	ByteStream *sink = acceptData(channel, size);
+	if(sink)
+	{
+		size_t len = input->readData(*sink, size);
+		if(len != size) throw IOException("Incomplete data chunk");
+		dataWritten(channel);
+	}
+	else if(size) AssertIO(input->ignore(size));
+}
+
+void Core::Handler::processData(const char *data, unsigned channel, unsigned size)
+{
+	// The chunk is written to the response content straight from the input buffer
+	ByteStream *sink = acceptData(channel, size);
+	if(sink)
+	{
+		sink->writeData(data, size);
+		dataWritten(channel);
+	}
+}
+
+ByteStream *Core::Handler::acceptData(unsigned channel, unsigned size)
+{
+	Request::Response *response;
+	if(!mResponses.get(channel,response))
+	{
+		if(mCancelled.find(channel) == mCancelled.end())
+		{
+			mCancelled.insert(channel);
+			
+			String args;
+			args.write(channel);
+			
+			Desynchronize(this);
+			LogDebug("Core::Handler", "Sending cancel on channel "+String::number(channel));
+			SynchronizeStatement(mSender, mSender->sendCommand("C", args, StringMap()));
+		}
+		
+		return NULL;
+	}
+	
+	Assert(response->content());
+	if(!size)
+	{
+		LogDebug("Core::Handler", "Finished receiving on channel "+String::number(channel));
+		response->content()->close();
+		response->mTransfertFinished = true;
+		response->mStatus = Request::Response::Finished;
+		closeChannel(channel);
+		return NULL;
+	}
+	
+	if(mFlowControl)
+	{
+		Synchronize(mSender);
+		Map<unsigned, Sender::ReceiveWindow>::iterator it = mSender->mWindows.find(channel);
+		if(it != mSender->mWindows.end())
+		{
+			Sender::ReceiveWindow &window = it->second;
+			if(window.received + size > window.granted)
+				throw IOException("Flow control window exceeded on channel " + String::number(channel));
+			
+			window.received+= size;
+		}
+	}
+	
+	return response->content();
+}
+
+void Core::Handler::dataWritten(unsigned channel)
+{
+	if(mFlowControl)
+	{
+		Synchronize(mSender);
+		Map<unsigned, Sender::ReceiveWindow>::iterator it = mSender->mWindows.find(channel);
+		if(it != mSender->mWindows.end() && mSender->isWindowUpdateDue(it->second))
+			mSender->notify();
+	}
+}
+
+void Core::Handler::run(void)
+{
+	// Incoming handshakes are already done by the handshake workers
+	if(!mHandshakeDone) authenticate();
+	if(mForwarding) forward();
+	process();
+	notifyAll();
+	
+	// In reactor mode, the link outlives the thread
+	if(SynchronizeTest(this, mReactor != NULL)) return;
+	
+	// TODO
+	Thread::Sleep(5.);	
+	Synchronize(this);
+}
+
+void Core::Handler::readable(void)
+{
+	char buffer[BufferSize];
+	size_t size = BufferSize;
+	bool connected = false;
+	
+	try {
+		connected = mSocket->readAvailableData(buffer, size);
+	}
+	catch(const NetException &e)
+	{
+		LogDebug("Core::Handler", e.what());
+	}
+	
+	if(!connected)
+	{
+		disconnect();
+		return;
+	}
+	
+	if(!size) return;
+	
+	bool pause = false;
+	{
+		Synchronize(&mInputSync);
+		if(mDisconnected) return;
+		
+		mRawInput.writeData(buffer, size);
+		mLastInputTime = Time::Now();
+		
+		// Frames of a link are processed in order by a single task at a time
+		if(!mInputScheduled)
+		{
+			mInputScheduled = true;
+			mReactor->dispatch(&mInputTask);
+		}
+		
+		// Stop reading while the input task is behind, processInput() resumes reading
+		if(!mInputPaused && mRawInput.size() >= MaxRawInput)
+			pause = mInputPaused = true;
+	}
+	
+	if(pause) updateWatch();
+}
+
+void Core::Handler::updateWatch(void)
+{
+	// The state is read and applied under the same lock, so concurrent updates are not reordered
+	Synchronize(&mWatchSync);
+	bool readable = SynchronizeTest(&mInputSync, !mInputPaused);
+	bool writable = (mOutput->pending() != 0);
+	if(readable == mWatchReadable && writable == mWatchWritable) return;
+	
+	mWatchReadable = readable;
+	mWatchWritable = writable;
+	mReactor->watch(mSocket->descriptor(), this, readable, writable);
+}
+
+void Core::Handler::writable(void)
+{
+	try {
+		mOutput->flush();
+	}
+	catch(const NetException &e)
+	{
+		LogDebug("Core::Handler", e.what());
+		disconnect();
+		return;
+	}
+	
+	// The sender holds off while the output queue is full
+	if(mOutput->pending() < Output::MaxPending) mSender->schedule();
+	updateWatch();
+}
+
+void Core::Handler::processInput(void)
+{
+	while(true)
+	{
+		bool resume = false;
+		{
+			Synchronize(&mInputSync);
+			if(mDisconnected || mRawInput.empty())
+			{
+				mInputScheduled = false;
+				mInputSync.notifyAll();
+				return;
+			}
+			
+			mCipherInput.append(mRawInput);	// segments are moved, not copied
+			std::swap(resume, mInputPaused);
+		}
+		
+		try {
+			if(resume) updateWatch();
+			
+			if(!processFrames())
+			{
+				LogDebug("Core::Handler", "Finished");
+				disconnect();
+			}
+		}
+		catch(const std::exception &e)
+		{
+			LogWarn("Core::Handler", e.what());
+			disconnect();
+		}
+	}
+}
+
+bool Core::Handler::processFrames(void)
+{
+	// Decipher everything available, incomplete blocks are kept by the cipher
+	char buffer[BufferSize];
+	size_t len;
+	while((len = mInputCipher->readData(buffer, BufferSize)))
+		mInput.append(buffer, len);
+	
+	bool keepOpen = true;
+	size_t pos = 0;
+	while(keepOpen && mInput.size() - pos >= FrameHeaderSize)
+	{
+		const char *header = mInput.data() + pos;
+		const size_t left = mInput.size() - pos - FrameHeaderSize;
+		
+		char opcode;
+		uint32_t channel, length;
+		readFrameHeader(header, opcode, channel, length);
+		if(length > MaxFramePayload) throw IOException("Frame payload is too large");
+		if(left < length) break;
+		
+		if(opcode == 'D')	// Data block, no parameters
+		{
+			const char *data = header + FrameHeaderSize;
+			pos+= FrameHeaderSize + length;
+			
+			Synchronize(this);
+			processData(data, channel, length);
+		}
+		else {
+			String command(1, opcode);
+			String args;
+			StringMap parameters;
+			readFramePayload(header + FrameHeaderSize, length, args, parameters);
+			
+			// Notifications and unknown commands are followed by their content
+			uint64_t extra = 0;
+			String tmp;
+			if((opcode == 'M' || String("KRDECIGQ").find(opcode) == String::NotFound)
+				&& parameters.get("length", tmp))
+				tmp.extract(extra);
+			
+			// The content is buffered until complete, so it is bounded like payloads
+			if(extra > MaxFramePayload) throw IOException("Frame content is too large");
+			if(left - length < extra) break;
+			
+			String content(header + FrameHeaderSize + length, size_t(extra));
+			pos+= FrameHeaderSize + length + size_t(extra);
+			
+			Synchronize(this);
+			keepOpen = processCommand(&content, command, args, parameters);
+		}
+		
+		if(SynchronizeTest(this, mStopping)) keepOpen = false;
+	}
+	
+	mInput.erase(0, pos);
+	return keepOpen;
+}
+
+void Core::Handler::checkTimeout(void)
+{
+	const double readTimeout = milliseconds(Config::Get("tpot_read_timeout").toInt());
+	
+	bool timeout;
+	SynchronizeStatement(&mInputSync, timeout = (Time::Now() - mLastInputTime > readTimeout));
+	
+	if(timeout)
+	{
+		LogDebug("Core::Handler", "Read timeout");
+		disconnect();
+		return;
+	}
+	
+	// Keep Alive
+	Synchronize(mSender);
+	mSender->mKeepAlive = true;
+	mSender->schedule();
+}
+
+void Core::Handler::disconnect(void)
+{
+	{
+		Synchronize(&mInputSync);
+		if(mDisconnected) return;
+		mDisconnected = true;
+		
+		if(mInputScheduled && mReactor->cancel(&mInputTask))
+		{
+			mInputScheduled = false;
+			mInputSync.notifyAll();
+		}
+	}
+	
+	mReactor->remove(mSocket->descriptor());
+	mSocket->shutdown();
+	Scheduler::Global->remove(&mTimeoutTask);
+	mReactor->dispatch(&mFinishTask);
+}
+
+void Core::Handler::DeleteTask::run(void)
+{
+	// Request tasks keep pointers to the handler and its sender
+	if(SynchronizeTest(mHandler, mHandler->mRunningTasks))
+	{
+		Scheduler::Global->schedule(this, 5.);
+		return;
+	}
+	
+	delete mHandler;
+	delete this;	// autodelete
+}
+
+Core::Handler::RequestTask::RequestTask(Handler *handler, Listener *listener, Request *request) :
+	mHandler(handler),
+	mPeering(handler->mPeering),
+	mListener(listener),
+	mRequest(request),
+	mSender(handler->mSender)
+{
+
+}
+
+void Core::Handler::RequestTask::run(void)
+{
+	// Once running, the task can't be cancelled anymore
+	{
+		Synchronize(mHandler);
+		RequestTask *task;
+		if(mHandler->mRequestTasks.get(mRequest->mId, task) && task == this)
+			mHandler->mRequestTasks.erase(mRequest->mId);
+	}
+	
+	try {
+		mListener->request(mPeering, mRequest);
+	}
+	catch(const Exception &e)
+	{
+		LogWarn("RequestTask::run", String("Listener failed to process request "+String::number(mRequest->mId)+": ") + e.what()); 
+	}
+	
+	try {
+		if(mRequest->responsesCount() == 0) 
+			mRequest->addResponse(new Request::Response(Request::Response::Failed));
+		
+		Synchronize(mSender);	
+		mSender->mRequestsToRespond.push_back(mRequest);
+		mRequest->mResponseSender = mSender;
+		mSender->notify();
+	}
+	catch(const Exception &e)
 	{
-		try {
-			listener->disconnected(peering);
-		}
-		catch(const Exception &e)
-		{
-			LogWarn("Core::Handler", String("Listener disconnected callback failed: ") + e.what());
-		}
+		LogWarn("RequestTask::run", e.what()); 
 	}
 	
-	// Stop the sender
-	if(mSender && mSender->isRunning())
 	{
-		SynchronizeStatement(mSender, mSender->mShouldStop = true);
-		mSender->notify();
-		mSender->join();	
+		Synchronize(mHandler);
+		--mHandler->mRunningTasks;
+		mHandler->notifyAll();
 	}
+	
+	delete this;	// autodelete
 }
 
-void Core::Handler::run(void)
+void Core::Handler::RequestTask::cancel(void)
 {
-	process();
-	notifyAll();
+	// Called with the handler lock
+	--mHandler->mRunningTasks;
+	mHandler->notifyAll();
 	
-	// TODO
-	Thread::Sleep(5.);	
-	Synchronize(this);
+	mRequest->mId = 0;	// received request, not to be removed from the core
+	delete mRequest;
+	delete this;
 }
 
 const size_t Core::Handler::Sender::ChunkSize = BufferSize;
 
+Core::Handler::Output::Output(Handler *handler, Socket *sock) :
+	mHandler(handler),
+	mSocket(sock)
+{
+	Assert(mHandler);
+	Assert(mSocket);
+}
+
+size_t Core::Handler::Output::pending(void) const
+{
+	Synchronize(this);
+	return mSegment.size() + mQueue.size();
+}
+
+void Core::Handler::Output::flush(void)
+{
+	Synchronize(this);
+	while(!mSegment.empty() || mQueue.pop(mSegment))
+	{
+		mSegment.ignore(mSocket->writeAvailableData(mSegment.data(), mSegment.size()));
+		if(!mSegment.empty()) break;	// the socket buffer is full
+	}
+}
+
+size_t Core::Handler::Output::readData(char *, size_t)
+{
+	return 0;
+}
+
+void Core::Handler::Output::writeData(const char *data, size_t size)
+{
+	bool blocked;
+	{
+		Synchronize(this);
+		mQueue.writeData(data, size);
+		flush();
+		blocked = !mSegment.empty();
+	}
+	
+	// The rest is sent when the socket is writable
+	if(blocked) mHandler->updateWatch();
+}
+
 Core::Handler::Sender::Sender(void) :
+		mStream(NULL),
+		mBinaryFraming(false),
 		mLastChannel(0),
-		mShouldStop(false)
+		mNextChannel(0),
+		mFlowControl(false),
+		mInitialCredit(0),
+		mShouldStop(false),
+		mReactor(NULL),
+		mOutput(NULL),
+		mPumpTask(this),
+		mPumpScheduled(false),
+		mPumping(false),
+		mKeepAlive(false)
 {
 
 }
@@ -1243,13 +2566,13 @@ Core::Handler::Sender::Sender(void) :
 Core::Handler::Sender::~Sender(void)
 {
 	try {
-		Map<unsigned, Request::Response*>::iterator it = mTransferts.begin();
+		Map<unsigned, Transfert>::iterator it = mTransferts.begin();
 		while(it != mTransferts.end())
 		{
 			int status = Request::Response::Interrupted;	
 			String args;
 			args << it->first << status;
-			Handler::sendCommand(mStream, "E", args, StringMap());
+			sendCommand("E", args, StringMap());
 			++it;
 		}
 	}
@@ -1275,182 +2598,444 @@ void Core::Handler::Sender::run(void)
 			Synchronize(this);
 			if(mShouldStop) break;
 
-			if(mNotificationsQueue.empty()
-				&& mRequestsQueue.empty()
-			  	&& mTransferts.empty())
+			if(isIdle())
 			{
-				// Keep Alive
-				String args;
-				args << unsigned(cryptrand());
-				StringMap parameters;
-				DesynchronizeStatement(this, Handler::sendCommand(mStream, "K", args, parameters));
+				DesynchronizeStatement(this, sendKeepAlive());
 
 				//LogDebug("Core::Handler::Sender", "No pending tasks, waiting");
-				wait(readTimeout/2);
+				double timeout = readTimeout/2;
+				while(!mShouldStop && isIdle() && wait(timeout)) {}	// readers notify often
 				if(mShouldStop) break;
 			}
 			
-			for(int i=0; i<mRequestsToRespond.size(); ++i)
+			send();
+		}
+		
+		LogDebug("Core::Handler::Sender", "Finished");
+	}
+	catch(const std::exception &e)
+	{
+		LogError("Core::Handler::Sender", e.what()); 
+	}
+}
+
+void Core::Handler::Sender::notify(void) const
+{
+	Synchronizable::notify();
+	if(mReactor) const_cast<Sender*>(this)->schedule();
+}
+
+bool Core::Handler::Sender::isIdle(void) const
+{
+	if(!mNotificationsQueue.empty() || !mRequestsQueue.empty())
+		return false;
+	
+	// Transferts waiting for credit do not count
+	for(Map<unsigned, Transfert>::const_iterator it = mTransferts.begin();
+		it != mTransferts.end();
+		++it)
+	{
+		if(hasCredit(it->second))
+			return false;
+	}
+	
+	for(Map<unsigned, ReceiveWindow>::const_iterator it = mWindows.begin();
+		it != mWindows.end();
+		++it)
+	{
+		if(isWindowUpdateDue(it->second))
+			return false;
+	}
+	
+	return true;
+}
+
+bool Core::Handler::Sender::hasCredit(const Transfert &transfert) const
+{
+	return (!mFlowControl || transfert.credit > 0);
+}
+
+bool Core::Handler::Sender::hasPriorityTraffic(void) const
+{
+	if(!mNotificationsQueue.empty() || !mRequestsQueue.empty())
+		return true;
+	
+	for(int i=0; i<mRequestsToRespond.size(); ++i)
+	{
+		Request *request = mRequestsToRespond[i];
+		Synchronize(request);
+		for(int j=0; j<request->responsesCount(); ++j)
+			if(!request->response(j)->mTransfertStarted) 
+				return true;
+	}
+	
+	return false;
+}
+
+bool Core::Handler::Sender::isWindowUpdateDue(const ReceiveWindow &window) const
+{
+	// Unread data in the pipe counts against the window, so a stalled reader stops the transfer,
+	// except for a request content sink which is the final destination and is never read
+	uint64_t outstanding = window.granted - window.received;
+	uint64_t buffered = (window.direct ? 0 : window.content->pending());
+	
+	return outstanding + buffered <= ChannelWindow/2;
+}
+
+void Core::Handler::Sender::send(void)
+{
+	Synchronize(this);
+	
+	if(!mWindows.empty()) sendWindowUpdates();
+	
+	for(int i=0; i<mRequestsToRespond.size(); ++i)
+	{
+		Request *request = mRequestsToRespond[i];
+		Synchronize(request);
+		
+		for(int j=0; j<request->responsesCount(); ++j)
+		{
+			Request::Response *response = request->response(j);
+			if(!response->mTransfertStarted)
 			{
-				Request *request = mRequestsToRespond[i];
-				Synchronize(request);
-				
-				for(int j=0; j<request->responsesCount(); ++j)
-				{
-					Request::Response *response = request->response(j);
-					if(!response->mTransfertStarted)
-					{
-						unsigned channel = 0;
-
-						response->mTransfertStarted = true;
-						if(!response->content()) response->mTransfertFinished = true;
-						else {
-							++mLastChannel;
-							channel = mLastChannel;
-							
-							LogDebug("Core::Handler::Sender", "Start sending on channel "+String::number(channel));
-							mTransferts.insert(channel,response);
-						}
-						
-						//LogDebug("Core::Handler::Sender", "Sending response " + String::number(j) + " for request " + String::number(request->id()));
-						
-						int status = response->status();
-						if(status == Request::Response::Success && j != request->responsesCount()-1)
-							status = Request::Response::Pending;
-						
-						String args;
-						args << request->id() << " " << status << " " <<channel;
-						DesynchronizeStatement(this, Handler::sendCommand(mStream, "R", args, response->mParameters));
-					}
+				unsigned channel = 0;
+
+				response->mTransfertStarted = true;
+				if(!response->content()) response->mTransfertFinished = true;
+				else {
+					++mLastChannel;
+					channel = mLastChannel;
+					
+					LogDebug("Core::Handler::Sender", "Start sending on channel "+String::number(channel));
+					
+					Transfert transfert;
+					transfert.response = response;
+					transfert.weight = request->mWeight;
+					transfert.deficit = 0;
+					transfert.credit = mInitialCredit;
+					mTransferts.insert(channel, transfert);
 				}
+				
+				//LogDebug("Core::Handler::Sender", "Sending response " + String::number(j) + " for request " + String::number(request->id()));
+				
+				int status = response->status();
+				if(status == Request::Response::Success && j != request->responsesCount()-1)
+					status = Request::Response::Pending;
+				
+				String args;
+				args << request->id() << " " << status << " " <<channel;
+				DesynchronizeStatement(this, sendCommand("R", args, response->mParameters));
 			}
+		}
+	}
+	
+	// Notifications are a strict high priority class
+	while(!mNotificationsQueue.empty())
+	{
+		const Notification &notification = mNotificationsQueue.front();
+		unsigned length = notification.content().size();
+		
+		// The remote side would drop the link on larger content
+		if(mBinaryFraming && length > MaxFramePayload)
+		{
+			LogWarn("Core::Handler::Sender", "Dropping notification, content is too large");
+			mNotificationsQueue.pop();
+			continue;
+		}
+		
+		//LogDebug("Core::Handler::Sender", "Sending notification");
+
+		String args = "";
+		StringMap parameters = notification.parameters();
+		parameters["length"] << length;
+		
+		DesynchronizeStatement(this, sendCommand("M", args, parameters));
+		DesynchronizeStatement(this, mStream->write(notification.mContent));
+		mNotificationsQueue.pop();
+	}
+	  
+	while(!mRequestsQueue.empty() && mNotificationsQueue.empty())
+	{
+		const RequestInfo &request = mRequestsQueue.front();
+		
+		if(request.cancel)
+		{
+			String args;
+			args << request.id;
+			StringMap parameters;
+			parameters["request"] << true;
+			DesynchronizeStatement(this, sendCommand("C", args, parameters));
 			
-			if(!mNotificationsQueue.empty())
-			{
-				const Notification &notification = mNotificationsQueue.front();
-				unsigned length = notification.content().size();
-				
-				//LogDebug("Core::Handler::Sender", "Sending notification");
+			mRequestsQueue.pop();
+			continue;
+		}
+		
+		//LogDebug("Core::Handler::Sender", "Sending request "+String::number(request.id));
+		
+		String command;
+		if(request.isData) command = "G";
+		else command = "I";
+		
+		StringMap parameters = request.parameters;
+		if(request.weight != Request::DefaultWeight)
+			parameters["weight"] << request.weight;
+		
+		String args;
+		args << request.id << " " << request.target;
+		DesynchronizeStatement(this, sendCommand(command, args, parameters));
+		
+		mRequestsQueue.pop();
+	}
 
-				String args = "";
-				StringMap parameters = notification.parameters();
-				parameters["length"] << length;
-				
-				DesynchronizeStatement(this, Handler::sendCommand(mStream, "M", args, parameters));
-				DesynchronizeStatement(this, mStream->write(notification.mContent));
-				mNotificationsQueue.pop();
+	// Bulk data is scheduled with deficit round-robin, each channel
+	// may send up to weight chunks per round within its credit
+	Array<unsigned> channels;
+	mTransferts.getKeys(channels);
+	
+	// Resume the round where it was interrupted
+	int first = 0;
+	while(first < channels.size() && channels[first] < mNextChannel) ++first;
+	
+	for(int i=0; i<channels.size(); ++i)
+	{
+		unsigned channel = channels[(first + i) % channels.size()];
+		mNextChannel = channel;
+		
+		while(true)
+		{
+			SyncYield(this);
+			
+			// Check for traffic with higher priority
+			if(hasPriorityTraffic())
+			{
+				finishResponses();
+				return;
 			}
-			  
-			if(!mRequestsQueue.empty())
+			
+			// The transfert may have been cancelled while unlocked
+			Map<unsigned, Transfert>::iterator it = mTransferts.find(channel);
+			if(it == mTransferts.end()) break;
+			Transfert &transfert = it->second;
+			
+			// Send only within the credit granted by the receiver
+			if(!hasCredit(transfert))
+			{
+				transfert.deficit = 0;
+				break;
+			}
+			
+			if(!transfert.deficit) transfert.deficit = uint64_t(transfert.weight)*ChunkSize;
+			
+			size_t chunkSize = size_t(std::min(transfert.deficit, uint64_t(ChunkSize)));
+			if(mFlowControl) chunkSize = size_t(std::min(transfert.credit, uint64_t(chunkSize)));
+			
+			// Data is read directly after the room for the frame header
+			char frame[FrameHeaderSize + ChunkSize];
+			char *buffer = frame + FrameHeaderSize;
+			size_t size = 0;
+			
+			Request::Response *response = transfert.response;
+			try {
+				ByteStream *content = response->content();
+				size = content->readData(buffer, chunkSize);
+			}
+			catch(const Exception &e)
 			{
-				const RequestInfo &request = mRequestsQueue.front();
-				//LogDebug("Core::Handler::Sender", "Sending request "+String::number(request.id));
+				LogWarn("Core::Handler::Sender", "Error on channel " + String::number(channel) + ": " + e.what());
 				
-				String command;
-				if(request.isData) command = "G";
-				else command = "I";
+				response->mTransfertFinished = true;
+				mTransferts.erase(it);
 				
 				String args;
-				args << request.id << " " << request.target;
-				DesynchronizeStatement(this, Handler::sendCommand(mStream, command, args, request.parameters));
-				
-				mRequestsQueue.pop();
+				args << channel << " " << Request::Response::ReadFailed;
+				StringMap parameters;
+				parameters["notification"] = e.what();
+				DesynchronizeStatement(this, sendCommand("E", args, parameters));
+				break;
 			}
 
-			Array<unsigned> channels;
-			mTransferts.getKeys(channels);
+			transfert.deficit-= size;
+			if(mFlowControl) transfert.credit-= size;
 			
-			for(int i=0; i<channels.size(); ++i)
+			if(size == 0)
 			{
-				SyncYield(this);
-			  
-				// Check for tasks with higher priority
-				if(!mNotificationsQueue.empty()
-				|| !mRequestsQueue.empty())
-					break;
-			  	
-				for(int j=0; j<mRequestsToRespond.size(); ++j)
-				{
-					Synchronize(mRequestsToRespond[j]);
-					for(int k=0; k<mRequestsToRespond[j]->responsesCount(); ++k)
-						if(!mRequestsToRespond[j]->response(k)->mTransfertStarted) 
-							break;
-				}
-				
-				unsigned channel = channels[i];
-				Request::Response *response;
-				if(!mTransferts.get(channel, response)) continue;
-				
-				char buffer[ChunkSize];
-				size_t size = 0;
-				
-				try {
-					ByteStream *content = response->content();
-					size = content->readData(buffer, ChunkSize);
-				}
-				catch(const Exception &e)
-				{
-					LogWarn("Core::Handler::Sender", "Error on channel " + String::number(channel) + ": " + e.what());
-					
-					response->mTransfertFinished = true;
-					mTransferts.erase(channel);
-					
-					String args;
-					args << channel << " " << Request::Response::ReadFailed;
-					StringMap parameters;
-					parameters["notification"] = e.what();
-					DesynchronizeStatement(this, Handler::sendCommand(mStream, "E", args, parameters));
-					continue;
-				}
-
+				LogDebug("Core::Handler::Sender", "Finished sending on channel "+String::number(channel));
+				response->mTransfertFinished = true;
+				mTransferts.erase(it);
+			}
+			
+			if(mBinaryFraming)
+			{
+				writeFrameHeader(frame, 'D', channel, uint32_t(size));
+				DesynchronizeStatement(this, mStream->writeData(frame, FrameHeaderSize + size));
+			}
+			else {
 				String args;
 				args << channel;
 				StringMap parameters;
 				parameters["length"] << size;
-				DesynchronizeStatement(this, Handler::sendCommand(mStream, "D", args, parameters));
-
-				if(size == 0)
-				{
-					LogDebug("Core::Handler::Sender", "Finished sending on channel "+String::number(channel));
-					response->mTransfertFinished = true;
-					mTransferts.erase(channel);
-				}
-				else {
-				 	DesynchronizeStatement(this, mStream->writeData(buffer, size));
-				}
+				DesynchronizeStatement(this, sendCommand("D", args, parameters));
+				if(size) DesynchronizeStatement(this, mStream->writeData(buffer, size));
 			}
 			
-			for(int i=0; i<mRequestsToRespond.size(); ++i)
+			if(size == 0) break;
+			
+			// The quantum is spent, next channel
+			if(!mTransferts.contains(channel) || !mTransferts[channel].deficit)
+				break;
+		}
+	}
+	
+	// Next round starts after the last channel
+	mNextChannel = (channels.empty() ? 0 : channels[(first + channels.size() - 1) % channels.size()] + 1);
+	
+	finishResponses();
+}
+
+void Core::Handler::Sender::finishResponses(void)
+{
+	Synchronize(this);
+	
+	for(int i=0; i<mRequestsToRespond.size(); ++i)
+	{
+		Request *request = mRequestsToRespond[i];
+		
+		{
+			Synchronize(request);
+			
+			if(request->isPending()) continue;
+
+			bool finished = true;
+			for(int j=0; j<request->responsesCount(); ++j)
 			{
-				Request *request = mRequestsToRespond[i];
-				
-				{
-					Synchronize(request);
-					
-					if(request->isPending()) continue;
+				Request::Response *response = request->response(j);
+				finished&= response->mTransfertFinished;
+			}
 
-					bool finished = true;
-					for(int j=0; j<request->responsesCount(); ++j)
-					{
-						Request::Response *response = request->response(j);
-						finished&= response->mTransfertFinished;
-					}
+			if(!finished) continue;
+		}
+		
+		mRequestsToRespond.erase(i);
+		request->mId = 0;	// request MUST NOT be suppressed from the core like a sent request !
+		delete request; 
+	}
+}
 
-					if(!finished) continue;
-				}
+void Core::Handler::Sender::sendKeepAlive(void)
+{
+	String args;
+	args << unsigned(cryptrand());
+	StringMap parameters;
+	sendCommand("K", args, parameters);
+}
+
+void Core::Handler::Sender::sendWindowUpdates(void)
+{
+	// All pending updates are sent in a single command. Credit flows against the data it grants,
+	// and the receiving side usually has no D or R frame of its own to carry it. The fixed
+	// 9-byte D header has no room for it anyway, so the update is a frame of its own.
+	StringMap parameters;
+	for(Map<unsigned, ReceiveWindow>::iterator it = mWindows.begin();
+		it != mWindows.end();
+		++it)
+	{
+		ReceiveWindow &window = it->second;
+		if(!isWindowUpdateDue(window)) continue;
+		
+		uint64_t outstanding = window.granted - window.received;
+		uint64_t buffered = (window.direct ? 0 : window.content->pending());
+		
+		uint64_t credit = ChannelWindow - outstanding - buffered;
+		window.granted+= credit;
+		parameters[String::number(it->first)] << credit;
+	}
+	
+	if(!parameters.empty())
+		DesynchronizeStatement(this, sendCommand("W", "", parameters));
+}
+
+void Core::Handler::Sender::schedule(void)
+{
+	// Only the pump state is locked here, as notify() may be called under request or pipe locks
+	Synchronize(&mPumpSync);
+	Assert(mReactor);
+	if(mShouldStop || mPumpScheduled) return;
+	
+	// If the pump is running, it will dispatch itself again when it returns
+	mPumpScheduled = true;
+	if(!mPumping) mReactor->dispatch(&mPumpTask);
+}
+
+void Core::Handler::Sender::pump(void)
+{
+	{
+		Synchronize(&mPumpSync);
+		mPumpScheduled = false;
+		mPumping = true;
+	}
+	
+	bool again = false;
+	
+	{
+		Synchronize(this);
+		if(!mShouldStop)
+		{
+			try {
+				if(mKeepAlive && isIdle()) 
+					DesynchronizeStatement(this, sendKeepAlive());
+				mKeepAlive = false;
 				
-				mRequestsToRespond.erase(i);
-				request->mId = 0;	// request MUST NOT be suppressed from the core like a sent request !
-				delete request; 
+				// One pass only, pending transferts are resumed by dispatching again
+				// so the worker is shared fairly between links.
+				// Nothing more is queued while the socket is behind, writable() resumes the pump.
+				if(!mOutput || mOutput->pending() < Output::MaxPending)
+				{
+					send();
+					again = !isIdle();
+				}
+			}
+			catch(const std::exception &e)
+			{
+				LogWarn("Core::Handler::Sender", e.what());
+				mShouldStop = true;
 			}
 		}
-		
-		LogDebug("Core::Handler::Sender", "Finished");
 	}
-	catch(const std::exception &e)
+	
+	Synchronize(&mPumpSync);
+	mPumping = false;
+	
+	if(!mShouldStop && (again || mPumpScheduled))
 	{
-		LogError("Core::Handler::Sender", e.what()); 
+		mPumpScheduled = true;
+		mReactor->dispatch(&mPumpTask);
+	}
+	
+	mPumpSync.notifyAll();
+}
+
+void Core::Handler::Sender::stop(void)
+{
+	SynchronizeStatement(this, mShouldStop = true);
+	
+	if(mReactor)
+	{
+		Synchronize(&mPumpSync);
+		if(mPumpScheduled && !mPumping && mReactor->cancel(&mPumpTask)) 
+			mPumpScheduled = false;
+		while(mPumping) mPumpSync.wait();
+	}
+	else if(isRunning())
+	{
+		Synchronizable::notify();
+		join();
 	}
 }
 
+void Core::Handler::Sender::sendCommand(const String &command, const String &args, const StringMap &parameters)
+{
+	if(mBinaryFraming) Handler::sendFrame(mStream, command, args, parameters);
+	else Handler::sendCommand(mStream, command, args, parameters);
+}
+
 }
@@ -25,6 +25,8 @@
 #include "tpn/include.h"
 #include "tpn/address.h"
 #include "tpn/stream.h"
+#include "tpn/bufferedstream.h"
+#include "tpn/bytechain.h"
 #include "tpn/serversocket.h"
 #include "tpn/socket.h"
 #include "tpn/pipe.h"
@@ -35,6 +37,10 @@
 #include "tpn/notification.h"
 #include "tpn/request.h"
 #include "tpn/scheduler.h"
+#include "tpn/reactor.h"
+#include "tpn/fairpool.h"
+#include "tpn/relay.h"
+#include "tpn/aescipher.h"
 #include "tpn/synchronizable.h"
 #include "tpn/map.h"
 #include "tpn/array.h"
@@ -81,15 +87,99 @@ public:
 	LinkStatus addPeer(Socket *sock, const Identifier &peering, bool async = false);
 	bool hasPeer(const Identifier &peering);
 	bool getInstancesNames(const Identifier &peering, Array<String> &array);
+	bool supportsFormat(const Identifier &peering, const String &format);	// all links to peering accept format
 	
 	bool sendNotification(const Notification &notification);
 	unsigned addRequest(Request *request);
 	void removeRequest(unsigned id);
+	
+	// Sender queue depths per traffic class, summed over all links
+	struct QueueDepths
+	{
+		unsigned notifications;	// strict high priority
+		unsigned requests;
+		unsigned responses;	// remote requests being answered
+		unsigned transferts;	// weighted bulk data
+		unsigned stalled;	// transferts waiting for credit
+	};
+	
+	void getQueueDepths(QueueDepths &depths);
+	
+	// Handshake counters, derivation times are cumulative in seconds
+	struct HandshakeStats
+	{
+		unsigned full;		// full key derivation
+		unsigned resumed;	// resumed from a session ticket
+		double fullTime;
+		double resumedTime;
+	};
+	
+	void getHandshakeStats(HandshakeStats &stats);
+	
+	// Incoming connection counters, latencies are cumulative in seconds
+	struct AcceptStats
+	{
+		unsigned accepted;
+		unsigned rejected;	// handshake queue full or too many from the source
+		unsigned limited;	// source address over its handshake rate
+		unsigned queued;	// waiting for a handshake worker
+		unsigned active;	// being handled by a handshake worker
+		unsigned started;
+		double acceptLatency;	// from accept to handshake start
+		double maxAcceptLatency;
+	};
+	
+	void getAcceptStats(AcceptStats &stats);
+	
+	// Remote requests are executed by a shared pool with fair queuing between peerings
+	typedef FairPool::Stats RequestStats;
+	void getRequestStats(RequestStats &stats);
 
 private:
 	void run(void);
+	
+	// Incoming connections are sniffed and authenticated by a bounded pool
+	struct Incoming
+	{
+		Socket *sock;
+		Address addr;
+		Time time;
+	};
+	
+	struct RateBucket
+	{
+		double tokens;
+		Time time;
+	};
+	
+	class HandshakeWorker : public Thread
+	{
+	public:
+		HandshakeWorker(Core *core);
+		~HandshakeWorker(void);
+		
+	private:
+		void run(void);
+		
+		Core *mCore;
+	};
+	
+	void processIncoming(const Incoming &incoming);
+	bool checkHandshakeRate(const Address &addr);
+	
+	// Session ticket negotiated on first authentication with a peering
+	struct Ticket
+	{
+		ByteString id;
+		ByteString key;		// pseudo-random key for session key derivation
+		Time expiry;
+	};
+	
+	bool getTicket(const Identifier &peering, Ticket &ticket);
+	void addTicket(const Identifier &peering, const Ticket &ticket);
+	void removeTicket(const Identifier &peering);
 
-	class Handler : public Thread, public Synchronizable
+	class Handler : public Thread, public Synchronizable, public Reactor::Client, protected Request::Callback
 	{
 	public:
 		Handler(Core *core, ByteStream *bs, const Address &remoteAddr);
@@ -101,11 +191,15 @@ private:
 		void sendNotification(const Notification &notification);
 		void addRequest(Request *request);
 		void removeRequest(unsigned id);
+		void getQueueDepths(QueueDepths &depths);
+		
+		bool handshake(void);	// returns true if the handler was handed off to the forwarding lookup, it must not be touched anymore
 		
 		bool isIncoming(void) const;
 		bool isAuthenticated(void) const;
 		bool isEstablished(void) const;
 		LinkStatus linkStatus(void) const;
+		bool supportsFormat(const String &format) const;
 
 	protected:
 		static const int NotFound = 1;
@@ -122,22 +216,175 @@ private:
 		       			String &args,
 					StringMap &parameters);
 		
+		// Returns the first supported cipher of a comma-separated list, or an empty string
+		static String chooseCipher(const String &offered, const String &accepted);
+		
+		// Binary framing: fixed header (opcode, channel, length) followed by payload
+		static const size_t FrameHeaderSize = 9;
+		static const size_t MaxFramePayload;
+		
+		// Flow control: bytes a sender may have in flight per channel
+		static const size_t ChannelWindow;
+		
+		static void sendFrame(	Stream *stream,
+					const String &command,
+					const String &args,
+					const StringMap &parameters);
+		
+		static bool recvFrameHeader(	Stream *stream,
+						char &opcode,
+						uint32_t &channel,
+						uint32_t &length);
+		
+		static void recvFramePayload(	Stream *stream,
+						uint32_t length,
+						String &args,
+						StringMap &parameters);
+		
+		static void readFrameHeader(const char *header, char &opcode, uint32_t &channel, uint32_t &length);
+		static void readFramePayload(const char *data, size_t size, String &args, StringMap &parameters);
+		static void writeFrameHeader(char *header, char opcode, uint32_t channel, uint32_t length);
+		static void writeVarint(String &out, uint64_t value);
+		static bool readVarint(const char *&data, const char *end, uint64_t &value);
+		
+		static void derivateKey(const ByteString &secret, const ByteString &salt, const ByteString &ticketKey, ByteString &key);
+		
 	private:
+		bool authenticate(void);
+		void forward(void);
 		void process(void);
+		bool processCommand(Stream *input, const String &command, String &args, StringMap &parameters);
+		void processData(Stream *input, unsigned channel, unsigned size);
+		void processData(const char *data, unsigned channel, unsigned size);
+		ByteStream *acceptData(unsigned channel, unsigned size);	// returns the content sink, or NULL if the chunk is dropped
+		void dataWritten(unsigned channel);
+		void closeChannel(unsigned channel);
+		void finish(void);
 		void run(void);
+		
+		// Reactor mode
+		static const size_t MaxRawInput;	// the socket is not read above this many unprocessed bytes
+		void readable(void);
+		void writable(void);
+		void updateWatch(void);
+		void processInput(void);
+		bool processFrames(void);
+		void checkTimeout(void);
+		void disconnect(void);
+		
+		class HandlerTask : public Task
+		{
+		public:
+			typedef void (Handler::*Function)(void);
+			HandlerTask(Handler *handler, Function function) : mHandler(handler), mFunction(function) {}
+			void run(void) { (mHandler->*mFunction)(); }
+			
+		private:
+			Handler *mHandler;
+			Function mFunction;
+		};
+		
+		class DeleteTask : public Task
+		{
+		public:
+			DeleteTask(Handler *handler) : mHandler(handler) {}
+			void run(void);
+			
+		private:
+			Handler *mHandler;
+		};
+		
+		class Sender;
+		
+		class RequestTask : public Task
+		{
+		public:
+			RequestTask(Handler *handler, Listener *listener, Request *request);
+			void run(void);
+			void cancel(void);	// must be removed from the pool first, deletes the task
+			
+		private:
+			Handler *mHandler;
+			Identifier mPeering;
+			Listener *mListener;
+			Request *mRequest;
+			Sender  *mSender;
+		};
+		
+		// Reactor mode output, ciphertext is queued and sent as the socket accepts it
+		class Output : public ByteStream, public Synchronizable
+		{
+		public:
+			static const size_t MaxPending;	// the sender waits for the socket above this many queued bytes
+			
+			Output(Handler *handler, Socket *sock);
+			
+			size_t pending(void) const;
+			void flush(void);	// non-blocking
+			
+			// ByteStream
+			size_t readData(char *buffer, size_t size);	// write-only, returns 0
+			void writeData(const char *data, size_t size);
+			
+		private:
+			Handler *mHandler;
+			Socket *mSocket;
+			ByteChain mQueue;
+			ByteString mSegment;	// first segment, partially sent
+		};
+		
+		void cancelRequestTasks(void);
 
 		Identifier mPeering, mRemotePeering;
 		Core	*mCore;
 		ByteStream  *mRawStream;
-		Stream  *mStream;
+		BufferedStream  *mStream;
 		Address mRemoteAddr;
 		bool mIsIncoming;
+		bool mBinaryFraming;
+		bool mFlowControl;
+		uint64_t mRemoteWindow;
+		Set<String> mRemoteFormats;	// payload formats advertised by the remote side
 		LinkStatus mLinkStatus;
 		Map<unsigned, Request*> mRequests;
 		Map<unsigned, Request::Response*> mResponses;
 		Set<unsigned> mCancelled;
-		Scheduler mScheduler;
+		Map<unsigned, RequestTask*> mRequestTasks;	// queued on the request pool
+		unsigned mRunningTasks;
+		bool mRequestCancel;	// remote side accepts cancels for requests
 		bool mStopping;
+		bool mHandshakeDone;
+		bool mHandshakeSucceeded;
+		
+		// Forwarding for a non local peering, the peer lookup completes through the callbacks
+		void response(Request *request, Request::Response *response);
+		void finished(Request *request, bool timeout);
+		bool mForwarding;
+		Request *mLookup;
+		String mForwardRemote;
+		
+		// Relayed connection, transferred by the handler thread
+		Stream *mForwardedStream;
+		ByteStream *mForwardedRawStream;
+		
+		Reactor *mReactor;
+		Socket *mSocket;
+		AesCipher *mInputCipher;
+		AesCipher *mOutputCipher;	// writes to mOutput
+		Output *mOutput;
+		ByteChain mRawInput, mCipherInput;
+		String mInput;
+		Time mLastInputTime;
+		Synchronizable mInputSync;
+		bool mInputScheduled;
+		bool mInputPaused;
+		bool mDisconnected;
+		Synchronizable mWatchSync;	// serializes watch updates
+		bool mWatchReadable;
+		bool mWatchWritable;
+		HandlerTask mInputTask;
+		HandlerTask mTimeoutTask;
+		HandlerTask mFinishTask;
 
 		ByteString mObfuscatedHello;
 		
@@ -147,9 +394,31 @@ private:
 			Sender(void);
 			~Sender(void);
 
+			void notify(void) const;
+			
 		private:
 			static const size_t ChunkSize;
 			void run(void);
+			bool isIdle(void) const;
+			void send(void);
+			void sendKeepAlive(void);
+			void sendWindowUpdates(void);
+			void sendCommand(const String &command, const String &args, const StringMap &parameters);
+			
+			// Reactor mode, sending is done by a task instead of a thread
+			void schedule(void);
+			void pump(void);
+			void stop(void);
+			
+			class PumpTask : public Task
+			{
+			public:
+				PumpTask(Sender *sender) : mSender(sender) {}
+				void run(void) { mSender->pump(); }
+				
+			private:
+				Sender *mSender;
+			};
 
 			struct RequestInfo
 			{
@@ -157,15 +426,51 @@ private:
 				String target;
 				StringMap parameters;
 				bool isData;
+				unsigned weight;
+				bool cancel;	// cancel for a request already sent
+			};
+			
+			struct Transfert
+			{
+				Request::Response *response;
+				unsigned weight;
+				uint64_t deficit;	// bytes left in the current round
+				uint64_t credit;	// flow control credit
 			};
 			
+			struct ReceiveWindow
+			{
+				Pipe *content;
+				bool direct;		// written to the request content sink, the pipe is not read
+				uint64_t granted;	// total bytes allowed so far
+				uint64_t received;	// total bytes received so far
+			};
+			
+			bool isWindowUpdateDue(const ReceiveWindow &window) const;
+			bool hasCredit(const Transfert &transfert) const;
+			bool hasPriorityTraffic(void) const;
+			void finishResponses(void);
+			
 			Stream *mStream;
+			bool mBinaryFraming;
 			unsigned mLastChannel;
-			Map<unsigned, Request::Response*> mTransferts;
+			Map<unsigned, Transfert> mTransferts;
+			unsigned mNextChannel;		// deficit round-robin position
+			Map<unsigned, ReceiveWindow> mWindows;
+			bool mFlowControl;
+			uint64_t mInitialCredit;
 			Queue<Notification>	mNotificationsQueue;
 			Queue<RequestInfo> 	mRequestsQueue;
 			Array<Request*> mRequestsToRespond;
 			bool mShouldStop;
+			
+			Reactor *mReactor;
+			Output *mOutput;		// reactor mode output queue
+			PumpTask mPumpTask;
+			Synchronizable mPumpSync;	// guards pump state only, may be locked under other locks
+			bool mPumpScheduled;
+			bool mPumping;
+			bool mKeepAlive;
 			friend class Handler;
 		};
 
@@ -177,11 +482,25 @@ private:
 
 	String mName;
 	ServerSocket mSock;
+	Reactor *mReactor;
+	FairPool *mRequestPool;
+	Relay *mRelay;
 	Map<Identifier, Identifier> mPeerings;
 	Map<Identifier, ByteString> mSecrets;
 	Map<Identifier, Listener*> mListeners;
 	Map<Identifier, Handler*>  mRedirections;
 	Map<Identifier, Handler*> mHandlers;
+	Map<Identifier, Ticket> mTickets;
+	HandshakeStats mHandshakeStats;
+	
+	Array<HandshakeWorker*> mHandshakeWorkers;
+	Queue<Incoming> mIncoming;
+	Map<String, unsigned> mIncomingSources;
+	Map<String, RateBucket> mHandshakeRates;
+	Synchronizable mIncomingSync;
+	AcceptStats mAcceptStats;
+	unsigned mMaxIncoming;
+	bool mIncomingClosed;
 	
 	unsigned mLastRequest;
 
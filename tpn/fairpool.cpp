@@ -0,0 +1,210 @@
+/*************************************************************************
+ *   Copyright (C) 2011-2013 by Paul-Louis Ageneau                       *
+ *   paul-louis (at) ageneau (dot) org                                   *
+ *                                                                       *
+ *   This file is part of TeapotNet.                                     *
+ *                                                                       *
+ *   TeapotNet is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU Affero General Public License as      *
+ *   published by the Free Software Foundation, either version 3 of      *
+ *   the License, or (at your option) any later version.                 *
+ *                                                                       *
+ *   TeapotNet is distributed in the hope that it will be useful, but    *
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the        *
+ *   GNU Affero General Public License for more details.                 *
+ *                                                                       *
+ *   You should have received a copy of the GNU Affero General Public    *
+ *   License along with TeapotNet.                                       *
+ *   If not, see <http://www.gnu.org/licenses/>.                         *
+ *************************************************************************/
+
+
+#include "tpn/fairpool.h"
+#include "tpn/exception.h"
+
+namespace tpn
+{
+
+FairPool::FairPool(unsigned workers, unsigned maxPerSource) :
+	mMaxPerSource(std::max(maxPerSource, 1U)),
+	mShouldStop(false)
+{
+	std::memset(&mStats, 0, sizeof(mStats));
+	
+	Synchronize(this);
+	
+	for(unsigned i=0; i<std::max(workers, 1U); ++i)
+	{
+		Worker *worker = new Worker(this);
+		mWorkers.push_back(worker);
+		worker->start();
+	}
+}
+
+FairPool::~FairPool(void)
+{
+	{
+		Synchronize(this);
+		mShouldStop = true;
+		mSources.clear();
+		mRound.clear();
+		notifyAll();
+	}
+	
+	for(int i=0; i<mWorkers.size(); ++i)
+		delete mWorkers[i];	// joins
+}
+
+void FairPool::launch(const Identifier &source, Task *task)
+{
+	Assert(task);
+	Synchronize(this);
+	if(mShouldStop) return;
+	
+	Source &s = mSources[source];
+	
+	Entry entry;
+	entry.task = task;
+	entry.time = Time::Now();
+	s.queue.push_back(entry);
+	++mStats.queued;
+	
+	schedule(source, s);
+}
+
+bool FairPool::cancel(const Identifier &source, Task *task)
+{
+	Synchronize(this);
+	
+	Map<Identifier, Source>::iterator it = mSources.find(source);
+	if(it == mSources.end()) return false;
+	
+	Source &s = it->second;
+	for(List<Entry>::iterator jt = s.queue.begin(); jt != s.queue.end(); ++jt)
+	{
+		if(jt->task == task)
+		{
+			s.queue.erase(jt);
+			--mStats.queued;
+			++mStats.cancelled;
+			
+			if(s.queue.empty() && s.scheduled)
+			{
+				mRound.remove(source);
+				s.scheduled = false;
+			}
+			
+			release(source);
+			return true;
+		}
+	}
+	
+	return false;
+}
+
+void FairPool::getStats(Stats &stats) const
+{
+	Synchronize(this);
+	stats = mStats;
+}
+
+Task *FairPool::next(Identifier &source)
+{
+	// Must be called with the lock
+	while(mRound.empty() && !mShouldStop) wait();
+	if(mShouldStop) return NULL;
+	
+	source = mRound.front();
+	mRound.pop_front();
+	
+	Source &s = mSources[source];
+	s.scheduled = false;
+	Assert(!s.queue.empty());
+	
+	Entry entry = s.queue.front();
+	s.queue.pop_front();
+	--mStats.queued;
+	
+	++s.running;
+	++mStats.running;
+	
+	double latency = std::max(Time::Now() - entry.time, 0.);
+	mStats.queueLatency+= latency;
+	mStats.maxQueueLatency = std::max(mStats.maxQueueLatency, latency);
+	
+	// The source goes back to the end of the round if it can run more tasks
+	schedule(source, s);
+	return entry.task;
+}
+
+void FairPool::finished(const Identifier &source)
+{
+	// Must be called with the lock
+	++mStats.executed;
+	--mStats.running;
+	
+	Map<Identifier, Source>::iterator it = mSources.find(source);
+	if(it == mSources.end()) return;
+	
+	--it->second.running;
+	schedule(source, it->second);
+	release(source);
+}
+
+void FairPool::schedule(const Identifier &source, Source &s)
+{
+	// Must be called with the lock
+	if(!s.scheduled && !s.queue.empty() && s.running < mMaxPerSource)
+	{
+		s.scheduled = true;
+		mRound.push_back(source);
+		notify();
+	}
+}
+
+void FairPool::release(const Identifier &source)
+{
+	// Must be called with the lock
+	Map<Identifier, Source>::iterator it = mSources.find(source);
+	if(it != mSources.end() && it->second.queue.empty() && !it->second.running)
+		mSources.erase(it);
+}
+
+FairPool::Worker::Worker(FairPool *pool) :
+	mPool(pool)
+{
+
+}
+
+void FairPool::Worker::run(void)
+{
+	while(true)
+	{
+		Identifier source;
+		Task *task = NULL;
+		
+		{
+			Synchronize(mPool);
+			task = mPool->next(source);
+			if(!task) break;
+		}
+		
+		// The task may delete itself
+		try {
+			task->run();
+		}
+		catch(const std::exception &e)
+		{
+			LogWarn("FairPool::Worker", String("Unhandled exception in task: ") + e.what());
+		}
+		catch(...)
+		{
+			LogWarn("FairPool::Worker", "Unknown exception in task");
+		}
+		
+		SynchronizeStatement(mPool, mPool->finished(source));
+	}
+}
+
+}
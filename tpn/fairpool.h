@@ -0,0 +1,106 @@
+/*************************************************************************
+ *   Copyright (C) 2011-2013 by Paul-Louis Ageneau                       *
+ *   paul-louis (at) ageneau (dot) org                                   *
+ *                                                                       *
+ *   This file is part of TeapotNet.                                     *
+ *                                                                       *
+ *   TeapotNet is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU Affero General Public License as      *
+ *   published by the Free Software Foundation, either version 3 of      *
+ *   the License, or (at your option) any later version.                 *
+ *                                                                       *
+ *   TeapotNet is distributed in the hope that it will be useful, but    *
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the        *
+ *   GNU Affero General Public License for more details.                 *
+ *                                                                       *
+ *   You should have received a copy of the GNU Affero General Public    *
+ *   License along with TeapotNet.                                       *
+ *   If not, see <http://www.gnu.org/licenses/>.                         *
+ *************************************************************************/
+
+
+#ifndef TPN_FAIRPOOL_H
+#define TPN_FAIRPOOL_H
+
+#include "tpn/include.h"
+#include "tpn/synchronizable.h"
+#include "tpn/thread.h"
+#include "tpn/task.h"
+#include "tpn/identifier.h"
+#include "tpn/time.h"
+#include "tpn/array.h"
+#include "tpn/list.h"
+#include "tpn/map.h"
+
+namespace tpn
+{
+
+// Bounded pool of workers with fair queuing between sources
+// Each source has its own queue and a cap on tasks running concurrently,
+// sources with runnable tasks are served round-robin.
+class FairPool : protected Synchronizable
+{
+public:
+	// Latencies are cumulative in seconds
+	struct Stats
+	{
+		unsigned queued;	// waiting for a worker
+		unsigned running;
+		unsigned executed;
+		unsigned cancelled;
+		double queueLatency;	// from launch to run, for executed tasks
+		double maxQueueLatency;
+	};
+	
+	FairPool(unsigned workers = 4, unsigned maxPerSource = 2);
+	~FairPool(void);
+	
+	void launch(const Identifier &source, Task *task);	// task is run on a worker
+	bool cancel(const Identifier &source, Task *task);	// true if the task was removed before running
+	
+	void getStats(Stats &stats) const;
+	
+private:
+	class Worker : public Thread
+	{
+	public:
+		Worker(FairPool *pool);
+		
+	private:
+		void run(void);
+		
+		FairPool *mPool;
+	};
+	
+	struct Entry
+	{
+		Task *task;
+		Time time;
+	};
+	
+	struct Source
+	{
+		Source(void) : running(0), scheduled(false) {}
+		
+		List<Entry> queue;
+		unsigned running;
+		bool scheduled;		// in the round-robin list
+	};
+	
+	Task *next(Identifier &source);
+	void finished(const Identifier &source);
+	void schedule(const Identifier &source, Source &s);
+	void release(const Identifier &source);
+	
+	Array<Worker*> mWorkers;
+	Map<Identifier, Source> mSources;
+	List<Identifier> mRound;	// sources with queued tasks under their cap
+	unsigned mMaxPerSource;
+	Stats mStats;
+	bool mShouldStop;
+};
+
+}
+
+#endif
@@ -412,6 +412,7 @@ void Http::Request::clear(void)
 	get.clear();
 	post.clear();
 	fullUrl.clear();
+	responseCookies.clear();
 	
 	for(Map<String, TempFile*>::iterator it = files.begin(); it != files.end(); ++it)
 	 	delete it->second;
@@ -478,6 +479,7 @@ Http::Response::Response(const Request &request, int code)
 	this->code = code;
 	this->version = request.version;
 	this->sock = request.sock;
+	this->cookies = request.responseCookies;
 	if(code != 204)
 		this->headers["Content-Type"] = "text/html; charset=UTF-8";
 }
@@ -58,6 +58,7 @@ public:
 		
 		String fullUrl;		// URL with parameters, used only by recv
 		Socket *sock;		// Internal use for Response construction
+		StringMap responseCookies;	// Cookies set by responses constructed from this request
 	};
 
 	struct Response
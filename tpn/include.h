@@ -59,6 +59,10 @@
 #define MACOSX
 #endif
 
+#ifdef __linux__
+#define LINUX
+#endif
+
 #include <cstdio>
 #include <cstdlib>
 #include <ctime>
@@ -109,6 +113,8 @@ typedef u_long ctl_t;
 #define SEWOULDBLOCK	WSAEWOULDBLOCK
 #define SEAGAIN		WSAEWOULDBLOCK
 #define SEADDRINUSE	WSAEADDRINUSE
+#define SEINTR		WSAEINTR
+#define SECONNABORTED	WSAECONNABORTED
 #define SOCK_TO_INT(x) 0
 
 #define mkdir(d,x) _mkdir(d)
@@ -153,6 +159,8 @@ typedef int ctl_t;
 #define SEWOULDBLOCK	EWOULDBLOCK
 #define SEAGAIN		EAGAIN
 #define SEADDRINUSE	EADDRINUSE
+#define SEINTR		EINTR
+#define SECONNABORTED	ECONNABORTED
 #define INVALID_SOCKET -1
 #define SOCK_TO_INT(x) (x)
 
@@ -27,12 +27,37 @@
 #include "tpn/config.h"
 #include "tpn/directory.h"
 #include "tpn/mime.h"
+#include "tpn/lockprofiler.h"
 
 namespace tpn
 {
 
 Interface *Interface::Instance = NULL;
 
+static const size_t SessionTokenSize = 32;	// bytes
+static const size_t SessionIdSize = 8;		// bytes of the token used as table index
+
+// Comparison time does not depend on where the tokens differ
+static bool TokenEquals(const String &a, const String &b)
+{
+	if(a.size() != b.size()) return false;
+	
+	char diff = 0;
+	for(size_t i=0; i<a.size(); ++i)
+		diff|= a[i] ^ b[i];
+	
+	return diff == 0;
+}
+
+// One row of a statistics table
+static void StatRow(Html &page, const String &name, const String &value)
+{
+	page.open("tr");
+	page.open("td",".name"); page.text(name); page.close("td");
+	page.open("td",".value"); page.text(value); page.close("td");
+	page.close("tr");
+}
+
 Interface::Interface(int port) :
 		Http::Server(port)
 {
@@ -66,6 +91,67 @@ void Interface::remove(const String &prefix, HttpInterfaceable *interfaceable)
 	mMutex.unlock();
 }
 
+User *Interface::getSession(const String &token)
+{
+	if(token.size() != 2*SessionTokenSize) return NULL;
+	
+	mSessionsMutex.lock();
+	Map<String,Session>::iterator it = mSessions.find(token.substr(0, 2*SessionIdSize));
+	if(it == mSessions.end() || !TokenEquals(it->second.token, token))
+	{
+		mSessionsMutex.unlock();
+		return NULL;
+	}
+	
+	Time now = Time::Now();
+	if(it->second.expiry < now)
+	{
+		mSessions.erase(it);
+		mSessionsMutex.unlock();
+		return NULL;
+	}
+	
+	// Sessions expire after a period of inactivity
+	it->second.expiry = now + milliseconds(Config::Get("interface_session_lifetime").toInt());
+	String name = it->second.name;
+	mSessionsMutex.unlock();
+	
+	return User::Get(name);
+}
+
+String Interface::createSession(User *user)
+{
+	Assert(user);
+	
+	double lifetime = milliseconds(Config::Get("interface_session_lifetime").toInt());
+	if(lifetime <= 0.) return "";
+	
+	ByteString random;
+	random.writeRandom(SessionTokenSize);
+	
+	Session session;
+	session.token = random.toString();
+	session.name = user->name();
+	session.expiry = Time::Now() + lifetime;
+	
+	mSessionsMutex.lock();
+	
+	// Purge expired sessions
+	Time now = Time::Now();
+	Map<String,Session>::iterator it = mSessions.begin();
+	while(it != mSessions.end())
+	{
+		if(it->second.expiry < now) mSessions.erase(it++);
+		else ++it;
+	}
+	
+	mSessions[session.token.substr(0, 2*SessionIdSize)] = session;
+	mSessionsMutex.unlock();
+	
+	LogDebug("Interface", "Created session for user \""+session.name+"\"");
+	return session.token;
+}
+
 void Interface::process(Http::Request &request)
 {
 	Address remoteAddr = request.sock->getRemoteAddress();
@@ -76,6 +162,10 @@ void Interface::process(Http::Request &request)
 	if(request.url.empty() || request.url[0] != '/') throw 404;
 	
 	User *user = NULL;
+	String token;
+	if(request.cookies.get("session", token))
+		user = getSession(token);
+	
 	String auth;
 	if(request.headers.get("Authorization", auth))
 	{
@@ -86,7 +176,18 @@ void Interface::process(Http::Request &request)
 		
 		String name = tmp.base64Decode();
 		String password = name.cut(':');
-		user = User::Authenticate(name, password);
+		
+		// Credentials for another user take precedence over the session
+		if(!user || user->name() != name)
+		{
+			user = User::Authenticate(name, password);
+			if(user)
+			{
+				token = createSession(user);
+				if(!token.empty())
+					request.responseCookies["session"] = token + "; Path=/; HttpOnly";
+			}
+		}
 	}
 	
 #ifdef ANDROID
@@ -230,6 +331,137 @@ void Interface::process(Http::Request &request)
 		}
 	}
 	
+	// Lock contention report, ranked by wait time
+	if(request.url == "/locks" && (remoteAddr.isLocal() || remoteAddr.isPrivate()))
+	{
+		if(request.get.contains("enable")) LockProfiler::SetEnabled(request.get["enable"].toBool());
+		if(request.get.contains("reset")) LockProfiler::Reset();
+		
+		Array<LockProfiler::Entry> entries;
+		LockProfiler::GetReport(entries, 100);
+		
+		Http::Response response(request, 200);
+		response.send();
+		
+		Html page(response.sock);
+		page.header("Lock contention");
+		page.open("h1");
+		page.text("Lock contention");
+		page.close("h1");
+		page.open("p");
+		if(LockProfiler::IsEnabled()) page.link("/locks?enable=false", "Disable profiler");
+		else page.link("/locks?enable=true", "Enable profiler");
+		page.text(" - ");
+		page.link("/locks?reset", "Reset");
+		page.close("p");
+		
+		page.open("table", ".locks");
+		page.open("tr");
+		page.open("th"); page.text("Site"); page.close("th");
+		page.open("th"); page.text("Locks"); page.close("th");
+		page.open("th"); page.text("Contended"); page.close("th");
+		page.open("th"); page.text("Wait (ms)"); page.close("th");
+		page.open("th"); page.text("Max wait (ms)"); page.close("th");
+		page.open("th"); page.text("Hold (ms)"); page.close("th");
+		page.close("tr");
+		
+		for(int i=0; i<entries.size(); ++i)
+		{
+			const LockProfiler::Entry &entry = entries[i];
+			page.open("tr");
+			page.open("td",".site"); page.text(String(entry.file) + ":" + String::number(entry.line)); page.close("td");
+			page.open("td"); page.text(String::number(entry.count)); page.close("td");
+			page.open("td"); page.text(String::number(entry.contended)); page.close("td");
+			page.open("td"); page.text(String::number(entry.waitTime*1000., 3)); page.close("td");
+			page.open("td"); page.text(String::number(entry.maxWait*1000., 3)); page.close("td");
+			page.open("td"); page.text(String::number(entry.holdTime*1000., 3)); page.close("td");
+			page.close("tr");
+		}
+		
+		page.close("table");
+		page.footer();
+		return;
+	}
+	
+	// Link and connection metrics
+	if(request.url == "/stats" && (remoteAddr.isLocal() || remoteAddr.isPrivate()))
+	{
+		Core::AcceptStats accept;
+		Core::Instance->getAcceptStats(accept);
+		
+		Http::Response response(request, 200);
+		response.send();
+		
+		Html page(response.sock);
+		page.header("Statistics");
+		page.open("h1");
+		page.text("Statistics");
+		page.close("h1");
+		
+		page.open("h2");
+		page.text("Incoming connections");
+		page.close("h2");
+		page.open("table", ".stats");
+		StatRow(page, "Accepted", String::number(accept.accepted));
+		StatRow(page, "Rejected", String::number(accept.rejected));
+		StatRow(page, "Rate limited", String::number(accept.limited));
+		StatRow(page, "Handshake queue", String::number(accept.queued));
+		StatRow(page, "Handshakes in progress", String::number(accept.active));
+		StatRow(page, "Handshakes started", String::number(accept.started));
+		StatRow(page, "Mean accept latency (ms)", String::number(accept.started ? accept.acceptLatency*1000./accept.started : 0., 3));
+		StatRow(page, "Max accept latency (ms)", String::number(accept.maxAcceptLatency*1000., 3));
+		page.close("table");
+		
+		Core::RequestStats requests;
+		Core::Instance->getRequestStats(requests);
+		
+		page.open("h2");
+		page.text("Remote requests");
+		page.close("h2");
+		page.open("table", ".stats");
+		StatRow(page, "Queued", String::number(requests.queued));
+		StatRow(page, "Running", String::number(requests.running));
+		StatRow(page, "Executed", String::number(requests.executed));
+		StatRow(page, "Cancelled", String::number(requests.cancelled));
+		StatRow(page, "Mean queue latency (ms)", String::number(requests.executed ? requests.queueLatency*1000./requests.executed : 0., 3));
+		StatRow(page, "Max queue latency (ms)", String::number(requests.maxQueueLatency*1000., 3));
+		page.close("table");
+		
+		Core::QueueDepths depths;
+		Core::Instance->getQueueDepths(depths);
+		
+		page.open("h2");
+		page.text("Send queues");
+		page.close("h2");
+		page.open("table", ".stats");
+		StatRow(page, "Notifications", String::number(depths.notifications));
+		StatRow(page, "Requests", String::number(depths.requests));
+		StatRow(page, "Responses", String::number(depths.responses));
+		StatRow(page, "Transfers", String::number(depths.transferts));
+		StatRow(page, "Transfers waiting for credit", String::number(depths.stalled));
+		page.close("table");
+		
+		Core::HandshakeStats handshakes;
+		Core::Instance->getHandshakeStats(handshakes);
+		double fullMean = (handshakes.full ? handshakes.fullTime/handshakes.full : 0.);
+		double resumedMean = (handshakes.resumed ? handshakes.resumedTime/handshakes.resumed : 0.);
+		
+		page.open("h2");
+		page.text("Handshakes");
+		page.close("h2");
+		page.open("table", ".stats");
+		StatRow(page, "Full", String::number(handshakes.full));
+		StatRow(page, "Resumed", String::number(handshakes.resumed));
+		StatRow(page, "Mean full derivation (ms)", String::number(fullMean*1000., 3));
+		StatRow(page, "Mean resumed derivation (ms)", String::number(resumedMean*1000., 3));
+		if(handshakes.full && handshakes.resumed)	// saved time is estimated with the mean full derivation
+			StatRow(page, "Time saved by resumption (ms)", String::number(handshakes.resumed*(fullMean - resumedMean)*1000., 3));
+		page.close("table");
+		
+		page.footer();
+		return;
+	}
+	
 	List<String> list;
 	request.url.explode(list,'/');
 	list.pop_front();	// first element is empty because url begin with '/'
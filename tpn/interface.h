@@ -26,9 +26,12 @@
 #include "tpn/http.h"
 #include "tpn/mutex.h"
 #include "tpn/map.h"
+#include "tpn/time.h"
 
 namespace tpn
 {
+
+class User;
   
 class HttpInterfaceable
 {
@@ -49,9 +52,23 @@ public:
 
 private:
 	void process(Http::Request &request);
-
+	
+	// Sessions avoid running the password hash on each authenticated request
+	struct Session
+	{
+		String token;
+		String name;	// user name
+		Time expiry;
+	};
+	
+	User *getSession(const String &token);
+	String createSession(User *user);
+	
 	Map<String,HttpInterfaceable*>	mPrefixes;
 	Mutex mMutex;
+	
+	Map<String,Session> mSessions;	// indexed by token prefix
+	Mutex mSessionsMutex;
 };
 
 }
@@ -26,9 +26,27 @@
 namespace tpn
 {
 
+static inline bool IsBlank(char chr)
+{
+	return (chr == ' ' || chr == '\t' || chr == '\r' || chr == '\n');
+}
+
+static inline bool IsFieldDelimiter(char chr)
+{
+	return (chr == ',' || chr == ']' || chr == '}');
+}
+
+static inline bool IsDelimiter(char chr)
+{
+	return (IsFieldDelimiter(chr) || chr == ':');
+}
+
 JsonSerializer::JsonSerializer(Stream *stream) :
 	mStream(stream),
-	mLevel(0)
+	mInputLevel(0),
+	mOutput(stream),
+	mLevel(0),
+	mFirst(true)
 {
 	Assert(stream);
 }
@@ -57,8 +75,8 @@ bool JsonSerializer::input(Element &element)
 
 bool JsonSerializer::input(Pair &pair)
 {
-	AssertIO(pair.deserializeKey(*this));
-	AssertIO(mStream->assertChar(':'));
+	if(!pair.deserializeKey(*this)) return false;	// empty map
+	AssertIO(mStream->last() == ':');
 	AssertIO(pair.deserializeValue(*this));
 	return true;
 }
@@ -70,28 +88,28 @@ bool JsonSerializer::input(String &str)
 	char chr;
 	if(!mStream->get(chr)) return false;
 
-	while(Stream::BlankCharacters.contains(chr))
+	while(IsBlank(chr))
 		if(!mStream->get(chr)) return false;
 	
-	bool quotes = (chr == '\'' || chr == '\"');
-	
-	String fieldDelimiters = ",]}";
+	// Closing an empty array or map
+	if(chr == ']' || chr == '}')
+	{
+		readClose();
+		return false;
+	}
 	
-	String delimiters;
-	if(quotes)
+	char quote = 0;
+	if(chr == '\'' || chr == '\"')
 	{
-		quotes = true;
-		delimiters = String(chr);
+		quote = chr;
 		AssertIO(mStream->get(chr));
 	}
 	else {
 		str+= chr;
-		delimiters = Stream::BlankCharacters;
-		delimiters+=fieldDelimiters;
 		if(!mStream->get(chr)) return true;
 	}
 
-	while(!delimiters.contains(chr))
+	while(quote ? chr != quote : !IsBlank(chr) && !IsDelimiter(chr))
 	{
 		if(chr == '\\')
 		{
@@ -105,12 +123,27 @@ bool JsonSerializer::input(String &str)
 			case 't': 	chr = '\t';	break;
 			case 'u':
 			{
-				String tmp;
-				AssertIO(mStream->read(tmp, 4));
-				unsigned u;
-				tmp >> u;
-				if(u >= 0x80) continue;	// TODO
-				chr = u;
+				unsigned u = 0;
+				for(int i=0; i<4; ++i)
+				{
+					AssertIO(mStream->get(chr));
+					u<<= 4;
+					if(chr >= '0' && chr <= '9') u+= chr - '0';
+					else if(chr >= 'a' && chr <= 'f') u+= chr - 'a' + 10;
+					else if(chr >= 'A' && chr <= 'F') u+= chr - 'A' + 10;
+					else throw IOException("Invalid unicode escape sequence");
+				}
+				
+				// Encode as UTF-8
+				if(u < 0x80) chr = char(u);
+				else {
+					if(u < 0x800) str+= char(0xC0 | (u >> 6));
+					else {
+						str+= char(0xE0 | (u >> 12));
+						str+= char(0x80 | ((u >> 6) & 0x3F));
+					}
+					chr = char(0x80 | (u & 0x3F));
+				}
 				break;
 			}
 			default: 
@@ -122,15 +155,17 @@ bool JsonSerializer::input(String &str)
 		if(chr) str+= chr;
 		if(!mStream->get(chr))
 		{
-			if(quotes) throw IOException();
+			if(quote) throw IOException();
 			else break;
 		}
 	}
 	
-	if(!fieldDelimiters.contains(chr))
+	// The delimiter is consumed so it is available through last(),
+	// nothing follows a top-level value
+	if(!IsDelimiter(chr) && mInputLevel > 0)
 	{
-		mStream->readChar(chr);
-		AssertIO(fieldDelimiters.contains(chr));
+		AssertIO(mStream->readChar(chr));
+		AssertIO(IsDelimiter(chr));
 	}
 	
 	return true; 
@@ -140,82 +175,100 @@ void JsonSerializer::output(const Serializable &s)
 {
 	if(s.isInlineSerializable() && !s.isNativeSerializable()) output(s.toString());
 	else s.serialize(*this);
+	writeDone();
 }
 
 void JsonSerializer::output(const Element &element)
 {
-	if(!mFirst) *mStream<<',';
+	if(!mFirst) mOutput.put(',');
 	mFirst = false;
-	*mStream<<Stream::NewLine;
-	*mStream<<String(mLevel*2, ' ');
+	writeIndent();
 	
 	element.serialize(*this);
+	writeDone();
 }
 
 void JsonSerializer::output(const Pair &pair)
 {
-	if(!mFirst) *mStream<<',';
+	if(!mFirst) mOutput.put(',');
 	mFirst = false;
-	*mStream<<Stream::NewLine;
-	*mStream<<String(mLevel*2, ' ');
+	writeIndent();
 	
 	pair.serializeKey(*this);
-	*mStream<<": ";
+	mOutput.writeData(": ", 2);
 	pair.serializeValue(*this);
+	writeDone();
 }
 
 void JsonSerializer::output(const String &str)
 {
-	*mStream<<'\"';
+	mOutput.put('\"');
+	
+	// Unescaped runs are written at once
+	const char *data = str.data();
+	size_t begin = 0;
   	for(size_t i=0; i<str.size(); ++i)
 	{
-	  	char chr = str[i];
-		
-		switch(chr)
+		const char *escaped;
+		switch(data[i])
 		{
-		case '\\': mStream->write("\\\\"); break;
-		case '\"': mStream->write("\\\""); break;
-		//case '\'': mStream->write("\\\'"); break;
-		case '\b': mStream->write("\\b");  break;
-		case '\f': mStream->write("\\f");  break;
-		case '\n': mStream->write("\\n");  break;
-		case '\r': mStream->write("\\r");  break;
-		case '\t': mStream->write("\\t");  break;
-		default: mStream->put(chr); break;
+		case '\\': escaped = "\\\\"; break;
+		case '\"': escaped = "\\\""; break;
+		//case '\'': escaped = "\\\'"; break;
+		case '\b': escaped = "\\b";  break;
+		case '\f': escaped = "\\f";  break;
+		case '\n': escaped = "\\n";  break;
+		case '\r': escaped = "\\r";  break;
+		case '\t': escaped = "\\t";  break;
+		default: continue;
 		}
+		
+		mOutput.writeData(data + begin, i - begin);
+		mOutput.writeData(escaped, 2);
+		begin = i + 1;
 	}
-	*mStream<<'\"';
+	mOutput.writeData(data + begin, str.size() - begin);
+	mOutput.put('\"');
+	writeDone();
 }
 
 bool JsonSerializer::inputArrayBegin(void)
 {
-	return true;
+	return readOpen('[');
 }
 
 bool JsonSerializer::inputArrayCheck(void)
 {
 	char chr = mStream->last();
 	if(chr == '[' || chr == ',') return true;
-	if(chr == ']') return false;
+	if(chr == ']')
+	{
+		readClose();
+		return false;
+	}
 	throw IOException();
 }
 
 bool JsonSerializer::inputMapBegin(void)
 {
-	return mStream->assertChar('{');
+	return readOpen('{');
 }
 
 bool JsonSerializer::inputMapCheck(void)
 {
   	char chr = mStream->last();
 	if(chr == '{' || chr == ',') return true;
-	if(chr == '}') return false;
+	if(chr == '}')
+	{
+		readClose();
+		return false;
+	}
 	throw IOException();
 }
 	
 void JsonSerializer::outputArrayBegin(int size)
 {
-  	*mStream<<'[';
+  	mOutput.put('[');
 	++mLevel;
 	mFirst = true;
 }
@@ -224,14 +277,15 @@ void JsonSerializer::outputArrayEnd(void)
 {
 	Assert(mLevel > 0);
 	--mLevel;
-	*mStream<<Stream::NewLine;
-	*mStream<<String(mLevel*2, ' ')<<']';
+	writeIndent();
+	mOutput.put(']');
 	mFirst = false;	// useful for higher level array or map
+	writeDone();
 }
 
 void JsonSerializer::outputMapBegin(int size)
 {
-	*mStream<<'{';
+	mOutput.put('{');
 	++mLevel;
 	mFirst = true;
 }
@@ -240,9 +294,60 @@ void JsonSerializer::outputMapEnd(void)
 {
 	Assert(mLevel > 0);
 	--mLevel;
-	*mStream<<Stream::NewLine;
-	*mStream<<String(mLevel*2, ' ')<<'}';
+	writeIndent();
+	mOutput.put('}');
 	mFirst = false;	// useful for higher level array or map
+	writeDone();
+}
+
+bool JsonSerializer::readOpen(char open)
+{
+	char chr;
+	if(!mStream->readChar(chr)) return false;
+	
+	// Closing an empty array or map instead of an element
+	if(chr == ']' || chr == '}')
+	{
+		readClose();
+		return false;
+	}
+	
+	AssertIO(chr == open);
+	++mInputLevel;
+	return true;
+}
+
+void JsonSerializer::readClose(void)
+{
+	AssertIO(mInputLevel > 0);
+	--mInputLevel;
+	
+	// Consume the delimiter following the array or map in the enclosing one
+	if(mInputLevel > 0)
+	{
+		char chr;
+		AssertIO(mStream->readChar(chr));
+		AssertIO(IsFieldDelimiter(chr));
+	}
+}
+
+void JsonSerializer::writeIndent(void)
+{
+	static const char spaces[] = "                                ";	// 32 spaces
+	
+	mOutput << Stream::NewLine;
+	size_t left = mLevel*2;
+	while(left)
+	{
+		size_t len = std::min(left, sizeof(spaces) - 1);
+		mOutput.writeData(spaces, len);
+		left-= len;
+	}
+}
+
+void JsonSerializer::writeDone(void)
+{
+	if(mLevel == 0) mOutput.flush();
 }
 
 }
@@ -24,11 +24,15 @@
 
 #include "tpn/serializer.h"
 #include "tpn/stream.h"
+#include "tpn/bufferedwriter.h"
+#include "tpn/exception.h"
 #include "tpn/array.h"
 
 namespace tpn
 {
 
+// Output is buffered and written to the stream in chunks,
+// it is flushed each time a top-level value is complete
 class JsonSerializer : public Serializer
 {
 public:
@@ -82,24 +86,35 @@ public:
 private:
   	template<typename T> bool read(T &value);
   	template<typename T> void write(const T &value);
+	bool readOpen(char open);
+	void readClose(void);
+	void writeIndent(void);
+	void writeDone(void);
   
-  	Stream *mStream;
-	int mLevel;
-	bool mFirst;
+  	Stream *mStream;	// for input
+	int mInputLevel;	// for input
+	BufferedWriter mOutput;	// for output
+	int mLevel;		// for output
+	bool mFirst;		// for output
 };
 
 template<typename T> 
 bool JsonSerializer::read(T &value)
 {
-	return mStream->read(value);
+	// Short tokens fit in the String without allocation
+	String str;
+	if(!input(str)) return false;
+	AssertIO(str.read(value));
+	return true;
 }
 
 template<typename T> 
 void JsonSerializer::write(const T &value)
 {
-	mStream->space();
-	mStream->write(value);
-	if(mLevel == 0) *mStream << Stream::NewLine;	
+	mOutput.space();
+	mOutput.write(value);
+	if(mLevel == 0) mOutput << Stream::NewLine;
+	writeDone();
 }
 
 }
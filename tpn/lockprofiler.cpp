@@ -0,0 +1,129 @@
+/*************************************************************************
+ *   Copyright (C) 2011-2013 by Paul-Louis Ageneau                       *
+ *   paul-louis (at) ageneau (dot) org                                   *
+ *                                                                       *
+ *   This file is part of TeapotNet.                                     *
+ *                                                                       *
+ *   TeapotNet is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU Affero General Public License as      *
+ *   published by the Free Software Foundation, either version 3 of      *
+ *   the License, or (at your option) any later version.                 *
+ *                                                                       *
+ *   TeapotNet is distributed in the hope that it will be useful, but    *
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the        *
+ *   GNU Affero General Public License for more details.                 *
+ *                                                                       *
+ *   You should have received a copy of the GNU Affero General Public    *
+ *   License along with TeapotNet.                                       *
+ *   If not, see <http://www.gnu.org/licenses/>.                         *
+ *************************************************************************/
+
+
+#include "tpn/lockprofiler.h"
+#include "tpn/array.h"
+
+namespace tpn
+{
+
+bool LockProfiler::Enabled = false;
+LockSite *LockProfiler::Sites = NULL;
+pthread_mutex_t LockProfiler::SitesMutex = PTHREAD_MUTEX_INITIALIZER;
+
+LockSite::LockSite(const char *file, int line) :
+	file(file),
+	line(line),
+	count(0),
+	contended(0),
+	waitTime(0),
+	maxWait(0),
+	holdTime(0),
+	next(NULL)
+{
+	LockProfiler::Register(this);
+}
+
+void LockSite::waited(uint64_t time, bool contended)
+{
+	__atomic_add_fetch(&count, 1, __ATOMIC_RELAXED);
+	if(contended) __atomic_add_fetch(&this->contended, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&waitTime, time, __ATOMIC_RELAXED);
+	
+	uint64_t max = __atomic_load_n(&maxWait, __ATOMIC_RELAXED);
+	while(time > max && !__atomic_compare_exchange_n(&maxWait, &max, time, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+}
+
+void LockSite::held(uint64_t time)
+{
+	__atomic_add_fetch(&holdTime, time, __ATOMIC_RELAXED);
+}
+
+void LockProfiler::SetEnabled(bool enabled)
+{
+	__atomic_store_n(&Enabled, enabled, __ATOMIC_RELAXED);
+}
+
+void LockProfiler::Reset(void)
+{
+	pthread_mutex_lock(&SitesMutex);
+	for(LockSite *site = Sites; site; site = site->next)
+	{
+		__atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&site->contended, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&site->waitTime, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&site->maxWait, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&site->holdTime, 0, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&SitesMutex);
+}
+
+static bool CompareWaitTime(const LockProfiler::Entry &a, const LockProfiler::Entry &b)
+{
+	return a.waitTime > b.waitTime;
+}
+
+void LockProfiler::GetReport(Array<Entry> &entries, int max)
+{
+	entries.clear();
+	
+	pthread_mutex_lock(&SitesMutex);
+	for(LockSite *site = Sites; site; site = site->next)
+	{
+		Entry entry;
+		entry.file = site->file;
+		entry.line = site->line;
+		entry.count = __atomic_load_n(&site->count, __ATOMIC_RELAXED);
+		entry.contended = __atomic_load_n(&site->contended, __ATOMIC_RELAXED);
+		entry.waitTime = double(__atomic_load_n(&site->waitTime, __ATOMIC_RELAXED))*1e-9;
+		entry.maxWait = double(__atomic_load_n(&site->maxWait, __ATOMIC_RELAXED))*1e-9;
+		entry.holdTime = double(__atomic_load_n(&site->holdTime, __ATOMIC_RELAXED))*1e-9;
+		if(entry.count) entries.push_back(entry);
+	}
+	pthread_mutex_unlock(&SitesMutex);
+	
+	std::sort(entries.begin(), entries.end(), CompareWaitTime);
+	if(max >= 0 && int(entries.size()) > max) entries.resize(max);
+}
+
+uint64_t LockProfiler::Clock(void)
+{
+#if defined(WINDOWS) || defined(MACOSX)
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return uint64_t(tv.tv_sec)*1000000000ULL + uint64_t(tv.tv_usec)*1000ULL;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return uint64_t(ts.tv_sec)*1000000000ULL + uint64_t(ts.tv_nsec);
+#endif
+}
+
+void LockProfiler::Register(LockSite *site)
+{
+	pthread_mutex_lock(&SitesMutex);
+	site->next = Sites;
+	Sites = site;
+	pthread_mutex_unlock(&SitesMutex);
+}
+
+}
@@ -0,0 +1,91 @@
+/*************************************************************************
+ *   Copyright (C) 2011-2013 by Paul-Louis Ageneau                       *
+ *   paul-louis (at) ageneau (dot) org                                   *
+ *                                                                       *
+ *   This file is part of TeapotNet.                                     *
+ *                                                                       *
+ *   TeapotNet is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU Affero General Public License as      *
+ *   published by the Free Software Foundation, either version 3 of      *
+ *   the License, or (at your option) any later version.                 *
+ *                                                                       *
+ *   TeapotNet is distributed in the hope that it will be useful, but    *
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the        *
+ *   GNU Affero General Public License for more details.                 *
+ *                                                                       *
+ *   You should have received a copy of the GNU Affero General Public    *
+ *   License along with TeapotNet.                                       *
+ *   If not, see <http://www.gnu.org/licenses/>.                         *
+ *************************************************************************/
+
+
+#ifndef TPN_LOCKPROFILER_H
+#define TPN_LOCKPROFILER_H
+
+#include "tpn/include.h"
+
+namespace tpn
+{
+
+template<typename T> class Array;
+
+// Lock statistics for a Synchronize call site
+// Sites are static objects created by the Synchronize macros, times are in nanoseconds
+class LockSite
+{
+public:
+	LockSite(const char *file, int line);
+	
+	void waited(uint64_t time, bool contended);
+	void held(uint64_t time);
+	
+	const char *file;
+	int line;
+	uint64_t count;
+	uint64_t contended;	// lock was busy when requested
+	uint64_t waitTime;
+	uint64_t maxWait;
+	uint64_t holdTime;	// until the mutex is fully released, Desynchronize included
+	LockSite *next;
+};
+
+// Lock contention profiler, disabled by default
+class LockProfiler
+{
+public:
+	struct Entry
+	{
+		const char *file;
+		int line;
+		uint64_t count;
+		uint64_t contended;
+		double waitTime;	// seconds
+		double maxWait;
+		double holdTime;
+	};
+	
+	static bool IsEnabled(void);
+	static void SetEnabled(bool enabled);
+	static void Reset(void);
+	static void GetReport(Array<Entry> &entries, int max = -1);	// ranked by wait time
+	static uint64_t Clock(void);	// monotonic, in nanoseconds
+	
+private:
+	static void Register(LockSite *site);
+	
+	static bool Enabled;
+	static LockSite *Sites;
+	static pthread_mutex_t SitesMutex;
+	
+	friend class LockSite;
+};
+
+inline bool LockProfiler::IsEnabled(void)
+{
+	return __atomic_load_n(&Enabled, __ATOMIC_RELAXED);
+}
+
+}
+
+#endif
@@ -32,6 +32,7 @@
 #include "tpn/directory.h"
 #include "tpn/portmapping.h"
 #include "tpn/thread.h"
+#include "tpn/lockprofiler.h"
 
 #include <signal.h>
 
@@ -298,6 +299,7 @@ int main(int argc, char** argv)
 		Config::Default("port", "8080");
 		Config::Default("tracker_port", "80");
 		Config::Default("interface_port", "8480");
+		Config::Default("interface_session_lifetime", "3600000");	// 1h of inactivity, 0 disables sessions
 		Config::Default("profiles_dir", "profiles");
 		Config::Default("static_dir", "static");
 		Config::Default("shared_dir", "shared");
@@ -311,11 +313,26 @@ int main(int argc, char** argv)
 		Config::Default("meeting_timeout", "15000");
 		Config::Default("tpot_timeout", "5000");
 		Config::Default("tpot_read_timeout", "60000");
+		Config::Default("tpot_ticket_lifetime", "43200000");	// 12h, 0 disables session resumption
+		Config::Default("tpot_ciphers", "AES256-GCM,AES256");	// by order of preference
+		Config::Default("tpot_backlog", "128");
+		Config::Default("tpot_handshake_workers", "4");
+		Config::Default("tpot_handshake_queue", "64");
+		Config::Default("tpot_handshake_rate", "5");		// per second and source address, 0 disables
+		Config::Default("tpot_handshake_burst", "10");
+		Config::Default("tpot_request_workers", "4");
+		Config::Default("tpot_request_per_peering", "2");	// concurrent requests per peering
 		Config::Default("user_global_shares", "true");
 		Config::Default("relay_enabled", "true");
+		Config::Default("relay_max_sessions", "256");	// 0 means unlimited
+		Config::Default("relay_max_buffered_sessions", "16");	// HTTP tunnels cost two threads each
 		Config::Default("http_proxy", "auto");
 		Config::Default("http_proxy_connect", "false");
 		Config::Default("prefetch_delay", "300000");
+		Config::Default("reactor_enabled", "true");
+		Config::Default("reactor_io_threads", "1");
+		Config::Default("reactor_workers", "4");
+		Config::Default("lock_profiler", "false");	// can be toggled on the interface at /locks
 		
 #ifdef ANDROID
 		Config::Default("force_http_tunnel", "false");
@@ -332,6 +349,8 @@ int main(int argc, char** argv)
 		Config::Default("cache_max_file_size", "2000");		// MiB
 		Config::Default("prefetch_max_file_size", "10");	// MiB
 #endif
+		
+		LockProfiler::SetEnabled(Config::Get("lock_profiler").toBool());
 
 #if defined(WINDOWS) || defined(MACOSX)
 		bool isBoot = args.contains("boot");
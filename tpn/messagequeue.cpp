@@ -24,9 +24,11 @@
 #include "tpn/html.h"
 #include "tpn/sha512.h"
 #include "tpn/yamlserializer.h"
+#include "tpn/byteserializer.h"
 #include "tpn/jsonserializer.h"
 #include "tpn/notification.h"
 #include "tpn/splicer.h"
+#include "tpn/core.h"
 
 namespace tpn
 {
@@ -226,20 +228,23 @@ void MessageQueue::ack(const Array<Message> &messages)
 	{
 		// TODO: ACKs are sent but ignored at reception for public messages
 
-		String tmp;
-		YamlSerializer serializer(&tmp);
-		serializer.output(it->second);
-
-		Notification notification(tmp);
-		notification.setParameter("type", "ack");
-		
 		AddressBook::Contact *contact = mUser->addressBook()->getContactByUniqueName(it->first);
 		if(contact)
+		{
+			Notification notification;
+			notification.setParameter("type", "ack");
+			WriteStamps(notification, it->second, contact->peering());
 			contact->send(notification);
+		}
 		
 		AddressBook::Contact *self = mUser->addressBook()->getSelf();
 		if(self && self != contact) 
+		{
+			Notification notification;
+			notification.setParameter("type", "ack");
+			WriteStamps(notification, it->second, self->peering());
 			self->send(notification);
+		}
 	}
 }
 
@@ -264,6 +269,143 @@ FROM messages AS m LEFT JOIN messages AS p ON p.stamp=NULLIF(m.parent,'') WHERE
         statement.execute();
 }
 
+void MessageQueue::WriteStamps(Notification &notification, const StringArray &stamps, const Identifier &peering)
+{
+	WriteStamps(notification, stamps, Core::Instance->supportsFormat(peering, "binary"));
+}
+
+void MessageQueue::WriteStamps(Notification &notification, const StringArray &stamps, bool binary)
+{
+	if(!binary)
+	{
+		String tmp;
+		YamlSerializer serializer(&tmp);
+		serializer.output(stamps);
+		notification.setContent(tmp);
+		return;
+	}
+	
+	// Generated stamps are sent as fixed-width records sorted by time,
+	// with times delta-coded on 16 bits and escaped with 0xFFFF when larger
+	Array<std::pair<uint32_t, uint32_t> > records;	// (time, prefix)
+	StringArray others;
+	records.reserve(stamps.size());
+	for(int i=0; i<stamps.size(); ++i)
+	{
+		uint32_t prefix, time;
+		if(ParseStamp(stamps[i], prefix, time)) records.push_back(std::make_pair(time, prefix));
+		else others.append(stamps[i]);
+	}
+	
+	std::sort(records.begin(), records.end());
+	
+	ByteString data;
+	ByteSerializer serializer(&data);
+	serializer.output(uint32_t(records.size()));
+	uint32_t last = 0;
+	for(int i=0; i<records.size(); ++i)
+	{
+		uint32_t delta = records[i].first - last;
+		serializer.output(records[i].second);
+		if(delta < 0xFFFF) serializer.output(uint16_t(delta));
+		else {
+			serializer.output(uint16_t(0xFFFF));
+			serializer.output(records[i].first);
+		}
+		last = records[i].first;
+	}
+	
+	serializer.output(uint32_t(others.size()));
+	for(int i=0; i<others.size(); ++i)
+		serializer.output(others[i]);
+	
+	notification.setContent(String(data.begin(), data.end()));
+	notification.setParameter("format", "binary");
+}
+
+void MessageQueue::ReadStamps(const Notification &notification, StringArray &stamps)
+{
+	stamps.clear();
+	
+	if(notification.parameter("format") != "binary")
+	{
+		String data = notification.content();
+		YamlSerializer serializer(&data);
+		serializer.input(stamps);
+		return;
+	}
+	
+	ByteString data(notification.content());
+	ByteSerializer serializer(&data);
+	
+	uint32_t count = 0;
+	AssertIO(serializer.input(count));
+	stamps.reserve(std::min(size_t(count), data.size()/6));
+	
+	uint32_t time = 0;
+	while(count--)
+	{
+		uint32_t prefix;
+		uint16_t delta;
+		AssertIO(serializer.input(prefix));
+		AssertIO(serializer.input(delta));
+		if(delta != 0xFFFF) time+= delta;
+		else AssertIO(serializer.input(time));
+		stamps.append(FormatStamp(prefix, time));
+	}
+	
+	AssertIO(serializer.input(count));
+	while(count--)
+	{
+		String stamp;
+		AssertIO(serializer.input(stamp));
+		stamps.append(stamp);
+	}
+}
+
+bool MessageQueue::ParseStamp(const String &stamp, uint32_t &prefix, uint32_t &time)
+{
+	// Stamps are generated as 4 alphanumeric characters followed by the unix time in uppercase hexadecimal
+	if(stamp.size() <= 4 || stamp.size() > 12) return false;
+	
+	prefix = 0;
+	for(int i=0; i<4; ++i)
+	{
+		char c = stamp[i];
+		if(!std::isalnum(static_cast<unsigned char>(c))) return false;
+		prefix = (prefix << 8) | uint8_t(c);
+	}
+	
+	if(stamp[4] == '0') return false;	// would not be formatted back identically
+	
+	time = 0;
+	for(int i=4; i<stamp.size(); ++i)
+	{
+		char c = stamp[i];
+		if(c >= '0' && c <= '9') time = (time << 4) | uint32_t(c - '0');
+		else if(c >= 'A' && c <= 'F') time = (time << 4) | uint32_t(c - 'A' + 10);
+		else return false;
+	}
+	
+	return true;
+}
+
+String MessageQueue::FormatStamp(uint32_t prefix, uint32_t time)
+{
+	static const char digits[] = "0123456789ABCDEF";
+	
+	char buffer[12];
+	for(int i=0; i<4; ++i)
+		buffer[i] = char(prefix >> (24 - 8*i));
+	
+	int n = 1;
+	while(n < 8 && (time >> (4*n))) ++n;
+	for(int i=0; i<n; ++i)
+		buffer[4 + n - 1 - i] = digits[(time >> (4*i)) & 0xF];
+	
+	return String(buffer, buffer + 4 + n);
+}
+
 void MessageQueue::http(const String &prefix, Http::Request &request)
 {
 	String url = request.url;
@@ -27,6 +27,7 @@
 #include "tpn/message.h"
 #include "tpn/database.h"
 #include "tpn/interface.h"
+#include "tpn/notification.h"
 #include "tpn/identifier.h"
 #include "tpn/string.h"
 #include "tpn/set.h"
@@ -56,6 +57,12 @@ public:
 
 	void http(const String &prefix, Http::Request &request);
 	
+	// Stamp lists of read, ack and unread notifications
+	// The compact binary format is used only if all links to peering support it
+	static void WriteStamps(Notification &notification, const StringArray &stamps, const Identifier &peering);
+	static void WriteStamps(Notification &notification, const StringArray &stamps, bool binary);
+	static void ReadStamps(const Notification &notification, StringArray &stamps);
+	
 	class Selection
 	{
 	public:
@@ -111,6 +118,9 @@ public:
 	Selection selectChilds(const String &parentStamp) const;
 	
 private:
+	static bool ParseStamp(const String &stamp, uint32_t &prefix, uint32_t &time);
+	static String FormatStamp(uint32_t prefix, uint32_t time);
+	
 	User *mUser;
 	Database *mDatabase;
 	
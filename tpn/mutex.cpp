@@ -21,162 +21,147 @@
 
 #include "tpn/mutex.h"
 #include "tpn/exception.h"
+#include "tpn/lockprofiler.h"
 
 namespace tpn
 {
 
-pthread_mutex_t Mutex::GlobalMutex = PTHREAD_MUTEX_INITIALIZER;
-	
-Mutex::Mutex(void) :
-	mLockCount(0)
+// The address of a thread-local variable identifies the running thread
+static __thread char ThreadMarker;
+
+uintptr_t Mutex::Self(void)
 {
-	pthread_mutexattr_t attr;
-	pthread_mutexattr_init(&attr);
-	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK);
-	//pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	return reinterpret_cast<uintptr_t>(&ThreadMarker);
+}
 
-	 if(pthread_mutex_init(&mMutex, &attr) != 0)
-		 throw Exception("Unable to create mutex");
+Mutex::Mutex(void) :
+	mOwner(0),
+	mLockCount(0),
+	mSite(NULL),
+	mLockTime(0)
+{
+	if(pthread_mutex_init(&mMutex, NULL) != 0)
+		throw Exception("Unable to create mutex");
 }
 
 Mutex::~Mutex(void)
 {
-	GlobalLock();
 	pthread_mutex_destroy(&mMutex);
-	GlobalUnlock();
 }
 
-void Mutex::lock(int count)
+void Mutex::lock(int count, LockSite *site)
 {
 	if(count <= 0) return;
-
-	int ret = pthread_mutex_lock(&mMutex);
-	if(ret != 0 && ret != EDEADLK)
-                        throw Exception("Unable to lock mutex");
-
-	GlobalLock();
-
-	try {			
-		if(ret == 0) Assert(mLockCount == 0);
-		mLockedBy = pthread_self();
+	
+	// Only the owner can see itself as owner, so the count is not shared
+	if(isOwner())
+	{
 		mLockCount+= count;
+		return;
 	}
-	catch(...)
+	
+	if(site && LockProfiler::IsEnabled())
 	{
-		GlobalUnlock();
-		throw;
+		uint64_t start = LockProfiler::Clock();
+		int ret = pthread_mutex_trylock(&mMutex);
+		bool contended = (ret == EBUSY);
+		if(contended) ret = pthread_mutex_lock(&mMutex);
+		if(ret != 0)
+			throw Exception("Unable to lock mutex");
+		
+		mLockTime = LockProfiler::Clock();
+		mSite = site;
+		site->waited(mLockTime - start, contended);
 	}
-
-	GlobalUnlock();
+	else {
+		if(pthread_mutex_lock(&mMutex) != 0)
+			throw Exception("Unable to lock mutex");
+		
+		mSite = NULL;
+	}
+	
+	attach(count);
 }
 
 bool Mutex::tryLock(void)
 {
-	GlobalLock();
-
-	try {
-		int ret = pthread_mutex_trylock(&mMutex);
-        	if(ret == EBUSY) 
-		{
-			GlobalUnlock();
-			return false;
-      		}
- 
-        	if(ret != 0 && ret != EDEADLK)
-                	throw Exception("Unable to lock mutex");
-
-		if(ret == 0) Assert(mLockCount == 0);
-		mLockedBy = pthread_self();
-        	mLockCount++;
+	if(isOwner())
+	{
+		++mLockCount;
+		return true;
 	}
-	catch(...)
-        {
-                GlobalUnlock();
-                throw;
-        }
-
-        GlobalUnlock();
+	
+	int ret = pthread_mutex_trylock(&mMutex);
+	if(ret == EBUSY) return false;
+	if(ret != 0)
+		throw Exception("Unable to lock mutex");
+	
+	mSite = NULL;
+	attach(1);
 	return true;
 }
 
 void Mutex::unlock(void)
 {
-	GlobalLock();
-
-	try {
-		if(!mLockCount)
-			throw Exception("Mutex is not locked");
-	
-		if(!pthread_equal(mLockedBy, pthread_self()))
-			throw Exception("Mutex is locked by another thread");
+	if(!isOwner())
+		throw Exception("Mutex is not locked by the current thread");
 	
-		mLockCount--;
-		if(mLockCount == 0)
-		{
-			int ret = pthread_mutex_unlock(&mMutex);
-			if(ret != 0) 
-				throw Exception("Unable to unlock mutex");
-		}
+	if(--mLockCount == 0)
+	{
+		release();
+		if(pthread_mutex_unlock(&mMutex) != 0)
+			throw Exception("Unable to unlock mutex");
 	}
-	catch(...)
-        {
-                GlobalUnlock();
-                throw;
-        }
-
-        GlobalUnlock();
 }
 
 int Mutex::unlockAll(void)
 {
-	GlobalLock();
-
-	int count;
-	try {
-		if(!mLockCount)
-			throw Exception("Mutex is not locked");
-		
-		if(!pthread_equal(mLockedBy, pthread_self()))
-			throw Exception("Mutex is locked by another thread");
+	if(!isOwner())
+		throw Exception("Mutex is not locked by the current thread");
+	
+	int count = mLockCount;
+	mLockCount = 0;
+	release();
+	if(pthread_mutex_unlock(&mMutex) != 0)
+		throw Exception("Unable to unlock mutex");
 	
- 		count = mLockCount;
-		mLockCount = 0;
-
-		int ret = pthread_mutex_unlock(&mMutex);
-		if(ret != 0) 
-			throw Exception("Unable to unlock mutex");
-	}
-	catch(...)
-        {
-                GlobalUnlock();
-                throw;
-        }
-
-        GlobalUnlock();
 	return count;
 }
 
 int Mutex::lockCount(void) const
 {
-	GlobalLock();
-	int count = mLockCount; 
-	GlobalUnlock();
-        return count;
+	if(!isOwner()) return 0;
+	return mLockCount;
 }
 
-void Mutex::GlobalLock(void)
+bool Mutex::isOwner(void) const
 {
-	int ret = pthread_mutex_lock(&GlobalMutex);
-        if(ret != 0)
-        	throw Exception("Unable to lock global mutex");
+	return __atomic_load_n(&mOwner, __ATOMIC_RELAXED) == Self();
 }
 
-void Mutex::GlobalUnlock(void)
+void Mutex::release(void)
 {
-	int ret = pthread_mutex_unlock(&GlobalMutex);
-	if(ret != 0)
-		throw Exception("Unable to unlock global mutex");
+	if(mSite)
+	{
+		mSite->held(LockProfiler::Clock() - mLockTime);
+		mSite = NULL;
+	}
+	
+	__atomic_store_n(&mOwner, 0, __ATOMIC_RELAXED);
 }
 
+int Mutex::detach(void)
+{
+	int count = mLockCount;
+	mLockCount = 0;
+	release();
+	return count;
 }
 
+void Mutex::attach(int count)
+{
+	__atomic_store_n(&mOwner, Self(), __ATOMIC_RELAXED);
+	mLockCount = count;
+}
+
+}
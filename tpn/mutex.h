@@ -27,7 +27,10 @@
 namespace tpn
 {
 
+class LockSite;
+
 // Recusive mutex implementation
+// The owner is tracked atomically, so locking never touches a global lock
 class Mutex
 {
 public:
@@ -36,22 +39,26 @@ public:
 
 	// Lock and Unlock are cumulative
 	// They can be called multiple times
-	void lock(int count = 1);
+	void lock(int count = 1, LockSite *site = NULL);	// site is profiled if the outermost lock
 	bool tryLock(void);
 	void unlock(void);	
 	int  unlockAll(void);
 	
-	int lockCount(void) const;
+	int lockCount(void) const;	// by the calling thread
 	
 private:
-	static void GlobalLock(void);
-	static void GlobalUnlock(void);
-	static pthread_mutex_t GlobalMutex;
-
+	static uintptr_t Self(void);
+	
+	bool isOwner(void) const;
+	void release(void);
+	int detach(void);		// with the mutex locked once more, before waiting
+	void attach(int count);		// after waiting
+	
 	pthread_mutex_t mMutex;
-	pthread_t mLockedBy;
+	uintptr_t mOwner;		// accessed atomically
 	int mLockCount;
-	int mRelockCount;
+	LockSite *mSite;
+	uint64_t mLockTime;
 
 	friend class Signal;
 };
@@ -22,6 +22,7 @@
 #include "tpn/pipe.h"
 #include "tpn/bytestring.h"
 #include "tpn/file.h"
+#include "tpn/synchronizable.h"
 
 namespace tpn
 {
@@ -44,6 +45,8 @@ Pipe::~Pipe(void)
 
 void Pipe::open(ByteStream *buffer, bool readOnly)
 {
+	mReadListener = NULL;
+	mPending = 0;
 	mReadBuffer = buffer;
 	if(!readOnly) mWriteBuffer = buffer->pipeIn();
 	else mWriteBuffer = NULL;
@@ -67,6 +70,21 @@ bool Pipe::is_open(void) const
 	return (mWriteBuffer != NULL); 
 }
 
+size_t Pipe::pending(void)
+{
+	mMutex.lock();
+	size_t pending = mPending;
+	mMutex.unlock();
+	return pending;
+}
+
+void Pipe::setReadListener(Synchronizable *listener)
+{
+	mMutex.lock();
+	mReadListener = listener;
+	mMutex.unlock();
+}
+
 size_t Pipe::readData(char *buffer, size_t size)
 {
 	mMutex.lock();
@@ -83,6 +101,19 @@ size_t Pipe::readData(char *buffer, size_t size)
 		mSignal.wait(mMutex);
 	}
 
+	mPending-= std::min(mPending, len);
+	
+	// The listener is notified with the lock held, so it can't be detached and deleted meanwhile.
+	// Its notify() must not lock the pipe.
+	try {
+		if(mReadListener) mReadListener->notify();
+	}
+	catch(...)
+	{
+		mMutex.unlock();
+		throw;
+	}
+	
 	mMutex.unlock();
 	return len;
 }
@@ -95,6 +126,7 @@ void Pipe::writeData(const char *data, size_t size)
 	mMutex.lock();
 	mWriteBuffer->writeData(data, size);
 	mWriteBuffer->flush();
+	mPending+= size;
 	mSignal.launchAll();
 	mMutex.unlock();
 }
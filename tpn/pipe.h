@@ -30,6 +30,8 @@
 namespace tpn
 {
 
+class Synchronizable;
+
 class Pipe : public Stream, public ByteStream
 {
 public:
@@ -42,6 +44,9 @@ public:
 	void close(void);		// closes the write end
 	bool is_open(void) const;	// true if the write end is open
 	
+	size_t pending(void);		// bytes written but not read yet
+	void setReadListener(Synchronizable *listener);	// listener is notified after reads, with the pipe locked
+	
 	// Stream, ByteStream
 	size_t readData(char *buffer, size_t size);
 	void writeData(const char *data, size_t size);
@@ -52,6 +57,8 @@ protected:
 private:
 	ByteStream *mReadBuffer;
 	ByteStream *mWriteBuffer;
+	Synchronizable *mReadListener;
+	size_t mPending;
 	Mutex mMutex;
 	Signal mSignal;
 };
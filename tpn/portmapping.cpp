@@ -24,6 +24,7 @@
 #include "tpn/http.h"
 #include "tpn/html.h"
 #include "tpn/jsonserializer.h"
+#include "tpn/bufferedstream.h"
 #include "tpn/core.h"
 
 namespace tpn
@@ -689,7 +690,8 @@ bool PortMapping::FreeboxAPI::check(String &host)
 	if(response.code != 200) return false;
 	
 	StringMap map;
-	JsonSerializer serializer(&sock);
+	BufferedStream buffered(&sock, BufferSize, false);	// the JSON tokenizer reads by character
+	JsonSerializer serializer(&buffered);
 	serializer.input(map);
 	
 	String apiBaseUrl, apiVersion;
@@ -745,7 +747,8 @@ bool PortMapping::FreeboxAPI::get(const String &url, FreeboxResponse &response)
 	hresponse.recv(sock);
 	if(hresponse.code != 200) return false;
 	
-	JsonSerializer serializer(&sock);
+	BufferedStream buffered(&sock, BufferSize, false);
+	JsonSerializer serializer(&buffered);
 	serializer.input(response);
 	return true;
 }
@@ -774,7 +777,8 @@ bool PortMapping::FreeboxAPI::put(const String &url, Serializable &data, Freebox
 	hresponse.recv(sock);
 	if(hresponse.code != 200) return false;
 	
-	JsonSerializer serializer(&sock);
+	BufferedStream buffered(&sock, BufferSize, false);
+	JsonSerializer serializer(&buffered);
 	serializer.input(response);
 	return true;
 }
@@ -0,0 +1,287 @@
+/*************************************************************************
+ *   Copyright (C) 2011-2013 by Paul-Louis Ageneau                       *
+ *   paul-louis (at) ageneau (dot) org                                   *
+ *                                                                       *
+ *   This file is part of TeapotNet.                                     *
+ *                                                                       *
+ *   TeapotNet is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU Affero General Public License as      *
+ *   published by the Free Software Foundation, either version 3 of      *
+ *   the License, or (at your option) any later version.                 *
+ *                                                                       *
+ *   TeapotNet is distributed in the hope that it will be useful, but    *
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the        *
+ *   GNU Affero General Public License for more details.                 *
+ *                                                                       *
+ *   You should have received a copy of the GNU Affero General Public    *
+ *   License along with TeapotNet.                                       *
+ *   If not, see <http://www.gnu.org/licenses/>.                         *
+ *************************************************************************/
+
+
+#include "tpn/reactor.h"
+#include "tpn/exception.h"
+#include "tpn/string.h"
+
+#ifdef LINUX
+#include <sys/epoll.h>
+#endif
+
+namespace tpn
+{
+
+bool Reactor::IsAvailable(void)
+{
+#ifdef LINUX
+	return true;
+#else
+	return false;
+#endif
+}
+
+Reactor::Reactor(unsigned ioThreads, unsigned workers) :
+	mNextIoThread(0),
+	mShouldStop(false)
+{
+	if(!IsAvailable()) throw Unsupported("Reactor");
+	
+	Synchronize(this);
+	
+	for(unsigned i=0; i<std::max(ioThreads, 1U); ++i)
+	{
+		IoThread *thread = new IoThread;
+		mIoThreads.push_back(thread);
+		thread->start();
+	}
+	
+	for(unsigned i=0; i<std::max(workers, 1U); ++i)
+	{
+		Worker *worker = new Worker(this);
+		mWorkers.push_back(worker);
+		worker->start();
+	}
+}
+
+Reactor::~Reactor(void)
+{
+	{
+		Synchronize(this);
+		mShouldStop = true;
+		mTasks.clear();
+		notifyAll();
+	}
+	
+	for(int i=0; i<mIoThreads.size(); ++i)
+	{
+		mIoThreads[i]->stop();
+		delete mIoThreads[i];	// joins
+	}
+	
+	for(int i=0; i<mWorkers.size(); ++i)
+		delete mWorkers[i];	// joins
+}
+
+void Reactor::add(socket_t sock, Client *client)
+{
+	Assert(client);
+	Synchronize(this);
+	
+	// Sockets are spread over I/O threads, a socket always stays on the same thread
+	IoThread *thread = mIoThreads[mNextIoThread];
+	mNextIoThread = (mNextIoThread + 1) % mIoThreads.size();
+	
+	thread->add(sock, client);
+	mSockets.insert(sock, thread);
+}
+
+void Reactor::remove(socket_t sock)
+{
+	Synchronize(this);
+	
+	IoThread *thread;
+	if(mSockets.get(sock, thread))
+	{
+		thread->remove(sock);
+		mSockets.erase(sock);
+	}
+}
+
+void Reactor::watch(socket_t sock, Client *client, bool readable, bool writable)
+{
+	Assert(client);
+	Synchronize(this);
+	
+	IoThread *thread;
+	if(mSockets.get(sock, thread))
+		thread->watch(sock, client, readable, writable);
+}
+
+void Reactor::dispatch(Task *task)
+{
+	Assert(task);
+	Synchronize(this);
+	if(mShouldStop) return;
+	mTasks.push_back(task);
+	notify();
+}
+
+bool Reactor::cancel(Task *task)
+{
+	Synchronize(this);
+	return mTasks.remove(task);
+}
+
+unsigned Reactor::pendingTasks(void) const
+{
+	Synchronize(this);
+	return unsigned(mTasks.size());
+}
+
+Reactor::IoThread::IoThread(void) :
+	mEpoll(-1),
+	mShouldStop(false)
+{
+#ifdef LINUX
+	mEpoll = epoll_create(64);
+	if(mEpoll < 0) throw Exception("Unable to create epoll instance");
+	
+	if(pipe(mWakeup) < 0)
+	{
+		::close(mEpoll);
+		throw Exception("Unable to create wakeup pipe");
+	}
+	
+	struct epoll_event event;
+	std::memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.ptr = NULL;
+	epoll_ctl(mEpoll, EPOLL_CTL_ADD, mWakeup[0], &event);
+#endif
+}
+
+Reactor::IoThread::~IoThread(void)
+{
+	join();
+	
+#ifdef LINUX
+	::close(mWakeup[0]);
+	::close(mWakeup[1]);
+	::close(mEpoll);
+#endif
+}
+
+void Reactor::IoThread::add(socket_t sock, Client *client)
+{
+#ifdef LINUX
+	struct epoll_event event;
+	std::memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN | EPOLLRDHUP;
+	event.data.ptr = client;
+	if(epoll_ctl(mEpoll, EPOLL_CTL_ADD, sock, &event) < 0)
+		throw NetException("Unable to watch socket (error " + String::number(errno) + ")");
+#endif
+}
+
+void Reactor::IoThread::remove(socket_t sock)
+{
+#ifdef LINUX
+	struct epoll_event event;
+	std::memset(&event, 0, sizeof(event));
+	epoll_ctl(mEpoll, EPOLL_CTL_DEL, sock, &event);
+#endif
+}
+
+void Reactor::IoThread::watch(socket_t sock, Client *client, bool readable, bool writable)
+{
+#ifdef LINUX
+	struct epoll_event event;
+	std::memset(&event, 0, sizeof(event));
+	if(readable) event.events|= EPOLLIN | EPOLLRDHUP;
+	if(writable) event.events|= EPOLLOUT;
+	event.data.ptr = client;
+	if(epoll_ctl(mEpoll, EPOLL_CTL_MOD, sock, &event) < 0)
+		throw NetException("Unable to watch socket (error " + String::number(errno) + ")");
+#endif
+}
+
+void Reactor::IoThread::stop(void)
+{
+	mShouldStop = true;
+	char dummy = 0;
+	if(::write(mWakeup[1], &dummy, 1) < 0)
+		LogWarn("Reactor::IoThread", "Unable to wake up I/O thread");
+}
+
+void Reactor::IoThread::run(void)
+{
+#ifdef LINUX
+	const int maxEvents = 64;
+	struct epoll_event events[maxEvents];
+	
+	while(!mShouldStop)
+	{
+		int count = epoll_wait(mEpoll, events, maxEvents, -1);
+		if(count < 0)
+		{
+			if(errno == EINTR) continue;
+			LogError("Reactor::IoThread", "epoll_wait failed (error " + String::number(errno) + ")");
+			break;
+		}
+		
+		for(int i=0; i<count; ++i)
+		{
+			Client *client = reinterpret_cast<Client*>(events[i].data.ptr);
+			if(!client) continue;	// wakeup pipe
+			
+			try {
+				// Errors and hang-ups are reported by the read itself
+				if(events[i].events & EPOLLOUT) client->writable();
+				if(events[i].events & ~uint32_t(EPOLLOUT)) client->readable();
+			}
+			catch(const std::exception &e)
+			{
+				LogWarn("Reactor::IoThread", e.what());
+			}
+		}
+	}
+#endif
+}
+
+Reactor::Worker::Worker(Reactor *reactor) :
+	mReactor(reactor)
+{
+
+}
+
+void Reactor::Worker::run(void)
+{
+	while(true)
+	{
+		Task *task = NULL;
+		
+		{
+			Synchronize(mReactor);
+			while(mReactor->mTasks.empty() && !mReactor->mShouldStop)
+				mReactor->wait();
+			
+			if(mReactor->mShouldStop) break;
+			task = mReactor->mTasks.front();
+			mReactor->mTasks.pop_front();
+		}
+		
+		try {
+			task->run();
+		}
+		catch(const std::exception &e)
+		{
+			LogWarn("Reactor::Worker", String("Unhandled exception in task: ") + e.what());
+		}
+		catch(...)
+		{
+			LogWarn("Reactor::Worker", "Unknown exception in task");
+		}
+	}
+}
+
+}
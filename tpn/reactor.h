@@ -0,0 +1,105 @@
+/*************************************************************************
+ *   Copyright (C) 2011-2013 by Paul-Louis Ageneau                       *
+ *   paul-louis (at) ageneau (dot) org                                   *
+ *                                                                       *
+ *   This file is part of TeapotNet.                                     *
+ *                                                                       *
+ *   TeapotNet is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU Affero General Public License as      *
+ *   published by the Free Software Foundation, either version 3 of      *
+ *   the License, or (at your option) any later version.                 *
+ *                                                                       *
+ *   TeapotNet is distributed in the hope that it will be useful, but    *
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the        *
+ *   GNU Affero General Public License for more details.                 *
+ *                                                                       *
+ *   You should have received a copy of the GNU Affero General Public    *
+ *   License along with TeapotNet.                                       *
+ *   If not, see <http://www.gnu.org/licenses/>.                         *
+ *************************************************************************/
+
+
+#ifndef TPN_REACTOR_H
+#define TPN_REACTOR_H
+
+#include "tpn/include.h"
+#include "tpn/synchronizable.h"
+#include "tpn/thread.h"
+#include "tpn/task.h"
+#include "tpn/array.h"
+#include "tpn/list.h"
+#include "tpn/map.h"
+
+namespace tpn
+{
+
+// Event loop for established links
+// Sockets are watched by a fixed set of I/O threads with epoll,
+// and tasks are dispatched to a bounded pool of workers.
+class Reactor : protected Synchronizable
+{
+public:
+	static bool IsAvailable(void);
+	
+	class Client
+	{
+	public:
+		virtual void readable(void) = 0;	// called from an I/O thread, must not block
+		virtual void writable(void) {}		// only if watched for writing
+	};
+	
+	Reactor(unsigned ioThreads = 1, unsigned workers = 4);
+	~Reactor(void);
+	
+	void add(socket_t sock, Client *client);
+	void remove(socket_t sock);
+	void watch(socket_t sock, Client *client, bool readable, bool writable);	// sock must have been added
+	
+	void dispatch(Task *task);	// task is run on a worker
+	bool cancel(Task *task);	// true if the task was removed before running
+	
+	unsigned pendingTasks(void) const;
+	
+private:
+	class IoThread : public Thread
+	{
+	public:
+		IoThread(void);
+		~IoThread(void);
+		
+		void add(socket_t sock, Client *client);
+		void remove(socket_t sock);
+		void watch(socket_t sock, Client *client, bool readable, bool writable);
+		void stop(void);
+		
+	private:
+		void run(void);
+		
+		int mEpoll;
+		int mWakeup[2];
+		bool mShouldStop;
+	};
+	
+	class Worker : public Thread
+	{
+	public:
+		Worker(Reactor *reactor);
+		
+	private:
+		void run(void);
+		
+		Reactor *mReactor;
+	};
+	
+	Array<IoThread*> mIoThreads;
+	Array<Worker*> mWorkers;
+	Map<socket_t, IoThread*> mSockets;
+	List<Task*> mTasks;
+	unsigned mNextIoThread;
+	bool mShouldStop;
+};
+
+}
+
+#endif
@@ -0,0 +1,436 @@
+/*************************************************************************
+ *   Copyright (C) 2011-2013 by Paul-Louis Ageneau                       *
+ *   paul-louis (at) ageneau (dot) org                                   *
+ *                                                                       *
+ *   This file is part of TeapotNet.                                     *
+ *                                                                       *
+ *   TeapotNet is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU Affero General Public License as      *
+ *   published by the Free Software Foundation, either version 3 of      *
+ *   the License, or (at your option) any later version.                 *
+ *                                                                       *
+ *   TeapotNet is distributed in the hope that it will be useful, but    *
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the        *
+ *   GNU Affero General Public License for more details.                 *
+ *                                                                       *
+ *   You should have received a copy of the GNU Affero General Public    *
+ *   License along with TeapotNet.                                       *
+ *   If not, see <http://www.gnu.org/licenses/>.                         *
+ *************************************************************************/
+
+
+#include "tpn/relay.h"
+#include "tpn/scheduler.h"
+#include "tpn/exception.h"
+#include "tpn/string.h"
+
+#ifdef LINUX
+#include <fcntl.h>
+#endif
+
+namespace tpn
+{
+
+Relay::Relay(Reactor *reactor, unsigned maxSessions, unsigned maxBufferedSessions, double timeout) :
+	mReactor(reactor),
+	mCopyPool(0, 2),
+	mMaxSessions(maxSessions),
+	mMaxBufferedSessions(maxBufferedSessions),
+	mBufferedSessions(0),
+	mTimeout(timeout),
+	mNextId(0),
+	mClosedBytes(0),
+	mCheckTask(this)
+{
+	if(mTimeout > 0.) Scheduler::Global->repeat(&mCheckTask, mTimeout/2);
+}
+
+Relay::~Relay(void)
+{
+	Scheduler::Global->remove(&mCheckTask);
+	
+	Array<Session*> sessions;
+	{
+		Synchronize(this);
+		for(Map<unsigned, Session*>::iterator it = mSessions.begin(); it != mSessions.end(); ++it)
+			sessions.push_back(it->second);
+	}
+	
+	for(int i=0; i<sessions.size(); ++i)
+		sessions[i]->close();
+	
+	mCopyPool.join();
+}
+
+bool Relay::add(ByteStream *first, ByteStream *second)
+{
+	Assert(first);
+	Assert(second);
+	
+	Session *session;
+	{
+		Synchronize(this);
+		if(mMaxSessions && mSessions.size() >= mMaxSessions)
+		{
+			LogWarn("Relay", "Maximum number of relayed sessions reached");
+			return false;
+		}
+		
+		// Buffered sessions hold two copy threads each
+		bool spliceable = false;
+#ifdef LINUX
+		spliceable = (mReactor && dynamic_cast<Socket*>(first) && dynamic_cast<Socket*>(second));
+#endif
+		if(!spliceable && mMaxBufferedSessions && mBufferedSessions >= mMaxBufferedSessions)
+		{
+			LogWarn("Relay", "Maximum number of buffered relayed sessions reached");
+			return false;
+		}
+		
+		session = new Session(this, ++mNextId, first, second);
+		mSessions.insert(session->id(), session);
+		if(!session->isSpliced()) ++mBufferedSessions;
+	}
+	
+	LogDebug("Relay", String("Relaying session ") + String::number(session->id()) + (session->isSpliced() ? " (spliced)" : " (buffered)"));
+	session->start();
+	return true;
+}
+
+bool Relay::isFull(void) const
+{
+	Synchronize(this);
+	return (mMaxSessions && mSessions.size() >= mMaxSessions);
+}
+
+unsigned Relay::count(void) const
+{
+	Synchronize(this);
+	return unsigned(mSessions.size());
+}
+
+uint64_t Relay::totalBytes(void) const
+{
+	Synchronize(this);
+	uint64_t total = mClosedBytes;
+	for(Map<unsigned, Session*>::const_iterator it = mSessions.begin(); it != mSessions.end(); ++it)
+	{
+		Stats stats;
+		it->second->getStats(stats);
+		total+= stats.forward + stats.backward;
+	}
+	return total;
+}
+
+void Relay::getStats(Array<Stats> &stats) const
+{
+	Synchronize(this);
+	stats.clear();
+	for(Map<unsigned, Session*>::const_iterator it = mSessions.begin(); it != mSessions.end(); ++it)
+	{
+		Stats s;
+		it->second->getStats(s);
+		stats.push_back(s);
+	}
+}
+
+void Relay::remove(Session *session)
+{
+	Stats stats;
+	session->getStats(stats);
+	
+	Synchronize(this);
+	if(mSessions.erase(stats.id))
+	{
+		mClosedBytes+= stats.forward + stats.backward;
+		if(!stats.spliced) --mBufferedSessions;
+	}
+}
+
+void Relay::checkTimeouts(void)
+{
+	// Sessions are deleted with a delay, so pointers stay valid outside of the lock
+	Array<Session*> sessions;
+	{
+		Synchronize(this);
+		for(Map<unsigned, Session*>::iterator it = mSessions.begin(); it != mSessions.end(); ++it)
+			if(it->second->isIdle(mTimeout))
+				sessions.push_back(it->second);
+	}
+	
+	for(int i=0; i<sessions.size(); ++i)
+	{
+		LogDebug("Relay", "Relayed session timed out");
+		sessions[i]->close();
+	}
+}
+
+Relay::Session::Session(Relay *relay, unsigned id, ByteStream *first, ByteStream *second) :
+	mRelay(relay),
+	mId(id),
+	mClosed(false),
+	mRunningCopies(0),
+	mStart(Time::Now()),
+	mLastActivity(Time::Now()),
+	mForwardTask(this, 0),
+	mBackwardTask(this, 1)
+{
+	mStreams[0] = first;
+	mStreams[1] = second;
+	
+	for(int i=0; i<2; ++i)
+	{
+		mSockets[i] = NULL;
+		mPipes[i][0] = mPipes[i][1] = -1;
+		mPiped[i] = 0;
+		mBytes[i] = 0;
+		mEof[i] = false;
+	}
+	
+#ifdef LINUX
+	// Splicing requires the reactor and plain sockets on both sides
+	Socket *sock0 = dynamic_cast<Socket*>(first);
+	Socket *sock1 = dynamic_cast<Socket*>(second);
+	if(mRelay->mReactor && sock0 && sock1)
+	{
+		if(::pipe(mPipes[0]) == 0)
+		{
+			if(::pipe(mPipes[1]) == 0)
+			{
+				mSockets[0] = sock0;
+				mSockets[1] = sock1;
+			}
+			else {
+				::close(mPipes[0][0]);
+				::close(mPipes[0][1]);
+				mPipes[0][0] = mPipes[0][1] = -1;
+			}
+		}
+	}
+#endif
+}
+
+Relay::Session::~Session(void)
+{
+#ifdef LINUX
+	for(int i=0; i<2; ++i)
+		if(mPipes[i][0] >= 0)
+		{
+			::close(mPipes[i][0]);
+			::close(mPipes[i][1]);
+		}
+#endif
+	
+	delete mStreams[0];
+	delete mStreams[1];
+}
+
+unsigned Relay::Session::id(void) const
+{
+	return mId;
+}
+
+bool Relay::Session::isSpliced(void) const
+{
+	return (mSockets[0] != NULL);
+}
+
+bool Relay::Session::isIdle(double timeout) const
+{
+	Synchronize(this);
+	return (Time::Now() - mLastActivity > timeout);
+}
+
+void Relay::Session::getStats(Stats &stats) const
+{
+	Synchronize(this);
+	stats.id = mId;
+	stats.start = mStart;
+	stats.forward = mBytes[0];
+	stats.backward = mBytes[1];
+	stats.spliced = isSpliced();
+}
+
+void Relay::Session::start(void)
+{
+	if(isSpliced())
+	{
+#ifdef LINUX
+		// The relay now owns the sockets, they are switched to non-blocking mode
+		for(int i=0; i<2; ++i)
+		{
+			int fd = mSockets[i]->descriptor();
+			::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+		}
+		
+		Synchronize(this);
+		mRelay->mReactor->add(mSockets[0]->descriptor(), this);
+		mRelay->mReactor->add(mSockets[1]->descriptor(), this);
+#endif
+	}
+	else {
+		SynchronizeStatement(this, mRunningCopies = 2);
+		mRelay->mCopyPool.launch(&mForwardTask);
+		mRelay->mCopyPool.launch(&mBackwardTask);
+	}
+}
+
+void Relay::Session::close(void)
+{
+	{
+		Synchronize(this);
+		if(mClosed) return;
+		mClosed = true;
+		
+		if(isSpliced())
+		{
+			mRelay->mReactor->remove(mSockets[0]->descriptor());
+			mRelay->mReactor->remove(mSockets[1]->descriptor());
+		}
+		
+		// Shutting down sockets also unblocks pending copies
+		for(int i=0; i<2; ++i)
+		{
+			Socket *sock = dynamic_cast<Socket*>(mStreams[i]);
+			if(sock) sock->shutdown();
+		}
+	}
+	
+	finish();
+}
+
+void Relay::Session::readable(void)
+{
+	pump();
+}
+
+void Relay::Session::writable(void)
+{
+	pump();
+}
+
+void Relay::Session::pump(void)
+{
+	Synchronize(this);
+	if(mClosed) return;
+	
+	try {
+		forward(0);
+		forward(1);
+	}
+	catch(const Exception &e)
+	{
+		LogDebug("Relay::Session", e.what());
+		Desynchronize(this);
+		close();
+		return;
+	}
+	
+	if(mEof[0] && mEof[1] && !mPiped[0] && !mPiped[1])
+	{
+		Desynchronize(this);
+		close();
+		return;
+	}
+	
+	update();
+}
+
+void Relay::Session::forward(int i)
+{
+#ifdef LINUX
+	const size_t spliceSize = 65536;
+	int src = mSockets[i]->descriptor();
+	int dst = mSockets[1-i]->descriptor();
+	
+	if(!mPiped[i] && !mEof[i])
+	{
+		ssize_t ret = ::splice(src, NULL, mPipes[i][1], NULL, spliceSize, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if(ret > 0) mPiped[i] = size_t(ret);
+		else if(ret == 0) 
+		{
+			// Propagate the half-close
+			mEof[i] = true;
+			::shutdown(dst, SHUT_WR);
+		}
+		else if(errno != EAGAIN && errno != EINTR)
+			throw NetException("Relay read failed (error " + String::number(errno) + ")");
+	}
+	
+	if(mPiped[i])
+	{
+		ssize_t ret = ::splice(mPipes[i][0], NULL, dst, NULL, mPiped[i], SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if(ret > 0) 
+		{
+			mPiped[i]-= size_t(ret);
+			mBytes[i]+= uint64_t(ret);
+			mLastActivity = Time::Now();
+		}
+		else if(ret < 0 && errno != EAGAIN && errno != EINTR)
+			throw NetException("Relay write failed (error " + String::number(errno) + ")");
+	}
+#endif
+}
+
+void Relay::Session::update(void)
+{
+	// A socket is read only when its outgoing pipe is empty,
+	// and watched for writing when its incoming pipe is not
+	for(int i=0; i<2; ++i)
+	{
+		bool readable = !mEof[i] && !mPiped[i];
+		bool writable = (mPiped[1-i] > 0);
+		mRelay->mReactor->watch(mSockets[i]->descriptor(), this, readable, writable);
+	}
+}
+
+void Relay::Session::copy(int i)
+{
+	char buffer[BufferSize];
+	
+	try {
+		size_t size;
+		while((size = mStreams[i]->readData(buffer, BufferSize)))
+		{
+			mStreams[1-i]->writeData(buffer, size);
+			
+			Synchronize(this);
+			mBytes[i]+= size;
+			mLastActivity = Time::Now();
+			if(mClosed) break;
+		}
+	}
+	catch(const std::exception &e)
+	{
+		LogDebug("Relay::Session", e.what());
+	}
+	
+	bool last;
+	{
+		Synchronize(this);
+		mEof[i] = true;
+		last = (--mRunningCopies == 0);
+	}
+	
+	// The first direction to end closes the session
+	close();
+	if(last) Scheduler::Global->schedule(new DeleteTask(this), 5.);
+}
+
+void Relay::Session::finish(void)
+{
+	mRelay->remove(this);
+	
+	// Copies still running will schedule the deletion
+	if(SynchronizeTest(this, mRunningCopies == 0) && isSpliced())
+		Scheduler::Global->schedule(new DeleteTask(this), 5.);
+}
+
+void Relay::Session::DeleteTask::run(void)
+{
+	delete mSession;
+	delete this;	// autodelete
+}
+
+}
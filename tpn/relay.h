@@ -0,0 +1,159 @@
+/*************************************************************************
+ *   Copyright (C) 2011-2013 by Paul-Louis Ageneau                       *
+ *   paul-louis (at) ageneau (dot) org                                   *
+ *                                                                       *
+ *   This file is part of TeapotNet.                                     *
+ *                                                                       *
+ *   TeapotNet is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU Affero General Public License as      *
+ *   published by the Free Software Foundation, either version 3 of      *
+ *   the License, or (at your option) any later version.                 *
+ *                                                                       *
+ *   TeapotNet is distributed in the hope that it will be useful, but    *
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the        *
+ *   GNU Affero General Public License for more details.                 *
+ *                                                                       *
+ *   You should have received a copy of the GNU Affero General Public    *
+ *   License along with TeapotNet.                                       *
+ *   If not, see <http://www.gnu.org/licenses/>.                         *
+ *************************************************************************/
+
+
+#ifndef TPN_RELAY_H
+#define TPN_RELAY_H
+
+#include "tpn/include.h"
+#include "tpn/synchronizable.h"
+#include "tpn/bytestream.h"
+#include "tpn/socket.h"
+#include "tpn/reactor.h"
+#include "tpn/threadpool.h"
+#include "tpn/task.h"
+#include "tpn/time.h"
+#include "tpn/array.h"
+#include "tpn/map.h"
+
+namespace tpn
+{
+
+// Forwarding engine for relayed connections
+// Pairs of plain sockets are forwarded by the reactor with splice() through a pipe.
+// Other streams like HTTP tunnels have no single descriptor to watch: a tunnel waits for
+// the next HTTP connection to be handed over and parses its framing inside readData() and
+// writeData(), so they are copied through a buffer by two threads per session, and the
+// count of such buffered sessions is limited.
+class Relay : protected Synchronizable
+{
+public:
+	struct Stats
+	{
+		unsigned id;
+		Time start;
+		uint64_t forward;	// from first to second stream
+		uint64_t backward;	// from second to first stream
+		bool spliced;
+	};
+	
+	Relay(Reactor *reactor = NULL,
+	      unsigned maxSessions = 0,
+	      unsigned maxBufferedSessions = 0,
+	      double timeout = 60.);	// 0 means unlimited
+	~Relay(void);
+	
+	bool add(ByteStream *first, ByteStream *second);	// takes ownership of streams on success
+	bool isFull(void) const;
+	unsigned count(void) const;
+	
+	uint64_t totalBytes(void) const;
+	void getStats(Array<Stats> &stats) const;
+	
+private:
+	class Session : public Synchronizable, public Reactor::Client
+	{
+	public:
+		Session(Relay *relay, unsigned id, ByteStream *first, ByteStream *second);
+		~Session(void);
+		
+		unsigned id(void) const;
+		bool isSpliced(void) const;
+		bool isIdle(double timeout) const;
+		void getStats(Stats &stats) const;
+		
+		void start(void);
+		void close(void);
+		
+	private:
+		// Reactor::Client
+		void readable(void);
+		void writable(void);
+		
+		void pump(void);
+		void forward(int i);
+		void update(void);
+		void copy(int i);
+		void finish(void);
+		
+		class CopyTask : public Task
+		{
+		public:
+			CopyTask(Session *session, int index) : mSession(session), mIndex(index) {}
+			void run(void) { mSession->copy(mIndex); }
+			
+		private:
+			Session *mSession;
+			int mIndex;
+		};
+		
+		class DeleteTask : public Task
+		{
+		public:
+			DeleteTask(Session *session) : mSession(session) {}
+			void run(void);
+			
+		private:
+			Session *mSession;
+		};
+		
+		Relay *mRelay;
+		unsigned mId;
+		ByteStream *mStreams[2];
+		Socket *mSockets[2];		// non-null when spliced
+		int mPipes[2][2];		// per direction
+		size_t mPiped[2];
+		uint64_t mBytes[2];
+		bool mEof[2];
+		bool mClosed;
+		unsigned mRunningCopies;
+		Time mStart, mLastActivity;
+		CopyTask mForwardTask, mBackwardTask;
+	};
+	
+	class CheckTask : public Task
+	{
+	public:
+		CheckTask(Relay *relay) : mRelay(relay) {}
+		void run(void) { mRelay->checkTimeouts(); }
+		
+	private:
+		Relay *mRelay;
+	};
+	
+	void remove(Session *session);
+	void checkTimeouts(void);
+	
+	Reactor *mReactor;
+	ThreadPool mCopyPool;
+	Map<unsigned, Session*> mSessions;
+	unsigned mMaxSessions;
+	unsigned mMaxBufferedSessions;
+	unsigned mBufferedSessions;
+	double mTimeout;
+	unsigned mNextId;
+	uint64_t mClosedBytes;
+	CheckTask mCheckTask;
+};
+
+}
+
+#endif
@@ -26,6 +26,7 @@
 #include "tpn/store.h"
 #include "tpn/stripedfile.h"
 #include "tpn/yamlserializer.h"
+#include "tpn/scheduler.h"
 
 namespace tpn
 {
@@ -39,17 +40,47 @@ const int Request::Response::Empty = 4;
 const int Request::Response::Interrupted = 5;
 const int Request::Response::ReadFailed = 6;
 
+const unsigned Request::BackgroundWeight = 1;
+const unsigned Request::DefaultWeight = 4;
+const unsigned Request::StreamingWeight = 8;
+const unsigned Request::MaxWeight = 16;
+
+
+// Request being finished by the current thread, see Request::deliver()
+__thread Request *Request::Finishing = NULL;
 
 Request::Request(const String &target, bool data) :
 		mId(0),				// 0 = invalid id
 		mResponseSender(NULL),
-		mContentSink(NULL)
+		mContentSink(NULL),
+		mWeight(DefaultWeight),
+		mCallback(NULL),
+		mDeliverTask(this),
+		mTimeout(0.),
+		mDelivered(0),
+		mSubmitting(false),
+		mScheduled(false),
+		mDelivering(false),
+		mRedeliver(false),
+		mDone(false)
 {
 	setTarget(target, data);
 }
 
 Request::~Request(void)
 {
+	if(SynchronizeTest(this, mCallback != NULL))
+	{
+		// Wait for a delivery already started by the scheduler
+		Synchronize(this);
+		mDone = true;
+		if(mScheduled && Scheduler::Global->remove(&mDeliverTask)) mScheduled = false;
+		
+		// Don't wait for ourselves if deleted from finished()
+		if(Finishing == this) Finishing = NULL;
+		else while(mScheduled || mDelivering) wait();
+	}
+	
 	cancel();
 
 	for(int i=0; i<mResponses.size(); ++i)
@@ -93,6 +124,18 @@ void Request::setParameter(const String &name, const String &value)
 	mParameters.insert(name, value);
 }
 
+void Request::setWeight(unsigned weight)
+{
+	Synchronize(this);
+	mWeight = bounds(weight, 1U, MaxWeight);
+}
+
+unsigned Request::weight(void) const
+{
+	Synchronize(this);
+	return mWeight;
+}
+
 void Request::submit(void)
 {
 	Synchronize(this);
@@ -114,6 +157,39 @@ void Request::submit(const Identifier &receiver)
 	}
 }
 
+void Request::submit(Callback *callback, double timeout)
+{
+	submit(Identifier::Null, callback, timeout);
+}
+
+void Request::submit(const Identifier &receiver, Callback *callback, double timeout)
+{
+	Assert(callback);
+	Synchronize(this);
+	if(mId) return;
+	
+	mReceiver = receiver;
+	mCallback = callback;
+	mSubmitTime = Time::Now();
+	mTimeout = timeout;
+	
+	// Responses may arrive before all peers are marked pending
+	mSubmitting = true;
+	try {
+		Desynchronize(this);
+		Core::Instance->addRequest(this);	// mId set by Core
+	}
+	catch(...)
+	{
+		mSubmitting = false;
+		mCallback = NULL;
+		throw;
+	}
+	
+	mSubmitting = false;
+	trigger();
+}
+
 void Request::cancel(void)
 {
 	Synchronize(this);
@@ -398,7 +474,11 @@ void Request::removePending(const Identifier &peering)
 	if(it != mPending.end())
 	{
 		mPending.erase(it);
-		if(mPending.empty()) notifyAll();
+		if(mPending.empty())
+		{
+			notifyAll();
+			trigger();
+		}
 	}
 }
 
@@ -416,9 +496,104 @@ int Request::addResponse(Response *response)
 	
 	mResponses.push_back(response);
 	if(mResponseSender) mResponseSender->notify();
+	trigger();
 	return mResponses.size()-1;
 }
 
+void Request::trigger(void)
+{
+	// Must be called with the lock
+	if(!mCallback || mSubmitting || mDone) return;
+	
+	// At most one delivery task is scheduled or running at a time
+	if(mDelivering) mRedeliver = true;
+	else if(mScheduled) {
+		// Pull a pending deadline forward, a launched task will see the response anyway
+		if(Scheduler::Global->remove(&mDeliverTask))
+			Scheduler::Global->schedule(&mDeliverTask);
+	}
+	else {
+		mScheduled = true;
+		Scheduler::Global->schedule(&mDeliverTask);
+	}
+}
+
+void Request::deliver(void)
+{
+	// The lock is taken manually as the request may be deleted by the callback
+	lock();
+	mScheduled = false;
+	if(mDone)
+	{
+		notifyAll();	// the destructor is waiting
+		unlock();
+		return;
+	}
+	
+	mDelivering = true;
+	while(true)
+	{
+		mRedeliver = false;
+		
+		Array<Response*> responses;
+		for(int i=mDelivered; i<mResponses.size(); ++i)
+			responses.push_back(mResponses[i]);
+		mDelivered = mResponses.size();
+		
+		bool timeout = !mPending.empty() && Time::Now() - mSubmitTime >= mTimeout;
+		bool finished = mPending.empty() || timeout;
+		if(finished) mDone = true;
+		
+		Callback *callback = mCallback;
+		unlock();
+		
+		for(int i=0; i<responses.size(); ++i)
+		{
+			try {
+				callback->response(this, responses[i]);
+			}
+			catch(const Exception &e)
+			{
+				LogWarn("Request::deliver", String("Response callback failed: ") + e.what());
+			}
+		}
+		
+		if(finished)
+		{
+			Finishing = this;
+			try {
+				callback->finished(this, timeout);
+			}
+			catch(const Exception &e)
+			{
+				LogWarn("Request::deliver", String("Finished callback failed: ") + e.what());
+			}
+			
+			if(Finishing != this) return;	// the request has been deleted
+			Finishing = NULL;
+			
+			lock();
+			mDelivering = false;
+			notifyAll();	// the destructor may be waiting
+			unlock();
+			return;
+		}
+		
+		lock();
+		if(mDone || !mRedeliver) break;
+	}
+	
+	mDelivering = false;
+	if(mDone) notifyAll();	// the destructor is waiting
+	else {
+		// Wake up again at the deadline
+		mScheduled = true;
+		Scheduler::Global->schedule(&mDeliverTask, std::max(mTimeout - (Time::Now() - mSubmitTime), 0.));
+	}
+	
+	unlock();
+}
+
 Request::Response *Request::response(int num)
 {
 	Synchronize(this);
@@ -26,6 +26,8 @@
 #include "tpn/synchronizable.h"
 #include "tpn/identifier.h"
 #include "tpn/bytestream.h"
+#include "tpn/task.h"
+#include "tpn/time.h"
 #include "tpn/array.h"
 #include "tpn/list.h"
 #include "tpn/map.h"
@@ -40,6 +42,12 @@ class Resource;
 class Request : public Synchronizable
 {
 public:
+	// Share of the remote sender bandwidth for the response data
+	static const unsigned BackgroundWeight;
+	static const unsigned DefaultWeight;
+	static const unsigned StreamingWeight;
+	static const unsigned MaxWeight;
+	
 	Request(const String &target = "", bool data = true);
 	virtual ~Request(void);
 
@@ -50,9 +58,15 @@ public:
 	void setTarget(const String &target, bool data);
 	void setParameters(StringMap &params);
 	void setParameter(const String &name, const String &value);
+	void setWeight(unsigned weight);
+	unsigned weight(void) const;
+	
+	class Callback;
 	
 	void submit(void);
 	void submit(const Identifier &receiver);
+	void submit(Callback *callback, double timeout);
+	void submit(const Identifier &receiver, Callback *callback, double timeout);
 	void cancel(void);
 	bool execute(User *user, bool isFromSelf = false);
 	bool executeDummy(void);
@@ -104,6 +118,16 @@ public:
 		friend class Core;
 	};
 
+	// Completion callbacks are run by the global scheduler without the request lock,
+	// so no thread has to wait for the responses.
+	// The request may be deleted in finished() or from another thread, but not in response().
+	class Callback
+	{
+	public:
+		virtual void response(Request *request, Response *response) {}		// on each response
+		virtual void finished(Request *request, bool timeout) = 0;		// once, when all peers answered or on timeout
+	};
+	
 	int responsesCount(void) const;
 	Response *response(int num);
 	const Response *response(int num) const;
@@ -113,6 +137,19 @@ public:
 private:
 	Response *createResponse(const Resource &resource, const StringMap &parameters, Store *store);
 	int addResponse(Response *response);
+	
+	void trigger(void);
+	void deliver(void);
+	
+	class DeliverTask : public Task
+	{
+	public:
+		DeliverTask(Request *request) : mRequest(request) {}
+		void run(void) { mRequest->deliver(); }
+		
+	private:
+		Request *mRequest;
+	};
 
 	Identifier mReceiver;
 	String mTarget;
@@ -120,12 +157,27 @@ private:
 	StringMap mParameters;
 	ByteStream *mContentSink;
 	Synchronizable *mResponseSender;
+	unsigned mWeight;
 	Address mRemoteAddr;
 	
 	unsigned mId;
 	Set<Identifier> mPending;
 
 	Array<Response*> mResponses;
+	
+	// Completion state
+	Callback *mCallback;
+	DeliverTask mDeliverTask;
+	Time mSubmitTime;
+	double mTimeout;
+	int mDelivered;		// responses passed to the callback
+	bool mSubmitting;
+	bool mScheduled;	// delivery task is in the scheduler
+	bool mDelivering;
+	bool mRedeliver;
+	bool mDone;
+	
+	static __thread Request *Finishing;
 
 	friend class Core;
 };
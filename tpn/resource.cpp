@@ -468,45 +468,73 @@ bool Resource::Query::submitLocal(Set<Resource> &result)
 
 bool Resource::Query::submitRemote(Set<Resource> &result, const Identifier &peering)
 {
+	// Responses are deserialized as they arrive, a digest query stops at the first resource
+	class Collector : public Synchronizable, public Request::Callback
+	{
+	public:
+		Collector(Store *store, bool first) : store(store), first(first), success(false), done(false) {}
+		
+		void response(Request *request, Request::Response *response)
+		{
+			if(response->error()) return;
+			
+			Synchronize(this);
+			success = true;
+			
+			if(response->status() != Request::Response::Empty)
+			{
+				try {
+					Resource resource(store);
+					StringMap parameters = response->parameters();
+					resource.deserialize(parameters);
+					resource.setPeering(response->peering());
+					resources.insert(resource);
+					if(first) notifyAll();
+				}
+				catch(const Exception &e)
+				{
+					LogWarn("Resource::Query::submit", String("Dropping invalid response: ") + e.what());
+				}
+			}
+		}
+		
+		void finished(Request *request, bool timeout)
+		{
+			Synchronize(this);
+			done = true;
+			notifyAll();
+		}
+		
+		Store *store;
+		bool first;
+		bool success;
+		bool done;
+		Set<Resource> resources;
+	};
+	
 	const double timeout = milliseconds(Config::Get("request_timeout").toInt());
 
-	Request request;
+	Collector collector(mStore, !mDigest.empty());
+	Request request;	// destroyed before collector
 	createRequest(request);
 	
 	try {
-		request.submit(peering);
-		request.wait(timeout);
+		request.submit(peering, &collector, timeout);
 	}
 	catch(const Exception &e)
 	{
 		return false;
 	}
 
-	Synchronize(&request);
-	bool success = false;
-	for(int i=0; i<request.responsesCount(); ++i)
-	{
-		const Request::Response *response = request.response(i);		
-                if(response->error()) continue;
-		success = true;
-		
-		if(response->status() != Request::Response::Empty)
-		{
-			try {
-				Resource resource(mStore);
-				StringMap parameters = response->parameters();
-				resource.deserialize(parameters);
-				resource.setPeering(response->peering());
-				result.insert(resource);
-			}
-			catch(const Exception &e)
-			{
-				LogWarn("Resource::Query::submit", String("Dropping invalid response: ") + e.what());
-			}
-		}
-	}
-
-	return success;
+	Synchronize(&collector);
+	double left = timeout;
+	while(!collector.done && !(collector.first && !collector.resources.empty()))
+		if(!collector.wait(left)) break;
+	
+	for(Set<Resource>::iterator it = collector.resources.begin(); it != collector.resources.end(); ++it)
+		result.insert(*it);
+	
+	return collector.success;
 }
 
 bool Resource::Query::submit(Set<Resource> &result, const Identifier &peering, bool forceLocal)
@@ -775,6 +803,7 @@ size_t Resource::SplicerAccessor::readData(char *buffer, size_t size)
 	{
 		mSplicer = new Splicer(mDigest, mPosition);
 		mSplicer->addSources(mSources);
+		mSplicer->setWeight(Request::StreamingWeight);	// a reader is waiting
 		//mSplicer->start();	// Do not start if it's not necessary
 	}
 
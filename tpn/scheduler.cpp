@@ -29,43 +29,40 @@ namespace tpn
 Scheduler *Scheduler::Global = new Scheduler(1);
 
 Scheduler::Scheduler(unsigned maxWaitingThreads) :
-	ThreadPool(0, maxWaitingThreads, 0)
+	ThreadPool(0, maxWaitingThreads, 0),
+	mStart(Time::Now()),
+	mTick(0),
+	mWakeTick(std::numeric_limits<uint64_t>::max()),
+	mThreadActive(false),
+	mScheduledCount(0),
+	mBuckets(NULL),
+	mBucketsCount(0),
+	mTimersCount(0)
 {
-	
+	std::fill(mLists, mLists + ListsCount, static_cast<Timer*>(NULL));
+	std::memset(mBitmaps, 0, sizeof(mBitmaps));
+	rehash(64);
 }
 
 Scheduler::~Scheduler(void)
 {
 	NOEXCEPTION(clear());	// wait for threads to finish
+	delete[] mBuckets;
 }
 
 void Scheduler::schedule(Task *task, double timeout)
 {
 	Synchronize(this);
 	
-	schedule(task, Time::Now() + timeout);
+	// Time arithmetic is avoided as it goes through the calendar
+	insert(task, toTick((Time::Now() - mStart) + timeout, true));
 }
 
 void Scheduler::schedule(Task *task, const Time &when)
 {
 	Synchronize(this);
 	
-	Time nextTime;
-        if(mNextTimes.get(task, nextTime))
-        {
-                mSchedule[nextTime].erase(task);
-                mNextTimes.erase(task);
-        }
-
-	mSchedule[when].insert(task);
-	mNextTimes[task] = when;
-	
-	Map<Time, Set<Task*> >::iterator it = mSchedule.begin();
-	double d =  it->first - Time::Now();
-	
-	//LogDebug("Scheduler::schedule", "Scheduled task (total " + String::number(mNextTimes.size()) + ")");
-	if(!isRunning()) start();
-	notifyAll();
+	insert(task, toTick(when - mStart, true));
 }
 
 void Scheduler::repeat(Task *task, double period)
@@ -78,77 +75,137 @@ void Scheduler::repeat(Task *task, double period)
 		return;
 	}
 	
-	if(!mNextTimes.contains(task))
+	Timer *timer = find(task);
+	if(!timer || timer->list < 0)
 		schedule(task, period);
 	
-	mPeriods[task] = period;
+	get(task)->period = period;
 }
 
-void Scheduler::remove(Task *task)
+bool Scheduler::remove(Task *task)
 {
 	Synchronize(this);
 
-	Time nextTime;
-	if(mNextTimes.get(task, nextTime))
-	{
-		mSchedule[nextTime].erase(task);
-		mNextTimes.erase(task);
-	}
+	Timer *timer = find(task);
+	if(!timer) return false;
 	
-	mPeriods.erase(task);
+	// An unlinked timer is a repeated task which is running, it is erased so it is not rescheduled
+	bool linked = (timer->list >= 0);
+	if(linked) unlink(timer);
+	erase(timer);
+	return linked;
 }
 
 void Scheduler::clear(void)
 {
 	Synchronize(this);
 	
-	mSchedule.clear();
-	mNextTimes.clear();
-	mPeriods.clear();
+	for(size_t i=0; i<mBucketsCount; ++i)
+	{
+		Timer *timer = mBuckets[i];
+		while(timer)
+		{
+			Timer *chain = timer->chain;
+			delete timer;
+			timer = chain;
+		}
+		
+		mBuckets[i] = NULL;
+	}
+	
+	std::fill(mLists, mLists + ListsCount, static_cast<Timer*>(NULL));
+	std::memset(mBitmaps, 0, sizeof(mBitmaps));
+	mScheduledCount = 0;
+	mTimersCount = 0;
+	notifyAll();	// the thread exits when nothing is scheduled
 	
 	ThreadPool::clear();	// wait for threads to finish
 }
 
+void Scheduler::insert(Task *task, uint64_t expiry)
+{
+	Assert(task);
+	
+	Timer *timer = get(task);
+	if(timer->list >= 0) unlink(timer);
+	timer->expiry = expiry;
+	link(timer);
+	
+	//LogDebug("Scheduler::schedule", "Scheduled task (total " + String::number(mScheduledCount) + ")");
+	if(!mThreadActive)
+	{
+		// Wait for a previous thread to exit before starting a new one
+		mThreadActive = true;
+		Thread::join();
+		start();
+	}
+	else if(expiry < mWakeTick)
+	{
+		notifyAll();
+	}
+}
+
 void Scheduler::onTaskFinished(Task *task)
 {
 	Synchronize(this);
 	Assert(task);
 	
-	double period = 0.;
-	if(mPeriods.get(task, period))
+	Timer *timer = find(task);
+	if(timer && timer->period >= 0.)
 	{
-		//LogDebug("Scheduler::run", "Re-scheduled task (period=" + String::number(period) + ")");
-		schedule(task, period);
+		//LogDebug("Scheduler::run", "Re-scheduled task (period=" + String::number(timer->period) + ")");
+		schedule(task, timer->period);
 	}
 }
 
 void Scheduler::run(void)
 {
+	Array<Task*> tasks;
 	while(true)
 	{
 		try {
-			Synchronize(this);
-			if(mSchedule.empty()) break;
-
-			Map<Time, Set<Task*> >::iterator it = mSchedule.begin();
-			double d =  it->first - Time::Now();
-			if(d > 0.)
+			tasks.clear();
+			
 			{
-				//LogDebug("Scheduler::run", "Next task in " + String::number(d) + " s");
-				wait(std::min(d, 60.));	// bound is necessary here in case of wall clock change
-				continue;
+				Synchronize(this);
+				if(!mScheduledCount)
+				{
+					mThreadActive = false;
+					break;
+				}
+				
+				mExpired.clear();
+				double elapsed = Time::Now() - mStart;
+				advance(toTick(elapsed, false), mExpired);
+				
+				if(mExpired.empty())
+				{
+					mWakeTick = nextTick();
+					double d = double(mWakeTick)/TicksPerSecond - elapsed;
+					
+					//LogDebug("Scheduler::run", "Next task in " + String::number(d) + " s");
+					if(d > 0.) wait(std::min(d, 60.));	// bound is necessary here in case of wall clock change
+					mWakeTick = std::numeric_limits<uint64_t>::max();
+					continue;
+				}
+				
+				// Collected timers are released before launching, so remove() and schedule()
+				// never see them: the tasks are launching and a new schedule gets a new timer
+				for(int i=0; i<mExpired.size(); ++i)
+				{
+					Timer *timer = mExpired[i];
+					tasks.push_back(timer->task);
+					if(timer->period < 0.) erase(timer);	// repeated timers are kept unlinked until the task is finished
+				}
+				
+				mExpired.clear();
 			}
-	
-			Set<Task*> set = it->second;
-			mSchedule.erase(it);
 			
-			for(Set<Task*>::iterator jt = set.begin(); jt != set.end(); ++jt)
+			// Expired timers are launched in one batch, without the lock as launch() may wait for a worker
+			for(int i=0; i<tasks.size(); ++i)
 			{
-				Task *task = *jt;
-				mNextTimes.erase(task);
-				
 				//LogDebug("Scheduler::run", "Launching task...");
-				launch(task);
+				launch(tasks[i]);
 			}
 		}
 		catch(const std::exception &e)
@@ -158,4 +215,223 @@ void Scheduler::run(void)
 	}
 }
 
+Scheduler::Timer *Scheduler::find(Task *task) const
+{
+	Timer *timer = mBuckets[bucket(task)];
+	while(timer && timer->task != task)
+		timer = timer->chain;
+	return timer;
+}
+
+Scheduler::Timer *Scheduler::get(Task *task)
+{
+	Timer *timer = find(task);
+	if(timer) return timer;
+	
+	if(mTimersCount >= mBucketsCount)
+		rehash(mBucketsCount*2);
+	
+	timer = new Timer;
+	timer->task = task;
+	timer->expiry = 0;
+	timer->period = -1.;
+	timer->list = -1;
+	timer->prev = timer->next = NULL;
+	
+	size_t i = bucket(task);
+	timer->chain = mBuckets[i];
+	mBuckets[i] = timer;
+	++mTimersCount;
+	return timer;
+}
+
+void Scheduler::erase(Timer *timer)
+{
+	Assert(timer->list < 0);
+	
+	Timer **p = &mBuckets[bucket(timer->task)];
+	while(*p != timer)
+	{
+		Assert(*p);
+		p = &(*p)->chain;
+	}
+	
+	*p = timer->chain;
+	--mTimersCount;
+	delete timer;
+}
+
+void Scheduler::rehash(size_t count)
+{
+	Timer **buckets = new Timer*[count];
+	std::fill(buckets, buckets + count, static_cast<Timer*>(NULL));
+	
+	std::swap(buckets, mBuckets);
+	std::swap(count, mBucketsCount);
+	
+	for(size_t i=0; i<count; ++i)
+	{
+		Timer *timer = buckets[i];
+		while(timer)
+		{
+			Timer *chain = timer->chain;
+			size_t j = bucket(timer->task);
+			timer->chain = mBuckets[j];
+			mBuckets[j] = timer;
+			timer = chain;
+		}
+	}
+	
+	delete[] buckets;
+}
+
+size_t Scheduler::bucket(Task *task) const
+{
+	// Fibonacci hashing, the count of buckets is a power of 2
+	uint64_t h = uint64_t(reinterpret_cast<uintptr_t>(task)) * 0x9E3779B97F4A7C15ULL;
+	return size_t(h >> 32) & (mBucketsCount - 1);
+}
+
+void Scheduler::link(Timer *timer)
+{
+	Assert(timer->list < 0);
+	
+	int list;
+	uint64_t expiry = timer->expiry;
+	if(expiry <= mTick)
+	{
+		list = DueList;
+	}
+	else {
+		uint64_t diff = expiry ^ mTick;
+		int level = 0;
+		while(level < Levels && (diff >> (SlotBits*(level+1))))
+			++level;
+		
+		if(level == Levels)
+		{
+			list = OverflowList;
+		}
+		else {
+			int slot = int(expiry >> (SlotBits*level)) & (Slots-1);
+			mBitmaps[level][slot/64]|= uint64_t(1) << (slot%64);
+			list = level*Slots + slot;
+		}
+	}
+	
+	timer->list = list;
+	timer->prev = NULL;
+	timer->next = mLists[list];
+	if(timer->next) timer->next->prev = timer;
+	mLists[list] = timer;
+	++mScheduledCount;
+}
+
+void Scheduler::unlink(Timer *timer)
+{
+	int list = timer->list;
+	Assert(list >= 0);
+	
+	if(timer->prev) timer->prev->next = timer->next;
+	else mLists[list] = timer->next;
+	if(timer->next) timer->next->prev = timer->prev;
+	
+	if(!mLists[list] && list < OverflowList)
+	{
+		int level = list / Slots;
+		int slot = list % Slots;
+		mBitmaps[level][slot/64]&= ~(uint64_t(1) << (slot%64));
+	}
+	
+	timer->list = -1;
+	timer->prev = timer->next = NULL;
+	--mScheduledCount;
+}
+
+uint64_t Scheduler::nextTick(void) const
+{
+	if(mLists[DueList]) return mTick;
+	
+	// Timers at a level lie after the current slot, and the first non-empty slot
+	// at a level always starts before any slot at upper levels
+	for(int level=0; level<Levels; ++level)
+	{
+		int current = int(mTick >> (SlotBits*level)) & (Slots-1);
+		for(int w=(current+1)/64; w<Slots/64; ++w)
+		{
+			uint64_t bits = mBitmaps[level][w];
+			if(w == (current+1)/64) bits&= ~uint64_t(0) << ((current+1)%64);
+			if(!bits) continue;
+			
+			uint64_t slot = uint64_t(w*64 + __builtin_ctzll(bits));
+			int shift = SlotBits*(level+1);
+			uint64_t base = (mTick >> shift) << shift;
+			return base | (slot << (SlotBits*level));
+		}
+	}
+	
+	if(mLists[OverflowList])
+	{
+		int shift = SlotBits*Levels;
+		return ((mTick >> shift) + 1) << shift;
+	}
+	
+	return std::numeric_limits<uint64_t>::max();
+}
+
+void Scheduler::advance(uint64_t tick, Array<Timer*> &expired)
+{
+	while(true)
+	{
+		uint64_t next = nextTick();
+		if(next > tick)
+		{
+			mTick = std::max(mTick, tick);
+			break;
+		}
+		
+		mTick = next;
+		
+		// Cascade slots starting at this tick, from the upper level
+		if(!(mTick & ((uint64_t(1) << (SlotBits*Levels)) - 1)))
+			cascade(OverflowList);
+		
+		for(int level=Levels-1; level>0; --level)
+			if(!(mTick & ((uint64_t(1) << (SlotBits*level)) - 1)))
+				cascade(level*Slots + (int(mTick >> (SlotBits*level)) & (Slots-1)));
+		
+		collect(int(mTick & (Slots-1)), expired);
+		collect(DueList, expired);
+	}
+}
+
+void Scheduler::collect(int list, Array<Timer*> &expired)
+{
+	while(mLists[list])
+	{
+		Timer *timer = mLists[list];
+		unlink(timer);
+		expired.push_back(timer);
+	}
+}
+
+void Scheduler::cascade(int list)
+{
+	Timer *timer = mLists[list];
+	while(timer)
+	{
+		Timer *next = timer->next;
+		unlink(timer);
+		link(timer);
+		timer = next;
+	}
+}
+
+uint64_t Scheduler::toTick(double seconds, bool roundUp) const
+{
+	double d = seconds*TicksPerSecond;
+	if(d <= 0.) return 0;
+	return uint64_t(roundUp ? std::ceil(d) : std::floor(d));
+}
+
 }
@@ -25,6 +25,7 @@
 #include "tpn/include.h"
 #include "tpn/threadpool.h"
 #include "tpn/time.h"
+#include "tpn/array.h"
 #include "tpn/map.h"
 
 namespace tpn
@@ -43,16 +44,65 @@ public:
 	
 	void repeat(Task *task, double period);
 	
-	void remove(Task *task);
+	bool remove(Task *task);	// true if the task was still pending, false if it is launching or running
 	void clear(void);
 	
 private:
+	// Hierarchical timing wheel with millisecond ticks
+	// A timer lies at the level of the highest digit where its expiry tick differs from the current tick,
+	// so schedule and remove are O(1), and slots are cascaded to the level below when the current tick reaches them.
+	static const int TicksPerSecond = 1000;
+	static const int SlotBits = 8;
+	static const int Slots = 1 << SlotBits;
+	static const int Levels = 4;				// beyond 2^32 ticks (49 days), timers wait in the overflow list
+	static const int OverflowList = Levels*Slots;
+	static const int DueList = Levels*Slots + 1;
+	static const int ListsCount = Levels*Slots + 2;
+	
+	struct Timer
+	{
+		Task *task;
+		uint64_t expiry;	// tick
+		double period;		// negative if not repeated
+		int list;		// -1 if not scheduled
+		Timer *prev;
+		Timer *next;
+		Timer *chain;		// in hash bucket
+	};
+	
+	void insert(Task *task, uint64_t expiry);
 	void onTaskFinished(Task *task);
 	void run(void);
 	
-	Map<Time, Set<Task*> > mSchedule;
-	Map<Task*, Time> mNextTimes;
-	Map<Task*, double> mPeriods;
+	Timer *find(Task *task) const;
+	Timer *get(Task *task);
+	void erase(Timer *timer);
+	void rehash(size_t count);
+	size_t bucket(Task *task) const;
+	
+	void link(Timer *timer);
+	void unlink(Timer *timer);
+	uint64_t nextTick(void) const;
+	void advance(uint64_t tick, Array<Timer*> &expired);
+	void collect(int list, Array<Timer*> &expired);
+	void cascade(int list);
+	
+	uint64_t toTick(double seconds, bool roundUp) const;	// seconds since start
+	
+	Time mStart;
+	uint64_t mTick;			// current tick of the wheel
+	uint64_t mWakeTick;		// tick the thread is waiting for
+	bool mThreadActive;
+	
+	Timer *mLists[ListsCount];
+	uint64_t mBitmaps[Levels][Slots/64];	// non-empty slots
+	unsigned mScheduledCount;
+	
+	Timer **mBuckets;		// Task* to Timer* hash table
+	size_t mBucketsCount;
+	size_t mTimersCount;
+	
+	Array<Timer*> mExpired;
 };
 
 }
@@ -33,11 +33,11 @@ ServerSocket::ServerSocket(void) :
 
 }
 
-ServerSocket::ServerSocket(int port) :
+ServerSocket::ServerSocket(int port, int backlog) :
 	mSock(INVALID_SOCKET),
 	mPort(0)
 {
-	listen(port);
+	listen(port, backlog);
 }
 
 ServerSocket::~ServerSocket(void)
@@ -159,7 +159,7 @@ void ServerSocket::getLocalAddresses(List<Address> &list) const
 #endif
 }
 
-void ServerSocket::listen(int port)
+void ServerSocket::listen(int port, int backlog)
 {
 	close();
 
@@ -213,7 +213,7 @@ void ServerSocket::listen(int port)
 			throw NetException(String("Binding failed on port ")+String::number(port));
 
 		// Listen
-		if(::listen(mSock, 16) != 0)
+		if(::listen(mSock, (backlog > 0 ? backlog : SOMAXCONN)) != 0)
 			throw NetException(String("Listening failed on port ")+String::number(port));
 
 		ctl_t b = 0;
@@ -244,7 +244,11 @@ void ServerSocket::accept(Socket &sock)
 {
 	if(mSock == INVALID_SOCKET) throw NetException("Socket not listening");
 	sock.close();
-	socket_t clientSock = ::accept(mSock, NULL, NULL);
+	
+	socket_t clientSock;
+	do clientSock = ::accept(mSock, NULL, NULL);
+	while(clientSock == INVALID_SOCKET && (sockerrno == SEINTR || sockerrno == SECONNABORTED));	// connection aborted before being accepted
+	
 	if(clientSock == INVALID_SOCKET) throw NetException(String("Listening socket closed on port ")+String::number(mPort) + " (error "+String::number(sockerrno)+")");
 	sock.mSock = clientSock;
 }
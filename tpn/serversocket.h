@@ -32,8 +32,10 @@ namespace tpn
 class ServerSocket
 {
 public:
+	static const int DefaultBacklog = 16;
+	
 	ServerSocket(void);
-	ServerSocket(int port);
+	ServerSocket(int port, int backlog = DefaultBacklog);
 	~ServerSocket(void);
 
 	bool isListening(void) const;
@@ -41,7 +43,7 @@ public:
 	Address getBindAddress(void) const;
 	void getLocalAddresses(List<Address> &list) const;
 
-	void listen(int port);
+	void listen(int port, int backlog = DefaultBacklog);
 	void close(void);
 	void accept(Socket &sock);
 
@@ -27,24 +27,62 @@
 #include "tpn/sha512.h"
 #include "tpn/exception.h"
 #include "tpn/bytearray.h"
+#include "tpn/array.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SHA512_AVX2
+#include <immintrin.h>
+#define AVX2_TARGET __attribute__((target("avx2")))
+#endif
 
 namespace tpn
 {
 
 const int Sha512::CryptRounds = 10000;
 
+bool Sha512::VectorEnabled = Sha512::IsVectorAvailable();
+
+bool Sha512::IsVectorAvailable(void)
+{
+#ifdef SHA512_AVX2
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#else
+	return false;
+#endif
+}
+
+void Sha512::SetVectorEnabled(bool enabled)
+{
+	VectorEnabled = enabled && IsVectorAvailable();
+}
+
 size_t Sha512::Hash(const char *data, size_t size, ByteStream &out)
 {
-	// TODO: ConstByteArray ?
-	ByteArray array(const_cast<char *>(data), size);
-	return Hash(array, out);
+	Sha512 sha;
+	sha.process(data, size);
+	sha.finalize(out);
+	return size;
+}
+
+size_t Sha512::Hash(const Sha512::Span *spans, size_t count, unsigned char *out)
+{
+	Sha512 sha;
+	sha.process(spans, count);
+	sha.finalize(out);
+	
+	size_t size = 0;
+	for(size_t i=0; i<count; ++i)
+		size+= spans[i].size;
+	return size;
 }
 
 size_t Sha512::Hash(const ByteString &message, ByteStream &out)
 {
-	ByteString tmp(message);
-	ByteStream *p = &tmp;
-	return Hash(*p, out);
+	Sha512 sha;
+	sha.process(message.data(), message.size());
+	sha.finalize(out);
+	return message.size();
 }
 
 size_t Sha512::Hash(ByteStream &data, ByteStream &out)
@@ -63,65 +101,283 @@ size_t Sha512::Hash(ByteStream &data, size_t size, ByteStream &out)
 	return size;
 }
 
+void Sha512::Hash(ByteStream *data[], ByteStream *out[], size_t count)
+{
+	Assert(data);
+	Assert(out);
+	
+	for(size_t first=0; first<count; first+= Lanes)
+	{
+		size_t n = std::min(count - first, Lanes);
+		
+		Sha512 sha[Lanes];
+		ByteStream *streams[Lanes];
+		ByteStream *outputs[Lanes];
+		for(size_t i=0; i<n; ++i)
+		{
+			streams[i] = data[first + i];
+			outputs[i] = out[first + i];
+		}
+		
+		char *buffers = new char[Lanes*BufferSize];
+		try {
+			while(n)
+			{
+				// Fill a buffer for each stream, a short read means the end of the stream
+				Sha512 *active[Lanes];
+				const char *chunks[Lanes];
+				size_t sizes[Lanes];
+				for(size_t i=0; i<n; ++i)
+				{
+					char *buffer = buffers + i*BufferSize;
+					size_t size = 0;
+					size_t len;
+					while(size < BufferSize && (len = streams[i]->readData(buffer + size, BufferSize - size)))
+						size+= len;
+					
+					active[i] = &sha[i];
+					chunks[i] = buffer;
+					sizes[i] = size;
+				}
+				
+				Process(active, chunks, sizes, n);
+				
+				// Finalize ended streams together
+				Sha512 *ended[Lanes];
+				unsigned char digests[Lanes][64];
+				unsigned char *digestPtrs[Lanes];
+				size_t e = 0;
+				for(size_t i=0; i<n; ++i)
+					if(sizes[i] < BufferSize)
+					{
+						ended[e] = &sha[i];
+						digestPtrs[e] = digests[e];
+						++e;
+					}
+				
+				Finalize(ended, digestPtrs, e);
+				
+				// Keep the others
+				size_t k = 0;
+				e = 0;
+				for(size_t i=0; i<n; ++i)
+				{
+					if(sizes[i] < BufferSize)
+					{
+						outputs[i]->writeData(reinterpret_cast<char*>(digests[e]), 64);
+						++e;
+					}
+					else {
+						if(k != i)
+						{
+							sha[k] = sha[i];
+							streams[k] = streams[i];
+							outputs[k] = outputs[i];
+						}
+						++k;
+					}
+				}
+				
+				n = k;
+			}
+		}
+		catch(...)
+		{
+			delete[] buffers;
+			throw;
+		}
+		
+		delete[] buffers;
+	}
+}
+
 void Sha512::RecursiveHash(const ByteString &message, const ByteString &salt, ByteStream &out, int rounds)
 {
 	Assert(rounds >= 1);
+	
+	if(rounds == 1)
+	{
+		out.writeBinary(message);
+		return;
+	}
+	
+	Span spans[2];
+	spans[0].data = salt.data();
+	spans[0].size = salt.size();
+	spans[1].data = message.data();
+	spans[1].size = message.size();
+	
+	unsigned char buffer[DigestSize];
+	Hash(spans, 2, buffer);
+	
+	spans[1].data = reinterpret_cast<const char*>(buffer);
+	spans[1].size = DigestSize;
+	while(--rounds > 1)
+		Hash(spans, 2, buffer);
+	
+	out.writeData(reinterpret_cast<const char*>(buffer), DigestSize);
+}
 
-	ByteString buffer(message);
-	while(--rounds)
+void Sha512::AuthenticationCode(const ByteString &key, ByteStream &data, ByteStream &out)
+{
+	Hmac hmac(key);
+	hmac.compute(data, out);
+}
+
+void Sha512::AuthenticationCode(const ByteString &key, const char *data, size_t size, ByteStream &out)
+{
+	Hmac hmac(key);
+	unsigned char digest[DigestSize];
+	hmac.compute(data, size, digest);
+	out.writeData(reinterpret_cast<const char*>(digest), DigestSize);
+}
+
+void Sha512::DerivateKey(const ByteString &password, const ByteString &salt, ByteStream &out, int rounds)
+{
+	Assert(rounds >= 1);
+	
+	if(rounds == 1)
 	{
-		ByteString tmp(salt);
+		out.writeBinary(salt);
+		return;
+	}
+	
+	// The key schedule is computed once for all rounds
+	Hmac hmac(password);
+	
+	unsigned char buffer[DigestSize];
+	hmac.compute(salt.data(), salt.size(), buffer);
+	while(--rounds > 1)
+		hmac.compute(reinterpret_cast<const char*>(buffer), DigestSize, buffer);
+	
+	out.writeData(reinterpret_cast<const char*>(buffer), DigestSize);
+}
 
-		Sha512 sha;
-        	sha.process(tmp);
-		sha.process(buffer);
-        	sha.finalize(buffer);
+void Sha512::DerivateKey(const ByteString &password, const ByteString salts[], ByteStream *out[], size_t count, int rounds)
+{
+	Assert(rounds >= 1);
+	
+	Hmac hmac(password);
+	
+	for(size_t first=0; first<count; first+= Lanes)
+	{
+		size_t n = std::min(count - first, Lanes);
+		
+		// Rounds are sequential for each salt, so salts are the independent lanes
+		Sha512 inner[Lanes], outer[Lanes];
+		Sha512 *innerPtrs[Lanes], *outerPtrs[Lanes];
+		const char *data[Lanes];
+		size_t sizes[Lanes];
+		unsigned char digests[Lanes][DigestSize];
+		unsigned char *digestPtrs[Lanes];
+		for(size_t i=0; i<n; ++i)
+		{
+			innerPtrs[i] = &inner[i];
+			outerPtrs[i] = &outer[i];
+			digestPtrs[i] = digests[i];
+			data[i] = salts[first + i].data();
+			sizes[i] = salts[first + i].size();
+		}
+		
+		if(rounds == 1)
+		{
+			for(size_t i=0; i<n; ++i)
+				if(sizes[i]) out[first + i]->writeData(data[i], sizes[i]);
+			continue;
+		}
+		
+		int r = rounds;
+		while(--r)
+		{
+			for(size_t i=0; i<n; ++i)
+			{
+				inner[i] = hmac.mInner;
+				outer[i] = hmac.mOuter;
+			}
+			
+			Process(innerPtrs, data, sizes, n);
+			Finalize(innerPtrs, digestPtrs, n);
+			
+			for(size_t i=0; i<n; ++i)
+			{
+				data[i] = reinterpret_cast<const char*>(digests[i]);
+				sizes[i] = DigestSize;
+			}
+			
+			Process(outerPtrs, data, sizes, n);
+			Finalize(outerPtrs, digestPtrs, n);
+		}
+		
+		for(size_t i=0; i<n; ++i)
+			out[first + i]->writeData(reinterpret_cast<const char*>(digests[i]), DigestSize);
 	}
+}
 
-	out.writeBinary(buffer);
+Sha512::Hmac::Hmac(const ByteString &key)
+{
+	init(key.data(), key.size());
 }
 
-void Sha512::AuthenticationCode(const ByteString &key, ByteStream &data, ByteStream &out)
+Sha512::Hmac::Hmac(const char *key, size_t size)
 {
-	ByteString ikey;
-	ByteString okey;
+	init(key, size);
+}
 
-	// Pad key
-	ByteString tmp(key);
-	if(tmp.size() < 64) tmp.writeZero(64 - tmp.size());
+void Sha512::Hmac::init(const char *key, size_t size)
+{
+	Assert(key || !size);
 	
-	// Inner and outer padding
-	uint8_t u;
-	while(tmp.readBinary(u))
+	// The key is padded with zeros to 64 bytes, then each byte of the inner and outer
+	// padded keys is hashed as a big-endian 32-bit integer for compatibility
+	const size_t padded = std::max(size, size_t(64));
+	Array<char> ikey, okey;
+	ikey.assign(4*padded, 0);
+	okey.assign(4*padded, 0);
+	for(size_t i=0; i<padded; ++i)
 	{
-		ikey.writeBinary(u ^ 0x36);
-		okey.writeBinary(u ^ 0x5C);
+		uint8_t u = (i < size ? uint8_t(key[i]) : 0);
+		ikey[4*i + 3] = char(u ^ 0x36);
+		okey[4*i + 3] = char(u ^ 0x5C);
 	}
+	
+	mInner.init();
+	mInner.process(&ikey[0], ikey.size());
+	mOuter.init();
+	mOuter.process(&okey[0], okey.size());
+}
 
-	Sha512 sha;
-        sha.process(ikey);
-        sha.process(data);
-        sha.finalize(tmp);
+void Sha512::Hmac::compute(const char *data, size_t size, unsigned char *out) const
+{
+	Span span;
+	span.data = data;
+	span.size = size;
+	compute(&span, 1, out);
+}
 
-	sha.init();	// reinit
-	sha.process(okey);
-	sha.process(tmp);
+void Sha512::Hmac::compute(const Sha512::Span *spans, size_t count, unsigned char *out) const
+{
+	Assert(out);
+	
+	Sha512 sha(mInner);
+	sha.process(spans, count);
+	sha.finalize(out);	// out may be part of the data
+	
+	sha = mOuter;
+	sha.process(reinterpret_cast<const char*>(out), DigestSize);
 	sha.finalize(out);
 }
 
-void Sha512::DerivateKey(const ByteString &password, const ByteString &salt, ByteStream &out, int rounds)
+void Sha512::Hmac::compute(ByteStream &data, ByteStream &out) const
 {
-	Assert(rounds >= 1);
-
-	ByteString buffer(salt);
-        while(--rounds)
-        {
-		ByteString tmp;
-		AuthenticationCode(password, buffer, tmp);
-		buffer = tmp;
-        }
-
-        out.writeBinary(buffer);
+	Sha512 sha(mInner);
+	sha.process(data);
+	
+	unsigned char digest[DigestSize];
+	sha.finalize(digest);
+	
+	sha = mOuter;
+	sha.process(reinterpret_cast<const char*>(digest), DigestSize);
+	sha.finalize(out);
 }
 
 /* Various macros */
@@ -151,6 +407,107 @@ void Sha512::DerivateKey(const ByteString &password, const ByteString &salt, Byt
 #define GAMMA0(x)       (S(x, 1) ^ S(x, 8) ^ R(x, 7))
 #define GAMMA1(x)       (S(x, 19) ^ S(x, 61) ^ R(x, 6))
 
+#ifdef SHA512_AVX2
+
+#define ROR64V(x, n)	_mm256_or_si256(_mm256_srli_epi64(x, n), _mm256_slli_epi64(x, 64 - (n)))
+#define ROR64X(x, n)	_mm_or_si128(_mm_srli_epi64(x, n), _mm_slli_epi64(x, 64 - (n)))
+
+// Compress one block for each of 4 independent states, lane i of each vector belongs to message i
+static AVX2_TARGET void Avx2Compress4(uint64_t *state[4], const unsigned char *buf[4], const uint64_t *K)
+{
+	__m256i W[80];
+	for(int i=0; i<16; ++i)
+	{
+		uint64_t w[4];
+		for(int l=0; l<4; ++l)
+			LOAD64H(w[l], buf[l] + 8*i);
+		W[i] = _mm256_set_epi64x(w[3], w[2], w[1], w[0]);
+	}
+	
+	for(int i=16; i<80; ++i)
+	{
+		__m256i w2 = W[i - 2];
+		__m256i w15 = W[i - 15];
+		__m256i g1 = _mm256_xor_si256(_mm256_xor_si256(ROR64V(w2, 19), ROR64V(w2, 61)), _mm256_srli_epi64(w2, 6));
+		__m256i g0 = _mm256_xor_si256(_mm256_xor_si256(ROR64V(w15, 1), ROR64V(w15, 8)), _mm256_srli_epi64(w15, 7));
+		W[i] = _mm256_add_epi64(_mm256_add_epi64(g1, W[i - 7]), _mm256_add_epi64(g0, W[i - 16]));
+	}
+	
+	__m256i S[8];
+	for(int j=0; j<8; ++j)
+		S[j] = _mm256_set_epi64x(state[3][j], state[2][j], state[1][j], state[0][j]);
+	
+	__m256i a = S[0], b = S[1], c = S[2], d = S[3], e = S[4], f = S[5], g = S[6], h = S[7];
+	
+	#define RNDV(a,b,c,d,e,f,g,h,i) \
+	{ \
+		__m256i s1 = _mm256_xor_si256(_mm256_xor_si256(ROR64V(e, 14), ROR64V(e, 18)), ROR64V(e, 41)); \
+		__m256i ch = _mm256_xor_si256(g, _mm256_and_si256(e, _mm256_xor_si256(f, g))); \
+		__m256i t0 = _mm256_add_epi64(_mm256_add_epi64(h, s1), _mm256_add_epi64(ch, \
+				_mm256_add_epi64(_mm256_set1_epi64x(K[i]), W[i]))); \
+		__m256i s0 = _mm256_xor_si256(_mm256_xor_si256(ROR64V(a, 28), ROR64V(a, 34)), ROR64V(a, 39)); \
+		__m256i maj = _mm256_or_si256(_mm256_and_si256(_mm256_or_si256(a, b), c), _mm256_and_si256(a, b)); \
+		d = _mm256_add_epi64(d, t0); \
+		h = _mm256_add_epi64(t0, _mm256_add_epi64(s0, maj)); \
+	}
+	
+	for(int i=0; i<80; i+=8)
+	{
+		RNDV(a,b,c,d,e,f,g,h,i+0);
+		RNDV(h,a,b,c,d,e,f,g,i+1);
+		RNDV(g,h,a,b,c,d,e,f,i+2);
+		RNDV(f,g,h,a,b,c,d,e,i+3);
+		RNDV(e,f,g,h,a,b,c,d,i+4);
+		RNDV(d,e,f,g,h,a,b,c,i+5);
+		RNDV(c,d,e,f,g,h,a,b,i+6);
+		RNDV(b,c,d,e,f,g,h,a,i+7);
+	}
+	
+	#undef RNDV
+	
+	S[0] = _mm256_add_epi64(S[0], a);
+	S[1] = _mm256_add_epi64(S[1], b);
+	S[2] = _mm256_add_epi64(S[2], c);
+	S[3] = _mm256_add_epi64(S[3], d);
+	S[4] = _mm256_add_epi64(S[4], e);
+	S[5] = _mm256_add_epi64(S[5], f);
+	S[6] = _mm256_add_epi64(S[6], g);
+	S[7] = _mm256_add_epi64(S[7], h);
+	
+	for(int j=0; j<8; ++j)
+	{
+		uint64_t v[4];
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(v), S[j]);
+		for(int l=0; l<4; ++l)
+			state[l][j] = v[l];
+	}
+}
+
+// Message schedule of a single block, two words at a time
+static AVX2_TARGET void Avx2Schedule(const unsigned char *buf, uint64_t *W)
+{
+	const __m128i swap = _mm_set_epi8(8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7);
+	for(int i=0; i<16; i+=2)
+	{
+		__m128i w = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 8*i));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(W + i), _mm_shuffle_epi8(w, swap));
+	}
+	
+	// W[i] and W[i+1] only depend on words up to W[i-1]
+	for(int i=16; i<80; i+=2)
+	{
+		__m128i w2  = _mm_loadu_si128(reinterpret_cast<const __m128i*>(W + i - 2));
+		__m128i w7  = _mm_loadu_si128(reinterpret_cast<const __m128i*>(W + i - 7));
+		__m128i w15 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(W + i - 15));
+		__m128i w16 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(W + i - 16));
+		__m128i g1 = _mm_xor_si128(_mm_xor_si128(ROR64X(w2, 19), ROR64X(w2, 61)), _mm_srli_epi64(w2, 6));
+		__m128i g0 = _mm_xor_si128(_mm_xor_si128(ROR64X(w15, 1), ROR64X(w15, 8)), _mm_srli_epi64(w15, 7));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(W + i), _mm_add_epi64(_mm_add_epi64(g1, w7), _mm_add_epi64(g0, w16)));
+	}
+}
+
+#endif
+
 /* the K array */
 const uint64_t Sha512::K[80] = {
 	CONST64(0x428a2f98d728ae22), CONST64(0x7137449123ef65cd), 
@@ -223,7 +580,7 @@ void Sha512::init(void)
 // Process a block of memory though the hash
 void Sha512::process(const char *data, size_t size)
 {
-	Assert(data != NULL);
+	Assert(data != NULL || !size);
 	Assert(curlen <= sizeof(buf));
 	
 	while (size)
@@ -252,6 +609,16 @@ void Sha512::process(const char *data, size_t size)
 	}
 }
 
+// Process a list of spans through the hash
+void Sha512::process(const Sha512::Span *spans, size_t count)
+{
+	Assert(spans || !count);
+	
+	for(size_t i=0; i<count; ++i)
+		if(spans[i].size)
+			process(spans[i].data, spans[i].size);
+}
+
 // Process a stream through the hash
 size_t Sha512::process(ByteStream &data)
 {
@@ -280,13 +647,145 @@ size_t Sha512::process(ByteStream &data, size_t max)
 	return max-left;
 }
 
+// Process independent data through several hashes at once
+void Sha512::Process(Sha512 *sha[], const char *data[], const size_t size[], size_t count)
+{
+	Assert(sha);
+	Assert(data);
+	Assert(size);
+	
+	const char *ptrs[Lanes];
+	size_t left[Lanes];
+	
+	for(size_t first=0; first<count; first+= Lanes)
+	{
+		size_t n = std::min(count - first, Lanes);
+		
+		// Complete partial blocks first
+		for(size_t i=0; i<n; ++i)
+		{
+			Sha512 *s = sha[first + i];
+			ptrs[i] = data[first + i];
+			left[i] = size[first + i];
+			if(s->curlen && left[i])
+			{
+				size_t len = std::min(left[i], size_t(128 - s->curlen));
+				s->process(ptrs[i], len);
+				ptrs[i]+= len;
+				left[i]-= len;
+			}
+		}
+		
+		// Compress whole blocks of all lanes together
+		while(true)
+		{
+			Sha512 *group[Lanes];
+			const unsigned char *blocks[Lanes];
+			size_t lanes[Lanes];
+			size_t g = 0;
+			for(size_t i=0; i<n; ++i)
+				if(left[i] >= 128)
+				{
+					group[g] = sha[first + i];
+					blocks[g] = reinterpret_cast<const unsigned char*>(ptrs[i]);
+					lanes[g] = i;
+					++g;
+				}
+			
+			if(!g) break;
+			CompressMulti(group, blocks, g);
+			
+			for(size_t j=0; j<g; ++j)
+			{
+				group[j]->length+= 128*8;
+				ptrs[lanes[j]]+= 128;
+				left[lanes[j]]-= 128;
+			}
+		}
+		
+		// Buffer what is left
+		for(size_t i=0; i<n; ++i)
+			if(left[i]) sha[first + i]->process(ptrs[i], left[i]);
+	}
+}
+
+// Terminate several hashes at once
+void Sha512::Finalize(Sha512 *sha[], unsigned char *out[], size_t count)
+{
+	Assert(sha);
+	Assert(out);
+	
+	for(size_t first=0; first<count; first+= Lanes)
+	{
+		size_t n = std::min(count - first, Lanes);
+		
+		const unsigned char *blocks[Lanes];
+		for(size_t i=0; i<n; ++i)
+		{
+			sha[first + i]->pad();
+			blocks[i] = sha[first + i]->buf;
+		}
+		
+		CompressMulti(sha + first, blocks, n);
+		
+		for(size_t i=0; i<n; ++i)
+			for(int j=0; j<8; ++j)
+				STORE64H(sha[first + i]->state[j], out[first + i]+(8*j));
+	}
+}
+
+void Sha512::CompressMulti(Sha512 *sha[], const unsigned char *buf[], size_t count)
+{
+	Assert(count <= Lanes);
+	
+#ifdef SHA512_AVX2
+	// With less than 3 blocks, the scalar rounds are faster
+	if(VectorEnabled && count >= 3)
+	{
+		uint64_t dummyState[8];
+		uint64_t *states[Lanes];
+		const unsigned char *blocks[Lanes];
+		for(size_t i=0; i<Lanes; ++i)
+		{
+			if(i < count)
+			{
+				states[i] = sha[i]->state;
+				blocks[i] = buf[i];
+			}
+			else {
+				// Unused lanes compute garbage on a copy
+				std::memcpy(dummyState, sha[0]->state, sizeof(dummyState));
+				states[i] = dummyState;
+				blocks[i] = buf[0];
+			}
+		}
+		
+		Avx2Compress4(states, blocks, K);
+		return;
+	}
+#endif
+	
+	for(size_t i=0; i<count; ++i)
+		sha[i]->compress(buf[i]);
+}
+
 // Terminate the hash and get the digest
 void Sha512::finalize(unsigned char *out)
 {
 	Assert(out != NULL);
-	Assert(curlen < sizeof(buf));
 	
-	int i;
+	pad();
+	compress(buf);
+	
+	// copy output
+	for (int i = 0; i < 8; i++)
+		STORE64H(state[i], out+(8*i));
+}
+
+// Pad the message, the last block is left in buf
+void Sha512::pad(void)
+{
+	Assert(curlen < sizeof(buf));
 	
 	/* increase the length of the message */
 	length += curlen * CONST64(8);
@@ -316,11 +815,6 @@ void Sha512::finalize(unsigned char *out)
 	
 	// store length */
 	STORE64H(length, buf+120);
-	compress(buf);
-	
-	// copy output
-	for (i = 0; i < 8; i++)
-		STORE64H(state[i], out+(8*i));
 }
 
 // Terminate the hash to get the digest
@@ -341,13 +835,19 @@ void Sha512::compress(const unsigned char *buf)
 	for (i = 0; i < 8; i++)
 		S[i] = state[i];
 	
-	/* copy the state into 1024-bits into W[0..15] */
-	for (i = 0; i < 16; i++)
-		LOAD64H(W[i], buf + (8*i));
-	
-	/* fill W[16..79] */
-	for (i = 16; i < 80; i++)
-		W[i] = GAMMA1(W[i - 2]) + W[i - 7] + GAMMA0(W[i - 15]) + W[i - 16];      
+#ifdef SHA512_AVX2
+	if(VectorEnabled) Avx2Schedule(buf, W);
+	else
+#endif
+	{
+		/* copy the state into 1024-bits into W[0..15] */
+		for (i = 0; i < 16; i++)
+			LOAD64H(W[i], buf + (8*i));
+		
+		/* fill W[16..79] */
+		for (i = 16; i < 80; i++)
+			W[i] = GAMMA1(W[i - 2]) + W[i - 7] + GAMMA0(W[i - 15]) + W[i - 16];      
+	}
 	
 	/* Compress */
 	#define RND(a,b,c,d,e,f,g,h,i) \
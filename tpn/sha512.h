@@ -30,25 +30,50 @@
 namespace tpn
 {
 
+// AVX2 instructions are used when the CPU supports them, either to hash
+// up to Lanes independent messages at once, or for the message schedule
 class Sha512
 {
 public:
 	static const int CryptRounds;
+	static const size_t Lanes = 4;
+	static const size_t DigestSize = 64;
+	
+	// Contiguous chunk of data, lists of spans are hashed as one message
+	struct Span
+	{
+		const char *data;
+		size_t size;
+	};
+	
+	class Hmac;
+	
+	static bool IsVectorAvailable(void);
+	static void SetVectorEnabled(bool enabled);	// enabled by default if available
   
 	static size_t Hash(const char *data, size_t size, ByteStream &out);
+	static size_t Hash(const Span *spans, size_t count, unsigned char *out);	// out is DigestSize bytes
 	static size_t Hash(const ByteString &message, ByteStream &out);
 	static size_t Hash(ByteStream &data, ByteStream &out);
 	static size_t Hash(ByteStream &data, size_t size, ByteStream &out);
+	static void Hash(ByteStream *data[], ByteStream *out[], size_t count);		// independent streams, hashed together
 
 	static void RecursiveHash(const ByteString &message, const ByteString &salt, ByteStream &out, int rounds = CryptRounds);
 	static void AuthenticationCode(const ByteString &key, ByteStream &data, ByteStream &out);
+	static void AuthenticationCode(const ByteString &key, const char *data, size_t size, ByteStream &out);
 	static void DerivateKey(const ByteString &password, const ByteString &salt, ByteStream &out, int rounds = CryptRounds);
+	static void DerivateKey(const ByteString &password, const ByteString salts[], ByteStream *out[], size_t count, int rounds = CryptRounds);
+	
+	// Process independent data through several hashes at once
+	static void Process(Sha512 *sha[], const char *data[], const size_t size[], size_t count);
+	static void Finalize(Sha512 *sha[], unsigned char *out[], size_t count);
 
 	Sha512(void);
 	~Sha512(void);
 	
 	void init(void);
 	void process(const char *data, size_t size);
+	void process(const Span *spans, size_t count);
 	size_t process(ByteStream &data);
 	size_t process(ByteStream &data, size_t max);
 	void finalize(unsigned char *out);
@@ -56,14 +81,39 @@ public:
 	
 private:
 	static const uint64_t K[80];
+	static bool VectorEnabled;
+	
+	static void CompressMulti(Sha512 *sha[], const unsigned char *buf[], size_t count);
 	
 	void compress(const unsigned char *buf);
+	void pad(void);		// pad and leave the last block in buf
 	
 	uint64_t  length, state[8];
 	unsigned char buf[128];
 	int curlen;
 };
 
+// HMAC key schedule, the states after the inner and outer padded keys
+// are computed once and reused for each message
+class Sha512::Hmac
+{
+public:
+	Hmac(const ByteString &key);
+	Hmac(const char *key, size_t size);
+	
+	void compute(const char *data, size_t size, unsigned char *out) const;	// out is DigestSize bytes
+	void compute(const Span *spans, size_t count, unsigned char *out) const;
+	void compute(ByteStream &data, ByteStream &out) const;
+	
+private:
+	void init(const char *key, size_t size);
+	
+	Sha512 mInner;
+	Sha512 mOuter;
+	
+	friend class Sha512;
+};
+
 }
 
 #endif
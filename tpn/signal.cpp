@@ -51,13 +51,11 @@ void Signal::launchAll(void)
 void Signal::wait(Mutex &mutex)
 {
 	mutex.lock();
-	int oldLockCount = mutex.mLockCount;
-	mutex.mLockCount = 0;
+	int oldLockCount = mutex.detach();
 	
 	int ret = pthread_cond_wait(&mCond, &mutex.mMutex);
 	
-	mutex.mLockedBy = pthread_self();
-	mutex.mLockCount = oldLockCount;
+	mutex.attach(oldLockCount);
 	mutex.unlock();
 
 	if(ret) throw Exception("Unable to wait for signal");
@@ -71,13 +69,11 @@ bool Signal::wait(Mutex &mutex, double &timeout)
 	t1.toStruct(ts);
 	
 	mutex.lock();
-	int oldLockCount = mutex.mLockCount;
-	mutex.mLockCount = 0;
+	int oldLockCount = mutex.detach();
 	
 	int ret = pthread_cond_timedwait(&mCond, &mutex.mMutex, &ts);
 
-	mutex.mLockedBy = pthread_self();
-	mutex.mLockCount = oldLockCount;
+	mutex.attach(oldLockCount);
 	mutex.unlock();
 
 	if(ret == ETIMEDOUT) 
@@ -286,6 +286,90 @@ size_t Socket::peekData(char *buffer, size_t size)
         return recvData(buffer, size, MSG_PEEK);
 }
 
+bool Socket::readAvailableData(char *buffer, size_t &size)
+{
+#ifdef MSG_DONTWAIT
+	int count = ::recv(mSock, buffer, size, MSG_DONTWAIT);
+#else
+	fd_set readfds;
+	FD_ZERO(&readfds);
+	FD_SET(mSock, &readfds);
+	
+	struct timeval tv;
+	Time::SecondsToStruct(0., tv);
+	int ret = ::select(SOCK_TO_INT(mSock)+1, &readfds, NULL, NULL, &tv);
+	if (ret == -1)
+		throw Exception("Unable to wait on socket");
+	if (ret == 0)
+	{
+		size = 0;
+		return true;
+	}
+	
+	int count = ::recv(mSock, buffer, size, 0);
+#endif
+	if(count < 0)
+	{
+		if(sockerrno == SEAGAIN || sockerrno == SEWOULDBLOCK || sockerrno == EINTR)
+		{
+			size = 0;
+			return true;
+		}
+		
+		throw NetException("Connection lost (error " + String::number(sockerrno) + ")");
+	}
+	
+	size = count;
+	return (count > 0);
+}
+
+size_t Socket::writeAvailableData(const char *data, size_t size)
+{
+#ifdef MSG_DONTWAIT
+	int count = ::send(mSock, data, size, MSG_DONTWAIT);
+#else
+	fd_set writefds;
+	FD_ZERO(&writefds);
+	FD_SET(mSock, &writefds);
+	
+	struct timeval tv;
+	Time::SecondsToStruct(0., tv);
+	int ret = ::select(SOCK_TO_INT(mSock)+1, NULL, &writefds, NULL, &tv);
+	if (ret == -1)
+		throw Exception("Unable to wait on socket");
+	if (ret == 0)
+		return 0;
+	
+	int count = ::send(mSock, data, size, 0);
+#endif
+	if(count < 0)
+	{
+		if(sockerrno == SEAGAIN || sockerrno == SEWOULDBLOCK || sockerrno == EINTR)
+			return 0;
+		
+		throw NetException("Connection lost (error " + String::number(sockerrno) + ")");
+	}
+	
+	return size_t(count);
+}
+
+void Socket::shutdown(void)
+{
+	if(mSock != INVALID_SOCKET)
+	{
+#ifdef WINDOWS
+		::shutdown(mSock, SD_BOTH);
+#else
+		::shutdown(mSock, SHUT_RDWR);
+#endif
+	}
+}
+
+socket_t Socket::descriptor(void) const
+{
+	return mSock;
+}
+
 size_t Socket::recvData(char *buffer, size_t size, int flags)
 {
 	if(mReadTimeout >= 0.)
@@ -64,6 +64,10 @@ public:
 
 	// Socket-specific
 	size_t peekData(char *buffer, size_t size);
+	bool readAvailableData(char *buffer, size_t &size);	// non-blocking, returns false on end of stream
+	size_t writeAvailableData(const char *data, size_t size);	// non-blocking, returns the count written
+	void shutdown(void);
+	socket_t descriptor(void) const;
 
 private:
 	size_t recvData(char *buffer, size_t size, int flags);
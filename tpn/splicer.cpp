@@ -85,6 +85,7 @@ void Splicer::Prefetch(const ByteString &target)
 				Splicer *splicer = NULL;
 				try {
 					splicer = new Splicer(target);
+					splicer->setWeight(Request::BackgroundWeight);
 					if(splicer->size() <= maxSize*1024*1024) splicer->start(true);	// autodelete
 					else delete splicer;
 				}
@@ -132,6 +133,7 @@ Splicer::Splicer(const ByteString &target, int64_t begin, int64_t end) :
 	mBegin(begin),
 	mEnd(end),
 	mPosition(0),
+	mWeight(Request::DefaultWeight),
 	mAutoDelete(false)
 {
 	mCacheEntry = GetCacheEntry(target);
@@ -170,6 +172,12 @@ void Splicer::addSources(const Set<Identifier> &sources)
 		mSources.insert(*it);
 }
 
+void Splicer::setWeight(unsigned weight)
+{
+	Synchronize(this);
+	mWeight = weight;
+}
+
 int64_t Splicer::size(void) const
 {
 	Synchronize(this);
@@ -239,13 +247,20 @@ void Splicer::start(bool autoDelete)
 	{
 		if(mSources.empty() || !query(i, *it))
 		{
+			// Proceed with the remaining cached sources, fresh ones are requested in the background
 			mCacheEntry->refreshSources();
-			mCacheEntry->getSources(mSources);
+			if(!mSources.empty()) mSources.erase(it);
 			it = mSources.begin();
-				
+			
 			if(mSources.empty())
+			{
+				mCacheEntry->markBlockDownloading(mCurrentBlock, false);
+				for(int j=0; j<i; ++j) delete mRequests[j];
+				mRequests.clear();
+				mStripes.clear();
 				throw Exception("No available sources found");
-				
+			}
+			
 			continue;
 		}
 			
@@ -381,6 +396,7 @@ bool Splicer::query(int i, const Identifier &source)
 		request = new Request;
 		request->setTarget(mCacheEntry->target().toString(),true);
 		request->setParameters(parameters);
+		request->setWeight(mWeight);
 		request->setContentSink(stripe);
 		request->submit(source);
 	}
@@ -504,7 +520,7 @@ void Splicer::run(void)
 				{
 					Set<Identifier> sources;
 					mCacheEntry->refreshSources();
-					mCacheEntry->getSources(sources);
+					mCacheEntry->getSources(sources, false);
 		
 					if(sources.empty())
 					{
@@ -553,13 +569,19 @@ Splicer::CacheEntry::CacheEntry(const ByteString &target) :
 	mIsFileInCache(false),
 	mSize(-1),
 	mBlockSize(128*1024),	// TODO
-	mTime(Time::Now())
+	mTime(Time::Now()),
+	mSourcesRequest(NULL)
 {
 	
 }
 
 Splicer::CacheEntry::~CacheEntry(void)
 {
+	{
+		Synchronize(this);
+		while(mSourcesRequest) wait();
+	}
+	
 	// If finished the file is in the cache
 	if(!finished() && !mFileName.empty())
 		File::Remove(mFileName);
@@ -646,55 +668,82 @@ void Splicer::CacheEntry::hintSources(const Set<Identifier> &sources)
 		mSources.insert(*it);
 }
 
-bool Splicer::CacheEntry::getSources(Set<Identifier> &sources)
+bool Splicer::CacheEntry::getSources(Set<Identifier> &sources, bool wait)
 {
 	Synchronize(this);
-	if(mSources.empty() || mSize < 0) refreshSources();
+	// Hinted entries are used as is, a new splicer can't proceed without a source and the size
+	if(mSources.empty() || mSize < 0) refreshSources(wait);
 	sources = mSources;
 	return !sources.empty();
 }
 
-void Splicer::CacheEntry::refreshSources(void)
+void Splicer::CacheEntry::refreshSources(bool wait)
 {
 	Synchronize(this);  
-
-	LogDebug("Splicer::CacheEntry", "Requesting available sources...");
 	
 	const double timeout = milliseconds(Config::Get("request_timeout").toInt());
 	
-	Request request(mTarget.toString(), false);
-	request.submit();
-	DesynchronizeStatement(this, request.wait(timeout));
-
+	if(!mSourcesRequest)
 	{
-		Synchronize(&request);
-		mSources.clear();
-		for(int i=0; i<request.responsesCount(); ++i)
+		LogDebug("Splicer::CacheEntry", "Requesting available sources...");
+		
+		mNewSources.clear();
+		mSourcesRequest = new Request(mTarget.toString(), false);
+		try {
+			Desynchronize(this);
+			mSourcesRequest->submit(this, timeout);	// finished() can be called before submit returns
+		}
+		catch(...)
 		{
-			Request::Response *response = request.response(i);
-			const StringMap &parameters = response->parameters();
-			
-			if(!response->error())
-			{
-				try {
-					String url;
-					if(response->parameter("url", url))
-						hintName(url.afterLast('/'));
-					
-					String tmp;
-					if(response->parameter("size", tmp))
-					{
-						int64_t size = -1;
-						tmp.extract(size);
-						hintSize(size);
-					}
-				}
-				catch(...) {}
-				
-				mSources.insert(response->peering());
-			}
+			delete mSourcesRequest;
+			mSourcesRequest = NULL;
+			throw;
+		}
+	}
+	
+	if(wait)
+	{
+		double left = timeout + 1.;
+		while(mSourcesRequest && left > 0.)
+			Synchronizable::wait(left);
+	}
+}
+
+void Splicer::CacheEntry::response(Request *request, Request::Response *response)
+{
+	if(response->error()) return;
+	
+	Synchronize(this);
+	
+	try {
+		String url;
+		if(response->parameter("url", url))
+			hintName(url.afterLast('/'));
+		
+		String tmp;
+		if(response->parameter("size", tmp))
+		{
+			int64_t size = -1;
+			tmp.extract(size);
+			hintSize(size);
 		}
 	}
+	catch(...) {}
+	
+	mNewSources.insert(response->peering());
+}
+
+void Splicer::CacheEntry::finished(Request *request, bool timeout)
+{
+	Synchronize(this);
+	Assert(request == mSourcesRequest);
+	
+	mSources = mNewSources;
+	mNewSources.clear();
+	
+	delete mSourcesRequest;
+	mSourcesRequest = NULL;
+	notifyAll();
 	
 	LogDebug("Splicer::CacheEntry", "Found " + String::number(int(mSources.size())) + " sources");
 }
@@ -46,6 +46,7 @@ public:
 	~Splicer(void);
 	
 	void addSources(const Set<Identifier> &sources);
+	void setWeight(unsigned weight);	// weight of the requests, see Request::setWeight()
 	
 	int64_t size(void) const;	// range size
 	int64_t begin(void) const;
@@ -67,9 +68,10 @@ private:
 	Array<StripedFile*> mStripes;
 	unsigned mFirstBlock, mCurrentBlock;
 	int64_t mBegin, mEnd, mPosition;
+	unsigned mWeight;
 	bool mAutoDelete;
 	
-	class CacheEntry : public Synchronizable
+	class CacheEntry : public Synchronizable, protected Request::Callback
 	{
 	public:
 		CacheEntry(const ByteString &target);
@@ -90,8 +92,8 @@ private:
 		void hintName(const String &name);
 		void hintSize(int64_t size);
 		void hintSources(const Set<Identifier> &sources);
-		bool getSources(Set<Identifier> &sources);
-		void refreshSources(void);
+		bool getSources(Set<Identifier> &sources, bool wait = true);	// if wait is false, return cached sources
+		void refreshSources(bool wait = false);	// if wait is false, only start refreshing
 		
 		bool isBlockFinished(unsigned block) const;
 		bool markBlockFinished(unsigned block);	// true if block was finished
@@ -101,6 +103,9 @@ private:
 		bool isDownloading(void) const;
 		
 	private:
+		void response(Request *request, Request::Response *response);
+		void finished(Request *request, bool timeout);
+		
 		ByteString mTarget;
 		String mFileName;
 		bool mIsFileInCache;
@@ -112,6 +117,9 @@ private:
 		Set<Identifier> mSources;
 		Array<bool> mFinishedBlocks;
 		Set<unsigned> mDownloading;
+		
+		Request *mSourcesRequest;	// pending sources request, if any
+		Set<Identifier> mNewSources;
 	};
 	
 	CacheEntry *mCacheEntry;
@@ -1248,6 +1248,16 @@ void Store::update(const String &url, String path, int64_t parentId, bool comput
 			type = 1;
 			size = File::Size(absPath);
 		}
+		
+		// The digest might have been computed along with other files, if the file has not changed since
+		ByteString precomputedDigest;
+		Digest precomputed;
+		if(mDigests.get(absPath, precomputed))
+		{
+			mDigests.erase(absPath);
+			if(type && precomputed.size == size && precomputed.time == time)
+				precomputedDigest = precomputed.digest;
+		}
 	
 		if(parentId < 0)
 		{
@@ -1289,11 +1299,14 @@ void Store::update(const String &url, String path, int64_t parentId, bool comput
 			  
 				if(type && computeDigests)
 				{
-					Desynchronize(this);
-					digest.clear();
-					File data(absPath, File::Read);
-					Sha512::Hash(data, digest);
-					data.close();
+					digest = precomputedDigest;
+					if(digest.empty())
+					{
+						Desynchronize(this);
+						File data(absPath, File::Read);
+						Sha512::Hash(data, digest);
+						data.close();
+					}
 				}
 				
 				statement = mDatabase->prepare("UPDATE files SET parent_id=?2, digest=?3, size=?4, time=?5, type=?6, seen=1 WHERE id=?1");
@@ -1314,11 +1327,14 @@ void Store::update(const String &url, String path, int64_t parentId, bool comput
 			
 			if(type && computeDigests)
 			{
-				Desynchronize(this);
-				digest.clear();
-				File data(absPath, File::Read);
-				Sha512::Hash(data, digest);
-				data.close();
+				digest = precomputedDigest;
+				if(digest.empty())
+				{
+					Desynchronize(this);
+					File data(absPath, File::Read);
+					Sha512::Hash(data, digest);
+					data.close();
+				}
 			}
 			
 			String name = url.afterLast('/');
@@ -1354,6 +1370,8 @@ void Store::update(const String &url, String path, int64_t parentId, bool comput
 			
 		if(!type)	// directory
 		{
+			if(computeDigests) hashFiles(url, path);
+			
 			Desynchronize(this);
 			Directory dir(absPath);
 			while(dir.nextFile())
@@ -1367,6 +1385,9 @@ void Store::update(const String &url, String path, int64_t parentId, bool comput
 				String childUrl  = url + '/' + dir.fileName();
 				update(childUrl, childPath, id, computeDigests);
 			}
+			
+			// Digests not picked up by update() would be stale on the next pass
+			clearDigests(absPath);
 		}
 		else {		// file
 		  
@@ -1381,6 +1402,105 @@ void Store::update(const String &url, String path, int64_t parentId, bool comput
 	}
 }
 
+// Hash the changed files of a directory several at a time, digests are then picked up by update()
+void Store::hashFiles(const String &url, const String &path)
+{
+	Synchronize(this);
+	
+	Array<String> paths;
+	String absPath = absolutePath(path);
+	Directory dir(absPath);
+	while(dir.nextFile())
+	{
+		if(dir.fileIsDir()
+			|| dir.fileName() == ".directory" 
+			|| dir.fileName().toLower() == "thumbs.db")
+			continue;
+		
+		String childUrl  = url + '/' + dir.fileName();
+		String childPath = absolutePath(path + Directory::Separator + dir.fileName());
+		
+		Database::Statement statement = mDatabase->prepare("SELECT digest, size, time FROM files WHERE url = ?1");
+		statement.bind(1, childUrl);
+		if(statement.step())
+		{
+			ByteString dbDigest;
+			int64_t dbSize, dbTime;
+			statement.value(0, dbDigest);
+			statement.value(1, dbSize);
+			statement.value(2, dbTime);
+			statement.finalize();
+			
+			if(!dbDigest.empty() && dbSize == File::Size(childPath) && dbTime == File::Time(childPath))
+				continue;
+		}
+		else statement.finalize();
+		
+		paths.push_back(childPath);
+	}
+	
+	for(size_t first=0; first<paths.size(); first+= Sha512::Lanes)
+	{
+		size_t n = std::min(paths.size() - first, Sha512::Lanes);
+		
+		File *files[Sha512::Lanes];
+		String names[Sha512::Lanes];
+		Digest digests[Sha512::Lanes];
+		size_t count = 0;
+		for(size_t i=0; i<n; ++i)
+		{
+			try {
+				// Size and time are taken before hashing, a file modified meanwhile won't match in update()
+				digests[count].size = File::Size(paths[first + i]);
+				digests[count].time = File::Time(paths[first + i]);
+				files[count] = new File(paths[first + i], File::Read);
+				names[count] = paths[first + i];
+				++count;
+			}
+			catch(const Exception &e)
+			{
+				LogWarn("Store", String("Unable to open ") + paths[first + i] + ": " + e.what());
+			}
+		}
+		
+		try {
+			Desynchronize(this);
+			ByteStream *in[Sha512::Lanes], *out[Sha512::Lanes];
+			for(size_t i=0; i<count; ++i)
+			{
+				in[i] = files[i];
+				out[i] = &digests[i].digest;
+			}
+			
+			Sha512::Hash(in, out, count);
+		}
+		catch(const Exception &e)
+		{
+			LogWarn("Store", String("Hashing failed in ") + path + ": " + e.what());
+			for(size_t i=0; i<count; ++i)
+				digests[i].digest.clear();
+		}
+		
+		for(size_t i=0; i<count; ++i)
+		{
+			if(!digests[i].digest.empty()) mDigests.insert(names[i], digests[i]);
+			delete files[i];
+		}
+	}
+}
+
+void Store::clearDigests(const String &absPath)
+{
+	Synchronize(this);
+	
+	Map<String, Digest>::iterator it = mDigests.begin();
+	while(it != mDigests.end())
+	{
+		if(it->first.beforeLast(Directory::Separator) == absPath) mDigests.erase(it++);
+		else ++it;
+	}
+}
+
 String Store::urlToPath(const String &url) const
 {
 	if(url.empty() || url[0] != '/') throw Exception("Invalid URL");
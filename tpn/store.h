@@ -77,17 +77,27 @@ private:
 	
 	bool prepareQuery(Database::Statement &statement, const Resource::Query &query, const String &fields, bool oneRowOnly = false);
 	void update(const String &url, String path = "", int64_t parentId = -1, bool computeDigests = true);
+	void hashFiles(const String &url, const String &path);
+	void clearDigests(const String &absPath);	// digests of the files directly in absPath
 	String urlToPath(const String &url) const;
 	String absolutePath(const String &path) const;
 	bool isHiddenUrl(const String &url) const;
 	int64_t freeSpace(String path, int64_t maxSize, int64_t space = 0);
 	void run(void);
 	
+	struct Digest
+	{
+		ByteString digest;
+		int64_t size;
+		int64_t time;
+	};
+	
 	User *mUser;
 	Database *mDatabase;
 	String mFileName;
 	String mBasePath;
 	StringMap mDirectories;
+	Map<String, Digest> mDigests;	// precomputed by hashFiles(), only valid for the same size and time
 	bool mRunning;
 };
 
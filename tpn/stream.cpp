@@ -24,6 +24,10 @@
 #include "tpn/exception.h"
 #include "tpn/bytestream.h"
 
+#if __cplusplus >= 201703L
+#include <charconv>
+#endif
+
 namespace tpn
 {
 
@@ -364,4 +368,154 @@ void Stream::error(void)
 	throw IOException();
 }
 
+bool Stream::readToken(char *buffer, size_t &size)
+{
+	// Same token as read(String &)
+	char chr;
+	do {
+		if(!get(chr)) return false;
+	}
+	while(chr == ' ' || chr == '\t' || chr == '\r' || chr == '\n');
+	
+	size_t count = 0;
+	do {
+		if(count == size) error();	// too long to be a number
+		buffer[count++] = chr;
+		if(!get(chr)) break;
+	}
+	while(chr != ' ' && chr != '\t' && chr != '\r' && chr != '\n');
+	
+	size = count;
+	return true;
+}
+
+bool Stream::readInteger(uint64_t &magnitude, bool &negative)
+{
+	char buffer[64];
+	size_t size = sizeof(buffer);
+	if(!readToken(buffer, size)) return false;
+	
+	const char *p = buffer;
+	const char *end = buffer + size;
+	
+	negative = false;
+	if(*p == '-' || *p == '+') negative = (*p++ == '-');
+	
+	// The 0x prefix is optional in hexadecimal mode
+	const unsigned base = (mHexa ? 16 : 10);
+	if(mHexa && end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X'))
+		p+= 2;
+	
+	// Trailing characters are ignored, like with iostreams
+	const char *first = p;
+	magnitude = 0;
+	for(; p != end; ++p)
+	{
+		unsigned digit;
+		if(*p >= '0' && *p <= '9') digit = *p - '0';
+		else if(base == 16 && *p >= 'a' && *p <= 'f') digit = *p - 'a' + 10;
+		else if(base == 16 && *p >= 'A' && *p <= 'F') digit = *p - 'A' + 10;
+		else break;
+		
+		if(magnitude > (std::numeric_limits<uint64_t>::max() - digit)/base) error();
+		magnitude = magnitude*base + digit;
+	}
+	
+	if(p == first) error();
+	return true;
+}
+
+void Stream::writeInteger(uint64_t value, bool negative)
+{
+	static const char digits[] = "0123456789ABCDEF";
+	const unsigned base = (mHexa ? 16 : 10);
+	
+	char buffer[24];
+	char *p = buffer + sizeof(buffer);
+	do {
+		*--p = digits[value % base];
+		value/= base;
+	}
+	while(value);
+	
+	if(negative) *--p = '-';
+	writeData(p, buffer + sizeof(buffer) - p);
+}
+
+#ifdef __cpp_lib_to_chars
+
+template<typename T> static bool ParseFloating(const char *first, const char *last, T &val)
+{
+	// Unlike with iostreams, a plus sign is not accepted by from_chars
+	if(first != last && *first == '+') ++first;
+	return std::from_chars(first, last, val).ec == std::errc();
+}
+
+template<typename T> static size_t FormatFloating(char *first, char *last, T val)
+{
+	// Default iostream format, like printf("%g")
+	std::to_chars_result result = std::to_chars(first, last, val, std::chars_format::general, 6);
+	if(result.ec != std::errc()) return 0;
+	return result.ptr - first;
+}
+
+#else
+
+template<typename T> static bool ParseFloating(const char *first, const char *last, T &val)
+{
+	std::istringstream iss(std::string(first, last));
+	iss.imbue(std::locale::classic());
+	return bool(iss>>val);
+}
+
+template<typename T> static size_t FormatFloating(char *first, char *last, T val)
+{
+	std::ostringstream oss;
+	oss.imbue(std::locale::classic());
+	if(!(oss<<val)) return 0;
+	std::string str = oss.str();
+	if(str.size() > size_t(last - first)) return 0;
+	std::copy(str.begin(), str.end(), first);
+	return str.size();
+}
+
+#endif
+
+bool Stream::readFloating(float &val)
+{
+	char buffer[512];
+	size_t size = sizeof(buffer);
+	if(!readToken(buffer, size)) return false;
+	if(!ParseFloating(buffer, buffer + size, val)) error();
+	return true;
+}
+
+bool Stream::readFloating(double &val)
+{
+	char buffer[512];
+	size_t size = sizeof(buffer);
+	if(!readToken(buffer, size)) return false;
+	if(!ParseFloating(buffer, buffer + size, val)) error();
+	return true;
+}
+
+void Stream::writeFloating(float val)
+{
+	writeFloating(double(val));
+}
+
+void Stream::writeFloating(double val)
+{
+	char buffer[64];
+	size_t size = FormatFloating(buffer, buffer + sizeof(buffer), val);
+	if(!size) error();
+	
+	// Exponents and special values are uppercase in hexadecimal mode, like with iostreams
+	if(mHexa)
+		for(size_t i=0; i<size; ++i)
+			buffer[i] = std::toupper(buffer[i]);
+	
+	writeData(buffer, size);
+}
+
 }
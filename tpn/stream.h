@@ -80,17 +80,17 @@ public:
 
 	inline bool	read(char &c) 			{ return readData(&c,1); }
 	inline bool	read(signed char &i) 		{ return readStd(i); }
-	inline bool	read(signed short &i) 		{ return readStd(i); }
-	inline bool	read(signed int &i) 		{ return readStd(i); }
-	inline bool	read(signed long &i) 		{ return readStd(i); }
-	inline bool     read(signed long long &i)       { return readStd(i); }
+	inline bool	read(signed short &i) 		{ return readInteger(i); }
+	inline bool	read(signed int &i) 		{ return readInteger(i); }
+	inline bool	read(signed long &i) 		{ return readInteger(i); }
+	inline bool     read(signed long long &i)       { return readInteger(i); }
 	inline bool	read(unsigned char &i) 		{ return readStd(i); }
-	inline bool	read(unsigned short &i) 	{ return readStd(i); }
-	inline bool	read(unsigned int &i) 		{ return readStd(i); }
-	inline bool	read(unsigned long &i) 		{ return readStd(i); }
-	inline bool	read(unsigned long long &i) 	{ return readStd(i); }
-	inline bool	read(float &f) 			{ return readStd(f); }
-	inline bool	read(double &f) 		{ return readStd(f); }
+	inline bool	read(unsigned short &i) 	{ return readInteger(i); }
+	inline bool	read(unsigned int &i) 		{ return readInteger(i); }
+	inline bool	read(unsigned long &i) 		{ return readInteger(i); }
+	inline bool	read(unsigned long long &i) 	{ return readInteger(i); }
+	inline bool	read(float &f) 			{ return readFloating(f); }
+	inline bool	read(double &f) 		{ return readFloating(f); }
 
 	double	readDouble(void);
 	float 	readFloat(void);
@@ -107,17 +107,17 @@ public:
 	
 	inline void	write(char c) 			{ writeData(&c,1); }
 	inline void	write(signed char i) 		{ writeStd(i); }
-	inline void	write(signed short i) 		{ writeStd(i); }
-	inline void	write(signed int i) 		{ writeStd(i); }
-	inline void	write(signed long i) 		{ writeStd(i); }
-	inline void     write(signed long long i)       { writeStd(i); }
+	inline void	write(signed short i) 		{ writeInteger(i); }
+	inline void	write(signed int i) 		{ writeInteger(i); }
+	inline void	write(signed long i) 		{ writeInteger(i); }
+	inline void     write(signed long long i)       { writeInteger(i); }
 	inline void	write(unsigned char i) 		{ writeStd(i); }
-	inline void	write(unsigned short i) 	{ writeStd(i); }
-	inline void	write(unsigned int i) 		{ writeStd(i); }
-	inline void	write(unsigned long i) 		{ writeStd(i); }
-	inline void	write(unsigned long long i) 	{ writeStd(i); }
-	inline void	write(float f) 			{ writeStd(f); }
-	inline void	write(double f) 		{ writeStd(f); }
+	inline void	write(unsigned short i) 	{ writeInteger(i); }
+	inline void	write(unsigned int i) 		{ writeInteger(i); }
+	inline void	write(unsigned long i) 		{ writeInteger(i); }
+	inline void	write(unsigned long long i) 	{ writeInteger(i); }
+	inline void	write(float f) 			{ writeFloating(f); }
+	inline void	write(double f) 		{ writeFloating(f); }
 
 	// Flow operators
 	template<typename T> Stream& operator>>(T &val);
@@ -127,7 +127,7 @@ public:
 	// Parsing
 	bool assertChar(char chr);
 	bool readChar(char &chr);
-	bool readLine(String &str);
+	virtual bool readLine(String &str);
 	bool readString(String &str);
 	template<typename T> bool readLine(T &output);
 	template<typename T> void writeLine(const T &input);
@@ -139,10 +139,22 @@ protected:
 
 private:
 	bool readStdString(std::string &output);
-	void error(void);
+	void error(void) __attribute__((noreturn));	// throws IOException
 
+	// Character types keep the iostream semantics, a single character is read or written
 	template<typename T> bool readStd(T &val);
 	template<typename T> void writeStd(const T &val);
+	
+	// Locale-free numeric conversions, without intermediate strings
+	bool readToken(char *buffer, size_t &size);	// size is the buffer size, then the token size
+	bool readInteger(uint64_t &magnitude, bool &negative);
+	void writeInteger(uint64_t value, bool negative);
+	template<typename T> bool readInteger(T &val);
+	template<typename T> void writeInteger(T val);
+	bool readFloating(float &val);
+	bool readFloating(double &val);
+	void writeFloating(float val);
+	void writeFloating(double val);
 };
 
 // NB: String is not defined here, as it herits from Stream.
@@ -171,6 +183,39 @@ template<typename T> void Stream::writeStd(const T &val)
 	write(oss.str());
 }
 
+template<typename T> bool Stream::readInteger(T &val)
+{
+	uint64_t magnitude;
+	bool negative;
+	if(!readInteger(magnitude, negative)) return false;
+	
+	// Out of range values are errors, except that negative values wrap around
+	// for unsigned types, like with iostreams
+	if(std::numeric_limits<T>::is_signed && negative)
+	{
+		if(magnitude > uint64_t(std::numeric_limits<T>::max()) + 1) error();
+		val = (magnitude ? T(-int64_t(magnitude - 1) - 1) : T(0));
+	}
+	else {
+		if(magnitude > uint64_t(std::numeric_limits<T>::max())) error();
+		val = (negative ? T(T(0) - T(magnitude)) : T(magnitude));
+	}
+	return true;
+}
+
+template<typename T> void Stream::writeInteger(T val)
+{
+	if(mHexa)
+	{
+		// Negative values are written in two's complement, like with iostreams
+		uint64_t value = uint64_t(val);
+		if(sizeof(T) < sizeof(uint64_t)) value&= (uint64_t(1) << (8*sizeof(T))) - 1;
+		writeInteger(value, false);
+	}
+	else if(val < T(0)) writeInteger(uint64_t(0) - uint64_t(val), true);
+	else writeInteger(uint64_t(val), false);
+}
+
 template<typename T> Stream& Stream::operator>>(T &val)
 {
 	if(!read(val)) error();
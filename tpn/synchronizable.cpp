@@ -34,9 +34,9 @@ Synchronizable::~Synchronizable(void)
 
 }
 
-void Synchronizable::lock(int count) const
+void Synchronizable::lock(int count, LockSite *site) const
 {
-	mMutex.lock(count);
+	mMutex.lock(count, site);
 }
 
 void Synchronizable::unlock(void) const
@@ -24,6 +24,7 @@
 
 #include "tpn/mutex.h"
 #include "tpn/signal.h"
+#include "tpn/lockprofiler.h"
 
 namespace tpn
 {
@@ -34,11 +35,11 @@ public:
 	Synchronizable(void);
 	virtual ~Synchronizable(void);
 
-	void lock(int count = 1) const;
+	void lock(int count = 1, LockSite *site = NULL) const;
 	void unlock(void) const;
 	int  unlockAll(void) const;
 
-	void notify(void) const;
+	virtual void notify(void) const;
 	void notifyAll(void) const;
 	void wait(void) const;
 	bool wait(double &timeout) const;
@@ -54,7 +55,7 @@ private:
 class Synchronizer
 {
 public:
-	inline Synchronizer(const Synchronizable *_s) : s(_s) { s->lock(); }
+	inline Synchronizer(const Synchronizable *_s, LockSite *site = NULL) : s(_s) { s->lock(1, site); }
 	inline ~Synchronizer(void) { s->unlock(); }
 
 private:
@@ -84,12 +85,13 @@ inline bool boolUnlock(Synchronizable *s, bool b)
 	return b;
 }
 
-#define Synchronize(x)   Synchronizer	__sync(x); 
+// Synchronize call sites are recorded by the lock profiler when it is enabled
+#define Synchronize(x)   static LockSite __site(__FILE__, __LINE__); Synchronizer __sync(x, &__site); 
 #define Desynchronize(x) Desynchronizer	__desync(x)
 #define Unprioritize(x)  {int __c = (x)->unlockAll(); tpn::sleep(0.01); (x)->lock(__c);}
 #define SyncYield(x)  {int __c = (x)->unlockAll(); yield(); (x)->lock(__c);}
 #define SynchronizeTest(x,test) (boolLock(x,true) && boolUnlock(x,(test)))
-#define SynchronizeStatement(x,stmt) { Synchronizer __sync(x); stmt; }
+#define SynchronizeStatement(x,stmt) { static LockSite __site(__FILE__, __LINE__); Synchronizer __sync(x, &__site); stmt; }
 #define DesynchronizeStatement(x,stmt) { Desynchronizer __desync(x); stmt; } 
 
 }
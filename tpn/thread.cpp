@@ -107,6 +107,11 @@ void Thread::terminate(void)
 #endif
 }
 
+void Thread::setAutoDelete(bool autoDelete)
+{
+	mAutoDelete = autoDelete;
+}
+
 bool Thread::isRunning(void)
 {
 	return mRunning;
@@ -169,8 +174,8 @@ void *Thread::ThreadCall(void *myWrapper)
 		LogWarn("Thread::ThreadCall", String("Unhandled unknown exception in thread")); 
 	}
 	
-	delete wrapper;
 	wrapper->thread->mRunning = false;
+	delete wrapper;
 	
 #ifdef PTW32_STATIC_LIB
 	pthread_win32_thread_detach_np();
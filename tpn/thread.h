@@ -46,6 +46,7 @@ public:
 	
 protected:
 	virtual void run(void);
+	void setAutoDelete(bool autoDelete);	// must be called from the running thread
 
 private:
 	static void *ThreadRun (void *myThread);
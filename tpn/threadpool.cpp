@@ -19,84 +19,112 @@
  *   If not, see <http://www.gnu.org/licenses/>.                         *
  *************************************************************************/
 
-#include "tpn/scheduler.h"
+#include "tpn/threadpool.h"
 #include "tpn/exception.h"
 #include "tpn/string.h"
 
 namespace tpn
 {
 
+__thread ThreadPool::Worker *ThreadPool::CurrentWorker = NULL;
+const double ThreadPool::SpawnDelay = 0.002;
+
 ThreadPool::ThreadPool(unsigned min, unsigned max, unsigned limit) :
-	mTask(NULL),
 	mMin(min),
 	mMax(max),
-	mLimit(limit)
+	mLimit(limit),
+	mIdle(0),
+	mActive(0),
+	mQueued(0),
+	mParked(0),
+	mWaiting(0)
 {
+	mDequesCount = (mLimit ? std::min(mLimit, MaxDeques) : MaxDeques);
+	mDeques = new TaskDeque[mDequesCount];
+	
 	Synchronize(this);
-
 	while(mWorkers.size() < mMin)
 	{
-		Worker *worker = new Worker(this);
-		mWorkers.insert(worker);
-		worker->start(true);
+		startWorker();
+		__atomic_add_fetch(&mIdle, 1, __ATOMIC_SEQ_CST);
 	}
 }
 
 ThreadPool::~ThreadPool(void)
 {
 	NOEXCEPTION(clear());
+	delete[] mDeques;
 }
 
 void ThreadPool::launch(Task *task)
 {
-	Worker *worker;
-	try
-	{
-		Synchronize(this);
-		Assert(!mTask);
-		
-		//String status;
-		//status << mAvailableWorkers.size() << "/" << mWorkers.size() << " workers available (min=" << mMin << ", max=" << mMax << ", limit=" << mLimit << ")";
-		//LogDebug("ThreadPool::launch", status);
-		
-		while(mAvailableWorkers.empty())
+	Assert(task);
+	__atomic_add_fetch(&mActive, 1, __ATOMIC_SEQ_CST);
+	
+	try {
+		if(!reserve())
 		{
-			if(!mLimit || mWorkers.size() < mLimit)
+			Synchronize(this);
+			__atomic_add_fetch(&mWaiting, 1, __ATOMIC_SEQ_CST);
+			
+			try {
+				bool delayed = false;
+				while(!reserve())
+				{
+					// Beyond max workers, running tasks get a chance to finish before a new thread is started,
+					// so bursts of short tasks do not end up in one thread each.
+					// The wait would release the pool lock, so there is no delay if the caller already holds it.
+					if(!delayed && mWorkers.size() >= std::max(mMin, mMax) && static_cast<Mutex&>(*this).lockCount() == 1)
+					{
+						delayed = true;
+						mIdleSignal.wait(*this, SpawnDelay);
+						continue;
+					}
+					
+					if(!mLimit || mWorkers.size() < mLimit)
+					{
+						startWorker();	// the new worker is reserved for the task
+						break;
+					}
+					
+					mIdleSignal.wait(*this);
+				}
+			}
+			catch(...)
 			{
-				worker = new Worker(this);
-				mWorkers.insert(worker);
-				worker->start(true);
-				break;
+				__atomic_sub_fetch(&mWaiting, 1, __ATOMIC_SEQ_CST);
+				throw;
 			}
 			
-			mSignal.wait(*this);
+			__atomic_sub_fetch(&mWaiting, 1, __ATOMIC_SEQ_CST);
 		}
-		
-		mTask = task;
-		notify();
-
-		while(mTask)
-                        mSignal.wait(*this);
 	}
 	catch(const Exception &e)
 	{
+		__atomic_sub_fetch(&mActive, 1, __ATOMIC_SEQ_CST);
 		LogWarn("ThreadPool::launch", String("Failed: ") + e.what());
 		throw;
 	}
+	
+	push(task);
+	wake();
 }
 
 void ThreadPool::join(void)
 {
 	Synchronize(this);
+	__atomic_add_fetch(&mWaiting, 1, __ATOMIC_SEQ_CST);
+	
+	while(__atomic_load_n(&mActive, __ATOMIC_SEQ_CST) > 0)
+		mIdleSignal.wait(*this);
 	
-	// Threads are always running so we can't use join() here
-	while(mAvailableWorkers.size() < mWorkers.size())
-		mSignal.wait(*this);
+	__atomic_sub_fetch(&mWaiting, 1, __ATOMIC_SEQ_CST);
 }
 
 void ThreadPool::clear(void)
 {
 	Synchronize(this);
+	__atomic_add_fetch(&mWaiting, 1, __ATOMIC_SEQ_CST);
 	
 	while(!mWorkers.empty())
 	{
@@ -108,21 +136,193 @@ void ThreadPool::clear(void)
 			worker->stop();
 		}
 
-		notifyAll();
-		mSignal.wait(*this);
+		mWorkSignal.launchAll();
+		mIdleSignal.wait(*this);
 	}
-		
-	mWorkers.clear();
-	mAvailableWorkers.clear();
+	
+	__atomic_sub_fetch(&mWaiting, 1, __ATOMIC_SEQ_CST);
 }
 
-void ThreadPool::onTaskFinished(Task *task)
+void ThreadPool::onTaskFinished(Task *)
 {
 	// Dummy
 }
 
+void ThreadPool::push(Task *task)
+{
+	Worker *worker = CurrentWorker;
+	if(worker && worker->mThreadPool == this && worker->mDeque && worker->mDeque->push(task))
+		return;
+	
+	MutexLocker lock(&mQueueMutex);
+	mQueue.push_back(task);
+	__atomic_add_fetch(&mQueued, 1, __ATOMIC_SEQ_CST);
+}
+
+Task *ThreadPool::pop(void)
+{
+	if(!__atomic_load_n(&mQueued, __ATOMIC_SEQ_CST))
+		return NULL;
+	
+	MutexLocker lock(&mQueueMutex);
+	if(mQueue.empty()) return NULL;
+	Task *task = mQueue.front();
+	mQueue.pop_front();
+	__atomic_sub_fetch(&mQueued, 1, __ATOMIC_SEQ_CST);
+	return task;
+}
+
+Task *ThreadPool::steal(unsigned &victim, const TaskDeque *own)
+{
+	for(unsigned i=0; i<mDequesCount; ++i)
+	{
+		unsigned k = (victim + i) % mDequesCount;
+		if(&mDeques[k] == own) continue;
+		
+		Task *task = mDeques[k].steal();
+		if(task)
+		{
+			victim = k;	// the same victim is likely to have more tasks
+			return task;
+		}
+	}
+	
+	return NULL;
+}
+
+bool ThreadPool::reserve(void)
+{
+	int idle = __atomic_load_n(&mIdle, __ATOMIC_SEQ_CST);
+	while(idle > 0)
+		if(__atomic_compare_exchange_n(&mIdle, &idle, idle - 1, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+			return true;
+	
+	return false;
+}
+
+void ThreadPool::wake(void)
+{
+	// Pairs with the parked count increment before a worker checks again for tasks
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&mParked, __ATOMIC_SEQ_CST) > 0)
+	{
+		Synchronize(this);
+		mWorkSignal.launch();
+	}
+}
+
+void ThreadPool::notifyIdle(void)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&mWaiting, __ATOMIC_SEQ_CST) > 0)
+	{
+		Synchronize(this);
+		mIdleSignal.launchAll();
+	}
+}
+
+void ThreadPool::startWorker(void)
+{
+	Synchronize(this);
+	
+	Worker *worker = new Worker(this);
+	mWorkers.insert(worker);
+	
+	try {
+		worker->start(true);
+	}
+	catch(...)
+	{
+		mWorkers.erase(worker);
+		delete worker;
+		throw;
+	}
+}
+
+ThreadPool::TaskDeque::TaskDeque(void) :
+	mTop(0),
+	mBottom(0),
+	mOwned(0)
+{
+	std::fill(mTasks, mTasks + Capacity, static_cast<Task*>(NULL));
+}
+
+bool ThreadPool::TaskDeque::push(Task *task)
+{
+	long b = __atomic_load_n(&mBottom, __ATOMIC_RELAXED);
+	long t = __atomic_load_n(&mTop, __ATOMIC_ACQUIRE);
+	if(b - t >= Capacity) return false;
+	
+	__atomic_store_n(&mTasks[b % Capacity], task, __ATOMIC_RELAXED);
+	__atomic_store_n(&mBottom, b + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+Task *ThreadPool::TaskDeque::pop(void)
+{
+	long b = __atomic_load_n(&mBottom, __ATOMIC_RELAXED) - 1;
+	__atomic_store_n(&mBottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	long t = __atomic_load_n(&mTop, __ATOMIC_RELAXED);
+	
+	if(t > b)
+	{
+		// Empty
+		__atomic_store_n(&mBottom, b + 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	
+	Task *task = __atomic_load_n(&mTasks[b % Capacity], __ATOMIC_RELAXED);
+	if(t == b)
+	{
+		// Last task, race against thieves
+		if(!__atomic_compare_exchange_n(&mTop, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			task = NULL;
+		__atomic_store_n(&mBottom, b + 1, __ATOMIC_RELAXED);
+	}
+	
+	return task;
+}
+
+Task *ThreadPool::TaskDeque::steal(void)
+{
+	while(true)
+	{
+		long t = __atomic_load_n(&mTop, __ATOMIC_ACQUIRE);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		long b = __atomic_load_n(&mBottom, __ATOMIC_ACQUIRE);
+		if(t >= b) return NULL;
+		
+		Task *task = __atomic_load_n(&mTasks[t % Capacity], __ATOMIC_RELAXED);
+		if(__atomic_compare_exchange_n(&mTop, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			return task;
+		
+		// Lost the race for this task, retry with the next one
+	}
+}
+
+bool ThreadPool::TaskDeque::empty(void) const
+{
+	long t = __atomic_load_n(&mTop, __ATOMIC_ACQUIRE);
+	long b = __atomic_load_n(&mBottom, __ATOMIC_ACQUIRE);
+	return t >= b;
+}
+
+bool ThreadPool::TaskDeque::acquire(void)
+{
+	int expected = 0;
+	return __atomic_compare_exchange_n(&mOwned, &expected, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+void ThreadPool::TaskDeque::release(void)
+{
+	__atomic_store_n(&mOwned, 0, __ATOMIC_RELEASE);
+}
+
 ThreadPool::Worker::Worker(ThreadPool *pool) :
 	mThreadPool(pool),
+	mDeque(NULL),
+	mVictim(0),
 	mShouldStop(false)
 {
 
@@ -130,10 +330,7 @@ ThreadPool::Worker::Worker(ThreadPool *pool) :
 
 ThreadPool::Worker::~Worker(void)
 {
-	Synchronize(mThreadPool);
-	mThreadPool->mAvailableWorkers.erase(this);
-	mThreadPool->mWorkers.erase(this);
-	mThreadPool->mSignal.launchAll();
+
 }
 
 void ThreadPool::Worker::stop(void)
@@ -143,50 +340,56 @@ void ThreadPool::Worker::stop(void)
 
 void ThreadPool::Worker::run(void)
 {
+	CurrentWorker = this;
+	
+	for(unsigned i=0; i<mThreadPool->mDequesCount; ++i)
+		if(mThreadPool->mDeques[i].acquire())
+		{
+			mDeque = &mThreadPool->mDeques[i];
+			mVictim = i + 1;
+			break;
+		}
+	
 	while(true)
 	{
-		Task *task = NULL;
+		Task *task = take();
 		
-		try {
-			Synchronize(mThreadPool);
-
-			if(!mThreadPool->mTask)
-			{
-				// Worker is now available      
-				mThreadPool->mAvailableWorkers.insert(this);
-				mThreadPool->mSignal.launchAll();
-			}
-
-			// Wait for Task
-			while(!mThreadPool->mTask)
-			{ 
-				double timeout = 10.;
-				while(!mThreadPool->mTask && !mShouldStop)
-					if(!mThreadPool->wait(timeout))
-						break;
-			
-				// Terminate if necessary
-				if(!mThreadPool->mTask)
+		if(!task)
+		{
+			try {
+				Synchronize(mThreadPool);
+				__atomic_add_fetch(&mThreadPool->mParked, 1, __ATOMIC_SEQ_CST);
+				
+				// Check again now that launches see this worker parked
+				task = take();
+				if(!task)
 				{
-					if(mShouldStop || mThreadPool->mWorkers.size() > mThreadPool->mMax)
+					// Only an idle worker not reserved by a launch may terminate,
+					// so terminating workers reserve themselves
+					if(mShouldStop && mThreadPool->reserve())
 					{
-						mThreadPool->mAvailableWorkers.erase(this);
-						mThreadPool->mWorkers.erase(this);
-						return;
+						__atomic_sub_fetch(&mThreadPool->mParked, 1, __ATOMIC_SEQ_CST);
+						break;
 					}
+					
+					double timeout = 10.;
+					bool signaled = mThreadPool->mWorkSignal.wait(*mThreadPool, timeout);
+					__atomic_sub_fetch(&mThreadPool->mParked, 1, __ATOMIC_SEQ_CST);
+					
+					// Terminate if necessary
+					if(!signaled && mThreadPool->mWorkers.size() > std::max(mThreadPool->mMin, mThreadPool->mMax) && mThreadPool->reserve())
+						break;
+					
+					continue;
 				}
+				
+				__atomic_sub_fetch(&mThreadPool->mParked, 1, __ATOMIC_SEQ_CST);
+			}
+			catch(const std::exception &e)
+			{
+				LogWarn("ThreadPool::Worker", e.what());
+				break;
 			}
-
-			// Run task
-			mThreadPool->mAvailableWorkers.erase(this);
-			task = mThreadPool->mTask;
-			mThreadPool->mTask = NULL;
-			mThreadPool->mSignal.launchAll();
-		}
-		catch(const std::exception &e)
-		{
-			LogWarn("ThreadPool::Worker", e.what());
-			break;
 		}
 		
 		try {
@@ -201,15 +404,43 @@ void ThreadPool::Worker::run(void)
 			LogWarn("ThreadPool::Worker", String("Unknown handled exception in task"));
 		}
 		
+		// Worker is now available
+		__atomic_add_fetch(&mThreadPool->mIdle, 1, __ATOMIC_SEQ_CST);
+		mThreadPool->notifyIdle();
+		
 		try {
-			Synchronize(mThreadPool);
 			mThreadPool->onTaskFinished(task);
 		}
 		catch(const std::exception &e)
 		{
 			LogWarn("ThreadPool::Worker", String("Error in finished callback: ") + e.what());
 		}
+		
+		if(__atomic_sub_fetch(&mThreadPool->mActive, 1, __ATOMIC_SEQ_CST) == 0)
+			mThreadPool->notifyIdle();
 	}
+	
+	try {
+		Synchronize(mThreadPool);
+		mThreadPool->mWorkers.erase(this);
+		if(mDeque) mDeque->release();
+		mThreadPool->mIdleSignal.launchAll();
+	}
+	catch(const std::exception &e)
+	{
+		LogWarn("ThreadPool::Worker", e.what());
+	}
+	
+	CurrentWorker = NULL;
+}
+
+Task *ThreadPool::Worker::take(void)
+{
+	Task *task = NULL;
+	if(mDeque) task = mDeque->pop();
+	if(!task) task = mThreadPool->pop();
+	if(!task) task = mThreadPool->steal(mVictim, mDeque);
+	return task;
 }
 
 }
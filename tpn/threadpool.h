@@ -24,6 +24,7 @@
 
 #include "tpn/include.h"
 #include "tpn/synchronizable.h"
+#include "tpn/mutex.h"
 #include "tpn/signal.h"
 #include "tpn/thread.h"
 #include "tpn/task.h"
@@ -32,6 +33,11 @@
 namespace tpn
 {
 
+// Work-stealing thread pool
+// Tasks launched from a worker go to its own deque, other tasks to a global injection queue,
+// idle workers take from their deque, then from the queue, then steal from other workers.
+// Tasks may block, so launch() always reserves an idle worker for the task, starting a new one
+// if none is available, and waits for one to become idle only when limit is reached.
 class ThreadPool : protected Synchronizable
 {
 public:
@@ -41,33 +47,88 @@ public:
 	virtual ~ThreadPool(void);
 	
 	void launch(Task *task);
-	void join(void);
-	void clear(void);
+	void join(void);	// wait for all launched tasks to finish
+	void clear(void);	// stop all workers
 	
 protected:
+	// Called from the worker thread once the task has finished, without any pool lock held
 	virtual void onTaskFinished(Task *task);
 	
 private:
+	// Fixed-capacity Chase-Lev deque, the owner pushes and pops at the bottom, thieves steal at the top
+	class TaskDeque
+	{
+	public:
+		static const long Capacity = 256;
+		
+		TaskDeque(void);
+		
+		bool push(Task *task);	// owner only, false if full
+		Task *pop(void);	// owner only
+		Task *steal(void);
+		bool empty(void) const;
+		
+		bool acquire(void);
+		void release(void);
+		
+	private:
+		long mTop;
+		long mBottom;
+		Task *mTasks[Capacity];
+		int mOwned;
+	};
+	
 	class Worker : public Thread
 	{
 	public:
 		Worker(ThreadPool *pool);
 		~Worker(void);
 	
-		void stop(void);		
+		void stop(void);
 
 	private:
 		void run(void);
+		Task *take(void);
 		
 		ThreadPool *mThreadPool;
+		TaskDeque *mDeque;	// NULL if all deques are taken
+		unsigned mVictim;
 		bool mShouldStop;
+		
+		friend class ThreadPool;
 	};
 	
-	Set<Worker*> mWorkers;
-	Set<Worker*> mAvailableWorkers;
-	Task *mTask;
-	Signal mSignal;
+	static const unsigned MaxDeques = 64;	// further workers only use the injection queue
+	static const double SpawnDelay;
+	static __thread Worker *CurrentWorker;
+	
+	void push(Task *task);
+	Task *pop(void);
+	Task *steal(unsigned &victim, const TaskDeque *own);
+	bool reserve(void);
+	void wake(void);
+	void notifyIdle(void);
+	void startWorker(void);
+	
 	unsigned mMin, mMax, mLimit;
+	
+	// Workers set and parking are protected by the Synchronizable
+	Set<Worker*> mWorkers;
+	Signal mWorkSignal;		// idle workers park on it
+	Signal mIdleSignal;		// launch(), join() and clear() wait on it
+	
+	Mutex mQueueMutex;
+	Deque<Task*> mQueue;		// global injection queue
+	
+	TaskDeque *mDeques;
+	unsigned mDequesCount;
+	
+	// Atomic counters
+	int mIdle;			// idle workers not reserved by a launch
+	int mActive;			// launched tasks not finished
+	int mQueued;			// tasks waiting in the injection queue
+	int mParked;
+	int mWaiting;
 };
 
 }
@@ -27,9 +27,37 @@
 namespace tpn
 {
 
+static inline bool IsBlank(char chr)
+{
+	return (chr == ' ' || chr == '\t' || chr == '\r' || chr == '\n');
+}
+
+// Lines are trimmed by index to prevent copies
+static inline void Trim(const String &str, size_t &begin, size_t &end)
+{
+	begin = 0;
+	end = str.size();
+	while(begin < end && IsBlank(str[begin])) ++begin;
+	while(end > begin && IsBlank(str[end-1])) --end;
+}
+
+static inline bool TrimmedEquals(const String &str, const char *value)
+{
+	size_t begin, end;
+	Trim(str, begin, end);
+	return str.compare(begin, end - begin, value) == 0;
+}
+
+static inline bool IsDocumentMarker(const String &str)
+{
+	return TrimmedEquals(str, "...") || TrimmedEquals(str, "---");
+}
+
 YamlSerializer::YamlSerializer(Stream *stream, int outputLevel) :
 	mStream(stream),
-	mLevel(outputLevel)
+	mOutput(stream),
+	mLevel(outputLevel),
+	mOutputLevel(outputLevel)
 {
 	Assert(stream);
 }
@@ -41,14 +69,7 @@ YamlSerializer::~YamlSerializer(void)
  
 bool YamlSerializer::input(Serializable &s)
 {
-	if(mIndent.empty())
-	{
-		if(mLine.empty() && !mStream->readLine(mLine))
-			return false;
-		
-		if(mLine.trimmed() == "...") return false;
-		if(mLine.trimmed() == "---") mLine.clear();
-	}
+	if(!readDocumentLine()) return false;
 	
 	if(s.isInlineSerializable() && !s.isNativeSerializable())
 	{
@@ -62,125 +83,68 @@ bool YamlSerializer::input(Serializable &s)
 
 bool YamlSerializer::input(Element &element)
 {  
-  	String trimmed = mLine.trimmed();
-	while(trimmed.empty())
-	{
-		mLine.clear();
-		if(!mStream->readLine(mLine))
-		{
-			if(!mIndent.empty()) mIndent.pop();
-			return false;
-		}
-		
-		trimmed =  mLine.trimmed();
-	}
-	
-	if(trimmed == "..." || trimmed == "---")
-		return false;
-
-	if(!mIndent.empty())
-	{
-		int indent = 0;
-		while(indent < mLine.size() && 
-			(mLine[indent] == ' ' || mLine[indent] == '\t')) ++indent;
-
-		if(mIndent.top() < 0) 
-		{
-			mIndent.pop();
-                	if((mIndent.empty() && indent == 0) || (!mIndent.empty() && mIndent.top() >= indent))
-				return false;
-
-			mIndent.push(indent);
-		}
-		else {
-			if(indent < mIndent.top()) 
-			{
-				mIndent.pop();
-				return false;
-			}
-
-			if(indent > mIndent.top()) 
-				mIndent.top() = indent;
-		}
-	}
-	
-	mLine.trim();
+	if(!readContentLine()) return false;
+	if(!readIndent()) return false;
 	
-	char chr;
-	mLine.get(chr);
-	if(chr != '-') throw IOException("Invalid array entry, missing '-'");
+	size_t begin, end;
+	Trim(mLine, begin, end);
+	if(mLine[begin] != '-') throw IOException("Invalid array entry, missing '-'");
 	
-	AssertIO(mLine.get(chr));
-	AssertIO(chr == ' ');
+	// A lone '-' means the entry is a block on the following lines
+	AssertIO(begin + 1 == end || mLine[begin+1] == ' ');
+	mLine.erase(end);
+	mLine.erase(0, std::min(begin + 2, end));
 	
+	// The block of the value is closed by its owner
 	mIndent.push(-1);
 	AssertIO(element.deserialize(*this));
-	if(!mIndent.empty()) mIndent.pop();
+	mIndent.pop();
 	return true;
 }
 
 bool YamlSerializer::input(Pair &pair)
 {
-	String trimmed = mLine.trimmed();
-	while(trimmed.empty())
+	if(!readContentLine()) return false;
+	if(!readIndent()) return false;
+	
+	size_t begin, end;
+	Trim(mLine, begin, end);
+	size_t colon = mLine.find(':', begin);
+	if(colon == String::npos || colon >= end) throw IOException("Invalid associative entry, missing ':'");
+	
+	// The key ends at the first colon followed by a space or by the end of line
+	size_t keyEnd;
+	size_t pos = begin;
+	while(true)
 	{
-		mLine.clear();
-		if(!mStream->readLine(mLine))
+		AssertIO(pos < end);
+		colon = mLine.find(':', pos);
+		if(colon == String::npos || colon >= end)
 		{
-			if(!mIndent.empty()) mIndent.pop();
-			return false;
+			keyEnd = pos = end;
+			break;
 		}
 		
-		trimmed =  mLine.trimmed();
-	}
-	
-	if(trimmed == "..." || trimmed == "---")
-		return false;
-	
-	if(!mIndent.empty())
-	{
-		int indent = 0;
-		while(indent < mLine.size() && 
-			(mLine[indent] == ' ' || mLine[indent] == '\t')) ++indent;
-	
-		if(mIndent.top() < 0)
-                {
-                        mIndent.pop();
-                        if((mIndent.empty() && indent == 0) || (!mIndent.empty() && mIndent.top() >= indent))
-                                return false;
-
-                        mIndent.push(indent);
-                }
-                else {
-                        if(indent < mIndent.top())
-                        {
-                                mIndent.pop();
-                                return false;
-                        }
-
-                        if(indent > mIndent.top())
-                                mIndent.top() = indent;
-                }
+		keyEnd = colon;
+		pos = colon + 1;
+		if(pos == end) break;
+		if(mLine[pos] == ' ')
+		{
+			++pos;
+			break;
+		}
+		++pos;
 	}
 	
-	mLine.trim();
-	if(!mLine.contains(':')) throw IOException("Invalid associative entry, missing ':'");
+	mKey.assign(mLine, begin, keyEnd - begin);
+	mLine.erase(end);
+	mLine.erase(0, pos);
 	
-	String key;
-	while(true)
-	{
-		AssertIO(mLine.readUntil(key,':'));
-		char chr;
-		if(!mLine.get(chr) || chr == ' ') break;
-		key+= ':';
-		key+= chr;
-	}
-
-	LineSerializer keySerializer(&key);
+	LineSerializer keySerializer(&mKey);
 	AssertIO(pair.deserializeKey(keySerializer));
 	mIndent.push(-1);
 	AssertIO(pair.deserializeValue(*this));
-	if(!mIndent.empty()) mIndent.pop();
+	mIndent.pop();
 	return true;
 }
 
@@ -188,75 +152,55 @@ bool YamlSerializer::input(String &str)
 {
 	str.clear();
  
-	if(mIndent.empty())
-	{
-		if(mLine.empty() && !mStream->readLine(mLine))
-			return false;
-		
-		if(mLine.trimmed() == "...") return false;
-		if(mLine.trimmed() == "---") mLine.clear();
-	}
+	if(!readDocumentLine()) return false;
 	
 	bool keepNewLines = true;
 	int i = 0;
 	while(true)
 	{
-		String trimmed =  mLine.trimmed();
-		if(mIndent.empty() && (trimmed == "..." || trimmed == "---"))
+		if(mIndent.empty() && IsDocumentMarker(mLine))
 			return i != 0;
 		
 		if(i == 0)
 		{
-			if(trimmed.empty() || trimmed == "|") keepNewLines = true;
-			else if(trimmed == ">") keepNewLines = false;
+			size_t begin, end;
+			Trim(mLine, begin, end);
+			if(begin == end || TrimmedEquals(mLine, "|")) keepNewLines = true;
+			else if(TrimmedEquals(mLine, ">")) keepNewLines = false;
 			else {
-				str = trimmed;
+				str.assign(mLine, begin, end - begin);
 				mLine.clear();
 				mStream->readLine(mLine);
 				return true;
 			}
 		}
 		else {
+			int indent = 0;
 			if(!mIndent.empty())
 			{
-				int indent = 0;
 				while(indent < mLine.size() && 
 					(mLine[indent] == ' ' || mLine[indent] == '\t')) ++indent;
 			
 				if(mIndent.top() < 0)
-                		{
-                        		mIndent.pop();
-                        		if((mIndent.empty() && indent == 0) || (!mIndent.empty() && mIndent.top() >= indent))
-						return true;
-
-                        		mIndent.push(indent);
-                		}
-                		else {
-                        		if(indent < mIndent.top())
-                        		{
-                                		mIndent.pop();
-						return true;
-                        		}
-
-                        		//if(indent > mIndent.top())
-                                	//	mIndent.top() = indent;
-                		}
-
-				mLine.ignore(indent);
+				{
+					if(indent <= enclosingIndent()) return true;
+					mIndent.top() = indent;
+				}
+				else if(indent < mIndent.top()) return true;
 			}
 
 			if(!str.empty())
-                	{
-                        	if(keepNewLines) str+= '\n';
-                        	else str+= ' ';
-                	}
+			{
+				if(keepNewLines) str+= '\n';
+				else str+= ' ';
+			}
 
-                	str+= mLine;
+			str.append(mLine, indent, String::npos);
 		}
 
 		mLine.clear();
 		if(!mStream->readLine(mLine))
-                	return true;
+			return true;
 
 		++i;
 	}
@@ -264,61 +208,88 @@ bool YamlSerializer::input(String &str)
 
 void YamlSerializer::output(const Serializable &s)
 {
-	if(!mLevel) *mStream<<"---";
+	if(!mLevel) mOutput<<"---";
 	
 	if(s.isInlineSerializable() && !s.isNativeSerializable()) output(s.toString());
 	else s.serialize(*this);
+	writeDone();
 }
 
 void YamlSerializer::output(const Element &element)
 {
-	*mStream<<String(std::max(mLevel-1,0)*2, ' ');
-	*mStream<<"-";
+	writeIndent(std::max(mLevel-1,0));
+	mOutput.put('-');
 	element.serialize(*this);
-	*mStream<<Stream::NewLine;
+	mOutput<<Stream::NewLine;
+	writeDone();
 }
 
 void YamlSerializer::output(const Pair &pair)
 {
-	*mStream<<String(std::max(mLevel-1,0)*2, ' ');
-	String key;
-	LineSerializer keySerializer(&key);
+	writeIndent(std::max(mLevel-1,0));
+	
+	// mKey is written before the value, so nested pairs can reuse it
+	mKey.clear();
+	LineSerializer keySerializer(&mKey);
 	pair.serializeKey(keySerializer);
-	key.trim();
-	*mStream<<key<<":";
+	size_t begin, end;
+	Trim(mKey, begin, end);
+	mOutput.writeData(mKey.data() + begin, end - begin);
+	mOutput.put(':');
+	
 	pair.serializeValue(*this);
-	*mStream<<Stream::NewLine;
+	mOutput<<Stream::NewLine;
+	writeDone();
 }
 
 void YamlSerializer::output(const String &str)
 {
-	if(!mLevel) *mStream<<"---";
+	if(!mLevel) mOutput<<"---";
 	
 	if(str.empty())
 	{
-		if(mLevel) *mStream<<Stream::Space;
+		if(mLevel) mOutput<<Stream::Space;
+		writeDone();
 		return;
 	}
 
 	if(!mLevel || str.contains('\n') || str[0] == '|' || str[0] == '>')
 	{
-		*mStream<<" |"<<Stream::NewLine;
+		mOutput<<" |"<<Stream::NewLine;
 	  
-		String copy(str);
-		copy.trim();
-
-		String line;
-		while(copy.readLine(line))
+		size_t begin, end;
+		Trim(str, begin, end);
+		
+		const char *data = str.data();
+		while(begin < end)
 		{
-			*mStream<<String(mLevel*2, ' ');
-			*mStream<<line;
-			if(copy.last() == '\n') *mStream<<Stream::NewLine;
+			size_t eol = str.find('\n', begin);
+			size_t last = (eol != String::npos ? eol : end);
+			
+			writeIndent(mLevel);
+			
+			// Carriage returns are ignored, as when reading lines
+			while(begin < last)
+			{
+				const char *p = reinterpret_cast<const char*>(std::memchr(data + begin, '\r', last - begin));
+				size_t next = (p ? size_t(p - data) : last);
+				mOutput.writeData(data + begin, next - begin);
+				begin = (p ? next + 1 : last);
+			}
+			
+			if(eol != String::npos)
+			{
+				mOutput<<Stream::NewLine;
+				begin = eol + 1;
+			}
 		}
 	}
 	else {
-		if(mLevel) *mStream<<Stream::Space;
-		*mStream<<str;
+		if(mLevel) mOutput<<Stream::Space;
+		mOutput<<str;
 	}
+	
+	writeDone();
 }
 
 bool YamlSerializer::inputArrayBegin(void)
@@ -343,7 +314,7 @@ bool YamlSerializer::inputMapCheck(void)
 	
 void YamlSerializer::outputArrayBegin(int size)
 {
-	*mStream<<Stream::NewLine;
+	mOutput<<Stream::NewLine;
 	++mLevel;
 }
 
@@ -351,11 +322,12 @@ void YamlSerializer::outputArrayEnd(void)
 {
 	Assert(mLevel > 0);
 	--mLevel;
+	writeDone();
 }
 
 void YamlSerializer::outputMapBegin(int size)
 {
-	*mStream<<Stream::NewLine;
+	mOutput<<Stream::NewLine;
   	++mLevel;
 }
 
@@ -363,11 +335,91 @@ void YamlSerializer::outputMapEnd(void)
 {
 	Assert(mLevel > 0);
 	--mLevel;
+	writeDone();
 }
 
 void YamlSerializer::outputClose(void)
 {
-	*mStream<<"..."<<Stream::NewLine;
+	mOutput<<"..."<<Stream::NewLine;
+	mOutput.flush();
+}
+
+bool YamlSerializer::readDocumentLine(void)
+{
+	// Document markers only matter at top level
+	if(mIndent.empty())
+	{
+		if(mLine.empty() && !mStream->readLine(mLine))
+			return false;
+		
+		if(TrimmedEquals(mLine, "...")) return false;
+		if(TrimmedEquals(mLine, "---")) mLine.clear();
+	}
+	
+	return true;
+}
+
+bool YamlSerializer::readContentLine(void)
+{
+	size_t begin, end;
+	Trim(mLine, begin, end);
+	while(begin == end)
+	{
+		mLine.clear();
+		if(!mStream->readLine(mLine)) return false;
+		Trim(mLine, begin, end);
+	}
+	
+	return !IsDocumentMarker(mLine);
+}
+
+bool YamlSerializer::readIndent(void)
+{
+	if(mIndent.empty()) return true;
+	
+	int indent = 0;
+	while(indent < mLine.size() && 
+		(mLine[indent] == ' ' || mLine[indent] == '\t')) ++indent;
+	
+	if(mIndent.top() < 0) 
+	{
+		// First line of the block, it must be indented deeper than the enclosing one
+		if(indent <= enclosingIndent()) return false;
+		mIndent.top() = indent;
+	}
+	else {
+		if(indent < mIndent.top()) return false;
+		if(indent > mIndent.top()) mIndent.top() = indent;
+	}
+	
+	return true;
+}
+
+int YamlSerializer::enclosingIndent(void)
+{
+	int top = mIndent.top();
+	mIndent.pop();
+	int indent = (mIndent.empty() ? 0 : mIndent.top());
+	mIndent.push(top);
+	return indent;
+}
+
+void YamlSerializer::writeIndent(int level)
+{
+	static const char spaces[] = "                                ";	// 32 spaces
+	
+	size_t left = level*2;
+	while(left)
+	{
+		size_t len = std::min(left, sizeof(spaces) - 1);
+		mOutput.writeData(spaces, len);
+		left-= len;
+	}
+}
+
+void YamlSerializer::writeDone(void)
+{
+	if(mLevel <= mOutputLevel) mOutput.flush();
 }
 
 }
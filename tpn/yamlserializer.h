@@ -24,11 +24,14 @@
 
 #include "tpn/serializer.h"
 #include "tpn/stream.h"
+#include "tpn/bufferedwriter.h"
 #include "tpn/array.h"
 
 namespace tpn
 {
 
+// Output is buffered and written to the stream in chunks,
+// it is flushed each time a value at the initial output level is complete
 class YamlSerializer : public Serializer
 {
 public:
@@ -84,35 +87,38 @@ public:
 private:
   	template<typename T> bool read(T &value);
   	template<typename T> void write(const T &value);
+	
+	bool readDocumentLine(void);
+	bool readContentLine(void);
+	bool readIndent(void);
+	int enclosingIndent(void);
+	void writeIndent(int level);
+	void writeDone(void);
   
   	Stream *mStream;
 	String mLine;		// for input
-	Stack<int> mIndent;	// for input
+	Stack<int> mIndent;	// for input, -1 until the first line of a block
+	BufferedWriter mOutput;	// for output
+	String mKey;		// for output
 	int mLevel;		// for output
+	int mOutputLevel;	// for output
 };
 
 template<typename T> 
 bool YamlSerializer::read(T &value)
 {
-	if(mIndent.empty())
-	{
-		if(mLine.empty() && !mStream->readLine(mLine))
-			return false;
-		
-		if(mLine.trimmed() == "...") return false;
-		if(mLine.trimmed() == "---") mLine.clear();
-	}
-	
+	if(!readDocumentLine()) return false;
 	return mLine.read(value);
 }
 
 template<typename T> 
 void YamlSerializer::write(const T &value)
 {
-	if(!mLevel) *mStream<<"---"<<Stream::NewLine;
-	else *mStream<<Stream::Space;
-	mStream->write(value);
-	if(!mLevel) *mStream << Stream::NewLine;	
+	if(!mLevel) mOutput<<"---"<<Stream::NewLine;
+	else mOutput<<Stream::Space;
+	mOutput.write(value);
+	if(!mLevel) mOutput<<Stream::NewLine;
+	writeDone();
 }
 
 }